@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Linux kernel crypto API (AF_ALG) hashing.
+ */
+
+#include "afalg.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/if_alg.h>
+#include <sys/socket.h>
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+
+int afalg_bind(const char *name)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "hash",
+	};
+	int tfm;
+
+	if (strlen(name) >= sizeof(sa.salg_name)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy((char *)sa.salg_name, name);
+
+	tfm = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (tfm < 0)
+		return -1;
+
+	if (bind(tfm, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		int error = errno;
+
+		close(tfm);
+		errno = error;
+		return -1;
+	}
+
+	return tfm;
+}
+
+int afalg_start(int tfm)
+{
+	return accept4(tfm, NULL, NULL, SOCK_CLOEXEC);
+}
+
+int afalg_update(int op, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len > 0) {
+		ssize_t n = send(op, p, len, MSG_MORE);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+
+		p += n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+int afalg_final(int op, unsigned char *out, size_t len)
+{
+	ssize_t n;
+
+	/* An empty message without MSG_MORE finalizes the hash. */
+	while (send(op, NULL, 0, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	do {
+		n = read(op, out, len);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return -1;
+
+	if ((size_t)n != len) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
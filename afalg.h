@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Linux kernel crypto API (AF_ALG) hashing declarations.
+ *
+ * A "transform" socket is bound to a kernel hash algorithm once; every hash
+ * computation then accepts its own operation socket from it, sends the data
+ * to it, and reads the digest back. The kernel may use a hardware
+ * accelerator or an implementation optimized for the CPU.
+ */
+
+#ifndef AFALG_H
+#define AFALG_H
+
+#include <stddef.h>
+
+/**
+ * Bind a transform socket to the kernel hash algorithm @p name.
+ *
+ * @param name  The kernel's name for the algorithm (e.g. "sha256").
+ *
+ * @returns Returns the transform socket, or -1 (with errno set) if the
+ *          kernel doesn't support AF_ALG or the algorithm.
+ */
+int afalg_bind(const char *name);
+
+/**
+ * Start a hash computation.
+ *
+ * @param tfm  The transform socket returned by afalg_bind().
+ *
+ * @returns Returns the operation socket (close it when done), or -1 (with
+ *          errno set) on failure.
+ */
+int afalg_start(int tfm);
+
+/**
+ * Hash more data.
+ *
+ * @param op    The operation socket.
+ * @param data  The data to hash.
+ * @param len   The length of @p data.
+ *
+ * @retval 0  The data was hashed.
+ * @retval -1 An error occurred (errno is set).
+ */
+int afalg_update(int op, const void *data, size_t len);
+
+/**
+ * Finish a hash computation.
+ *
+ * @param op   The operation socket.
+ * @param out  Where to store the hash.
+ * @param len  The length of the hash.
+ *
+ * @retval 0  The hash was stored in @p out.
+ * @retval -1 An error occurred (errno is set).
+ */
+int afalg_final(int op, unsigned char *out, size_t len);
+
+#endif /* AFALG_H */
@@ -41,12 +41,34 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#ifdef HAVE_BTRFS_ENCODED
+#include "btrfs_read.h"
+#endif
+#include "blockdev.h"
+#include "budget.h"
+#include "cost.h"
+#include "coverage.h"
+#include "devslot.h"
+#include "dircache.h"
+#include "dirty.h"
+#include "events.h"
+#include "ext4.h"
 #include "file.h"
+#include "gate.h"
+#include "migrate.h"
+#include "policy.h"
+#include "stats.h"
+#include "tagcache.h"
 #include "utilities.h"
+#include "verify.h"
 
 
 /** The options set by command-line arguments. */
@@ -88,14 +110,123 @@ static void usage(const char *program)
 		"  -r, --recursive       process directories and their contents (not just files)\n"
 		"  -v, --verbose         print all checksums (not just missing/changed)\n"
 		"  -V, --version         output version information and exit\n"
+		"      --dir-cache=FILE  reuse the listings of unchanged directories from FILE\n"
+		"      --tag-cache=FILE  skip reading the attributes of unchanged files using FILE\n"
+		"      --manifest=FILE   also write the path, size, mtime, and hash of every\n"
+		"                        file to the binary manifest FILE (see b2tag-manifest)\n"
+		"      --cost-report[=DEPTH]\n"
+		"                        print the most expensive directories (down to DEPTH,\n"
+		"                        default 2) at exit\n"
+		"      --record-verified\n"
+		"                        record when each hashed file was last verified\n"
+		"      --coverage[=DEPTH]\n"
+		"                        only report the bytes and files verified within\n"
+		"                        each age range, for directories down to DEPTH\n"
+		"                        (default 1), without reading any file data\n"
+		"      --policy=FILE     apply the per-subtree rules in FILE (exclusions,\n"
+		"                        algorithms, check frequencies, and hashing rates)\n"
+#ifdef HAVE_BTRFS_ENCODED
+		"      --btrfs-encoded[=THREADS]\n"
+		"                        hash compressed btrfs files by reading the compressed\n"
+		"                        extents and decompressing them in THREADS threads\n"
+		"                        (default: the number of CPUs; needs CAP_SYS_ADMIN)\n"
+#endif
+		"      --events=PATH     publish non-OK states, errors, and progress as JSON\n"
+		"                        lines to the UNIX datagram socket or FIFO at PATH\n"
+		"      --layout=LAYOUT   store tags in LAYOUT: shatag (user.shatag.ts and\n"
+		"                        user.shatag.ALG, the default) or record (one\n"
+		"                        user.b2tag.ALG attribute)\n"
+		"      --migrate=LAYOUT  move the tags stored in LAYOUT to the --layout one\n"
+		"                        without reading any file data\n"
+		"      --remove-tags[=ALGS]\n"
+		"                        remove the tags of the comma-separated ALGS (named\n"
+		"                        like the hash algorithm options, e.g. blake2b,md5;\n"
+		"                        default: all of them, in every layout) without\n"
+		"                        reading any file data\n"
+		"      --jobs=N          migrate, remove tags, or read block devices with N\n"
+		"                        threads (default: the number of CPUs)\n"
+		"      --max-rate=N      migrate or remove the tags of at most N files per\n"
+		"                        second\n"
+		"      --resume=FILE     record the directories migrated (or whose tags were\n"
+		"                        removed) in FILE, and skip the ones already in it\n"
+		"      --block-devices=DIR\n"
+		"                        hash block devices in regions, keeping the region\n"
+		"                        hashes in DIR, and report the regions that changed\n"
+		"      --region-size=SIZE\n"
+		"                        the size of each block device region (a multiple\n"
+		"                        of 1M, default 64M)\n"
+		"      --stats[=NAME]    publish live counters in the shared-memory segment\n"
+		"                        NAME (default: b2tag.PID) for b2tag-top\n"
+		"      --dirty-inodes=FILE\n"
+		"                        only process the files that b2tag-dirtyd saw being\n"
+		"                        modified since the run that last saved FILE\n"
+		"      --two-phase       check (like -c), but tag new and changed files first\n"
+		"                        and verify the rest in a low-priority thread\n"
+		"      --device-slots=N  only let N b2tag processes read a device at once\n"
+		"                        (others do quick checks while they wait)\n"
+		"      --memory-limit=SIZE\n"
+		"                        limit the memory used by buffers and caches to SIZE\n"
+		"                        bytes (K, M, G, and T suffixes are accepted)\n"
+		"      --hash-backend=NAME\n"
+		"                        compute hashes with NAME: evp (OpenSSL, the default),\n"
+		"                        kernel (the kernel crypto API), builtin, or auto\n"
+		"                        (benchmark them once per machine, use the fastest)\n"
+		"      --ext4-image=IMAGE\n"
+		"                        read the FILEs (paths inside the image, e.g. /) from\n"
+		"                        the unmounted ext4 image or device IMAGE, in disk\n"
+		"                        order with -r; implies --dry-run\n"
+		"      --gate            run as a daemon that verifies every open of a file\n"
+		"                        below the FILEs (fanotify, needs CAP_SYS_ADMIN)\n"
+		"                        and denies opens of corrupt files; implies --dry-run\n"
+		"      --gate-timeout=MS answer an open after MS milliseconds even if it\n"
+		"                        wasn't verified yet (default: 1000, 0 to wait)\n"
+		"      --gate-ttl=DURATION\n"
+		"                        re-verify files after DURATION (s, m, h, d, or w\n"
+		"                        suffix; default: until they change)\n"
+		"      --gate-fail-closed\n"
+		"                        deny the opens that couldn't be verified in time\n"
 		"\n"
 		"Hash algorithms:\n"
 		"  --blake2b (default, 512-bit)  --blake2s (256-bit, recommended on 32-bit)\n"
 		"  --sha512                      --sha256 (shatag compatible)\n"
+		"  --sha3-512                    --sha3-256\n"
+		"  --k12 (KangarooTwelve, 256-bit)\n"
 		"  --sha1 (deprecated)           --md5 (deprecated)\n",
 		program);
 }
 
+/** getopt values for options that only have a long form. */
+enum long_only_opts {
+	OPT_DIR_CACHE = 256,
+	OPT_TAG_CACHE,
+	OPT_MEMORY_LIMIT,
+	OPT_DEVICE_SLOTS,
+	OPT_MANIFEST,
+	OPT_COST_REPORT,
+	OPT_BTRFS_ENCODED,
+	OPT_TWO_PHASE,
+	OPT_EVENTS,
+	OPT_DIRTY_INODES,
+	OPT_STATS,
+	OPT_LAYOUT,
+	OPT_MIGRATE,
+	OPT_JOBS,
+	OPT_MAX_RATE,
+	OPT_RESUME,
+	OPT_POLICY,
+	OPT_BLOCK_DEVICES,
+	OPT_REGION_SIZE,
+	OPT_RECORD_VERIFIED,
+	OPT_COVERAGE,
+	OPT_HASH_BACKEND,
+	OPT_EXT4_IMAGE,
+	OPT_GATE,
+	OPT_GATE_TIMEOUT,
+	OPT_GATE_TTL,
+	OPT_GATE_FAIL_CLOSED,
+	OPT_REMOVE_TAGS,
+};
+
 /**
  * Long options to pass to getopt.
  */
@@ -113,14 +244,81 @@ static const struct option long_opts[] = {
 	{ "sha1",       no_argument, 0,  0  },
 	{ "sha256",     no_argument, 0,  0  },
 	{ "sha512",     no_argument, 0,  0  },
+	{ "sha3-256",   no_argument, 0,  0  },
+	{ "sha3-512",   no_argument, 0,  0  },
+	{ "k12",        no_argument, 0,  0  },
 	{ "blake2",     no_argument, 0,  1  },
 	{ "blake2b",    no_argument, 0,  1  },
 	{ "blake2b512", no_argument, 0,  1  },
 	{ "blake2s",    no_argument, 0,  2  },
 	{ "blake2s256", no_argument, 0,  2  },
+	{ "dir-cache",  required_argument, 0, OPT_DIR_CACHE },
+	{ "tag-cache",  required_argument, 0, OPT_TAG_CACHE },
+	{ "memory-limit", required_argument, 0, OPT_MEMORY_LIMIT },
+	{ "hash-backend", required_argument, 0, OPT_HASH_BACKEND },
+	{ "ext4-image", required_argument, 0, OPT_EXT4_IMAGE },
+	{ "gate",       no_argument, 0, OPT_GATE },
+	{ "gate-timeout", required_argument, 0, OPT_GATE_TIMEOUT },
+	{ "gate-ttl",   required_argument, 0, OPT_GATE_TTL },
+	{ "gate-fail-closed", no_argument, 0, OPT_GATE_FAIL_CLOSED },
+	{ "device-slots", required_argument, 0, OPT_DEVICE_SLOTS },
+	{ "manifest",   required_argument, 0, OPT_MANIFEST },
+	{ "cost-report", optional_argument, 0, OPT_COST_REPORT },
+	{ "two-phase",  no_argument, 0, OPT_TWO_PHASE },
+	{ "events",     required_argument, 0, OPT_EVENTS },
+	{ "dirty-inodes", required_argument, 0, OPT_DIRTY_INODES },
+	{ "stats",      optional_argument, 0, OPT_STATS },
+	{ "layout",     required_argument, 0, OPT_LAYOUT },
+	{ "migrate",    required_argument, 0, OPT_MIGRATE },
+	{ "remove-tags", optional_argument, 0, OPT_REMOVE_TAGS },
+	{ "jobs",       required_argument, 0, OPT_JOBS },
+	{ "max-rate",   required_argument, 0, OPT_MAX_RATE },
+	{ "resume",     required_argument, 0, OPT_RESUME },
+	{ "record-verified", no_argument, 0, OPT_RECORD_VERIFIED },
+	{ "coverage",   optional_argument, 0, OPT_COVERAGE },
+	{ "policy",     required_argument, 0, OPT_POLICY },
+	{ "block-devices", required_argument, 0, OPT_BLOCK_DEVICES },
+	{ "region-size", required_argument, 0, OPT_REGION_SIZE },
+#ifdef HAVE_BTRFS_ENCODED
+	{ "btrfs-encoded", optional_argument, 0, OPT_BTRFS_ENCODED },
+#endif
 	{ NULL, 0, 0, 0 }
 };
 
+/**
+ * Look up a hash algorithm by the name of its option (e.g. "blake2b").
+ *
+ * @param name  The option name, without the leading dashes.
+ * @param alg   Set to the algorithm.
+ *
+ * @retval 0  The algorithm was found.
+ * @retval -1 @p name isn't a hash algorithm option.
+ */
+static int get_alg_by_option(const char *name, hash_alg_t *alg)
+{
+	const struct option *o;
+
+	for (o = long_opts; o->name != NULL; o++) {
+		if (strcmp(o->name, name) != 0)
+			continue;
+
+		switch (o->val) {
+		case 0:
+			return get_alg_by_name(name, alg);
+		case 1:
+			*alg = HASH_ALG_BLAKE2B;
+			return 0;
+		case 2:
+			*alg = HASH_ALG_BLAKE2S;
+			return 0;
+		default:
+			return -1;
+		}
+	}
+
+	return -1;
+}
+
 /**
  * The entry point to the b2tag utility.
  *
@@ -133,11 +331,16 @@ static const struct option long_opts[] = {
 int main(int argc, char *argv[])
 {
 	int ret = 0;
+	int err = 0;
 	char *program = basename(argv[0]);
 	int opt;
 	int option_index = 0;
 
 	args.alg = HASH_ALG_BLAKE2B;
+	args.cost_report = -1;
+	args.coverage = -1;
+	args.region_size = 64ULL << 20;
+	args.gate_timeout = 1000;
 
 	while ((opt = getopt_long(argc, argv, "cfhnpqrvV", long_opts, &option_index)) != -1) {
 		switch (opt) {
@@ -178,6 +381,218 @@ int main(int argc, char *argv[])
 		case 'V':
 			version();
 			return EXIT_SUCCESS;
+		case OPT_DIR_CACHE:
+			args.dir_cache = optarg;
+			break;
+		case OPT_TAG_CACHE:
+			args.tag_cache = optarg;
+			break;
+		case OPT_EVENTS:
+			args.events = optarg;
+			break;
+		case OPT_LAYOUT:
+			if (xa_layout_by_name(optarg, &args.layout) != 0) {
+				fprintf(stderr, "Unknown layout \"%s\"\n", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_MIGRATE:
+			if (xa_layout_by_name(optarg, &args.migrate_from) != 0) {
+				fprintf(stderr, "Unknown layout \"%s\"\n", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			args.migrate = true;
+			break;
+		case OPT_REMOVE_TAGS: {
+			char *name;
+
+			if (optarg == NULL) {
+				args.remove_tags = XA_ALL_ALGS;
+				break;
+			}
+
+			args.remove_tags = 0;
+			for (name = strtok(optarg, ","); name != NULL; name = strtok(NULL, ",")) {
+				hash_alg_t alg;
+
+				if (get_alg_by_option(name, &alg) != 0) {
+					fprintf(stderr, "Unknown hash algorithm \"%s\"\n", name);
+					usage(program);
+					return EXIT_FAILURE;
+				}
+				args.remove_tags |= 1U << alg;
+			}
+
+			if (args.remove_tags == 0) {
+				fprintf(stderr, "No hash algorithm given to --remove-tags\n");
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case OPT_JOBS:
+		case OPT_MAX_RATE: {
+			char *end;
+			unsigned long n;
+
+			errno = 0;
+			n = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || n < 1 ||
+				n > (opt == OPT_JOBS ? 1024 : UINT_MAX)) {
+				fprintf(stderr, "Invalid %s \"%s\"\n",
+					opt == OPT_JOBS ? "number of jobs" : "rate", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			if (opt == OPT_JOBS)
+				args.jobs = (unsigned int)n;
+			else
+				args.max_rate = (unsigned int)n;
+			break;
+		}
+		case OPT_RESUME:
+			args.resume = optarg;
+			break;
+		case OPT_POLICY:
+			args.policy = optarg;
+			break;
+		case OPT_RECORD_VERIFIED:
+			args.record_verified = true;
+			break;
+		case OPT_COVERAGE: {
+			char *end;
+			long depth = 1;
+
+			if (optarg != NULL) {
+				errno = 0;
+				depth = strtol(optarg, &end, 10);
+				if (errno != 0 || end == optarg || *end != '\0' || depth < 0 || depth > 1024) {
+					fprintf(stderr, "Invalid coverage depth \"%s\"\n", optarg);
+					usage(program);
+					return EXIT_FAILURE;
+				}
+			}
+			args.coverage = (int)depth;
+			break;
+		}
+		case OPT_BLOCK_DEVICES:
+			args.block_devices = optarg;
+			break;
+		case OPT_REGION_SIZE:
+			if (parse_size(optarg, &args.region_size) != 0 || args.region_size == 0) {
+				fprintf(stderr, "Invalid region size \"%s\"\n", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_STATS:
+			args.stats = optarg != NULL ? optarg : "";
+			break;
+		case OPT_DIRTY_INODES:
+			args.dirty_inodes = optarg;
+			break;
+		case OPT_TWO_PHASE:
+			args.check = true;
+			args.two_phase = true;
+			break;
+		case OPT_DEVICE_SLOTS: {
+			char *end;
+			unsigned long slots;
+
+			errno = 0;
+			slots = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || slots > 1024) {
+				fprintf(stderr, "Invalid number of device slots \"%s\"\n", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			args.device_slots = (unsigned int)slots;
+			break;
+		}
+		case OPT_COST_REPORT: {
+			char *end;
+			long depth = 2;
+
+			if (optarg != NULL) {
+				errno = 0;
+				depth = strtol(optarg, &end, 10);
+				if (errno != 0 || end == optarg || *end != '\0' || depth < 0 || depth > 1024) {
+					fprintf(stderr, "Invalid cost report depth \"%s\"\n", optarg);
+					usage(program);
+					return EXIT_FAILURE;
+				}
+			}
+			args.cost_report = (int)depth;
+			break;
+		}
+#ifdef HAVE_BTRFS_ENCODED
+		case OPT_BTRFS_ENCODED: {
+			char *end;
+			long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+			if (optarg != NULL) {
+				errno = 0;
+				threads = strtol(optarg, &end, 10);
+				if (errno != 0 || end == optarg || *end != '\0' || threads < 1 || threads > 256) {
+					fprintf(stderr, "Invalid number of decompression threads \"%s\"\n", optarg);
+					usage(program);
+					return EXIT_FAILURE;
+				}
+			}
+			args.btrfs_encoded = threads > 0 ? (unsigned int)threads : 1;
+			break;
+		}
+#endif
+		case OPT_HASH_BACKEND:
+			if (hash_set_backend(optarg) != 0) {
+				fprintf(stderr, "Unknown hash backend \"%s\"\n", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_EXT4_IMAGE:
+			args.ext4_image = optarg;
+			break;
+		case OPT_GATE:
+			args.gate = true;
+			break;
+		case OPT_GATE_TIMEOUT: {
+			char *end;
+			unsigned long ms;
+
+			errno = 0;
+			ms = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || ms > UINT_MAX) {
+				fprintf(stderr, "Invalid gate timeout \"%s\"\n", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			args.gate_timeout = (unsigned int)ms;
+			break;
+		}
+		case OPT_GATE_TTL:
+			if (parse_duration(optarg, &args.gate_ttl) != 0) {
+				fprintf(stderr, "Invalid gate TTL \"%s\"\n", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_GATE_FAIL_CLOSED:
+			args.gate_fail_closed = true;
+			break;
+		case OPT_MANIFEST:
+			args.manifest = optarg;
+			break;
+		case OPT_MEMORY_LIMIT:
+			if (parse_size(optarg, &args.memory_limit) != 0 ||
+				args.memory_limit > SIZE_MAX) {
+				fprintf(stderr, "Invalid memory limit \"%s\"\n", optarg);
+				usage(program);
+				return EXIT_FAILURE;
+			}
+			break;
 
 		default:
 			if (isprint(opt))
@@ -204,21 +619,176 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	/* Nothing inside the image can be written, and the gate only verifies. */
+	if (args.ext4_image != NULL || args.gate)
+		args.dry_run = true;
+
 	if (args.dry_run && args.force)
 		pr_warn("Warning: --dry-run takes precedence over --force.\n");
 
+	if (args.migrate && args.migrate_from == args.layout) {
+		fprintf(stderr, "--migrate needs a different --layout to migrate to.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (args.migrate && (args.check || args.print || args.manifest != NULL)) {
+		fprintf(stderr, "--migrate can't be combined with --check, --two-phase, --print, or --manifest.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (args.remove_tags != 0 && (args.migrate || args.check || args.print ||
+			args.manifest != NULL || args.coverage >= 0 || args.block_devices != NULL ||
+			args.dirty_inodes != NULL || args.ext4_image != NULL || args.gate)) {
+		fprintf(stderr, "--remove-tags can't be combined with --migrate, --check, --two-phase, --print, --manifest, --coverage, --block-devices, --dirty-inodes, --ext4-image, or --gate.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (args.coverage >= 0 && (args.check || args.print || args.manifest != NULL ||
+			args.migrate || args.dirty_inodes != NULL || args.block_devices != NULL)) {
+		fprintf(stderr, "--coverage can't be combined with --check, --two-phase, --print, --manifest, --migrate, --dirty-inodes, or --block-devices.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (args.ext4_image != NULL && (args.migrate || args.block_devices != NULL ||
+			args.dirty_inodes != NULL || args.record_verified || args.dir_cache != NULL)) {
+		fprintf(stderr, "--ext4-image can't be combined with --migrate, --block-devices, --dirty-inodes, --record-verified, or --dir-cache.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (args.gate && (args.check || args.print || args.manifest != NULL || args.migrate ||
+			args.block_devices != NULL || args.dirty_inodes != NULL || args.ext4_image != NULL ||
+			args.cost_report >= 0 || args.coverage >= 0)) {
+		fprintf(stderr, "--gate can't be combined with --check, --two-phase, --print, --manifest, --migrate, --block-devices, --dirty-inodes, --ext4-image, --cost-report, or --coverage.\n");
+		return EXIT_FAILURE;
+	}
+
+	xa_set_layout(args.layout);
+
+	budget_set_limit((size_t)args.memory_limit);
+
+	if (args.policy != NULL && policy_load(args.policy) != 0)
+		return EXIT_FAILURE;
+
+	/* The manifest only has room for one algorithm. */
+	if (args.manifest != NULL && policy_sets_alg()) {
+		fprintf(stderr, "--manifest can't be combined with a --policy that changes the algorithm.\n");
+		policy_close();
+		return EXIT_FAILURE;
+	}
+
+	if (args.block_devices != NULL && blockdev_init(args.block_devices, args.region_size,
+			args.jobs ? args.jobs : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN), args.alg) != 0) {
+		policy_close();
+		return EXIT_FAILURE;
+	}
+
+	if (args.dir_cache != NULL && dircache_open(args.dir_cache) != 0)
+		return EXIT_FAILURE;
+
+	if (args.ext4_image != NULL && ext4_open(args.ext4_image) != 0) {
+		policy_close();
+		return EXIT_FAILURE;
+	}
+
+	/* The tag cache is only an optimization, so run without it on failure. */
+	if (args.tag_cache != NULL && !args.dry_run)
+		tagcache_open(args.tag_cache);
+
+	if (args.cost_report >= 0)
+		cost_init((unsigned int)args.cost_report);
+
+	if (args.coverage >= 0)
+		coverage_init((unsigned int)args.coverage);
+
+	if (devslot_init(args.device_slots) != 0)
+		return EXIT_FAILURE;
+
+#ifdef HAVE_BTRFS_ENCODED
+	btrfs_encoded_init(args.btrfs_encoded);
+#endif
+
+	if (args.events != NULL && events_open(args.events) != 0)
+		return EXIT_FAILURE;
+
+	/* Draining the tracker would lose the changes a dry run doesn't tag. */
+	if (args.dirty_inodes != NULL && args.dry_run)
+		pr_warn("Warning: --dirty-inodes is ignored with --dry-run.\n");
+	else if (args.dirty_inodes != NULL)
+		dirty_open(args.dirty_inodes, args.recursive && !args.check && !args.print &&
+			args.manifest == NULL && !args.migrate && !policy_deep_checks());
+
+	/* From here on, errors go through the teardown below: the threads must
+	 * be stopped and the tracker state written back.
+	 */
+	if (args.two_phase && verify_start() != 0) {
+		err = -1;
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (args.migrate && migrate_start(args.migrate_from, args.layout, args.alg,
+			args.jobs ? args.jobs : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN),
+			args.max_rate, args.resume) != 0) {
+		err = -1;
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (args.remove_tags != 0 && migrate_start_removal(args.remove_tags,
+			args.jobs ? args.jobs : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN),
+			args.max_rate, args.resume) != 0) {
+		err = -1;
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (args.manifest != NULL) {
+		manifest_out = manifest_writer_open(args.manifest, args.alg, false);
+		if (manifest_out == NULL) {
+			pr_err("Error: could not create manifest \"%s\": %m\n", args.manifest);
+			err = -1;
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	if (args.gate) {
+		struct gate_config cfg = {
+			.workers = args.jobs ? args.jobs : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN),
+			.timeout_ms = args.gate_timeout,
+			.ttl = args.gate_ttl,
+			.cache_entries = GATE_CACHE_ENTRIES,
+			.fail_closed = args.gate_fail_closed,
+		};
+
+		ret = gate_run(argv, (size_t)argc, &cfg);
+		policy_close();
+		events_close(ret);
+		return ret;
+	}
+
+	/* Created last, so the segment isn't left behind by the errors above. */
+	if (args.stats != NULL &&
+		stats_open(args.stats[0] != '\0' ? args.stats : NULL, get_alg_name(args.alg)) != 0) {
+		err = -1;
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
 	while (argc >= 1) {
-		int err;
 		char *pos = argv[0] + strlen(argv[0]) - 1;
 
 		/* Remove trailing slashes */
 		while (pos > argv[0] && *pos == '/')
 			*pos-- = '\0';
 
-		err = process_path(argv[0]);
+		if (args.ext4_image != NULL)
+			err = ext4_process(argv[0]);
+		else
+			err = process_path(argv[0]);
 
 		if (err < 0)
-			return ret;
+			break;
 		else if (ret == 0 && err > 0)
 			ret = err;
 
@@ -226,5 +796,56 @@ int main(int argc, char *argv[])
 		argv++;
 	}
 
+	/* Files on devices that other b2tag processes were reading. */
+	if (err >= 0) {
+		err = process_deferred();
+		if (ret == 0 && err > 0)
+			ret = err;
+	}
+
+	/* Files whose quick check passed, verified in the background. */
+	if (err >= 0) {
+		err = process_verified();
+		if (ret == 0 && err > 0)
+			ret = err;
+	}
+
+out:
+	/* Wait for the files still being migrated (even after a fatal error). */
+	if (args.migrate || args.remove_tags != 0) {
+		int failed = migrate_stop();
+
+		if (ret == 0 && failed > 0)
+			ret = failed;
+	}
+
+	verify_stop();
+	if (args.dirty_inodes != NULL && !args.dry_run)
+		dirty_close(err >= 0 && ret == 0);
+#ifdef HAVE_BTRFS_ENCODED
+	btrfs_encoded_cleanup();
+#endif
+	devslot_close();
+	cost_report();
+	coverage_report();
+
+	/* Don't replace the manifest with a partial one. */
+	if (manifest_out != NULL && err < 0)
+		manifest_writer_abort(manifest_out);
+	else if (manifest_out != NULL && manifest_writer_close(manifest_out) != 0 && ret == 0)
+		ret = 1;
+
+	if (dircache_close() != 0 && ret == 0)
+		ret = 1;
+
+	tagcache_close();
+	ext4_close();
+	policy_close();
+	events_close(ret);
+	stats_close(ret);
+
+	if (budget_limit() != 0)
+		pr_warn("Peak memory use: %zu of %zu bytes\n", budget_peak(), budget_limit());
+
 	return ret;
 }
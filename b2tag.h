@@ -37,6 +37,7 @@
 #include <stdbool.h>
 
 #include "hash.h"
+#include "xa.h"
 
 /**
  * The options passed to the program on the command-line.
@@ -56,6 +57,62 @@ struct args_s {
 	bool recursive;
 	/** The verbosity level (how many messages to print). */
 	int verbose;
+	/** The directory listing cache file (NULL if not in use). */
+	const char *dir_cache;
+	/** The stat/tag cache file (NULL if not in use). */
+	const char *tag_cache;
+	/** The most memory to use for buffers and caches (0 for no limit). */
+	unsigned long long memory_limit;
+	/** The number of b2tag processes that may read a device at once (0 for any). */
+	unsigned int device_slots;
+	/** The binary manifest to write (NULL if not in use). */
+	const char *manifest;
+	/** Report the cost of directories down to this depth (-1 for no report). */
+	int cost_report;
+	/** Report verification coverage down to this depth (-1 to check files). */
+	int coverage;
+	/** Record when each file's data was last verified. */
+	bool record_verified;
+	/** The per-subtree policy file (NULL if not in use). */
+	const char *policy;
+	/** The unmounted ext4 image to read the files from (NULL if not in use). */
+	const char *ext4_image;
+	/** Run as the verify-on-open gate daemon. */
+	bool gate;
+	/** The longest an open waits for verification (in milliseconds, 0 for no limit). */
+	unsigned int gate_timeout;
+	/** How long a verification is trusted (in seconds, 0 for no limit). */
+	time_t gate_ttl;
+	/** Deny the opens that couldn't be verified in time. */
+	bool gate_fail_closed;
+	/** The socket or FIFO to publish events to (NULL if not in use). */
+	const char *events;
+	/** The attribute layout tags are stored in. */
+	xa_layout_t layout;
+	/** Whether to migrate tags from migrate_from to layout (without hashing). */
+	bool migrate;
+	/** The attribute layout to migrate tags from. */
+	xa_layout_t migrate_from;
+	/** The algorithms whose tags to remove (bit 1 << hash_alg_t, 0 if not in use). */
+	unsigned int remove_tags;
+	/** The number of worker threads (0 for the number of CPUs). */
+	unsigned int jobs;
+	/** The most files to migrate per second (0 for no limit). */
+	unsigned int max_rate;
+	/** The file recording the directories already migrated (NULL if not in use). */
+	const char *resume;
+	/** The directory of the block device sidecar files (NULL if not in use). */
+	const char *block_devices;
+	/** The size of each block device region. */
+	unsigned long long region_size;
+	/** The statistics segment's name ("" for the default, NULL if not in use). */
+	const char *stats;
+	/** The dirty-inode tracker state file (NULL if not in use). */
+	const char *dirty_inodes;
+	/** Verify files that passed the quick check in a background thread. */
+	bool two_phase;
+	/** The number of btrfs decompression threads (0 to read files normally). */
+	unsigned int btrfs_encoded;
 };
 
 /** The options set by command-line arguments. */
@@ -0,0 +1,1184 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Benchmarks for b2tag's own per-file overhead (b2tag-bench).
+ *
+ * The benchmarks run against the in-memory backend (see io_mem.h) so they
+ * measure the traversal, state machine, and hashing code without the kernel.
+ * The exception is the write benchmark, which measures the overhead the
+ * write-time tagging library (libb2tag-preload.so) adds to real writes.
+ *
+ * The scrub benchmark silently corrupts files of a tagged tree, then runs
+ * scan schedules (one round per simulated day) and reports how long, and how
+ * many bytes of reading, each schedule took to report every corruption.
+ * Detections are taken from the event stream (see events.h), so only files
+ * b2tag actually reported as CORRUPT count.
+ *
+ * The gate benchmark measures the decisions of the verify-on-open gate
+ * without fanotify (which needs privileges): the latency of verifying a file,
+ * of allowing it from the verified cache, and of denying a corrupted file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "b2tag.h"
+#include "events.h"
+#include "file.h"
+#include "gate.h"
+#include "hash.h"
+#include "io_mem.h"
+#include "policy.h"
+#include "tagcache.h"
+#include "utilities.h"
+
+/** The most schedules the scrub benchmark can compare. */
+#define MAX_SCHEDULES 8
+
+/** The options set by command-line arguments. */
+struct args_s args;
+
+/** Returns the current monotonic time in seconds. */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Prints a usage message for b2tag-bench.
+ *
+ * @param program  The name of the program being run.
+ */
+static void usage(const char *program)
+{
+	printf(
+		"Usage: %s [OPTION]... walk|hash|write|scrub|gate\n"
+		"\n"
+		"Benchmark b2tag against a synthetic in-memory tree.\n"
+		"\n"
+		"Benchmarks:\n"
+		"  walk                  tag, then re-check a synthetic tree\n"
+		"  hash                  hash a single in-memory file with each algorithm\n"
+		"  write                 write files to TMPDIR (with and without --preload)\n"
+		"  scrub                 corrupt files of a tagged tree and measure how long\n"
+		"                        each --schedule takes to report them\n"
+		"  gate                  measure the verify-on-open gate's decision latency\n"
+		"                        (verify, cache hit, and deny of --corrupt files)\n"
+		"\n"
+		"Optional arguments:\n"
+		"  -a, --alg=ALG         only benchmark ALG (default: all for hash, blake2b512\n"
+		"                        for walk and scrub)\n"
+		"  -B, --hash-backend=NAME\n"
+		"                        compute hashes with backend NAME (evp, kernel,\n"
+		"                        builtin, or auto)\n"
+		"  -c, --check           re-check the tree with --check (hash every file)\n"
+		"  -C, --corrupt=N       flip a bit in N files for scrub (default: 10)\n"
+		"  -d, --depth=N         directory levels below the root (default: 3)\n"
+		"  -e, --fail-every=N    fail every Nth filesystem operation with EIO\n"
+		"  -h, --help            show this help message and exit\n"
+		"  -l, --latency=NS      add NS nanoseconds to every filesystem operation\n"
+		"  -n, --files=N         regular files per directory (default: 100)\n"
+		"  -P, --preload=LIB     also run the write benchmark with LIB preloaded\n"
+		"  -r, --rounds=N        give up on scrub schedules after N rounds\n"
+		"                        (simulated days, default: 30)\n"
+		"  -s, --size=BYTES      size of each file (default: 4096, 256M for hash,\n"
+		"                        1M for write)\n"
+		"  -S, --schedule=SCHED  a scrub schedule (may be repeated): full (--check),\n"
+		"                        quick (no --check), or --policy rule options\n"
+		"                        applied to every file, e.g. \"check=7d rate=50M\"\n"
+		"                        (default: full)\n"
+		"  -T, --tag-cache=FILE  use a (new) tag cache in FILE for the walk\n"
+		"  -w, --fanout=N        subdirectories per directory (default: 10)\n",
+		program);
+}
+
+/** Long options to pass to getopt. */
+static const struct option long_opts[] = {
+	{ "alg",        required_argument, 0, 'a' },
+	{ "hash-backend", required_argument, 0, 'B' },
+	{ "check",      no_argument,       0, 'c' },
+	{ "corrupt",    required_argument, 0, 'C' },
+	{ "depth",      required_argument, 0, 'd' },
+	{ "fail-every", required_argument, 0, 'e' },
+	{ "help",       no_argument,       0, 'h' },
+	{ "latency",    required_argument, 0, 'l' },
+	{ "files",      required_argument, 0, 'n' },
+	{ "preload",    required_argument, 0, 'P' },
+	{ "rounds",     required_argument, 0, 'r' },
+	{ "schedule",   required_argument, 0, 'S' },
+	{ "size",       required_argument, 0, 's' },
+	{ "tag-cache",  required_argument, 0, 'T' },
+	{ "fanout",     required_argument, 0, 'w' },
+	{ NULL, 0, 0, 0 }
+};
+
+/**
+ * Parse a number with an optional K, M, G, or T (binary) suffix.
+ *
+ * @param s  The string to parse.
+ *
+ * @returns Returns the number (exits on malformed input).
+ */
+static unsigned long long parse_num(const char *s)
+{
+	unsigned long long val;
+
+	if (parse_size(s, &val) != 0)
+		die("Invalid number: \"%s\"\n", s);
+
+	return val;
+}
+
+/**
+ * Prints the results of one walk pass.
+ *
+ * @param name     The pass name.
+ * @param files    The number of files processed.
+ * @param elapsed  The time the pass took (in seconds).
+ * @param ret      The return value of process_path().
+ */
+static void print_walk(const char *name, uint64_t files, double elapsed, int ret)
+{
+	struct io_mem_stats st;
+
+	io_mem_get_stats(&st, true);
+
+	printf("%-8s %10llu files %9.3f s %11.0f files/s %9.0f ns/file"
+		" (ret %d, %lu opens, %lu xattr reads, %lu xattr writes, %lu faults)\n",
+		name, (unsigned long long)files, elapsed, files / elapsed,
+		elapsed * 1e9 / files, ret, st.opens, st.getxattr, st.setxattr, st.faults);
+}
+
+/**
+ * Tag every file in the synthetic tree, then re-check it.
+ *
+ * @param cfg    The tree configuration.
+ * @param check  Whether to hash every file during the re-check.
+ *
+ * @returns Returns 0 on success and a non-zero number on failure.
+ */
+static int bench_walk(const struct io_mem_config *cfg, bool check)
+{
+	uint64_t files;
+	double start;
+	int ret;
+
+	if (io_mem_init(cfg) != 0)
+		die("Failed to set up the in-memory tree\n");
+
+	files = io_mem_file_count();
+	if (files == 0)
+		die("The tree has no files\n");
+
+	printf("walk: %s, depth %u, fanout %u, %u files/dir, %lld bytes/file\n",
+		get_alg_name(args.alg), cfg->depth, cfg->fanout, cfg->files,
+		(long long)cfg->file_size);
+
+	if (args.tag_cache != NULL) {
+		unlink(args.tag_cache);
+		if (tagcache_open(args.tag_cache) != 0)
+			die("Failed to open the tag cache\n");
+	}
+
+	args.recursive = true;
+	args.check = false;
+	start = now();
+	ret = process_path(IO_MEM_ROOT);
+	print_walk("tag", files, now() - start, ret);
+
+	args.check = check;
+	start = now();
+	ret = process_path(IO_MEM_ROOT);
+	print_walk(check ? "check" : "quick", files, now() - start, ret);
+
+	tagcache_close();
+	io_mem_cleanup();
+
+	return 0;
+}
+
+/**
+ * Measure the hashing throughput of one algorithm.
+ *
+ * @param alg   The algorithm to benchmark.
+ * @param size  The number of bytes to hash.
+ * @param mibs  Where to store the throughput (in MiB/s).
+ *
+ * @returns Returns 0 on success and a non-zero number on failure.
+ */
+static int bench_hash_alg(hash_alg_t alg, off_t size, double *mibs)
+{
+	char hash[MAX_HASH_STRING_LENGTH + 1];
+	double elapsed;
+	int err;
+	int fd;
+
+	fd = io->open(IO_MEM_ROOT "/f0", O_RDONLY);
+	if (fd < 0)
+		die("Failed to open the in-memory file: %m\n");
+
+	elapsed = now();
+	err = fhash(fd, hash, sizeof(hash), alg);
+	elapsed = now() - elapsed;
+
+	io->close(fd);
+
+	if (err != 0)
+		return err;
+
+	*mibs = size / elapsed / (1 << 20);
+
+	return 0;
+}
+
+/**
+ * Measure the hashing throughput of one or all algorithms.
+ *
+ * @param cfg  The tree configuration (only the file size is used).
+ * @param alg  The algorithm to benchmark (or -1 for all of them).
+ *
+ * @returns Returns 0 on success and a non-zero number on failure.
+ */
+static int bench_hash(const struct io_mem_config *cfg, int alg)
+{
+	struct io_mem_config hcfg = { .files = 1, .file_size = cfg->file_size };
+	double blake2b = 0;
+	int ret = 0;
+	int i;
+
+	if (io_mem_init(&hcfg) != 0)
+		die("Failed to set up the in-memory tree\n");
+
+	printf("hash: %lld bytes\n", (long long)hcfg.file_size);
+
+	/* HASH_ALG_BLAKE2B (the default) comes first, so the others can be
+	 * compared against it.
+	 */
+	for (i = 0; i < HASH_ALG_COUNT; i++) {
+		double mibs;
+
+		if (alg >= 0 && alg != i)
+			continue;
+
+		if (bench_hash_alg((hash_alg_t)i, hcfg.file_size, &mibs) != 0) {
+			ret = 1;
+			continue;
+		}
+
+		if (i == HASH_ALG_BLAKE2B)
+			blake2b = mibs;
+
+		if (blake2b > 0)
+			printf("%-12s %9.1f MiB/s  %5.2fx blake2b\n", get_alg_name((hash_alg_t)i),
+				mibs, mibs / blake2b);
+		else
+			printf("%-12s %9.1f MiB/s\n", get_alg_name((hash_alg_t)i), mibs);
+	}
+
+	io_mem_cleanup();
+
+	return ret;
+}
+
+/** A corruption injected by the scrub benchmark. */
+struct scrub_item {
+	char path[PATH_MAX]; /**< The corrupted file. */
+	off_t offset;        /**< The offset of the corrupted byte. */
+	unsigned bit;        /**< The flipped bit. */
+	int idx;             /**< The corruption's io_mem_corrupt() index. */
+	unsigned round;      /**< The round it was reported in (0 if it wasn't). */
+	double time;         /**< The scan time until it was reported (in seconds). */
+	uint64_t bytes;      /**< The bytes read until it was reported. */
+};
+
+/** The datagram the scrub benchmark sends itself to flush the event socket. */
+#define SCRUB_SYNC "sync"
+
+/** The datagram that stops the scrub benchmark's event listener. */
+#define SCRUB_QUIT "quit"
+
+/** The scrub benchmark's temporary files and event listener. */
+static struct {
+	char dir[PATH_MAX];         /**< The temporary directory. */
+	char socket[PATH_MAX + 16]; /**< The event socket's path. */
+	char policy[PATH_MAX + 16]; /**< The schedule's policy file. */
+	struct sockaddr_un addr;    /**< The event socket's address. */
+	int fd;                     /**< The event socket. */
+	int sync_fd;                /**< The socket sync markers are sent from. */
+	pthread_t listener;         /**< The thread reading the event socket. */
+	unsigned long long sent;    /**< The sync markers sent. */
+	pthread_mutex_t lock;       /**< Protects everything below. */
+	pthread_cond_t cond;        /**< Signalled when a sync marker is received. */
+	struct scrub_item *items;   /**< The corruptions being looked for. */
+	size_t n;                   /**< The number of corruptions. */
+	unsigned round;             /**< The round being run. */
+	unsigned long long synced;  /**< The sync markers received. */
+	unsigned long long dropped; /**< The events the stream reported dropping. */
+} scrub = {
+	.fd = -1,
+	.sync_fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/** Returns the next number of a deterministic (xorshift) sequence. */
+static uint64_t scrub_random(uint64_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+
+	return *seed;
+}
+
+/**
+ * Mark the corruption an event reports as CORRUPT (if any) as reported in
+ * the current round.
+ *
+ * @note The caller must hold scrub.lock.
+ *
+ * @param event  The event (a JSON object).
+ */
+static void scrub_event(const char *event)
+{
+	char needle[PATH_MAX + 16];
+	const char *dropped;
+	size_t i;
+
+	dropped = strstr(event, "\"dropped\":");
+	if (dropped != NULL && strtoull(dropped + 10, NULL, 10) > scrub.dropped)
+		scrub.dropped = strtoull(dropped + 10, NULL, 10);
+
+	if (strstr(event, "\"event\":\"state\"") == NULL ||
+		strstr(event, "\"state\":\"CORRUPT\"") == NULL)
+		return;
+
+	for (i = 0; i < scrub.n; i++) {
+		snprintf(needle, sizeof(needle), "\"path\":\"%s\"", scrub.items[i].path);
+		if (scrub.items[i].round == 0 && strstr(event, needle) != NULL)
+			scrub.items[i].round = scrub.round;
+	}
+}
+
+/** Read the event socket (so no events are dropped while a round runs). */
+static void *scrub_listen(void *arg __attribute__((unused)))
+{
+	char buf[4096 + 1];
+	ssize_t len;
+
+	for (;;) {
+		len = recv(scrub.fd, buf, sizeof(buf) - 1, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			die("Failed to receive events: %m\n");
+
+		buf[len] = '\0';
+
+		if (strcmp(buf, SCRUB_QUIT) == 0)
+			break;
+
+		pthread_mutex_lock(&scrub.lock);
+		if (strcmp(buf, SCRUB_SYNC) == 0) {
+			scrub.synced++;
+			pthread_cond_broadcast(&scrub.cond);
+		}
+		else {
+			scrub_event(buf);
+		}
+		pthread_mutex_unlock(&scrub.lock);
+	}
+
+	return NULL;
+}
+
+/** Send a marker to the event socket. */
+static void scrub_send(const char *marker)
+{
+	if (sendto(scrub.sync_fd, marker, strlen(marker), 0, (struct sockaddr *)&scrub.addr,
+			sizeof(scrub.addr)) < 0)
+		die("Failed to send to the event socket: %m\n");
+}
+
+/** Wait until the listener has processed every event published so far. */
+static void scrub_sync(void)
+{
+	unsigned long long target = ++scrub.sent;
+
+	scrub_send(SCRUB_SYNC);
+
+	pthread_mutex_lock(&scrub.lock);
+	while (scrub.synced < target)
+		pthread_cond_wait(&scrub.cond, &scrub.lock);
+	pthread_mutex_unlock(&scrub.lock);
+}
+
+/** Create the temporary directory and start listening on an event socket in it. */
+static void scrub_setup(void)
+{
+	const char *tmpdir;
+
+	tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL || tmpdir[0] == '\0')
+		tmpdir = "/tmp";
+
+	snprintf(scrub.dir, sizeof(scrub.dir), "%s/b2tag-bench.XXXXXX", tmpdir);
+	if (mkdtemp(scrub.dir) == NULL)
+		die("Failed to create a directory in %s: %m\n", tmpdir);
+
+	snprintf(scrub.socket, sizeof(scrub.socket), "%s/events", scrub.dir);
+	snprintf(scrub.policy, sizeof(scrub.policy), "%s/policy", scrub.dir);
+	if (strlen(scrub.socket) >= sizeof(scrub.addr.sun_path))
+		die("The temporary directory \"%s\" is too long\n", scrub.dir);
+
+	scrub.addr.sun_family = AF_UNIX;
+	strcpy(scrub.addr.sun_path, scrub.socket);
+
+	scrub.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (scrub.fd < 0 || bind(scrub.fd, (struct sockaddr *)&scrub.addr, sizeof(scrub.addr)) != 0)
+		die("Failed to create the event socket: %m\n");
+
+	scrub.sync_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (scrub.sync_fd < 0)
+		die("Failed to create a socket: %m\n");
+
+	errno = pthread_create(&scrub.listener, NULL, scrub_listen, NULL);
+	if (errno != 0)
+		die("Failed to start the event listener: %m\n");
+}
+
+/** Stop the event listener and remove the temporary files. */
+static void scrub_teardown(void)
+{
+	scrub_send(SCRUB_QUIT);
+	pthread_join(scrub.listener, NULL);
+
+	close(scrub.sync_fd);
+	close(scrub.fd);
+	unlink(scrub.socket);
+	unlink(scrub.policy);
+	rmdir(scrub.dir);
+}
+
+/**
+ * Choose the files to corrupt (different files, at random offsets).
+ *
+ * @param cfg    The tree configuration.
+ * @param items  Where to store the corruptions.
+ * @param n      The number of corruptions (at most the number of files).
+ */
+static void scrub_pick(const struct io_mem_config *cfg, struct scrub_item *items, size_t n)
+{
+	uint64_t seed = 0x2545f4914f6cdd1dULL;
+	uint64_t files = io_mem_file_count();
+	size_t i, j;
+
+	for (i = 0; i < n; i++) {
+		uint64_t file;
+
+		do {
+			file = scrub_random(&seed) % files;
+			if (io_mem_file_path(file, items[i].path, sizeof(items[i].path)) != 0)
+				die("Failed to build the path of file %llu\n", (unsigned long long)file);
+
+			for (j = 0; j < i; j++) {
+				if (strcmp(items[i].path, items[j].path) == 0)
+					break;
+			}
+		} while (j < i);
+
+		items[i].offset = (off_t)(scrub_random(&seed) % (uint64_t)cfg->file_size);
+		items[i].bit = (unsigned)(scrub_random(&seed) % 8);
+	}
+}
+
+/**
+ * Work out when the corruptions reported in a round were found.
+ *
+ * The cost of a detection is taken from when the corrupted file was closed
+ * (i.e. fully hashed), which is just before b2tag reported it.
+ *
+ * @param items    The corruptions.
+ * @param n        The number of corruptions.
+ * @param round    The round that just ran.
+ * @param start    When the round started (see now()).
+ * @param elapsed  The time taken by the previous rounds (in seconds).
+ *
+ * @returns Returns the number of corruptions reported in @p round.
+ */
+static size_t scrub_found(struct scrub_item *items, size_t n, unsigned round, double start,
+	double elapsed)
+{
+	size_t found = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct io_mem_corruption c;
+
+		if (items[i].round != round)
+			continue;
+
+		if (io_mem_get_corruption(items[i].idx, &c) != 0 || !c.read)
+			die("%s was reported without reading the corrupted byte\n", items[i].path);
+
+		items[i].time = elapsed + (double)c.time.tv_sec + (double)c.time.tv_nsec / 1e9 - start;
+		items[i].bytes = c.bytes;
+		found++;
+	}
+
+	return found;
+}
+
+/** Orders corruptions by when they were reported (unreported ones last). */
+static int scrub_compare(const void *a, const void *b)
+{
+	const struct scrub_item *x = a;
+	const struct scrub_item *y = b;
+
+	if ((x->round == 0) != (y->round == 0))
+		return x->round == 0 ? 1 : -1;
+
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+/**
+ * Run one schedule against a freshly tagged and corrupted tree.
+ *
+ * @param cfg     The tree configuration.
+ * @param sched   The schedule ("full", "quick", or policy rule options).
+ * @param items   The corruptions.
+ * @param n       The number of corruptions.
+ * @param rounds  The most rounds to run.
+ */
+static void scrub_schedule(const struct io_mem_config *cfg, const char *sched,
+	struct scrub_item *items, size_t n, unsigned rounds)
+{
+	struct io_mem_stats st;
+	time_t base = time(NULL);
+	double elapsed = 0;
+	size_t found = 0;
+	unsigned round;
+	size_t i;
+
+	if (io_mem_init(cfg) != 0)
+		die("Failed to set up the in-memory tree\n");
+
+	args.check = false;
+	process_path(IO_MEM_ROOT);
+
+	for (i = 0; i < n; i++) {
+		items[i].idx = io_mem_corrupt(items[i].path, items[i].offset, items[i].bit);
+		if (items[i].idx < 0)
+			die("Failed to corrupt %s: %s\n", items[i].path, strerror(-items[i].idx));
+		items[i].round = 0;
+	}
+
+	if (strcmp(sched, "full") == 0) {
+		args.check = true;
+	}
+	else if (strcmp(sched, "quick") != 0) {
+		FILE *f = fopen(scrub.policy, "w");
+
+		if (f == NULL || fprintf(f, "* %s\n", sched) < 0 || fclose(f) != 0)
+			die("Failed to write %s: %m\n", scrub.policy);
+
+		if (policy_load(scrub.policy) != 0) {
+			scrub_teardown();
+			die("Invalid schedule: \"%s\"\n", sched);
+		}
+	}
+
+	pthread_mutex_lock(&scrub.lock);
+	scrub.items = items;
+	scrub.n = n;
+	pthread_mutex_unlock(&scrub.lock);
+
+	/* Only publish the rounds' events (the tagging pass reports every file). */
+	if (events_open(scrub.socket) != 0)
+		die("Failed to publish events\n");
+
+	io_mem_get_stats(&st, true);
+
+	for (round = 1; round <= rounds && found < n; round++) {
+		double start, end;
+
+		/* Each round is a day later, so periodic checks cover a new slice. */
+		policy_set_time(base + (time_t)(round - 1) * 24 * 60 * 60);
+
+		pthread_mutex_lock(&scrub.lock);
+		scrub.round = round;
+		pthread_mutex_unlock(&scrub.lock);
+
+		start = now();
+		process_path(IO_MEM_ROOT);
+		end = now();
+
+		scrub_sync();
+		found += scrub_found(items, n, round, start, elapsed);
+		elapsed += end - start;
+	}
+
+	io_mem_get_stats(&st, false);
+
+	/* The end event carries the final count of dropped events. */
+	events_close(0);
+	scrub_sync();
+
+	pthread_mutex_lock(&scrub.lock);
+	scrub.items = NULL;
+	scrub.n = 0;
+	pthread_mutex_unlock(&scrub.lock);
+
+	printf("schedule \"%s\": %zu of %zu reported in %u rounds (%.3f s, %.1f MiB read)\n",
+		sched, found, n, round - 1, elapsed, (double)st.bytes / (1 << 20));
+
+	qsort(items, n, sizeof(items[0]), scrub_compare);
+
+	for (i = 0; i < n; i++) {
+		if (items[i].round != 0)
+			printf("  round %4u %9.3f s %10.1f MiB  %s\n", items[i].round, items[i].time,
+				(double)items[i].bytes / (1 << 20), items[i].path);
+		else
+			printf("  not reported              %s\n", items[i].path);
+	}
+
+	policy_close();
+	io_mem_cleanup();
+}
+
+/**
+ * Measure how long each schedule takes to report silently corrupted files.
+ *
+ * @param cfg        The tree configuration.
+ * @param corrupt    The number of files to corrupt.
+ * @param rounds     The most rounds to run each schedule for.
+ * @param schedules  The schedules to compare.
+ * @param count      The number of schedules.
+ *
+ * @returns Returns 0 on success and a non-zero number on failure.
+ */
+static int bench_scrub(const struct io_mem_config *cfg, size_t corrupt, unsigned rounds,
+	const char *schedules[], size_t count)
+{
+	struct scrub_item *items;
+	uint64_t files;
+	size_t i;
+
+	if (io_mem_init(cfg) != 0)
+		die("Failed to set up the in-memory tree\n");
+
+	files = io_mem_file_count();
+	if (files == 0)
+		die("The tree has no files\n");
+	if (corrupt > files)
+		corrupt = (size_t)files;
+
+	items = calloc(corrupt ? corrupt : 1, sizeof(*items));
+	if (items == NULL)
+		die("Out of memory\n");
+
+	scrub_pick(cfg, items, corrupt);
+
+	printf("scrub: %s, %llu files, %lld bytes/file, %zu corrupted, up to %u rounds\n",
+		get_alg_name(args.alg), (unsigned long long)files, (long long)cfg->file_size,
+		corrupt, rounds);
+
+	scrub_setup();
+	args.recursive = true;
+
+	for (i = 0; i < count; i++)
+		scrub_schedule(cfg, schedules[i], items, corrupt, rounds);
+
+	if (scrub.dropped > 0)
+		printf("warning: %llu events were dropped (detections may be missing)\n",
+			scrub.dropped);
+
+	scrub_teardown();
+	free(items);
+
+	return 0;
+}
+
+/** The number of cache-hit passes over the tree in the gate benchmark. */
+#define GATE_PASSES 10
+
+/** Orders latencies. */
+static int gate_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Prints the latency distribution of one kind of gate decision.
+ *
+ * @param name  The kind of decision.
+ * @param ns    The latencies (in nanoseconds, sorted in place).
+ * @param n     The number of latencies.
+ */
+static void print_gate(const char *name, uint64_t *ns, size_t n)
+{
+	uint64_t total = 0;
+	size_t i;
+
+	if (n == 0)
+		return;
+
+	qsort(ns, n, sizeof(ns[0]), gate_compare);
+	for (i = 0; i < n; i++)
+		total += ns[i];
+
+	printf("%-8s %10zu decisions %9.0f ns/decision  p50 %7llu ns  p99 %7llu ns  max %9llu ns\n",
+		name, n, (double)total / (double)n, (unsigned long long)ns[n / 2],
+		(unsigned long long)ns[n - n / 100 - 1], (unsigned long long)ns[n - 1]);
+}
+
+/**
+ * Open a file of the tree and ask the gate about it.
+ *
+ * @param n       The file's number.
+ * @param verify  Whether to verify the file if the cache misses.
+ * @param ns      Where to store the decision's latency (in nanoseconds).
+ *
+ * @returns Returns the decision.
+ */
+static enum gate_decision gate_open(uint64_t n, bool verify, uint64_t *ns)
+{
+	char path[PATH_MAX];
+	enum gate_decision decision;
+	struct stat st;
+	double start;
+	int fd;
+
+	if (io_mem_file_path(n, path, sizeof(path)) != 0)
+		die("Failed to find file %llu\n", (unsigned long long)n);
+
+	fd = io->open(path, O_RDONLY);
+	if (fd < 0)
+		die("Failed to open \"%s\": %m\n", path);
+
+	start = now();
+	decision = gate_lookup(fd, &st);
+	if (decision == GATE_VERIFY && verify)
+		decision = gate_verify(fd, &st, path, false);
+	*ns = (uint64_t)((now() - start) * 1e9);
+
+	io->close(fd);
+
+	return decision;
+}
+
+/**
+ * Measure the latency of the verify-on-open gate's decisions (see gate.h):
+ * verifying every file of a tagged tree, allowing them again from the
+ * verified cache, and denying corrupted files once their entries expire.
+ *
+ * @param cfg      The tree configuration.
+ * @param corrupt  The number of files to corrupt.
+ *
+ * @returns Returns 0 on success and a non-zero number on failure.
+ */
+static int bench_gate(const struct io_mem_config *cfg, size_t corrupt)
+{
+	uint64_t files;
+	uint64_t *ns;
+	size_t denied = 0;
+	size_t n;
+	uint64_t i;
+
+	if (io_mem_init(cfg) != 0)
+		die("Failed to set up the in-memory tree\n");
+
+	files = io_mem_file_count();
+	if (files == 0)
+		die("The tree has no files\n");
+	if (corrupt > files)
+		corrupt = (size_t)files;
+
+	ns = malloc(files * GATE_PASSES * sizeof(ns[0]));
+	if (ns == NULL)
+		die("Out of memory\n");
+
+	printf("gate: %s, %llu files, %lld bytes/file, %zu corrupted\n",
+		get_alg_name(args.alg), (unsigned long long)files, (long long)cfg->file_size, corrupt);
+
+	args.recursive = true;
+	args.check = false;
+	args.dry_run = false;
+	if (process_path(IO_MEM_ROOT) < 0)
+		die("Failed to tag the in-memory tree\n");
+
+	if (gate_cache_init(files * 2, 0) != 0)
+		die("Failed to allocate the verified cache\n");
+
+	/* Cold: every open is verified (and cached). */
+	for (i = 0; i < files; i++) {
+		if (gate_open(i, true, &ns[i]) != GATE_ALLOW)
+			die("The gate denied an intact file\n");
+	}
+	print_gate("verify", ns, (size_t)files);
+
+	/* Warm: the opens are allowed from the cache (conflicts in the cache's
+	 * sets can evict a few files, which are left out).
+	 */
+	n = 0;
+	for (i = 0; i < files * GATE_PASSES; i++) {
+		if (gate_open(i % files, false, &ns[n]) == GATE_ALLOW)
+			n++;
+	}
+	print_gate("hit", ns, n);
+	printf("%.2f%% of the opens missed the cache\n",
+		100.0 * (double)(files * GATE_PASSES - n) / (double)(files * GATE_PASSES));
+
+	/* The cache can't see silent corruption, so expire it and re-verify. */
+	for (i = 0; i < corrupt; i++) {
+		char path[PATH_MAX];
+
+		io_mem_file_path(i * (files / corrupt), path, sizeof(path));
+		if (io_mem_corrupt(path, cfg->file_size / 2, (unsigned)i % 8) < 0)
+			die("Failed to corrupt \"%s\"\n", path);
+	}
+
+	gate_cache_free();
+	if (gate_cache_init(files * 2, 0) != 0)
+		die("Failed to allocate the verified cache\n");
+
+	n = 0;
+	for (i = 0; i < corrupt; i++) {
+		if (gate_open(i * (files / corrupt), true, &ns[n++]) == GATE_DENY)
+			denied++;
+	}
+	print_gate("deny", ns, n);
+	printf("%zu of %zu corrupted files denied\n", denied, corrupt);
+
+	gate_cache_free();
+	io_mem_cleanup();
+	free(ns);
+
+	return denied == corrupt ? 0 : 1;
+}
+
+/** The size of each write() in the write benchmark. */
+#define WRITE_CHUNK (64 << 10)
+
+/** The environment variable passing the baseline to the preloaded write run. */
+#define WRITE_BASELINE_ENV "B2TAG_BENCH_BASELINE"
+
+/**
+ * Write (and delete) files in a temporary directory.
+ *
+ * @param cfg   The tree configuration (the number and size of the files).
+ * @param mibs  Where to store the throughput (in MiB/s).
+ *
+ * @returns Returns 0 on success and a non-zero number on failure.
+ */
+static int bench_write_pass(const struct io_mem_config *cfg, double *mibs)
+{
+	char dir[PATH_MAX];
+	char path[PATH_MAX + 16];
+	const char *tmpdir;
+	char *buf;
+	double elapsed;
+	unsigned i;
+	int ret = 0;
+
+	tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL || tmpdir[0] == '\0')
+		tmpdir = "/tmp";
+
+	snprintf(dir, sizeof(dir), "%s/b2tag-bench.XXXXXX", tmpdir);
+	if (mkdtemp(dir) == NULL)
+		die("Failed to create a directory in %s: %m\n", tmpdir);
+
+	buf = malloc(WRITE_CHUNK);
+	if (buf == NULL)
+		die("Out of memory\n");
+	for (i = 0; i < WRITE_CHUNK; i++)
+		buf[i] = (char)(i * 131 + 7);
+
+	elapsed = now();
+
+	for (i = 0; i < cfg->files && ret == 0; i++) {
+		off_t left = cfg->file_size;
+		int fd;
+
+		snprintf(path, sizeof(path), "%s/f%u", dir, i);
+
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			pr_err("Failed to create %s: %m\n", path);
+			ret = 1;
+			break;
+		}
+
+		while (left > 0) {
+			size_t n = left < WRITE_CHUNK ? (size_t)left : WRITE_CHUNK;
+			ssize_t len = write(fd, buf, n);
+
+			if (len <= 0) {
+				pr_err("Failed to write %s: %m\n", path);
+				ret = 1;
+				break;
+			}
+
+			left -= len;
+		}
+
+		/* Closing the file is when the preload library tags it. */
+		if (close(fd) != 0) {
+			pr_err("Failed to close %s: %m\n", path);
+			ret = 1;
+		}
+	}
+
+	elapsed = now() - elapsed;
+
+	while (i-- > 0) {
+		snprintf(path, sizeof(path), "%s/f%u", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+	free(buf);
+
+	*mibs = (double)cfg->files * cfg->file_size / elapsed / (1 << 20);
+
+	return ret;
+}
+
+/**
+ * Measure the write throughput, and with @p preload, the throughput with the
+ * write-time tagging library loaded.
+ *
+ * The preloaded run re-executes the benchmark with LD_PRELOAD set (the library
+ * can't be loaded into a running process), passing the baseline along in the
+ * environment.
+ *
+ * @param cfg      The tree configuration (the number and size of the files).
+ * @param alg      The algorithm the library should use (or -1 for its default).
+ * @param preload  The library to preload (or NULL).
+ * @param argv     The command-line arguments (to re-execute the benchmark).
+ *
+ * @returns Returns 0 on success and a non-zero number on failure.
+ */
+static int bench_write(const struct io_mem_config *cfg, int alg, const char *preload,
+	char *argv[])
+{
+	const char *baseline = getenv(WRITE_BASELINE_ENV);
+	char rate[32];
+	double mibs;
+	int ret;
+
+	if (baseline != NULL) {
+		ret = bench_write_pass(cfg, &mibs);
+		if (ret == 0)
+			printf("%-12s %9.1f MiB/s  %5.1f%% overhead\n", "preload", mibs,
+				(strtod(baseline, NULL) / mibs - 1) * 100);
+		return ret;
+	}
+
+	printf("write: %u files, %lld bytes/file, %d byte writes\n", cfg->files,
+		(long long)cfg->file_size, WRITE_CHUNK);
+
+	ret = bench_write_pass(cfg, &mibs);
+	if (ret != 0)
+		return ret;
+
+	printf("%-12s %9.1f MiB/s\n", "plain", mibs);
+
+	if (preload == NULL)
+		return 0;
+
+	fflush(stdout);
+
+	snprintf(rate, sizeof(rate), "%f", mibs);
+	if (setenv(WRITE_BASELINE_ENV, rate, 1) != 0 || setenv("LD_PRELOAD", preload, 1) != 0 ||
+		(alg >= 0 && setenv("B2TAG_ALG", get_alg_name((hash_alg_t)alg), 1) != 0))
+		die("Failed to set up the environment: %m\n");
+
+	execv("/proc/self/exe", argv);
+	die("Failed to re-execute %s: %m\n", argv[0]);
+}
+
+/**
+ * The entry point to the b2tag-bench utility.
+ *
+ * @param argc  The number of command-line arguments.
+ * @param argv  The command-line arguments.
+ *
+ * @retval 0  Program completed successfully.
+ * @retval !0 An error occurred.
+ */
+int main(int argc, char *argv[])
+{
+	struct io_mem_config cfg = {
+		.depth = 3,
+		.fanout = 10,
+		.files = 100,
+	};
+	char *program = basename(argv[0]);
+	const char *schedules[MAX_SCHEDULES];
+	const char *preload = NULL;
+	size_t nschedules = 0;
+	size_t corrupt = 10;
+	unsigned rounds = 30;
+	bool check = false;
+	int alg = -1;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "a:B:cC:d:e:hl:n:P:r:s:S:T:w:", long_opts,
+			NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			if (get_alg_by_name(optarg, &args.alg) != 0)
+				die("Unknown hash algorithm: \"%s\"\n", optarg);
+			alg = (int)args.alg;
+			break;
+		case 'B':
+			if (hash_set_backend(optarg) != 0)
+				die("Unknown hash backend: \"%s\"\n", optarg);
+			break;
+		case 'c':
+			check = true;
+			break;
+		case 'C':
+			corrupt = (size_t)parse_num(optarg);
+			break;
+		case 'd':
+			cfg.depth = (unsigned)parse_num(optarg);
+			break;
+		case 'e':
+			cfg.fail_every = (unsigned long)parse_num(optarg);
+			break;
+		case 'h':
+			usage(program);
+			return EXIT_SUCCESS;
+		case 'l':
+			cfg.latency_ns = (unsigned long)parse_num(optarg);
+			break;
+		case 'n':
+			cfg.files = (unsigned)parse_num(optarg);
+			break;
+		case 'P':
+			preload = optarg;
+			break;
+		case 'r':
+			rounds = (unsigned)parse_num(optarg);
+			break;
+		case 's':
+			cfg.file_size = (off_t)parse_num(optarg);
+			break;
+		case 'S':
+			if (nschedules == MAX_SCHEDULES)
+				die("At most %d schedules can be compared\n", MAX_SCHEDULES);
+			schedules[nschedules++] = optarg;
+			break;
+		case 'T':
+			args.tag_cache = optarg;
+			break;
+		case 'w':
+			cfg.fanout = (unsigned)parse_num(optarg);
+			break;
+		default:
+			usage(program);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(program);
+		return EXIT_FAILURE;
+	}
+
+	/* Don't print any per-file messages. */
+	args.verbose = -2;
+
+	if (strcmp(argv[optind], "walk") == 0) {
+		if (alg < 0)
+			args.alg = HASH_ALG_BLAKE2B;
+		if (cfg.file_size == 0)
+			cfg.file_size = 4096;
+
+		return bench_walk(&cfg, check);
+	}
+
+	if (strcmp(argv[optind], "hash") == 0) {
+		if (cfg.file_size == 0)
+			cfg.file_size = 256 << 20;
+
+		return bench_hash(&cfg, alg);
+	}
+
+	if (strcmp(argv[optind], "scrub") == 0) {
+		if (alg < 0)
+			args.alg = HASH_ALG_BLAKE2B;
+		if (cfg.file_size == 0)
+			cfg.file_size = 4096;
+		if (nschedules == 0)
+			schedules[nschedules++] = "full";
+
+		return bench_scrub(&cfg, corrupt, rounds, schedules, nschedules);
+	}
+
+	if (strcmp(argv[optind], "gate") == 0) {
+		if (alg < 0)
+			args.alg = HASH_ALG_BLAKE2B;
+		if (cfg.file_size == 0)
+			cfg.file_size = 4096;
+
+		return bench_gate(&cfg, corrupt);
+	}
+
+	if (strcmp(argv[optind], "write") == 0) {
+		if (cfg.file_size == 0)
+			cfg.file_size = 1 << 20;
+
+		return bench_write(&cfg, alg, preload, argv);
+	}
+
+	usage(program);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Block device region verification.
+ *
+ * The sidecar file layout (all integers little-endian):
+ * @li A struct region_header.
+ * @li The raw digest of each region, in order.
+ *
+ * A device's sidecar is named after the path it was given as (with every
+ * byte other than letters, digits, '.', '_', and '-' escaped as %XX), since
+ * device numbers (and the dm-N names behind LVM's symlinks) can change
+ * across reboots.
+ */
+
+#include "blockdev.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "b2tag.h"
+#include "budget.h"
+#include "events.h"
+#include "io.h"
+#include "utilities.h"
+
+/** The magic string (and version) at the start of a sidecar file. */
+#define REGION_MAGIC "B2TREGN1"
+
+/** The size of each read (regions are a multiple of this). */
+#define BLOCKDEV_CHUNK (1 << 20)
+
+/** The alignment of the read buffers (for O_DIRECT). */
+#define BLOCKDEV_ALIGN 4096
+
+/** The on-disk sidecar header. */
+struct region_header {
+	char magic[8];        /**< #REGION_MAGIC */
+	char alg[16];         /**< The hash algorithm's name (NUL-padded). */
+	uint32_t hash_len;    /**< The digest length. */
+	uint32_t pad;         /**< Reserved (zero). */
+	uint64_t region_size; /**< The size of each region. */
+	uint64_t device_size; /**< The size of the device. */
+	uint64_t count;       /**< The number of regions. */
+};
+
+/** A device being hashed. */
+struct bd_job {
+	int fd;                 /**< The open device. */
+	uint64_t size;          /**< The device's size. */
+	uint64_t nregions;      /**< The number of regions. */
+	uint64_t next;          /**< The next region to hash (atomic). */
+	unsigned char *digests; /**< The region digests. */
+	int error;              /**< The first error (0 if none). */
+	uint64_t error_region;  /**< The region the first error occurred in. */
+	pthread_mutex_t lock;   /**< Protects bd_job::error. */
+};
+
+/** The block device settings. */
+static struct {
+	bool enabled;         /**< Whether block devices are verified. */
+	const char *dir;      /**< The sidecar directory. */
+	uint64_t region_size; /**< The size of each region. */
+	unsigned int jobs;    /**< The number of reader threads per device. */
+	hash_alg_t alg;       /**< The hash algorithm. */
+	size_t hash_len;      /**< The digest length. */
+} bd;
+
+int blockdev_init(const char *dir, unsigned long long region_size, unsigned int jobs,
+	hash_alg_t alg)
+{
+	struct stat st;
+
+	if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		pr_err("Error: \"%s\" is not a directory\n", dir);
+		return 1;
+	}
+
+	if (region_size == 0 || region_size % BLOCKDEV_CHUNK != 0) {
+		pr_err("Error: the region size must be a multiple of 1M\n");
+		return 1;
+	}
+
+	bd.enabled = true;
+	bd.dir = dir;
+	bd.region_size = region_size;
+	bd.jobs = jobs > 0 ? jobs : 1;
+	bd.alg = alg;
+	bd.hash_len = get_alg_size(alg);
+
+	return 0;
+}
+
+bool blockdev_enabled(void)
+{
+	return bd.enabled;
+}
+
+/** Record the first error (and stop the other threads). */
+static void bd_fail(struct bd_job *job, uint64_t region, int error)
+{
+	pthread_mutex_lock(&job->lock);
+	if (job->error == 0) {
+		job->error = error ? error : EIO;
+		job->error_region = region;
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	__atomic_store_n(&job->next, job->nregions, __ATOMIC_RELAXED);
+}
+
+/**
+ * Hash a single region.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int bd_hash_region(struct bd_job *job, uint64_t region, void *buf)
+{
+	uint64_t off = region * bd.region_size;
+	uint64_t end = off + bd.region_size < job->size ? off + bd.region_size : job->size;
+	hash_ctx_t *ctx;
+
+	ctx = hash_ctx_new(bd.alg);
+	if (ctx == NULL)
+		return -1;
+
+	while (off < end) {
+		size_t len = end - off < BLOCKDEV_CHUNK ? (size_t)(end - off) : BLOCKDEV_CHUNK;
+		ssize_t n = pread(job->fd, buf, len, (off_t)off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		/* The device shrank while it was being read. */
+		if (n == 0)
+			errno = EIO;
+
+		if (n <= 0 || hash_update(ctx, buf, (size_t)n) != 0)
+			goto fail;
+
+		off += (uint64_t)n;
+	}
+
+	if (hash_final(ctx, job->digests + region * bd.hash_len) < 0)
+		goto fail;
+
+	hash_ctx_free(ctx);
+	return 0;
+
+fail:
+	hash_ctx_free(ctx);
+	return -1;
+}
+
+/** A reader thread: hash regions until there are none left. */
+static void *bd_thread(void *arg)
+{
+	struct bd_job *job = arg;
+	void *buf = NULL;
+
+	if (budget_reserve(BLOCKDEV_CHUNK, false) != 0) {
+		bd_fail(job, 0, ENOMEM);
+		return NULL;
+	}
+
+	if (posix_memalign(&buf, BLOCKDEV_ALIGN, BLOCKDEV_CHUNK) != 0) {
+		budget_release(BLOCKDEV_CHUNK);
+		bd_fail(job, 0, ENOMEM);
+		return NULL;
+	}
+
+	for (;;) {
+		uint64_t region = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+
+		if (region >= job->nregions)
+			break;
+
+		if (bd_hash_region(job, region, buf) != 0) {
+			bd_fail(job, region, errno);
+			break;
+		}
+	}
+
+	free(buf);
+	budget_release(BLOCKDEV_CHUNK);
+
+	return NULL;
+}
+
+/**
+ * Hash every region of a device with up to bd.jobs threads.
+ *
+ * @retval 0  The device was hashed.
+ * @retval -1 An error occurred (in bd_job::error).
+ */
+static int bd_hash(struct bd_job *job)
+{
+	unsigned int nthreads = bd.jobs;
+	pthread_t *threads;
+	unsigned int i;
+
+	if (nthreads > job->nregions)
+		nthreads = job->nregions > 0 ? (unsigned int)job->nregions : 1;
+
+	threads = budget_malloc(nthreads * sizeof(threads[0]));
+	if (threads == NULL) {
+		job->error = errno;
+		return -1;
+	}
+
+	/* This thread is one of the readers. */
+	for (i = 1; i < nthreads; i++) {
+		int err = pthread_create(&threads[i], NULL, bd_thread, job);
+
+		if (err != 0) {
+			pr_warn("Warning: could not start a reader thread: %s\n", strerror(err));
+			nthreads = i;
+			break;
+		}
+	}
+
+	bd_thread(job);
+
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	budget_free(threads, nthreads * sizeof(threads[0]));
+
+	return job->error != 0 ? -1 : 0;
+}
+
+/**
+ * Format the path of a device's sidecar file.
+ *
+ * @returns Returns the path (free with free()) or NULL on failure.
+ */
+static char *bd_sidecar_path(const char *filename)
+{
+	size_t dir_len = strlen(bd.dir);
+	char *path;
+	char *p;
+
+	path = malloc(dir_len + 1 + strlen(filename) * 3 + sizeof(".regions"));
+	if (path == NULL)
+		return NULL;
+
+	memcpy(path, bd.dir, dir_len);
+	p = path + dir_len;
+	*p++ = '/';
+
+	for (; *filename != '\0'; filename++) {
+		unsigned char c = (unsigned char)*filename;
+
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '.' || c == '_' || c == '-')
+			*p++ = (char)c;
+		else
+			p += sprintf(p, "%%%02X", c);
+	}
+
+	strcpy(p, ".regions");
+
+	return path;
+}
+
+/**
+ * Load a sidecar file.
+ *
+ * @param path     The sidecar file.
+ * @param hdr      Where to store the (host-endian) header.
+ * @param digests  Where to store the digests (free with budget_free()).
+ *
+ * @retval 0  The sidecar was loaded.
+ * @retval 1  There's no (usable) sidecar.
+ */
+static int bd_load(const char *path, struct region_header *hdr, unsigned char **digests)
+{
+	size_t size;
+	FILE *f;
+
+	*digests = NULL;
+
+	f = fopen(path, "rbe");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			pr_warn("Warning: could not open \"%s\": %m\n", path);
+		return 1;
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+		memcmp(hdr->magic, REGION_MAGIC, sizeof(hdr->magic)) != 0)
+		goto corrupt;
+
+	hdr->hash_len    = le32toh(hdr->hash_len);
+	hdr->region_size = le64toh(hdr->region_size);
+	hdr->device_size = le64toh(hdr->device_size);
+	hdr->count       = le64toh(hdr->count);
+
+	if (hdr->alg[sizeof(hdr->alg) - 1] != '\0' || hdr->hash_len > MAX_HASH_SIZE ||
+		hdr->region_size == 0 ||
+		hdr->count != (hdr->device_size + hdr->region_size - 1) / hdr->region_size)
+		goto corrupt;
+
+	/* Digests of another algorithm or region size can't be compared. */
+	if (strcmp(hdr->alg, get_alg_name(bd.alg)) != 0 || hdr->region_size != bd.region_size) {
+		pr_warn("Warning: \"%s\" uses another algorithm or region size, ignoring it\n", path);
+		fclose(f);
+		return 1;
+	}
+
+	size = (size_t)hdr->count * hdr->hash_len;
+
+	*digests = budget_malloc(size ? size : 1);
+	if (*digests == NULL) {
+		pr_warn("Warning: could not load \"%s\": %m\n", path);
+		fclose(f);
+		return 1;
+	}
+
+	if (fread(*digests, 1, size, f) != size) {
+		budget_free(*digests, size ? size : 1);
+		*digests = NULL;
+		goto corrupt;
+	}
+
+	fclose(f);
+	return 0;
+
+corrupt:
+	pr_warn("Warning: ignoring corrupt sidecar \"%s\"\n", path);
+	fclose(f);
+	return 1;
+}
+
+/**
+ * Write a sidecar file (atomically replacing the old one).
+ *
+ * @retval 0  The sidecar was written.
+ * @retval 1  An error occurred (a message was printed).
+ */
+static int bd_save(const char *path, const struct bd_job *job)
+{
+	struct region_header hdr = { .magic = REGION_MAGIC };
+	size_t size = (size_t)job->nregions * bd.hash_len;
+	char *tmp;
+	FILE *f;
+
+	strncpy(hdr.alg, get_alg_name(bd.alg), sizeof(hdr.alg) - 1);
+	hdr.hash_len    = htole32((uint32_t)bd.hash_len);
+	hdr.region_size = htole64(bd.region_size);
+	hdr.device_size = htole64(job->size);
+	hdr.count       = htole64(job->nregions);
+
+	if (asprintf(&tmp, "%s.%d", path, (int)getpid()) < 0) {
+		pr_err("Error: could not write \"%s\": %m\n", path);
+		return 1;
+	}
+
+	f = fopen(tmp, "wbe");
+	if (f == NULL)
+		goto fail;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(job->digests, 1, size, f) != size) {
+		fclose(f);
+		goto fail;
+	}
+
+	if (fclose(f) != 0 || rename(tmp, path) != 0)
+		goto fail;
+
+	free(tmp);
+	return 0;
+
+fail:
+	pr_err("Error: could not write \"%s\": %m\n", path);
+	unlink(tmp);
+	free(tmp);
+	return 1;
+}
+
+/** Returns the length of region @p region of a device of @p size bytes. */
+static uint64_t region_len(uint64_t size, uint64_t region)
+{
+	uint64_t start = region * bd.region_size;
+
+	if (start >= size)
+		return 0;
+
+	return size - start < bd.region_size ? size - start : bd.region_size;
+}
+
+/**
+ * Compare the new region digests with the sidecar's and report the result.
+ *
+ * @returns Returns 0 if the device is new or unchanged and 1 if it changed.
+ */
+static int bd_report(const char *filename, const struct bd_job *job,
+	const struct region_header *old, const unsigned char *digests)
+{
+	uint64_t changed = 0;
+	uint64_t i;
+
+	if (digests == NULL) {
+		if (check_err())
+			printf("%s: NEW\n", filename);
+		return 0;
+	}
+
+	for (i = 0; i < job->nregions; i++) {
+		uint64_t len = region_len(job->size, i);
+
+		/* A region that grew or shrank (or is new) changed too. */
+		if (len == region_len(old->device_size, i) &&
+			memcmp(job->digests + i * bd.hash_len, digests + i * bd.hash_len, bd.hash_len) == 0)
+			continue;
+
+		changed++;
+
+		if (check_crit())
+			printf("%s: region %" PRIu64 " (bytes %" PRIu64 "-%" PRIu64 "): CHANGED\n",
+				filename, i, i * bd.region_size, i * bd.region_size + len - 1);
+	}
+
+	if (old->device_size != job->size) {
+		if (check_crit())
+			printf("%s: RESIZED (%" PRIu64 " to %" PRIu64 " bytes)\n", filename,
+				old->device_size, job->size);
+		events_state(filename, "RESIZED");
+		return 1;
+	}
+
+	if (changed > 0) {
+		if (check_crit())
+			printf("%s: CHANGED (%" PRIu64 " of %" PRIu64 " regions)\n", filename, changed,
+				job->nregions);
+		events_state(filename, "CHANGED");
+		return 1;
+	}
+
+	if (check_err())
+		printf("%s: OK\n", filename);
+
+	return 0;
+}
+
+int blockdev_check(const char *filename, const struct stat *st)
+{
+	struct bd_job job = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	struct region_header old;
+	unsigned char *old_digests = NULL;
+	struct timespec start, end;
+	char *sidecar = NULL;
+	bool direct = true;
+	size_t size = 0;
+	int ret = 1;
+
+	if (!S_ISBLK(st->st_mode)) {
+		pr_err("Error: \"%s\" is not a block device\n", filename);
+		return 1;
+	}
+
+	pr_debug("Processing block device: %s\n", filename);
+
+	job.fd = io->open(filename, O_RDONLY | O_DIRECT);
+	if (job.fd < 0 && errno == EINVAL) {
+		direct = false;
+		job.fd = io->open(filename, O_RDONLY);
+	}
+
+	if (job.fd < 0) {
+		pr_err("Error: could not open block device \"%s\": %m\n", filename);
+		return 1;
+	}
+
+	if (ioctl(job.fd, BLKGETSIZE64, &job.size) != 0) {
+		pr_err("Error: could not get the size of \"%s\": %m\n", filename);
+		goto out;
+	}
+
+	job.nregions = (job.size + bd.region_size - 1) / bd.region_size;
+	size = (size_t)job.nregions * bd.hash_len;
+
+	job.digests = budget_malloc(size ? size : 1);
+	sidecar = bd_sidecar_path(filename);
+	if (job.digests == NULL || sidecar == NULL) {
+		pr_err("Error: could not check \"%s\": %m\n", filename);
+		ret = -1;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (bd_hash(&job) != 0) {
+		errno = job.error;
+		pr_err("Error: could not read \"%s\" (region %" PRIu64 "): %m\n", filename,
+			job.error_region);
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (check_debug()) {
+		double secs = (double)(end.tv_sec - start.tv_sec) +
+			(double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+		pr_debug("Hashed %" PRIu64 " regions of %s in %.3f s (%.1f MiB/s%s)\n",
+			job.nregions, filename, secs, (double)job.size / (1 << 20) / secs,
+			direct ? ", O_DIRECT" : "");
+	}
+
+	if (bd_load(sidecar, &old, &old_digests) != 0)
+		old_digests = NULL;
+
+	ret = bd_report(filename, &job, &old, old_digests);
+
+	if (!args.dry_run && bd_save(sidecar, &job) != 0)
+		ret = 1;
+
+out:
+	if (old_digests != NULL) {
+		size_t old_size = (size_t)(old.count * old.hash_len);
+
+		budget_free(old_digests, old_size ? old_size : 1);
+	}
+	budget_free(job.digests, size ? size : 1);
+	free(sidecar);
+	io->close(job.fd);
+	pthread_mutex_destroy(&job.lock);
+
+	return ret;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Block device region verification declarations.
+ *
+ * Block devices (e.g. LVM logical volumes or loop-mounted disk images) have
+ * no extended attributes and no meaningful mtime, so they're hashed in
+ * fixed-size regions instead: several threads read different regions of the
+ * device at once (with O_DIRECT, bypassing the page cache), and the region
+ * digests are stored in a sidecar file. The next run compares the new digests
+ * with the sidecar's and reports exactly which regions changed.
+ */
+
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdbool.h>
+
+#include <sys/stat.h>
+
+#include "hash.h"
+
+/**
+ * Enable block device verification.
+ *
+ * @param dir          The directory to keep the sidecar files in.
+ * @param region_size  The size of each region (a multiple of 1 MiB).
+ * @param jobs         The number of reader threads per device.
+ * @param alg          The hash algorithm.
+ *
+ * @retval 0  Block devices will be verified.
+ * @retval !0 The arguments are invalid (a message was printed).
+ */
+int blockdev_init(const char *dir, unsigned long long region_size, unsigned int jobs,
+	hash_alg_t alg);
+
+/**
+ * Returns whether block devices are verified.
+ */
+bool blockdev_enabled(void);
+
+/**
+ * Hash a block device's regions, compare them with its sidecar file, report
+ * the changed regions, and update the sidecar (unless --dry-run is set).
+ *
+ * @param filename  The block device.
+ * @param st        The block device's stat() structure.
+ *
+ * @retval 0  The device is new or unchanged.
+ * @retval >0 Regions changed or the device couldn't be read.
+ * @retval <0 A fatal error occurred.
+ */
+int blockdev_check(const char *filename, const struct stat *st);
+
+#endif /* BLOCKDEV_H */
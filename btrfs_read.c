@@ -0,0 +1,483 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * btrfs encoded reads with parallel decompression.
+ *
+ * Extents are read in batches of one per slot. The compressed slots of a
+ * batch are decompressed in parallel, then all of the batch's slots are fed
+ * to the digest in order. Extents whose compression isn't supported
+ * (e.g. LZO) are read normally in their turn.
+ */
+
+#include "btrfs_read.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/btrfs.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "budget.h"
+#include "io.h"
+#include "utilities.h"
+
+/** The largest compressed (and decompressed) btrfs extent. */
+#define EXTENT_MAX (128 * 1024)
+
+/** Don't bother with encoded reads for files smaller than this. */
+#define MIN_FILE_SIZE (4 * EXTENT_MAX)
+
+/** An extent being read. */
+struct slot {
+	unsigned char in[EXTENT_MAX];  /**< The encoded data. */
+	unsigned char out[EXTENT_MAX]; /**< The decoded data. */
+	struct btrfs_ioctl_encoded_io_args args; /**< The extent's metadata. */
+	size_t in_len; /**< The length of the encoded data. */
+	bool fallback; /**< Whether the extent has to be read normally. */
+	int err;       /**< Whether decompression failed. */
+};
+
+/** The decompression thread pool. */
+static struct {
+	unsigned int threads;   /**< The number of worker threads. */
+	pthread_t *tids;        /**< The worker threads. */
+	struct slot *slots;     /**< The extents of a batch. */
+	unsigned int nslots;    /**< The number of slots. */
+	struct slot **jobs;     /**< The slots to decompress. */
+	size_t njobs;           /**< The number of slots to decompress. */
+	size_t next;            /**< The next job to hand out. */
+	size_t pending;         /**< The jobs not finished yet. */
+	bool stop;              /**< Whether the workers should exit. */
+	bool disabled;          /**< Whether encoded reads are unavailable. */
+	pthread_mutex_t busy;   /**< Held while a file is being read. */
+	pthread_mutex_t lock;   /**< Protects the job fields. */
+	pthread_cond_t work;    /**< Signalled when jobs are added. */
+	pthread_cond_t done;    /**< Signalled when the last job finishes. */
+} pool = {
+	.disabled = true,
+	.busy = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/** Returns whether a compression type is supported. */
+static bool supported(__u32 compression)
+{
+	switch (compression) {
+	case BTRFS_ENCODED_IO_COMPRESSION_ZLIB:
+#ifdef HAVE_ZSTD
+	case BTRFS_ENCODED_IO_COMPRESSION_ZSTD:
+#endif
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/**
+ * Decompress a slot's extent into slot::out (zero-filling any short output).
+ *
+ * @returns Returns 0 on success and -1 if the data is corrupt.
+ */
+static int decompress(struct slot *s)
+{
+	size_t out_len = (size_t)s->args.unencoded_len;
+	size_t got;
+
+	if (out_len > sizeof(s->out))
+		return -1;
+
+	if (s->args.compression == BTRFS_ENCODED_IO_COMPRESSION_ZLIB) {
+		z_stream z = {
+			.next_in   = s->in,
+			.avail_in  = (uInt)s->in_len,
+			.next_out  = s->out,
+			.avail_out = (uInt)out_len,
+		};
+		int ret;
+
+		if (inflateInit(&z) != Z_OK)
+			return -1;
+
+		ret = inflate(&z, Z_FINISH);
+		got = out_len - z.avail_out;
+		inflateEnd(&z);
+
+		if (ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && z.avail_out == 0))
+			return -1;
+	}
+#ifdef HAVE_ZSTD
+	else if (s->args.compression == BTRFS_ENCODED_IO_COMPRESSION_ZSTD) {
+		got = ZSTD_decompress(s->out, out_len, s->in, s->in_len);
+		if (ZSTD_isError(got))
+			return -1;
+	}
+#endif
+	else {
+		return -1;
+	}
+
+	memset(s->out + got, 0, out_len - got);
+
+	return 0;
+}
+
+/** The decompression worker thread. */
+static void *worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&pool.lock);
+
+	for (;;) {
+		struct slot *s;
+
+		while (!pool.stop && pool.next >= pool.njobs)
+			pthread_cond_wait(&pool.work, &pool.lock);
+
+		if (pool.stop)
+			break;
+
+		s = pool.jobs[pool.next++];
+
+		pthread_mutex_unlock(&pool.lock);
+		s->err = decompress(s);
+		pthread_mutex_lock(&pool.lock);
+
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+void btrfs_encoded_init(unsigned int threads)
+{
+	unsigned int i;
+
+	if (threads == 0)
+		return;
+
+	pool.slots = budget_malloc(threads * sizeof(pool.slots[0]));
+	pool.jobs = malloc(threads * sizeof(pool.jobs[0]));
+	pool.tids = malloc(threads * sizeof(pool.tids[0]));
+	if (pool.slots == NULL || pool.jobs == NULL || pool.tids == NULL) {
+		pr_warn("Warning: not enough memory for encoded reads\n");
+		goto fail;
+	}
+
+	/* A single thread decompresses in the reading thread. */
+	for (i = 0; threads > 1 && i < threads; i++) {
+		if (pthread_create(&pool.tids[i], NULL, worker, NULL) != 0) {
+			pr_warn("Warning: failed to start decompression thread: %m\n");
+			break;
+		}
+		pool.threads++;
+	}
+
+	if (threads > 1 && pool.threads == 0)
+		goto fail;
+
+	pool.nslots = threads;
+	pool.disabled = false;
+	return;
+
+fail:
+	budget_free(pool.slots, threads * sizeof(pool.slots[0]));
+	free(pool.jobs);
+	free(pool.tids);
+	pool.slots = NULL;
+	pool.jobs = NULL;
+	pool.tids = NULL;
+}
+
+void btrfs_encoded_cleanup(void)
+{
+	unsigned int i;
+
+	if (pool.slots == NULL)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.threads; i++)
+		pthread_join(pool.tids[i], NULL);
+
+	budget_free(pool.slots, pool.nslots * sizeof(pool.slots[0]));
+	free(pool.jobs);
+	free(pool.tids);
+
+	pool.threads = 0;
+	pool.nslots = 0;
+	pool.slots = NULL;
+	pool.jobs = NULL;
+	pool.tids = NULL;
+	pool.stop = false;
+	pool.disabled = true;
+}
+
+/**
+ * Read the extent at @p offset into a slot.
+ *
+ * @retval 0  The extent was read (slot::args.len is 0 at the end of the file).
+ * @retval -1 The ioctl failed (with errno set).
+ */
+static int read_extent(int fd, struct slot *s, off_t offset)
+{
+	struct iovec iov = { .iov_base = s->in, .iov_len = sizeof(s->in) };
+	int ret;
+
+	memset(&s->args, 0, sizeof(s->args));
+	s->args.iov = &iov;
+	s->args.iovcnt = 1;
+	s->args.offset = offset;
+
+	ret = ioctl(fd, BTRFS_IOC_ENCODED_READ, &s->args);
+	if (ret < 0)
+		return -1;
+
+	s->in_len = (size_t)ret;
+	s->err = 0;
+	s->fallback = false;
+
+	if (s->args.compression == BTRFS_ENCODED_IO_COMPRESSION_NONE) {
+		/* Unencoded data is returned as is (and is never partial). */
+		if (s->args.len > s->in_len)
+			s->args.len = s->in_len;
+	} else if (!supported(s->args.compression) || s->args.encryption != 0 ||
+		   s->args.unencoded_len > sizeof(s->out) ||
+		   s->args.unencoded_offset > s->args.unencoded_len ||
+		   s->args.len > s->args.unencoded_len - s->args.unencoded_offset) {
+		s->fallback = true;
+	}
+
+	return 0;
+}
+
+/** Decompress the compressed slots of a batch (in parallel if possible). */
+static void decompress_batch(size_t nslots)
+{
+	size_t i, njobs = 0;
+
+	for (i = 0; i < nslots; i++) {
+		struct slot *s = &pool.slots[i];
+
+		if (!s->fallback && s->args.compression != BTRFS_ENCODED_IO_COMPRESSION_NONE)
+			pool.jobs[njobs++] = s;
+	}
+
+	if (njobs == 0)
+		return;
+
+	if (pool.threads == 0 || njobs == 1) {
+		for (i = 0; i < njobs; i++)
+			pool.jobs[i]->err = decompress(pool.jobs[i]);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.njobs = njobs;
+	pool.next = 0;
+	pool.pending = njobs;
+	pthread_cond_broadcast(&pool.work);
+	while (pool.pending != 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pool.njobs = 0;
+	pool.next = 0;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * Digest @p len bytes of the file at @p offset using normal reads.
+ *
+ * @returns Returns the number of bytes digested (less than @p len at the end
+ *          of the file) or -1 on error.
+ */
+static ssize_t digest_pread(int fd, hash_ctx_t *c, unsigned char *buf, size_t bufsz,
+			    off_t offset, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t want = len - done < bufsz ? len - done : bufsz;
+		ssize_t got = pread(fd, buf, want, offset + (off_t)done);
+
+		if (got < 0) {
+			pr_err("Error reading file: %m\n");
+			return -1;
+		}
+
+		if (got == 0)
+			break;
+
+		if (hash_update(c, buf, (size_t)got) != 0) {
+			pr_err("Failed to update digest\n");
+			return -1;
+		}
+
+		done += (size_t)got;
+	}
+
+	return (ssize_t)done;
+}
+
+/**
+ * Digest the slots of a batch in file order.
+ *
+ * @retval 0  The batch was digested.
+ * @retval -1 An error occurred.
+ */
+static int digest_batch(int fd, hash_ctx_t *c, size_t nslots)
+{
+	size_t i;
+
+	for (i = 0; i < nslots; i++) {
+		struct slot *s = &pool.slots[i];
+		const unsigned char *data;
+
+		if (s->fallback) {
+			if (digest_pread(fd, c, s->out, sizeof(s->out), s->args.offset,
+					 s->args.len) < 0)
+				return -1;
+			continue;
+		}
+
+		if (s->err != 0) {
+			pr_err("Failed to decompress extent at offset %lld\n",
+			       (long long)s->args.offset);
+			return -1;
+		}
+
+		if (s->args.compression == BTRFS_ENCODED_IO_COMPRESSION_NONE)
+			data = s->in;
+		else
+			data = s->out + s->args.unencoded_offset;
+
+		if (hash_update(c, data, s->args.len) != 0) {
+			pr_err("Failed to update digest\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int btrfs_encoded_hash(int fd, hash_ctx_t *c)
+{
+	struct statfs sfs;
+	struct stat st;
+	off_t offset = 0;
+	bool eof = false;
+	int err = 0;
+
+	if (pool.disabled || io != &io_real_ops)
+		return 1;
+
+	if (fstat(fd, &st) != 0 || st.st_size < MIN_FILE_SIZE)
+		return 1;
+
+	if (fstatfs(fd, &sfs) != 0 || sfs.f_type != BTRFS_SUPER_MAGIC)
+		return 1;
+
+	/* Another thread is using the slots. */
+	if (pthread_mutex_trylock(&pool.busy) != 0)
+		return 1;
+
+	while (!eof) {
+		size_t nslots = 0;
+
+		while (nslots < pool.nslots) {
+			struct slot *s = &pool.slots[nslots];
+
+			if (read_extent(fd, s, offset) != 0) {
+				if (offset == 0) {
+					/* Nothing was digested yet: read normally. */
+					if (errno == EPERM) {
+						pr_warn("Warning: encoded reads need CAP_SYS_ADMIN, disabling them\n");
+						pool.disabled = true;
+					} else {
+						pr_debug("Encoded read failed: %m\n");
+					}
+					err = 1;
+					goto out;
+				}
+
+				/* Finish the file with normal reads. */
+				pr_debug("Encoded read failed at offset %lld: %m\n", (long long)offset);
+				s->fallback = true;
+				s->args.offset = offset;
+				s->args.len = SIZE_MAX;
+				nslots++;
+				eof = true;
+				break;
+			}
+
+			if (s->args.len == 0) {
+				eof = true;
+				break;
+			}
+
+			offset += (off_t)s->args.len;
+			nslots++;
+		}
+
+		decompress_batch(nslots);
+
+		if (digest_batch(fd, c, nslots) != 0) {
+			err = -1;
+			break;
+		}
+	}
+
+out:
+	pthread_mutex_unlock(&pool.busy);
+
+	return err;
+}
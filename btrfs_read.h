@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * btrfs encoded read declarations.
+ *
+ * On a compressed btrfs filesystem, the kernel decompresses a file's extents
+ * one at a time in the reading thread, which limits how fast a single file can
+ * be hashed. With BTRFS_IOC_ENCODED_READ, b2tag instead reads the compressed
+ * extents as they are on disk and decompresses them in a pool of worker
+ * threads, feeding the digest in file order.
+ *
+ * Encoded reads require CAP_SYS_ADMIN. Only built with BTRFS_ENCODED=1.
+ */
+
+#ifndef BTRFS_READ_H
+#define BTRFS_READ_H
+
+#include "hash.h"
+
+/**
+ * Enable encoded reads with @p threads decompression threads.
+ *
+ * @param threads  The number of decompression threads (0 to disable).
+ */
+void btrfs_encoded_init(unsigned int threads);
+
+/**
+ * Stop the decompression threads and free their buffers.
+ */
+void btrfs_encoded_cleanup(void);
+
+/**
+ * Digest a whole file using encoded reads.
+ *
+ * @param fd  The file (positioned at the start).
+ * @param c   The digest context (nothing is digested if this returns >0).
+ *
+ * @retval 0  The whole file was digested.
+ * @retval >0 Encoded reads can't be used for this file; read it normally.
+ * @retval <0 An error occurred.
+ */
+int btrfs_encoded_hash(int fd, hash_ctx_t *c);
+
+#endif /* BTRFS_READ_H */
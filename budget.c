@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Memory budget shared by all of b2tag's buffers and caches.
+ */
+
+#include "budget.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "utilities.h"
+
+/** The most reclaim functions that can be registered. */
+#define MAX_RECLAIMERS 8
+
+/** The memory budget. */
+static struct {
+	size_t limit;    /**< The memory limit (0 for no limit). */
+	size_t used;     /**< The memory currently reserved. */
+	size_t peak;     /**< The most memory reserved at once. */
+	budget_reclaim_fn reclaim[MAX_RECLAIMERS]; /**< Reclaim functions. */
+	size_t nreclaim; /**< The number of reclaim functions. */
+	pthread_mutex_t lock;    /**< Protects everything above. */
+	pthread_cond_t released; /**< Signalled when memory is released. */
+} budget = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.released = PTHREAD_COND_INITIALIZER,
+};
+
+void budget_set_limit(size_t limit)
+{
+	pthread_mutex_lock(&budget.lock);
+	budget.limit = limit;
+	pthread_mutex_unlock(&budget.lock);
+}
+
+size_t budget_limit(void)
+{
+	return budget.limit;
+}
+
+size_t budget_peak(void)
+{
+	size_t peak;
+
+	pthread_mutex_lock(&budget.lock);
+	peak = budget.peak;
+	pthread_mutex_unlock(&budget.lock);
+
+	return peak;
+}
+
+void budget_register_reclaim(budget_reclaim_fn reclaim)
+{
+	pthread_mutex_lock(&budget.lock);
+	assert(budget.nreclaim < MAX_RECLAIMERS);
+	budget.reclaim[budget.nreclaim++] = reclaim;
+	pthread_mutex_unlock(&budget.lock);
+}
+
+/**
+ * Try to reserve memory without reclaiming or waiting.
+ *
+ * @note The caller must hold budget.lock.
+ *
+ * @returns Returns true if the memory was reserved.
+ */
+static bool budget_try(size_t size)
+{
+	if (budget.limit != 0 && (size > budget.limit || budget.used > budget.limit - size))
+		return false;
+
+	budget.used += size;
+	if (budget.used > budget.peak)
+		budget.peak = budget.used;
+
+	return true;
+}
+
+int budget_reserve(size_t size, bool wait)
+{
+	size_t i;
+
+	pthread_mutex_lock(&budget.lock);
+
+	if (budget_try(size)) {
+		pthread_mutex_unlock(&budget.lock);
+		return 0;
+	}
+
+	/* Ask the caches to make room (without holding the lock, since they
+	 * release what they free).
+	 */
+	for (i = 0; i < budget.nreclaim; i++) {
+		budget_reclaim_fn reclaim = budget.reclaim[i];
+
+		pthread_mutex_unlock(&budget.lock);
+		reclaim(size);
+		pthread_mutex_lock(&budget.lock);
+
+		if (budget_try(size)) {
+			pthread_mutex_unlock(&budget.lock);
+			return 0;
+		}
+	}
+
+	/* Back-pressure: wait for another thread to release memory. */
+	while (wait && size <= budget.limit) {
+		pthread_cond_wait(&budget.released, &budget.lock);
+
+		if (budget_try(size)) {
+			pthread_mutex_unlock(&budget.lock);
+			return 0;
+		}
+	}
+
+	pthread_mutex_unlock(&budget.lock);
+
+	errno = ENOMEM;
+	return -1;
+}
+
+void budget_release(size_t size)
+{
+	pthread_mutex_lock(&budget.lock);
+	assert(size <= budget.used);
+	budget.used -= size;
+	pthread_cond_broadcast(&budget.released);
+	pthread_mutex_unlock(&budget.lock);
+}
+
+void *budget_malloc(size_t size)
+{
+	void *ptr;
+
+	if (budget_reserve(size, false) != 0)
+		return NULL;
+
+	ptr = malloc(size);
+	if (ptr == NULL)
+		budget_release(size);
+
+	return ptr;
+}
+
+void *budget_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+	void *tmp;
+
+	if (new_size > old_size && budget_reserve(new_size - old_size, false) != 0)
+		return NULL;
+
+	tmp = realloc(ptr, new_size);
+
+	if (tmp == NULL && new_size > old_size)
+		budget_release(new_size - old_size);
+	else if (tmp != NULL && new_size < old_size)
+		budget_release(old_size - new_size);
+
+	return tmp;
+}
+
+void budget_free(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+
+	free(ptr);
+	budget_release(size);
+}
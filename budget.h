@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Memory budget declarations.
+ *
+ * Every buffer, queue, and cache whose size depends on the tree being scanned
+ * reserves its memory from a single budget (set with --memory-limit). When the
+ * budget is exhausted, the registered reclaim functions (e.g. cache eviction)
+ * are asked to free memory; after that, a reservation either waits for
+ * another thread to release memory (back-pressure) or fails.
+ */
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A function that frees (and releases) memory when the budget is exhausted.
+ *
+ * @param wanted  The number of bytes the caller would like freed.
+ *
+ * @returns Returns the number of bytes released.
+ */
+typedef size_t (*budget_reclaim_fn)(size_t wanted);
+
+/**
+ * Set the memory limit.
+ *
+ * @param limit  The most memory (in bytes) that may be reserved (0 for no limit).
+ */
+void budget_set_limit(size_t limit);
+
+/**
+ * Returns the memory limit (0 if there is no limit).
+ */
+size_t budget_limit(void);
+
+/**
+ * Returns the largest amount of memory that was reserved at once.
+ */
+size_t budget_peak(void);
+
+/**
+ * Register a function to call when the budget is exhausted.
+ *
+ * @param reclaim  The reclaim function.
+ */
+void budget_register_reclaim(budget_reclaim_fn reclaim);
+
+/**
+ * Reserve @p size bytes from the budget.
+ *
+ * @param size  The number of bytes to reserve.
+ * @param wait  Whether to wait for other threads to release memory if the
+ *              budget is exhausted (even after reclaiming). Only pass true
+ *              if another thread is guaranteed to release memory.
+ *
+ * @retval 0  The memory was reserved.
+ * @retval -1 The budget is exhausted (errno is set to ENOMEM).
+ */
+int budget_reserve(size_t size, bool wait);
+
+/**
+ * Return @p size bytes to the budget.
+ *
+ * @param size  The number of bytes to release.
+ */
+void budget_release(size_t size);
+
+/**
+ * Reserve @p size bytes and allocate them with malloc().
+ *
+ * @param size  The number of bytes to allocate.
+ *
+ * @returns Returns the allocated memory or NULL (with errno set) on failure.
+ */
+void *budget_malloc(size_t size);
+
+/**
+ * Resize memory allocated with budget_malloc() (or NULL).
+ *
+ * @param ptr       The memory to resize.
+ * @param old_size  The current size of @p ptr.
+ * @param new_size  The new size of @p ptr.
+ *
+ * @returns Returns the resized memory or NULL (with errno set) on failure,
+ *          in which case @p ptr is left untouched.
+ */
+void *budget_realloc(void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * Free memory allocated with budget_malloc() and release it.
+ *
+ * @param ptr   The memory to free (may be NULL).
+ * @param size  The size of @p ptr.
+ */
+void budget_free(void *ptr, size_t size);
+
+#endif /* BUDGET_H */
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Cost report.
+ */
+
+#include "cost.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** A directory in the cost report. */
+struct cost_dir {
+	char *path;         /**< The directory's path. */
+	struct cost_mark c; /**< The subtree's totals (start_ns is the elapsed time). */
+};
+
+/** The cost report. */
+static struct {
+	bool enabled;                  /**< Whether cost reporting is enabled. */
+	unsigned int depth;            /**< The deepest directories to report. */
+	struct cost_mark total;        /**< The running totals. */
+	struct cost_dir top[COST_TOP]; /**< The most expensive directories (most expensive first). */
+	size_t count;                  /**< The number of entries in cost::top. */
+} cost;
+
+void cost_init(unsigned int depth)
+{
+	cost.enabled = true;
+	cost.depth = depth;
+}
+
+bool cost_enabled(void)
+{
+	return cost.enabled;
+}
+
+uint64_t cost_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void cost_file(void)
+{
+	cost.total.files++;
+}
+
+void cost_error(void)
+{
+	cost.total.errors++;
+}
+
+void cost_hash(uint64_t bytes, uint64_t elapsed)
+{
+	cost.total.bytes += bytes;
+	cost.total.hash_ns += elapsed;
+}
+
+void cost_begin(struct cost_mark *mark)
+{
+	*mark = cost.total;
+	mark->start_ns = cost_now();
+}
+
+void cost_end(const struct cost_mark *mark, const char *path, unsigned int depth)
+{
+	struct cost_dir d;
+	size_t i;
+
+	cost.total.dirs++;
+
+	if (depth > cost.depth)
+		return;
+
+	d.c.start_ns = cost_now() - mark->start_ns;
+	d.c.files    = cost.total.files   - mark->files;
+	d.c.dirs     = cost.total.dirs    - mark->dirs;
+	d.c.bytes    = cost.total.bytes   - mark->bytes;
+	d.c.hash_ns  = cost.total.hash_ns - mark->hash_ns;
+	d.c.errors   = cost.total.errors  - mark->errors;
+
+	/* Keep the list sorted by elapsed time. */
+	i = cost.count;
+	if (i == COST_TOP) {
+		if (cost.top[COST_TOP - 1].c.start_ns >= d.c.start_ns)
+			return;
+
+		free(cost.top[--i].path);
+	}
+
+	d.path = strdup(path);
+	if (d.path == NULL)
+		return;
+
+	for (; i > 0 && cost.top[i - 1].c.start_ns < d.c.start_ns; i--)
+		cost.top[i] = cost.top[i - 1];
+
+	cost.top[i] = d;
+	if (cost.count < COST_TOP)
+		cost.count++;
+}
+
+void cost_report(void)
+{
+	size_t i;
+
+	if (!cost.enabled || cost.count == 0)
+		return;
+
+	fprintf(stderr, "Most expensive directories (to depth %u):\n", cost.depth);
+	fprintf(stderr, "%9s %9s %9s %9s %7s %10s %6s  %s\n",
+		"total(s)", "hash(s)", "meta(s)", "files", "dirs", "read(MiB)", "errors", "path");
+
+	for (i = 0; i < cost.count; i++) {
+		const struct cost_mark *c = &cost.top[i].c;
+
+		fprintf(stderr, "%9.3f %9.3f %9.3f %9llu %7llu %10.1f %6llu  %s\n",
+			c->start_ns / 1e9, c->hash_ns / 1e9,
+			(c->start_ns > c->hash_ns ? c->start_ns - c->hash_ns : 0) / 1e9,
+			(unsigned long long)c->files, (unsigned long long)c->dirs,
+			c->bytes / 1048576.0, (unsigned long long)c->errors, cost.top[i].path);
+
+		free(cost.top[i].path);
+	}
+
+	cost.count = 0;
+}
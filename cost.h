@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Cost report declarations.
+ *
+ * With --cost-report, b2tag keeps running totals of the files checked, bytes
+ * hashed, time spent hashing, and errors. Each directory snapshots the totals
+ * when it's entered, so the cost of its whole subtree is just the difference
+ * when it's left. Only the most expensive directories (up to the configured
+ * depth) are kept, so memory use doesn't depend on the size of the tree.
+ */
+
+#ifndef COST_H
+#define COST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** The number of directories listed in the cost report. */
+#define COST_TOP 20
+
+/** A snapshot of the running totals. */
+struct cost_mark {
+	uint64_t start_ns; /**< The time. */
+	uint64_t files;    /**< The files checked. */
+	uint64_t dirs;     /**< The directories read. */
+	uint64_t bytes;    /**< The bytes hashed. */
+	uint64_t hash_ns;  /**< The time spent hashing. */
+	uint64_t errors;   /**< The files and directories with errors. */
+};
+
+/**
+ * Enable cost reporting.
+ *
+ * @param depth  The deepest directories to report individually (the top-level
+ *               paths are depth 0; deeper directories are rolled up into
+ *               their ancestors).
+ */
+void cost_init(unsigned int depth);
+
+/**
+ * Returns whether cost reporting is enabled.
+ */
+bool cost_enabled(void);
+
+/**
+ * Returns the current monotonic time in nanoseconds.
+ */
+uint64_t cost_now(void);
+
+/**
+ * Account a checked file.
+ */
+void cost_file(void);
+
+/**
+ * Account a file or directory that couldn't be checked.
+ */
+void cost_error(void);
+
+/**
+ * Account a hashed file.
+ *
+ * @param bytes    The bytes hashed.
+ * @param elapsed  The time spent hashing (in nanoseconds).
+ */
+void cost_hash(uint64_t bytes, uint64_t elapsed);
+
+/**
+ * Take a snapshot of the running totals when entering a directory.
+ *
+ * @param mark  Where to store the snapshot.
+ */
+void cost_begin(struct cost_mark *mark);
+
+/**
+ * Account a directory's subtree when leaving it.
+ *
+ * @param mark   The snapshot taken by cost_begin().
+ * @param path   The directory's path.
+ * @param depth  The directory's depth below the top-level path.
+ */
+void cost_end(const struct cost_mark *mark, const char *path, unsigned int depth);
+
+/**
+ * Print the most expensive directories (to stderr) and free them.
+ */
+void cost_report(void);
+
+#endif /* COST_H */
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Verification coverage report.
+ */
+
+#include "coverage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utilities.h"
+#include "xa.h"
+
+/** The index of the "never verified" totals. */
+#define COVERAGE_NEVER (COVERAGE_AGES - 1)
+
+/** The upper bounds (in days) of the age ranges, and their column names. */
+static const struct {
+	unsigned int days;
+	const char *name;
+} coverage_ages[COVERAGE_AGES - 2] = {
+	{   1, "1d" },
+	{   7, "7d" },
+	{  30, "30d" },
+	{  90, "90d" },
+	{ 365, "1y" },
+};
+
+/** A directory in the coverage report. */
+struct coverage_dir {
+	char *path;             /**< The directory's path. */
+	struct coverage_mark c; /**< The subtree's totals. */
+};
+
+/** The coverage report. */
+static struct {
+	bool enabled;                /**< Whether the report is enabled. */
+	unsigned int depth;          /**< The deepest directories to report. */
+	time_t now;                  /**< The time ages are measured from. */
+	struct coverage_mark total;  /**< The running totals. */
+	struct coverage_dir *dirs;   /**< The directories to report. */
+	size_t count;                /**< The number of entries in coverage::dirs. */
+	size_t allocated;            /**< The allocated size of coverage::dirs. */
+} coverage;
+
+void coverage_init(unsigned int depth)
+{
+	coverage.enabled = true;
+	coverage.depth = depth;
+	coverage.now = time(NULL);
+}
+
+bool coverage_enabled(void)
+{
+	return coverage.enabled;
+}
+
+/** Returns the age range a file verified at @p verified falls in. */
+static size_t coverage_age(time_t verified)
+{
+	time_t age = coverage.now > verified ? coverage.now - verified : 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(coverage_ages); i++) {
+		if (age <= (time_t)coverage_ages[i].days * 86400)
+			return i;
+	}
+
+	return COVERAGE_NEVER - 1;
+}
+
+int coverage_file(int fd, const char *filename, const struct stat *st)
+{
+	struct timespec verified;
+	size_t age;
+
+	switch (xa_read_verified(fd, &verified)) {
+	case E_OK:
+		/* The data verified back then may not be there any more. */
+		if (ts_compare(verified, st->st_mtim, false) < 0)
+			age = COVERAGE_NEVER;
+		else
+			age = coverage_age(verified.tv_sec);
+		break;
+	case E_INVALID:
+		pr_warn("Warning: ignoring invalid verification time of \"%s\"\n", filename);
+		/* Fall through. */
+	case E_NOT_FOUND:
+	case E_UNSUPPORTED:
+		age = COVERAGE_NEVER;
+		break;
+	default:
+		pr_err("Error: could not read extended attributes of \"%s\": %m\n", filename);
+		return 1;
+	}
+
+	if (check_debug())
+		pr_debug("%s: %s\n", filename, age < ARRAY_SIZE(coverage_ages) ?
+			coverage_ages[age].name : age == COVERAGE_NEVER ? "never" : "older");
+
+	coverage.total.files[age]++;
+	coverage.total.bytes[age] += (uint64_t)st->st_size;
+
+	return 0;
+}
+
+void coverage_begin(struct coverage_mark *mark)
+{
+	*mark = coverage.total;
+}
+
+void coverage_end(const struct coverage_mark *mark, const char *path, unsigned int depth)
+{
+	struct coverage_dir *d;
+	size_t i;
+
+	if (depth > coverage.depth)
+		return;
+
+	if (coverage.count >= coverage.allocated) {
+		size_t allocated = coverage.allocated ? coverage.allocated * 2 : 64;
+		void *tmp;
+
+		tmp = realloc(coverage.dirs, allocated * sizeof(coverage.dirs[0]));
+		if (tmp == NULL)
+			return;
+
+		coverage.dirs = tmp;
+		coverage.allocated = allocated;
+	}
+
+	d = &coverage.dirs[coverage.count];
+
+	d->path = strdup(path);
+	if (d->path == NULL)
+		return;
+
+	for (i = 0; i < COVERAGE_AGES; i++) {
+		d->c.files[i] = coverage.total.files[i] - mark->files[i];
+		d->c.bytes[i] = coverage.total.bytes[i] - mark->bytes[i];
+	}
+
+	coverage.count++;
+}
+
+/** qsort() comparison function to sort directories by path. */
+static int coverage_dir_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct coverage_dir *)a)->path, ((const struct coverage_dir *)b)->path);
+}
+
+/**
+ * Print one row of the report: the total, then the cumulative percentage
+ * verified within each age range (and at all).
+ */
+static void coverage_row(const uint64_t values[COVERAGE_AGES], bool bytes, const char *path)
+{
+	uint64_t total = 0;
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < COVERAGE_AGES; i++)
+		total += values[i];
+
+	if (bytes)
+		printf("%12.1f", total / 1048576.0);
+	else
+		printf("%12llu", (unsigned long long)total);
+
+	/* The last ("ever") column includes the "older" range. */
+	for (i = 0; i < COVERAGE_NEVER; i++) {
+		sum += values[i];
+		printf(" %6.1f", total ? 100.0 * (double)sum / (double)total : 0.0);
+	}
+
+	printf("  %s\n", path);
+}
+
+void coverage_report(void)
+{
+	size_t i;
+	int bytes;
+
+	if (!coverage.enabled)
+		return;
+
+	qsort(coverage.dirs, coverage.count, sizeof(coverage.dirs[0]), coverage_dir_compare);
+
+	for (bytes = 1; bytes >= 0; bytes--) {
+		size_t j;
+
+		printf("%sVerified %s (cumulative %%, to depth %u):\n", bytes ? "" : "\n",
+			bytes ? "bytes" : "files", coverage.depth);
+		printf("%12s", bytes ? "size(MiB)" : "files");
+		for (j = 0; j < ARRAY_SIZE(coverage_ages); j++)
+			printf(" %6s", coverage_ages[j].name);
+		printf(" %6s  %s\n", "ever", "path");
+
+		for (i = 0; i < coverage.count; i++) {
+			const struct coverage_mark *c = &coverage.dirs[i].c;
+
+			coverage_row(bytes ? c->bytes : c->files, bytes, coverage.dirs[i].path);
+		}
+
+		coverage_row(bytes ? coverage.total.bytes : coverage.total.files, bytes, "(total)");
+	}
+
+	for (i = 0; i < coverage.count; i++)
+		free(coverage.dirs[i].path);
+
+	free(coverage.dirs);
+	coverage.dirs = NULL;
+	coverage.count = coverage.allocated = 0;
+}
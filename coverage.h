@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Verification coverage report declarations.
+ *
+ * With --record-verified, every file whose data is hashed and found to match
+ * its tag (or is given a new tag) gets a user.b2tag.verified attribute with
+ * the current time. Files that are only quick-checked aren't touched.
+ *
+ * --coverage then walks a tree without reading any file data and totals the
+ * files and bytes by the age of their last verification, for the whole run
+ * and for every directory down to a given depth. Like the cost report, each
+ * directory snapshots the totals when it's entered, so its subtree's totals
+ * are just the difference when it's left.
+ */
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+/** The verification ages reported (up to a day, a week, ..., older, never). */
+#define COVERAGE_AGES 7
+
+/** A snapshot of the running totals. */
+struct coverage_mark {
+	uint64_t files[COVERAGE_AGES]; /**< The files last verified in each age range. */
+	uint64_t bytes[COVERAGE_AGES]; /**< The bytes last verified in each age range. */
+};
+
+/**
+ * Enable the coverage report (and disable hashing).
+ *
+ * @param depth  The deepest directories to report individually (the top-level
+ *               paths are depth 0).
+ */
+void coverage_init(unsigned int depth);
+
+/**
+ * Returns whether the coverage report is enabled.
+ */
+bool coverage_enabled(void);
+
+/**
+ * Account a file by the age of its last verification.
+ *
+ * Files modified since they were verified count as never verified.
+ *
+ * @param fd        The file.
+ * @param filename  The file's name (for messages).
+ * @param st        The file's stat() structure.
+ *
+ * @retval 0  The file was accounted.
+ * @retval >0 The file's attributes couldn't be read.
+ */
+int coverage_file(int fd, const char *filename, const struct stat *st);
+
+/**
+ * Snapshot the running totals when entering a directory.
+ *
+ * @param mark  Where to store the snapshot.
+ */
+void coverage_begin(struct coverage_mark *mark);
+
+/**
+ * Record a directory's subtree totals when leaving it.
+ *
+ * @param mark   The snapshot taken by coverage_begin().
+ * @param path   The directory's path.
+ * @param depth  The directory's depth.
+ */
+void coverage_end(const struct coverage_mark *mark, const char *path, unsigned int depth);
+
+/**
+ * Print the coverage report (if enabled).
+ */
+void coverage_report(void);
+
+#endif /* COVERAGE_H */
@@ -0,0 +1,408 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Per-device reader slots.
+ *
+ * Slot @c i of device @c maj:min is the lock file @c dev-maj:min.i in the lock
+ * directory; holding an exclusive flock() on it means holding the slot.
+ */
+
+#include "devslot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "utilities.h"
+
+/** A device whose slot is held. */
+struct held_slot {
+	dev_t dev;         /**< The device ID. */
+	int fd;            /**< The locked slot file. */
+	unsigned int refs; /**< The number of holders (the walk and the verifier). */
+};
+
+/** The device arbitration state. */
+static struct {
+	unsigned int slots;       /**< Slots per device (0 if disabled). */
+	char *dir;                /**< The lock directory. */
+	struct held_slot *held;   /**< The slots held by this process. */
+	size_t count;             /**< The number of held slots. */
+	dev_t current;            /**< The device of the walk's slot. */
+	bool has_current;         /**< Whether the walk holds a slot. */
+	pthread_mutex_t lock;     /**< Protects the held slots (for --two-phase). */
+} ds = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Check that a lock directory can't be tampered with by other users.
+ *
+ * A shared directory must be owned by root (or this user) and, if others may
+ * write to it, sticky (so they can't replace this user's lock files). A
+ * private one must be owned by this user and inaccessible to everyone else.
+ *
+ * @retval 0  The directory is safe to use.
+ * @retval -1 It isn't (or couldn't be checked).
+ */
+static int devslot_check_dir(const char *dir, bool shared)
+{
+	struct stat st;
+	uid_t uid = getuid();
+
+	if (lstat(dir, &st) != 0)
+		return -1;
+
+	if (!S_ISDIR(st.st_mode))
+		goto unsafe;
+
+	if (shared) {
+		if (st.st_uid != 0 && st.st_uid != uid)
+			goto unsafe;
+		if ((st.st_mode & (S_IWGRP | S_IWOTH)) != 0 && (st.st_mode & S_ISVTX) == 0)
+			goto unsafe;
+	}
+	else if (st.st_uid != uid || (st.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+		goto unsafe;
+	}
+
+	return 0;
+
+unsafe:
+	pr_warn("Warning: not using lock directory \"%s\" (wrong type, owner, or permissions)\n", dir);
+	return -1;
+}
+
+/**
+ * Find (and create if necessary) a usable lock directory.
+ *
+ * /run/b2tag is shared by every user, but is usually only writable by root.
+ * Otherwise fall back to a per-user directory.
+ *
+ * @returns Returns the directory (must be freed) or NULL on failure.
+ */
+static char *devslot_dir(void)
+{
+	const char *runtime = getenv("XDG_RUNTIME_DIR");
+	char *dir;
+
+	if (mkdir("/run/b2tag", 01777) == 0)
+		chmod("/run/b2tag", 01777);
+
+	if (access("/run/b2tag", W_OK | X_OK) == 0 && devslot_check_dir("/run/b2tag", true) == 0)
+		return strdup("/run/b2tag");
+
+	if (runtime != NULL && runtime[0] == '/') {
+		if (asprintf(&dir, "%s/b2tag", runtime) < 0)
+			return NULL;
+	}
+	else if (asprintf(&dir, "/tmp/b2tag-%u", (unsigned int)getuid()) < 0) {
+		return NULL;
+	}
+
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		pr_err("Error: could not create lock directory \"%s\": %m\n", dir);
+		free(dir);
+		return NULL;
+	}
+
+	/* It may have been created by someone else (e.g. in /tmp). */
+	if (devslot_check_dir(dir, false) != 0) {
+		pr_err("Error: lock directory \"%s\" isn't a private directory of this user\n", dir);
+		free(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+int devslot_init(unsigned int slots)
+{
+	ds.slots = slots;
+	if (slots == 0)
+		return 0;
+
+	ds.dir = devslot_dir();
+	if (ds.dir == NULL) {
+		ds.slots = 0;
+		return -1;
+	}
+
+	pr_debug("Using %u reader slot(s) per device in \"%s\"\n", slots, ds.dir);
+
+	return 0;
+}
+
+void devslot_close(void)
+{
+	size_t i;
+
+	for (i = 0; i < ds.count; i++)
+		close(ds.held[i].fd);
+
+	free(ds.held);
+	free(ds.dir);
+	ds.slots = 0;
+	ds.dir = NULL;
+	ds.held = NULL;
+	ds.count = 0;
+	ds.has_current = false;
+}
+
+/**
+ * Try to lock one slot of a device.
+ *
+ * @returns Returns the locked slot file, -1 if it's busy (or @p wait is
+ *          false), or -2 on error.
+ */
+static int devslot_lock(dev_t dev, unsigned int slot, bool wait)
+{
+	struct stat st;
+	char *path;
+	int fd;
+
+	if (asprintf(&path, "%s/dev-%u:%u.%u", ds.dir, major(dev), minor(dev), slot) < 0)
+		return -2;
+
+	/* flock() works on read-only files, so other users can share the slot.
+	 * Don't follow symlinks or block on FIFOs planted in a shared directory.
+	 */
+	fd = open(path, O_RDONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		pr_err("Error: could not open device lock \"%s\": %m\n", path);
+		free(path);
+		return -2;
+	}
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		pr_err("Error: device lock \"%s\" isn't a regular file\n", path);
+		close(fd);
+		free(path);
+		return -2;
+	}
+
+	free(path);
+
+	if (flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0) {
+		int err = errno;
+
+		close(fd);
+		return err == EWOULDBLOCK ? -1 : -2;
+	}
+
+	return fd;
+}
+
+/** Returns this process's slot of @p dev (or NULL). The caller holds the lock. */
+static struct held_slot *devslot_find(dev_t dev)
+{
+	size_t i;
+
+	for (i = 0; i < ds.count; i++) {
+		if (ds.held[i].dev == dev)
+			return &ds.held[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * Add a reference to a device's slot, recording @p fd as the slot if this
+ * process doesn't hold one yet. The caller holds the lock.
+ *
+ * @retval 0  The slot is held.
+ * @retval -1 Out of memory (@p fd is closed).
+ */
+static int devslot_hold(dev_t dev, int fd)
+{
+	struct held_slot *slot = devslot_find(dev);
+	struct held_slot *tmp;
+
+	if (slot != NULL) {
+		/* Another thread got a slot while this one waited. */
+		close(fd);
+		slot->refs++;
+		return 0;
+	}
+
+	tmp = realloc(ds.held, (ds.count + 1) * sizeof(ds.held[0]));
+	if (tmp == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	ds.held = tmp;
+	ds.held[ds.count++] = (struct held_slot){ .dev = dev, .fd = fd, .refs = 1 };
+
+	return 0;
+}
+
+/** Drop a reference to a device's slot, releasing it with the last one. The caller holds the lock. */
+static void devslot_unref(dev_t dev)
+{
+	struct held_slot *slot = devslot_find(dev);
+
+	if (slot == NULL || --slot->refs > 0)
+		return;
+
+	close(slot->fd);
+	*slot = ds.held[--ds.count];
+}
+
+/**
+ * Take a reference to a device's slot without waiting. The caller holds the
+ * lock.
+ *
+ * @retval 0  A slot is held.
+ * @retval >0 All of the device's slots are busy.
+ * @retval <0 An error occurred.
+ */
+static int devslot_try(dev_t dev)
+{
+	struct held_slot *slot = devslot_find(dev);
+	unsigned int i;
+	int fd = -1;
+
+	if (slot != NULL) {
+		slot->refs++;
+		return 0;
+	}
+
+	for (i = 0; i < ds.slots && fd == -1; i++)
+		fd = devslot_lock(dev, i, false);
+
+	if (fd == -1)
+		return 1;
+	if (fd < 0)
+		return -1;
+
+	return devslot_hold(dev, fd);
+}
+
+int devslot_acquire(dev_t dev, bool wait)
+{
+	int fd;
+	int ret;
+
+	if (ds.slots == 0)
+		return 0;
+
+	pthread_mutex_lock(&ds.lock);
+
+	if (ds.has_current && ds.current == dev) {
+		pthread_mutex_unlock(&ds.lock);
+		return 0;
+	}
+
+	/* Give up the previous device first, so a process never waits for a
+	 * slot while holding one (two processes each waiting for the other's
+	 * device would wait forever).
+	 */
+	if (ds.has_current) {
+		devslot_unref(ds.current);
+		ds.has_current = false;
+	}
+
+	ret = devslot_try(dev);
+	if (ret == 0) {
+		ds.current = dev;
+		ds.has_current = true;
+	}
+
+	pthread_mutex_unlock(&ds.lock);
+
+	if (ret <= 0 || !wait)
+		return ret;
+
+	/* Queue up behind one of the readers, without blocking the verifier. */
+	pr_debug("Waiting for a reader slot on device %u:%u\n", major(dev), minor(dev));
+	fd = devslot_lock(dev, (unsigned int)getpid() % ds.slots, true);
+	if (fd < 0)
+		return -1;
+
+	pthread_mutex_lock(&ds.lock);
+
+	ret = devslot_hold(dev, fd);
+	if (ret == 0) {
+		ds.current = dev;
+		ds.has_current = true;
+	}
+
+	pthread_mutex_unlock(&ds.lock);
+
+	return ret;
+}
+
+void devslot_release(void)
+{
+	if (ds.slots == 0)
+		return;
+
+	pthread_mutex_lock(&ds.lock);
+
+	if (ds.has_current) {
+		devslot_unref(ds.current);
+		ds.has_current = false;
+	}
+
+	pthread_mutex_unlock(&ds.lock);
+}
+
+int devslot_borrow(dev_t dev)
+{
+	int ret;
+
+	if (ds.slots == 0)
+		return 0;
+
+	pthread_mutex_lock(&ds.lock);
+	ret = devslot_try(dev);
+	pthread_mutex_unlock(&ds.lock);
+
+	return ret;
+}
+
+void devslot_return(dev_t dev)
+{
+	if (ds.slots == 0)
+		return;
+
+	pthread_mutex_lock(&ds.lock);
+	devslot_unref(dev);
+	pthread_mutex_unlock(&ds.lock);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Per-device reader slot declarations.
+ *
+ * Several b2tag processes hashing files on the same disk at once turn each
+ * other's sequential reads into random I/O. To avoid that, a process must
+ * hold one of a device's (configurable number of) reader slots before it
+ * reads file data from it. The slots are lock files shared by all b2tag
+ * processes on the machine, so they're released automatically if a process
+ * exits or crashes.
+ */
+
+#ifndef DEVSLOT_H
+#define DEVSLOT_H
+
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+/**
+ * Enable device arbitration with @p slots readers per device.
+ *
+ * @param slots  The number of processes that may read a device at once
+ *               (0 disables arbitration).
+ *
+ * @retval 0  Arbitration was enabled (or disabled) successfully.
+ * @retval !0 The lock directory couldn't be created.
+ */
+int devslot_init(unsigned int slots);
+
+/**
+ * Release all held slots.
+ */
+void devslot_close(void);
+
+/**
+ * Move the walk's reader slot to a device.
+ *
+ * The walk holds at most one slot: the previous device's slot is released
+ * first, so the process never waits for a slot while holding one (which could
+ * deadlock two processes waiting for each other's devices). Only the walk
+ * thread may call this.
+ *
+ * @param dev   The device ID.
+ * @param wait  Whether to wait for a slot to become free.
+ *
+ * @retval 0  A slot is held (or arbitration is disabled).
+ * @retval >0 All of the device's slots are busy (only if @p wait is false).
+ * @retval <0 An error occurred (the caller should read the device anyway).
+ */
+int devslot_acquire(dev_t dev, bool wait);
+
+/**
+ * Release the walk's reader slot (once it's done reading).
+ */
+void devslot_release(void);
+
+/**
+ * Borrow a reader slot for a device without waiting.
+ *
+ * This shares the walk's slot if it holds one for @p dev. It may be called
+ * from any thread, and the slot must be returned with devslot_return() as
+ * soon as the file has been read.
+ *
+ * @param dev  The device ID.
+ *
+ * @retval 0  A slot is held (or arbitration is disabled).
+ * @retval >0 All of the device's slots are busy.
+ * @retval <0 An error occurred (the caller should read the device anyway, and
+ *            not return the slot).
+ */
+int devslot_borrow(dev_t dev);
+
+/**
+ * Return a slot borrowed with devslot_borrow().
+ *
+ * @param dev  The device ID.
+ */
+void devslot_return(dev_t dev);
+
+#endif /* DEVSLOT_H */
@@ -0,0 +1,706 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Persistent directory listing cache.
+ *
+ * The cache file is a local, native-endian file:
+ * @li An 8-byte magic string (#DIRCACHE_MAGIC).
+ * @li For each directory: a struct dc_rec, then dc_rec::count struct
+ *     dc_entry, then dc_rec::names_len bytes of NUL-terminated names.
+ */
+
+#include "dircache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "utilities.h"
+
+/** The magic string (and version) at the start of the cache file. */
+#define DIRCACHE_MAGIC "B2TDIRC1"
+
+/** Drop listings that haven't been used in this many saves. */
+#define DIRCACHE_MAX_AGE 16
+
+/** The on-disk header of a cached directory. */
+struct dc_rec {
+	uint64_t dev;       /**< The directory's device ID. */
+	uint64_t ino;       /**< The directory's inode number. */
+	int64_t  sec;       /**< The directory's mtime (seconds). */
+	int64_t  nsec;      /**< The directory's mtime (nanoseconds). */
+	uint32_t age;       /**< Saves since the listing was last used. */
+	uint32_t count;     /**< The number of entries. */
+	uint64_t names_len; /**< The length of the names blob. */
+};
+
+/** The on-disk form of a directory entry. */
+struct dc_entry {
+	uint64_t ino;      /**< The entry's inode number. */
+	uint32_t name_off; /**< The offset of the name in the names blob. */
+	uint8_t  type;     /**< The entry's type (DT_*). */
+	uint8_t  pad[3];   /**< Padding (zero). */
+};
+
+/** The directory listing cache. */
+static struct {
+	char *path;                   /**< The cache file. */
+	struct dircache_dir **table;  /**< Open-addressed hash table of listings. */
+	size_t size;                  /**< The number of slots in the table. */
+	size_t count;                 /**< The number of listings in the table. */
+	size_t evicted;               /**< The number of listings evicted. */
+	bool dirty;                   /**< Whether the cache needs to be saved. */
+	pthread_mutex_t lock;         /**< Protects the table and the listings' pins. */
+} dc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+bool dircache_enabled(void)
+{
+	return dc.path != NULL;
+}
+
+/** Hash a directory's device and inode numbers into a table index. */
+static size_t dc_slot(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t)ino * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)dev;
+
+	return (size_t)(h ^ (h >> 29)) & (dc.size - 1);
+}
+
+/**
+ * Find the slot for a directory.
+ *
+ * @returns Returns the directory's slot, or the empty slot where it belongs.
+ */
+static struct dircache_dir **dc_find(dev_t dev, ino_t ino)
+{
+	size_t i = dc_slot(dev, ino);
+
+	while (dc.table[i] != NULL) {
+		if (dc.table[i]->ino == ino && dc.table[i]->dev == dev)
+			break;
+		i = (i + 1) & (dc.size - 1);
+	}
+
+	return &dc.table[i];
+}
+
+/** Allocate an empty listing. */
+static struct dircache_dir *dc_alloc_dir(void)
+{
+	struct dircache_dir *dir;
+
+	dir = budget_malloc(sizeof(*dir));
+	if (dir == NULL)
+		return NULL;
+
+	memset(dir, 0, sizeof(*dir));
+	dir->mem = sizeof(*dir);
+
+	return dir;
+}
+
+/** Resize part of a listing, charging it to the listing's memory. */
+static void *dc_realloc(struct dircache_dir *dir, void *ptr, size_t old_size, size_t new_size)
+{
+	void *tmp;
+
+	tmp = budget_realloc(ptr, old_size, new_size);
+	if (tmp != NULL)
+		dir->mem += new_size - old_size;
+
+	return tmp;
+}
+
+/** Free a single listing. */
+static void dc_free_dir(struct dircache_dir *dir)
+{
+	if (dir == NULL)
+		return;
+
+	free(dir->entries);
+	free(dir->names);
+	budget_release(dir->mem);
+	free(dir);
+}
+
+/**
+ * Evict every listing that isn't in use (the budget's reclaim function).
+ *
+ * Evicted listings are simply dropped, so they are read again if needed
+ * (and left out of the cache file if it gets saved).
+ *
+ * This runs on whichever thread is reserving memory. If the table is locked
+ * (by another thread, or by this one allocating inside dc_insert()), nothing
+ * is evicted rather than waiting for it.
+ */
+static size_t dc_reclaim(size_t wanted)
+{
+	size_t freed = 0;
+	size_t start;
+	size_t i;
+
+	(void)wanted;
+
+	if (pthread_mutex_trylock(&dc.lock) != 0)
+		return 0;
+
+	if (dc.count == 0)
+		goto out;
+
+	for (i = 0; i < dc.size; i++) {
+		struct dircache_dir *dir = dc.table[i];
+
+		if (dir == NULL || dir->pins > 0)
+			continue;
+
+		freed += dir->mem;
+		dc_free_dir(dir);
+		dc.table[i] = NULL;
+		dc.count--;
+		dc.evicted++;
+	}
+
+	if (freed == 0)
+		goto out;
+
+	/* Re-insert the remaining listings so none are stranded behind the
+	 * freed slots. Starting just after an empty slot and going around once
+	 * means each listing can only move back into an already processed slot.
+	 */
+	for (start = 0; dc.table[start] != NULL; start++)
+		;
+
+	for (i = 1; i <= dc.size; i++) {
+		size_t slot = (start + i) & (dc.size - 1);
+		struct dircache_dir *dir = dc.table[slot];
+
+		if (dir == NULL)
+			continue;
+
+		dc.table[slot] = NULL;
+		*dc_find(dir->dev, dir->ino) = dir;
+	}
+
+	pr_debug("Evicted directory listings (%zu bytes freed)\n", freed);
+
+out:
+	pthread_mutex_unlock(&dc.lock);
+	return freed;
+}
+
+/**
+ * Insert (or replace) a listing in the table, growing the table if needed.
+ * The caller must hold dc.lock.
+ *
+ * @returns Returns 0 on success and -1 on failure (@p dir is freed).
+ */
+static int dc_insert(struct dircache_dir *dir)
+{
+	struct dircache_dir **slot;
+
+	if ((dc.count + 1) * 10 >= dc.size * 7) {
+		struct dircache_dir **old = dc.table;
+		size_t old_size = dc.size;
+		size_t i;
+
+		dc.size = old_size ? old_size * 2 : 1024;
+		dc.table = budget_malloc(dc.size * sizeof(dc.table[0]));
+		if (dc.table == NULL) {
+			dc.table = old;
+			dc.size = old_size;
+			dc_free_dir(dir);
+			return -1;
+		}
+
+		memset(dc.table, 0, dc.size * sizeof(dc.table[0]));
+
+		for (i = 0; i < old_size; i++) {
+			if (old[i] != NULL)
+				*dc_find(old[i]->dev, old[i]->ino) = old[i];
+		}
+
+		budget_free(old, old_size * sizeof(old[0]));
+	}
+
+	slot = dc_find(dir->dev, dir->ino);
+	if (*slot != NULL)
+		dc_free_dir(*slot);
+	else
+		dc.count++;
+
+	*slot = dir;
+	dc.dirty = true;
+
+	return 0;
+}
+
+/**
+ * Turn a names blob and on-disk entries into a listing.
+ *
+ * @returns Returns 0 on success and -1 if the entries are malformed.
+ */
+static int dc_fill(struct dircache_dir *dir, const struct dc_entry *raw, size_t names_len)
+{
+	size_t i;
+
+	for (i = 0; i < dir->count; i++) {
+		if (raw[i].name_off >= names_len)
+			return -1;
+
+		dir->entries[i].ino  = (ino_t)raw[i].ino;
+		dir->entries[i].type = raw[i].type;
+		dir->entries[i].name = dir->names + raw[i].name_off;
+	}
+
+	/* Every name must be NUL-terminated within the blob. */
+	if (names_len > 0 && dir->names[names_len - 1] != '\0')
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Load a single listing from the cache file.
+ *
+ * @retval 1  A listing was loaded.
+ * @retval 0  The end of the file was reached.
+ * @retval <0 The cache file is malformed or couldn't be read.
+ */
+static int dc_load_one(FILE *f)
+{
+	struct dircache_dir *dir;
+	struct dc_entry *raw;
+	struct dc_rec rec;
+	int err;
+
+	if (fread(&rec, sizeof(rec), 1, f) != 1)
+		return feof(f) ? 0 : -1;
+
+	if (rec.names_len > UINT32_MAX || rec.count > rec.names_len)
+		return -1;
+
+	dir = dc_alloc_dir();
+	raw = malloc(rec.count * sizeof(*raw) + 1);
+	if (dir == NULL || raw == NULL)
+		goto fail;
+
+	dir->dev   = (dev_t)rec.dev;
+	dir->ino   = (ino_t)rec.ino;
+	dir->mtime = (struct timespec){ .tv_sec = rec.sec, .tv_nsec = rec.nsec };
+	dir->age   = rec.age;
+	dir->count = rec.count;
+
+	dir->entries = dc_realloc(dir, NULL, 0, rec.count * sizeof(dir->entries[0]) + 1);
+	if (dir->entries == NULL)
+		goto fail;
+
+	dir->names = dc_realloc(dir, NULL, 0, rec.names_len + 1);
+	if (dir->names == NULL)
+		goto fail;
+
+	if (fread(raw, sizeof(*raw), rec.count, f) != rec.count)
+		goto fail;
+
+	if (fread(dir->names, 1, rec.names_len, f) != rec.names_len)
+		goto fail;
+
+	if (dc_fill(dir, raw, rec.names_len) != 0)
+		goto fail;
+
+	free(raw);
+
+	pthread_mutex_lock(&dc.lock);
+	err = dc_insert(dir);
+	pthread_mutex_unlock(&dc.lock);
+
+	return err == 0 ? 1 : -1;
+
+fail:
+	free(raw);
+	dc_free_dir(dir);
+	return -1;
+}
+
+int dircache_open(const char *path)
+{
+	char magic[sizeof(DIRCACHE_MAGIC) - 1];
+	int err = 0;
+	FILE *f;
+
+	assert(path != NULL);
+	assert(dc.path == NULL);
+
+	dc.path = strdup(path);
+	if (dc.path == NULL)
+		return -1;
+
+	budget_register_reclaim(dc_reclaim);
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		if (errno == ENOENT)
+			return 0;
+
+		pr_err("Error: could not open directory cache \"%s\": %m\n", path);
+		free(dc.path);
+		dc.path = NULL;
+		return -1;
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+		memcmp(magic, DIRCACHE_MAGIC, sizeof(magic)) != 0) {
+		pr_warn("Warning: ignoring unrecognized directory cache \"%s\"\n", path);
+	}
+	else {
+		while ((err = dc_load_one(f)) > 0)
+			;
+	}
+
+	fclose(f);
+
+	if (err < 0 && errno == ENOMEM)
+		pr_warn("Warning: memory limit reached loading directory cache \"%s\"\n", path);
+	else if (err < 0)
+		pr_warn("Warning: directory cache \"%s\" is truncated or corrupt\n", path);
+
+	/* A partially loaded cache is still correct (entries are keyed by mtime). */
+	dc.dirty = false;
+
+	pr_debug("Loaded %zu cached directory listings from \"%s\"\n", dc.count, path);
+
+	return 0;
+}
+
+/**
+ * Write a single listing to the cache file.
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int dc_save_one(FILE *f, const struct dircache_dir *dir)
+{
+	struct dc_rec rec = {
+		.dev   = (uint64_t)dir->dev,
+		.ino   = (uint64_t)dir->ino,
+		.sec   = dir->mtime.tv_sec,
+		.nsec  = dir->mtime.tv_nsec,
+		.age   = dir->age,
+		.count = (uint32_t)dir->count,
+	};
+	size_t i;
+
+	for (i = 0; i < dir->count; i++)
+		rec.names_len += strlen(dir->entries[i].name) + 1;
+
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1)
+		return -1;
+
+	rec.names_len = 0;
+
+	for (i = 0; i < dir->count; i++) {
+		struct dc_entry raw = {
+			.ino      = (uint64_t)dir->entries[i].ino,
+			.name_off = (uint32_t)rec.names_len,
+			.type     = dir->entries[i].type,
+		};
+
+		if (fwrite(&raw, sizeof(raw), 1, f) != 1)
+			return -1;
+
+		rec.names_len += strlen(dir->entries[i].name) + 1;
+	}
+
+	for (i = 0; i < dir->count; i++) {
+		const char *name = dir->entries[i].name;
+
+		if (fwrite(name, 1, strlen(name) + 1, f) != strlen(name) + 1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the whole cache to a temporary file and move it into place.
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int dc_save(void)
+{
+	char *tmp;
+	size_t i;
+	FILE *f;
+
+	if (asprintf(&tmp, "%s.%d", dc.path, (int)getpid()) < 0)
+		return -1;
+
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		pr_err("Error: could not create \"%s\": %m\n", tmp);
+		free(tmp);
+		return -1;
+	}
+
+	if (fwrite(DIRCACHE_MAGIC, sizeof(DIRCACHE_MAGIC) - 1, 1, f) != 1)
+		goto fail;
+
+	for (i = 0; i < dc.size; i++) {
+		struct dircache_dir *dir = dc.table[i];
+
+		/* Skip racy (uncacheable) and long-unused listings. */
+		if (dir == NULL || dir->mtime.tv_sec == 0 || dir->age >= DIRCACHE_MAX_AGE)
+			continue;
+
+		if (dc_save_one(f, dir) != 0)
+			goto fail;
+	}
+
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto fail;
+	}
+
+	if (rename(tmp, dc.path) != 0) {
+		f = NULL;
+		goto fail;
+	}
+
+	free(tmp);
+	return 0;
+
+fail:
+	pr_err("Error: could not write directory cache \"%s\": %m\n", tmp);
+	if (f != NULL)
+		fclose(f);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+int dircache_close(void)
+{
+	int ret = 0;
+	size_t i;
+
+	if (dc.path == NULL)
+		return 0;
+
+	pthread_mutex_lock(&dc.lock);
+
+	if (dc.evicted > 0)
+		pr_debug("Evicted %zu directory listings to stay within the memory limit\n",
+			dc.evicted);
+
+	/* Age every listing that wasn't used by this run. */
+	for (i = 0; i < dc.size; i++) {
+		if (dc.table[i] != NULL && dc.table[i]->age++ > 0)
+			dc.dirty = true;
+	}
+
+	if (dc.dirty)
+		ret = dc_save();
+
+	for (i = 0; i < dc.size; i++)
+		dc_free_dir(dc.table[i]);
+
+	budget_free(dc.table, dc.size * sizeof(dc.table[0]));
+	free(dc.path);
+	dc.path = NULL;
+	dc.table = NULL;
+	dc.size = 0;
+	dc.count = 0;
+	dc.evicted = 0;
+	dc.dirty = false;
+
+	pthread_mutex_unlock(&dc.lock);
+
+	return ret;
+}
+
+const struct dircache_dir *dircache_lookup(const struct stat *st)
+{
+	struct dircache_dir *dir;
+
+	assert(st != NULL);
+
+	pthread_mutex_lock(&dc.lock);
+
+	dir = dc.count > 0 ? *dc_find(st->st_dev, st->st_ino) : NULL;
+	if (dir != NULL && ts_compare(dir->mtime, st->st_mtim, false) == 0) {
+		dir->age = 0;
+		dir->pins++;
+	}
+	else {
+		dir = NULL;
+	}
+
+	pthread_mutex_unlock(&dc.lock);
+
+	return dir;
+}
+
+void dircache_release(const struct dircache_dir *dir)
+{
+	struct dircache_dir *cached;
+
+	assert(dir != NULL);
+
+	pthread_mutex_lock(&dc.lock);
+	cached = *dc_find(dir->dev, dir->ino);
+	assert(cached == dir && cached->pins > 0);
+	cached->pins--;
+	pthread_mutex_unlock(&dc.lock);
+}
+
+/** qsort() comparison function to sort entries by inode number. */
+static int dc_compare_ino(const void *a, const void *b)
+{
+	const struct dircache_entry *x = a;
+	const struct dircache_entry *y = b;
+
+	return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+const struct dircache_dir *dircache_read(io_dir_t *dirp, const struct stat *st)
+{
+	struct dircache_dir *dir;
+	struct dirent *entry;
+	size_t names_alloc = 0;
+	size_t names_len = 0;
+	size_t alloc = 0;
+	size_t i;
+	int err;
+
+	assert(dirp != NULL);
+	assert(st != NULL);
+
+	dir = dc_alloc_dir();
+	if (dir == NULL)
+		return NULL;
+
+	dir->dev   = st->st_dev;
+	dir->ino   = st->st_ino;
+	dir->mtime = st->st_mtim;
+
+	/* A directory changed within the last second may change again without
+	 * its mtime changing, so don't reuse its listing in later runs.
+	 */
+	if (st->st_mtim.tv_sec >= time(NULL) - 1)
+		dir->mtime = (struct timespec){ 0, 0 };
+
+	errno = 0;
+	while ((entry = io->readdir(dirp)) != NULL) {
+		size_t len;
+
+		/* Ignore "." and ".." entries. */
+		if (entry->d_name[0] == '.') {
+			if (entry->d_name[1] == '\0')
+				continue;
+			if (entry->d_name[1] == '.' && entry->d_name[2] == '\0')
+				continue;
+		}
+
+		len = strlen(entry->d_name) + 1;
+
+		if (dir->count >= alloc) {
+			void *tmp;
+
+			tmp = dc_realloc(dir, dir->entries, alloc * sizeof(dir->entries[0]),
+				(alloc ? alloc * 2 : 64) * sizeof(dir->entries[0]));
+			if (tmp == NULL)
+				goto fail;
+			dir->entries = tmp;
+			alloc = alloc ? alloc * 2 : 64;
+		}
+
+		if (names_len + len > names_alloc) {
+			void *tmp;
+
+			tmp = dc_realloc(dir, dir->names, names_alloc, (names_len + len) * 2);
+			if (tmp == NULL)
+				goto fail;
+			dir->names = tmp;
+			names_alloc = (names_len + len) * 2;
+		}
+
+		memcpy(dir->names + names_len, entry->d_name, len);
+
+		dir->entries[dir->count].ino  = entry->d_ino;
+		dir->entries[dir->count].type = entry->d_type;
+		/* Store the offset for now since dir->names may still move. */
+		dir->entries[dir->count].name = (const char *)(uintptr_t)names_len;
+		dir->count++;
+
+		names_len += len;
+		errno = 0;
+	}
+
+	if (errno != 0)
+		goto fail;
+
+	for (i = 0; i < dir->count; i++)
+		dir->entries[i].name = dir->names + (uintptr_t)dir->entries[i].name;
+
+	/* Visit the entries in inode order (which usually matches disk order). */
+	qsort(dir->entries, dir->count, sizeof(dir->entries[0]), dc_compare_ino);
+
+	/* Pin it before unlocking, so it can't be evicted in between. */
+	pthread_mutex_lock(&dc.lock);
+	if (dc_insert(dir) == 0)
+		dir->pins++;
+	else
+		dir = NULL;
+	pthread_mutex_unlock(&dc.lock);
+
+	if (dir == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	return dir;
+
+fail:
+	err = errno;
+	dc_free_dir(dir);
+
+	/* Let the caller fall back to reading the directory itself. */
+	if (err == ENOMEM)
+		io->rewinddir(dirp);
+
+	errno = err;
+	return NULL;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Persistent directory listing cache declarations.
+ *
+ * A directory whose mtime hasn't changed still has the same set of names, so
+ * its listing can be reused across runs instead of calling readdir() again.
+ * Listings are keyed by the directory's device, inode, and mtime.
+ *
+ * Listings are charged to the memory budget. When the budget runs out, listings
+ * that aren't in use are evicted (they're simply read again next time).
+ */
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "io.h"
+
+/** A single directory entry. */
+struct dircache_entry {
+	ino_t ino;           /**< The entry's inode number. */
+	unsigned char type;  /**< The entry's type (DT_* from dirent.h). */
+	const char *name;    /**< The entry's name. */
+};
+
+/** A cached directory listing (sorted by inode number). */
+struct dircache_dir {
+	dev_t dev;                      /**< The directory's device ID. */
+	ino_t ino;                      /**< The directory's inode number. */
+	struct timespec mtime;          /**< The directory's mtime when listed. */
+	unsigned age;                   /**< Saves since the listing was last used. */
+	size_t count;                   /**< The number of entries. */
+	struct dircache_entry *entries; /**< The entries (excluding "." and ".."). */
+	char *names;                    /**< Storage for the entry names. */
+	size_t mem;                     /**< The memory reserved for the listing. */
+	unsigned pins;                  /**< Users that haven't released the listing. */
+};
+
+/**
+ * Load the directory listing cache from @p path.
+ *
+ * A missing cache file is not an error (the cache simply starts out empty).
+ *
+ * @param path  The cache file.
+ *
+ * @retval 0  The cache was loaded successfully.
+ * @retval !0 An error occurred (the cache is disabled).
+ */
+int dircache_open(const char *path);
+
+/**
+ * Save the cache back to its file (if it changed) and free it.
+ *
+ * @retval 0  The cache was saved successfully (or didn't need saving).
+ * @retval !0 An error occurred writing the cache file.
+ */
+int dircache_close(void);
+
+/**
+ * Returns whether the directory listing cache is in use.
+ */
+bool dircache_enabled(void);
+
+/**
+ * Look up a directory's cached listing.
+ *
+ * @param st  The directory's stat() structure.
+ *
+ * The listing must be released with dircache_release() when done with it.
+ *
+ * @returns Returns the listing if the directory is cached and its mtime
+ *          hasn't changed, otherwise NULL.
+ */
+const struct dircache_dir *dircache_lookup(const struct stat *st);
+
+/**
+ * Read a directory's listing and store it in the cache.
+ *
+ * Directories modified within the last second are read but not cached since
+ * they may change again without changing their mtime.
+ *
+ * The listing must be released with dircache_release() when done with it.
+ *
+ * @param dirp  The open directory stream to read.
+ * @param st    The directory's stat() structure.
+ *
+ * @returns Returns the listing (owned by the cache) or NULL on failure. If the
+ *          memory budget is exhausted, errno is set to ENOMEM and @p dirp is
+ *          rewound so the caller can read the directory itself.
+ */
+const struct dircache_dir *dircache_read(io_dir_t *dirp, const struct stat *st);
+
+/**
+ * Release a listing returned by dircache_lookup() or dircache_read(), allowing
+ * it to be evicted.
+ *
+ * @param dir  The listing.
+ */
+void dircache_release(const struct dircache_dir *dir);
+
+#endif /* DIRCACHE_H */
@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Dirty-inode set.
+ *
+ * The tracker's pinned maps are read with the bpf() system call directly, so
+ * b2tag doesn't need libbpf (only b2tag-dirtyd does).
+ */
+
+#include "dirty.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/bpf.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "budget.h"
+#include "dirty_track.h"
+#include "utilities.h"
+
+/** The kernel's internal "operation not supported" error (for map types without batches). */
+#define KERNEL_ENOTSUPP 524
+
+/** The number of keys to drain at once. */
+#define DRAIN_BATCH 4096
+
+/** The dirty set and tracker state. */
+static struct {
+	bool enabled;     /**< Whether clean files are skipped. */
+	bool loaded;      /**< Whether the tracker's maps were opened. */
+	const char *path; /**< The state file. */
+	uint64_t gen;     /**< The tracker's generation. */
+	uint64_t overflow; /**< The tracker's overflow count before draining. */
+	uint64_t drains;  /**< The tracker's drain count after this run's drain. */
+	struct dirty_key *keys; /**< Open-addressed set of inodes (all zero is empty). */
+	size_t mask;      /**< The set's size minus one. */
+	size_t count;     /**< The number of inodes in the set. */
+	bool has_zero;    /**< Whether inode 0 of device 0 is in the set. */
+	dev_t *mounts;    /**< The sorted devices of the mounted filesystems. */
+	size_t mount_count; /**< The number of mounted devices. */
+} dirty;
+
+/** Wrapper for the bpf() system call. */
+static long sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+/** Open a pinned map. */
+static int bpf_obj_get(const char *path)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.pathname = (uintptr_t)path;
+
+	return (int)sys_bpf(BPF_OBJ_GET, &attr);
+}
+
+/** Update an element of a map. */
+static int bpf_update(int fd, const void *key, const void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t)fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+	attr.flags = BPF_ANY;
+
+	return (int)sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+/** Look up an element of a map. */
+static int bpf_lookup(int fd, const void *key, void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t)fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+
+	return (int)sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+/** Returns whether a set entry is empty (or the all-zero key). */
+static bool dirty_empty(const struct dirty_key *key)
+{
+	return key->ino == 0 && key->dev == 0;
+}
+
+/**
+ * Returns the slot of @p ino in the set (for hashing). Only the inode number
+ * is hashed, so every device's entries for an inode number share a cluster.
+ */
+static size_t dirty_slot(uint64_t ino)
+{
+	return (size_t)((ino * 0x9E3779B97F4A7C15ULL) >> 17) & dirty.mask;
+}
+
+/**
+ * Add an inode to the set (growing it as necessary).
+ *
+ * @retval 0  The inode was added.
+ * @retval -1 Out of memory.
+ */
+static int dirty_add(const struct dirty_key *key)
+{
+	size_t i;
+
+	if (dirty_empty(key)) {
+		dirty.has_zero = true;
+		return 0;
+	}
+
+	/* Keep the set at most half full. */
+	if (dirty.keys == NULL || (dirty.count + 1) * 2 > dirty.mask + 1) {
+		size_t old_size = dirty.keys != NULL ? dirty.mask + 1 : 0;
+		size_t size = old_size ? old_size * 2 : 1024;
+		struct dirty_key *old = dirty.keys;
+
+		dirty.keys = budget_malloc(size * sizeof(dirty.keys[0]));
+		if (dirty.keys == NULL) {
+			dirty.keys = old;
+			return -1;
+		}
+
+		memset(dirty.keys, 0, size * sizeof(dirty.keys[0]));
+		dirty.mask = size - 1;
+		dirty.count = 0;
+
+		for (i = 0; i < old_size; i++)
+			if (!dirty_empty(&old[i]))
+				dirty_add(&old[i]);
+
+		budget_free(old, old_size * sizeof(old[0]));
+	}
+
+	for (i = dirty_slot(key->ino); !dirty_empty(&dirty.keys[i]); i = (i + 1) & dirty.mask)
+		if (dirty.keys[i].ino == key->ino && dirty.keys[i].dev == key->dev)
+			return 0;
+
+	dirty.keys[i].ino = key->ino;
+	dirty.keys[i].dev = key->dev;
+	dirty.count++;
+
+	return 0;
+}
+
+bool dirty_enabled(void)
+{
+	return dirty.enabled;
+}
+
+/** Compare two device numbers (for qsort() and bsearch()). */
+static int dev_cmp(const void *a, const void *b)
+{
+	dev_t x = *(const dev_t *)a;
+	dev_t y = *(const dev_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Read the devices of the mounted filesystems.
+ *
+ * These are the superblocks' device numbers, the ones the tracker records. A
+ * file whose st_dev isn't one of them (e.g. in a btrfs subvolume) is matched
+ * by its inode number alone.
+ */
+static void dirty_read_mounts(void)
+{
+	unsigned int maj, min;
+	size_t allocated = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (f == NULL) {
+		pr_warn("Warning: could not read the mounted filesystems (%m)\n");
+		return;
+	}
+
+	while (fscanf(f, "%*d %*d %u:%u%*[^\n]\n", &maj, &min) == 2) {
+		if (dirty.mount_count >= allocated) {
+			dev_t *tmp;
+
+			allocated = allocated ? allocated * 2 : 64;
+			tmp = realloc(dirty.mounts, allocated * sizeof(dirty.mounts[0]));
+			if (tmp == NULL) {
+				/* Without the list, every file is matched by inode. */
+				free(dirty.mounts);
+				dirty.mounts = NULL;
+				dirty.mount_count = 0;
+				break;
+			}
+			dirty.mounts = tmp;
+		}
+
+		dirty.mounts[dirty.mount_count++] = makedev(maj, min);
+	}
+
+	fclose(f);
+
+	if (dirty.mount_count > 0)
+		qsort(dirty.mounts, dirty.mount_count, sizeof(dirty.mounts[0]), dev_cmp);
+}
+
+bool dirty_contains(dev_t dev, ino_t ino)
+{
+	/* The tracker records the kernel's encoding of the device number. */
+	struct dirty_key key = {
+		.ino = ino,
+		.dev = (__u32)((major(dev) << 20) | minor(dev)),
+	};
+	bool any_dev;
+	size_t i;
+
+	if (dirty_empty(&key))
+		return dirty.has_zero;
+
+	if (dirty.keys == NULL)
+		return false;
+
+	any_dev = dirty.mount_count == 0 ||
+		bsearch(&dev, dirty.mounts, dirty.mount_count, sizeof(dirty.mounts[0]), dev_cmp) == NULL;
+
+	for (i = dirty_slot(key.ino); !dirty_empty(&dirty.keys[i]); i = (i + 1) & dirty.mask)
+		if (dirty.keys[i].ino == key.ino && (any_dev || dirty.keys[i].dev == key.dev))
+			return true;
+
+	return false;
+}
+
+/** Free the set. */
+static void dirty_free(void)
+{
+	budget_free(dirty.keys, dirty.keys ? (dirty.mask + 1) * sizeof(dirty.keys[0]) : 0);
+	dirty.keys = NULL;
+	dirty.count = 0;
+	dirty.has_zero = false;
+
+	free(dirty.mounts);
+	dirty.mounts = NULL;
+	dirty.mount_count = 0;
+}
+
+/**
+ * Move every key out of the tracker's map into the set.
+ *
+ * Uses BPF_MAP_LOOKUP_AND_DELETE_BATCH, or, on kernels without it, collects
+ * the keys and then deletes them one at a time.
+ *
+ * @retval 0  The map was drained.
+ * @retval -1 An error occurred (some inodes may have been lost).
+ */
+static int dirty_drain(int map, bool keep)
+{
+	static struct dirty_key keys[DRAIN_BATCH];
+	static __u8 values[DRAIN_BATCH];
+	union bpf_attr attr;
+	uint64_t batch = 0;
+	bool first = true;
+	size_t i;
+
+	for (;;) {
+		long err;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.batch.map_fd = (uint32_t)map;
+		attr.batch.in_batch = first ? 0 : (uintptr_t)&batch;
+		attr.batch.out_batch = (uintptr_t)&batch;
+		attr.batch.keys = (uintptr_t)keys;
+		attr.batch.values = (uintptr_t)values;
+		attr.batch.count = DRAIN_BATCH;
+
+		err = sys_bpf(BPF_MAP_LOOKUP_AND_DELETE_BATCH, &attr);
+		if (err != 0 && errno != ENOENT) {
+			if (first && (errno == EINVAL || errno == KERNEL_ENOTSUPP || errno == EOPNOTSUPP))
+				break;
+			return -1;
+		}
+
+		for (i = 0; keep && i < attr.batch.count; i++)
+			if (dirty_add(&keys[i]) != 0)
+				return -1;
+
+		/* ENOENT means that was the last batch. */
+		if (err != 0)
+			return 0;
+
+		first = false;
+	}
+
+	/* Fall back to iterating (the kernel doesn't support batches). */
+	for (;;) {
+		struct dirty_key key;
+		long err;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = (uint32_t)map;
+		attr.key = 0;
+		attr.next_key = (uintptr_t)&key;
+
+		/* Always start from the beginning since the key is deleted. */
+		err = sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+		if (err != 0)
+			return errno == ENOENT ? 0 : -1;
+
+		if (keep && dirty_add(&key) != 0)
+			return -1;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = (uint32_t)map;
+		attr.key = (uintptr_t)&key;
+		if (sys_bpf(BPF_MAP_DELETE_ELEM, &attr) != 0 && errno != ENOENT)
+			return -1;
+	}
+}
+
+/**
+ * Read the state file.
+ *
+ * @retval 0  The state was read.
+ * @retval -1 There's no (valid) state file.
+ */
+static int dirty_read_state(uint64_t *gen, uint64_t *overflow, uint64_t *drains)
+{
+	unsigned long long g, o, d;
+	FILE *f;
+	int n;
+
+	f = fopen(dirty.path, "r");
+	if (f == NULL)
+		return -1;
+
+	n = fscanf(f, "b2tag-dirty 2 %llx %llu %llu", &g, &o, &d);
+	fclose(f);
+
+	if (n != 3)
+		return -1;
+
+	*gen = g;
+	*overflow = o;
+	*drains = d;
+
+	return 0;
+}
+
+/** Read a statistic of the tracker (0 if it can't be read). */
+static uint64_t dirty_stat(int stats, __u32 key)
+{
+	__u64 value;
+
+	if (bpf_lookup(stats, &key, &value) != 0)
+		return 0;
+
+	return value;
+}
+
+int dirty_open(const char *state, bool filter)
+{
+	__u32 key;
+	__u64 value;
+	uint64_t gen, overflow, drains;
+	bool gap = false;
+	int stats;
+	int map;
+	int pin;
+
+	dirty.path = state;
+
+	stats = bpf_obj_get(DIRTY_PIN_STATS);
+	map = bpf_obj_get(DIRTY_PIN_MAP);
+	pin = open(DIRTY_PIN_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (stats < 0 || map < 0 || pin < 0) {
+		pr_warn("Warning: the dirty-inode tracker isn't loaded (%m), doing a full walk\n");
+		if (stats >= 0)
+			close(stats);
+		if (map >= 0)
+			close(map);
+		if (pin >= 0)
+			close(pin);
+		return 1;
+	}
+
+	/* Serialize with other runs, so each drain is counted (and seen). */
+	if (flock(pin, LOCK_EX) != 0) {
+		pr_warn("Warning: could not lock the dirty-inode tracker (%m), doing a full walk\n");
+		close(stats);
+		close(map);
+		close(pin);
+		return 1;
+	}
+
+	dirty.gen = dirty_stat(stats, DIRTY_STAT_GEN);
+	dirty.overflow = dirty_stat(stats, DIRTY_STAT_OVERFLOW);
+	dirty.drains = dirty_stat(stats, DIRTY_STAT_DRAINS);
+
+	if (dirty_read_state(&gen, &overflow, &drains) != 0) {
+		pr_warn("Warning: no previous dirty-inode state in \"%s\", doing a full walk\n", state);
+		gap = true;
+	}
+	else if (gen != dirty.gen) {
+		pr_warn("Warning: the dirty-inode tracker was restarted, doing a full walk\n");
+		gap = true;
+	}
+	else if (overflow != dirty.overflow) {
+		pr_warn("Warning: the dirty-inode tracker dropped %llu inodes, doing a full walk\n",
+			(unsigned long long)(dirty.overflow - overflow));
+		gap = true;
+	}
+	else if (drains != dirty.drains) {
+		/* Another run (e.g. over other paths) took the inodes since. */
+		pr_warn("Warning: the dirty-inode tracker was drained by another run, doing a full walk\n");
+		gap = true;
+	}
+
+	/* Once the map is drained, the old state no longer describes what the
+	 * next run missed: invalidate it first, so an interrupted or failed run
+	 * leaves no state (and the next run does a full walk). dirty_close()
+	 * writes it again if this run succeeds.
+	 */
+	if (unlink(state) != 0 && errno != ENOENT) {
+		pr_warn("Warning: could not remove \"%s\" (%m), doing a full walk\n", state);
+		close(stats);
+		close(map);
+		close(pin);
+		return 1;
+	}
+
+	dirty.loaded = dirty.gen != 0;
+
+	/* Always empty the map, so the next run starts from here. */
+	if (dirty_drain(map, filter && !gap) != 0) {
+		pr_warn("Warning: could not drain the dirty-inode tracker (%m), doing a full walk\n");
+		gap = true;
+		/* The next run can't trust what's left either. */
+		dirty.loaded = false;
+	}
+
+	/* Count the drain, so every other state file is now out of date. */
+	key = DIRTY_STAT_DRAINS;
+	value = ++dirty.drains;
+	if (bpf_update(stats, &key, &value) != 0) {
+		pr_warn("Warning: could not update the dirty-inode tracker (%m)\n");
+		dirty.loaded = false;
+	}
+
+	close(stats);
+	close(map);
+	close(pin);
+
+	if (gap || !filter) {
+		dirty_free();
+		return 1;
+	}
+
+	pr_debug("%zu dirty inodes since the last run\n", dirty.count + dirty.has_zero);
+	dirty_read_mounts();
+	dirty.enabled = true;
+
+	return 0;
+}
+
+void dirty_close(bool success)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	dirty_free();
+	dirty.enabled = false;
+
+	/* The drained inodes are lost if this run failed, so leave the state
+	 * missing (dirty_open() removed it, forcing a full walk next time).
+	 */
+	if (!success || !dirty.loaded)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", dirty.path) >= (int)sizeof(tmp))
+		return;
+
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		pr_err("Error: could not write \"%s\": %m\n", tmp);
+		return;
+	}
+
+	fprintf(f, "b2tag-dirty 2 %016llx %llu %llu\n", (unsigned long long)dirty.gen,
+		(unsigned long long)dirty.overflow, (unsigned long long)dirty.drains);
+
+	if (fclose(f) != 0 || rename(tmp, dirty.path) != 0) {
+		pr_err("Error: could not write \"%s\": %m\n", dirty.path);
+		unlink(tmp);
+	}
+}
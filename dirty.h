@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Dirty-inode set declarations.
+ *
+ * With --dirty-inodes, b2tag drains the set of inodes that the eBPF tracker
+ * (see b2tag-dirtyd) recorded as modified since the last run, and skips the
+ * regular files that aren't in it without opening them. A full walk is done
+ * instead whenever the tracker can't vouch for the whole interval since the
+ * last successful run: it isn't loaded, was reloaded (e.g. after a reboot),
+ * or dropped inodes because its map was full.
+ */
+
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+/**
+ * Drain the tracker's dirty set and decide whether the run can be incremental.
+ * The state file is removed before draining, so only dirty_close() after a
+ * successful run makes the next one incremental. Every drain is counted in the
+ * tracker, so a drain by any other run (e.g. over other paths, with another
+ * state file) also makes the next run a full walk.
+ *
+ * @param state   The file recording the tracker state at the last successful run.
+ * @param filter  Whether clean files may be skipped (false for e.g. --check).
+ *
+ * @retval 0  The run is incremental (see dirty_enabled()).
+ * @retval >0 There is a gap in the tracking: do a full walk.
+ */
+int dirty_open(const char *state, bool filter);
+
+/**
+ * Record the tracker state for the next run (if this one was successful) and
+ * free the dirty set.
+ *
+ * @param success  Whether every file was processed successfully.
+ */
+void dirty_close(bool success);
+
+/**
+ * Returns whether clean files are being skipped.
+ */
+bool dirty_enabled(void);
+
+/**
+ * Returns whether a file may have been modified since the last run.
+ *
+ * @param dev  The device of the file's directory.
+ * @param ino  The file's inode number.
+ */
+bool dirty_contains(dev_t dev, ino_t ino);
+
+#endif /* DIRTY_H */
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * The dirty-inode tracker's eBPF program.
+ *
+ * Records the (device, inode) of every regular file that may have been
+ * modified: opened for writing, written (by any path that checks write
+ * permission, including writev, splice, AIO, and io_uring), truncated,
+ * fallocated, renamed, or dirtied through a shared mapping. Only built with
+ * BPF=1.
+ */
+
+#include "vmlinux.h"
+
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+#include "dirty_track.h"
+
+/* Kernel macros that aren't in the BTF. */
+#define S_IFMT      00170000
+#define S_IFREG     0100000
+#define MAY_WRITE   0x00000002
+#define FMODE_WRITE 0x2
+#define EEXIST      17
+
+char LICENSE[] SEC("license") = "GPL";
+
+/** The dirty inodes. */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, DIRTY_MAX_ENTRIES);
+	__type(key, struct dirty_key);
+	__type(value, __u8);
+} dirty SEC(".maps");
+
+/** The tracker's statistics (see ::dirty_stat). */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, DIRTY_STAT_COUNT);
+	__type(key, __u32);
+	__type(value, __u64);
+} dirty_stats SEC(".maps");
+
+/** Add one to a statistic. */
+static __always_inline void count(__u32 stat)
+{
+	__u64 *value = bpf_map_lookup_elem(&dirty_stats, &stat);
+
+	if (value != NULL)
+		__sync_fetch_and_add(value, 1);
+}
+
+/** Record a regular file as dirty. */
+static __always_inline void mark_inode(struct inode *inode)
+{
+	struct dirty_key key = {};
+	__u8 one = 1;
+	long err;
+
+	if (inode == NULL || (inode->i_mode & S_IFMT) != S_IFREG)
+		return;
+
+	key.dev = inode->i_sb->s_dev;
+	key.ino = inode->i_ino;
+
+	err = bpf_map_update_elem(&dirty, &key, &one, BPF_NOEXIST);
+	if (err == 0)
+		count(DIRTY_STAT_MARKED);
+	else if (err != -EEXIST)
+		count(DIRTY_STAT_OVERFLOW);
+}
+
+SEC("fexit/security_file_open")
+int BPF_PROG(on_open, struct file *file, int ret)
+{
+	if (ret == 0 && (file->f_mode & FMODE_WRITE))
+		mark_inode(file->f_inode);
+	return 0;
+}
+
+/* Every read/write path (including AIO and io_uring) calls this. */
+SEC("fexit/security_file_permission")
+int BPF_PROG(on_permission, struct file *file, int mask, int ret)
+{
+	if (ret == 0 && (mask & MAY_WRITE))
+		mark_inode(file->f_inode);
+	return 0;
+}
+
+/* The first argument's type changed between kernels (it isn't used). */
+SEC("fexit/do_truncate")
+int BPF_PROG(on_truncate, void *idmap, struct dentry *dentry)
+{
+	mark_inode(dentry->d_inode);
+	return 0;
+}
+
+SEC("fexit/vfs_fallocate")
+int BPF_PROG(on_fallocate, struct file *file)
+{
+	mark_inode(file->f_inode);
+	return 0;
+}
+
+SEC("fexit/vfs_rename")
+int BPF_PROG(on_rename, struct renamedata *rd)
+{
+	mark_inode(rd->old_dentry->d_inode);
+	return 0;
+}
+
+/* Called when a shared mapping's page is first written to. */
+SEC("fexit/file_update_time")
+int BPF_PROG(on_update_time, struct file *file)
+{
+	mark_inode(file->f_inode);
+	return 0;
+}
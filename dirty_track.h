@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Definitions shared by the dirty-inode tracker's eBPF program, its loader
+ * (b2tag-dirtyd), and b2tag.
+ *
+ * The tracker's maps and links are pinned in DIRTY_PIN_DIR, so they keep
+ * working after b2tag-dirtyd exits (until they're unpinned or the machine
+ * reboots).
+ */
+
+#ifndef DIRTY_TRACK_H
+#define DIRTY_TRACK_H
+
+#ifndef __VMLINUX_H__
+#include <linux/types.h>
+#endif
+
+/** Where the tracker's maps and links are pinned. */
+#define DIRTY_PIN_DIR "/sys/fs/bpf/b2tag"
+
+/** The pinned set of dirty inodes. */
+#define DIRTY_PIN_MAP DIRTY_PIN_DIR "/dirty"
+
+/** The pinned statistics. */
+#define DIRTY_PIN_STATS DIRTY_PIN_DIR "/dirty_stats"
+
+/** The most dirty inodes that can be tracked between runs. */
+#define DIRTY_MAX_ENTRIES (1 << 20)
+
+/** A dirty inode (the key of the dirty map; the value is unused). */
+struct dirty_key {
+	__u64 ino; /**< The inode number. */
+	__u32 dev; /**< The device number (in the kernel's encoding). */
+	__u32 pad; /**< Always zero. */
+};
+
+/** The indices of the statistics array. */
+enum dirty_stat {
+	/** The tracker's generation (random, set when it's loaded). */
+	DIRTY_STAT_GEN,
+	/** The inodes that couldn't be recorded (the map was full). */
+	DIRTY_STAT_OVERFLOW,
+	/** The inodes added to the map. */
+	DIRTY_STAT_MARKED,
+	/** The number of times b2tag drained the map (by any run). */
+	DIRTY_STAT_DRAINS,
+
+	/** The number of statistics (not a statistic). */
+	DIRTY_STAT_COUNT
+};
+
+#endif /* DIRTY_TRACK_H */
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Dirty-inode tracker loader (b2tag-dirtyd).
+ *
+ * Loads the tracker's eBPF program, attaches it, and pins its maps and links
+ * in DIRTY_PIN_DIR so it keeps running after this program exits. Only built
+ * with BPF=1 (it needs clang, bpftool, and libbpf).
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include "b2tag.h"
+#include "dirty_track.h"
+#include "dirty_track.skel.h"
+#include "utilities.h"
+
+/** The options set by command-line arguments. */
+struct args_s args;
+
+/** A program's link and where it's pinned. */
+struct pinned_link {
+	const char *name;      /**< The pin's name in DIRTY_PIN_DIR. */
+	struct bpf_link **link; /**< The skeleton's link. */
+};
+
+/**
+ * Prints a usage message for b2tag-dirtyd.
+ *
+ * @param program  The name of the program being run.
+ */
+static void usage(const char *program)
+{
+	printf(
+		"Usage: %s load|unload|status\n"
+		"\n"
+		"Manage the dirty-inode tracker used by b2tag --dirty-inodes.\n"
+		"\n"
+		"Commands:\n"
+		"  load    load the tracker and pin it in " DIRTY_PIN_DIR "\n"
+		"  unload  detach the tracker and remove its pins\n"
+		"  status  print the tracker's generation and counters\n",
+		program);
+}
+
+/** Returns the path of the pin called @p name. */
+static const char *pin_path(const char *name)
+{
+	static char path[256];
+
+	snprintf(path, sizeof(path), DIRTY_PIN_DIR "/%s", name);
+
+	return path;
+}
+
+/** The names of the pinned links (the maps are pinned by path). */
+static const char * const link_names[] = {
+	"on_open", "on_permission", "on_truncate", "on_fallocate", "on_rename", "on_update_time",
+};
+
+/**
+ * Remove all of the tracker's pins (detaching it).
+ *
+ * @returns Returns 0 on success and 1 if a pin couldn't be removed.
+ */
+static int dirty_unload(void)
+{
+	int ret = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(link_names); i++) {
+		if (unlink(pin_path(link_names[i])) != 0 && errno != ENOENT) {
+			pr_err("Error: could not remove \"%s\": %m\n", pin_path(link_names[i]));
+			ret = 1;
+		}
+	}
+
+	if (unlink(DIRTY_PIN_MAP) != 0 && errno != ENOENT)
+		ret = 1;
+	if (unlink(DIRTY_PIN_STATS) != 0 && errno != ENOENT)
+		ret = 1;
+	if (rmdir(DIRTY_PIN_DIR) != 0 && errno != ENOENT)
+		ret = 1;
+
+	return ret;
+}
+
+/**
+ * Load and attach the tracker and pin it.
+ *
+ * @returns Returns 0 on success and 1 on failure.
+ */
+static int dirty_load(void)
+{
+	struct dirty_track_bpf *skel;
+	struct pinned_link links[ARRAY_SIZE(link_names)];
+	__u32 key = DIRTY_STAT_GEN;
+	__u64 gen = 0;
+	size_t i;
+
+	if (access(DIRTY_PIN_MAP, F_OK) == 0) {
+		pr_err("Error: the tracker is already loaded (see \"%s\")\n", DIRTY_PIN_DIR);
+		return 1;
+	}
+
+	skel = dirty_track_bpf__open_and_load();
+	if (skel == NULL) {
+		pr_err("Error: could not load the tracker: %m\n");
+		return 1;
+	}
+
+	/* Every hook is needed: a missed one would silently lose writes. */
+	if (dirty_track_bpf__attach(skel) != 0) {
+		pr_err("Error: could not attach the tracker: %m\n");
+		goto fail;
+	}
+
+	links[0] = (struct pinned_link){ link_names[0], &skel->links.on_open };
+	links[1] = (struct pinned_link){ link_names[1], &skel->links.on_permission };
+	links[2] = (struct pinned_link){ link_names[2], &skel->links.on_truncate };
+	links[3] = (struct pinned_link){ link_names[3], &skel->links.on_fallocate };
+	links[4] = (struct pinned_link){ link_names[4], &skel->links.on_rename };
+	links[5] = (struct pinned_link){ link_names[5], &skel->links.on_update_time };
+
+	/* A new generation tells b2tag that whatever happened before now wasn't
+	 * tracked.
+	 */
+	while (gen == 0) {
+		if (getrandom(&gen, sizeof(gen), 0) != sizeof(gen)) {
+			pr_err("Error: could not pick a generation: %m\n");
+			goto fail;
+		}
+	}
+
+	if (bpf_map__update_elem(skel->maps.dirty_stats, &key, sizeof(key), &gen, sizeof(gen), BPF_ANY) != 0) {
+		pr_err("Error: could not set the tracker's generation: %m\n");
+		goto fail;
+	}
+
+	if (mkdir(DIRTY_PIN_DIR, 0700) != 0 && errno != EEXIST) {
+		pr_err("Error: could not create \"%s\": %m\n", DIRTY_PIN_DIR);
+		goto fail;
+	}
+
+	if (bpf_map__pin(skel->maps.dirty, DIRTY_PIN_MAP) != 0 ||
+		bpf_map__pin(skel->maps.dirty_stats, DIRTY_PIN_STATS) != 0) {
+		pr_err("Error: could not pin the tracker's maps: %m\n");
+		goto fail_unpin;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(links); i++) {
+		if (bpf_link__pin(*links[i].link, pin_path(links[i].name)) != 0) {
+			pr_err("Error: could not pin \"%s\": %m\n", links[i].name);
+			goto fail_unpin;
+		}
+	}
+
+	/* The pins keep the tracker alive. */
+	dirty_track_bpf__destroy(skel);
+
+	printf("Tracker loaded (generation %016llx)\n", (unsigned long long)gen);
+
+	return 0;
+
+fail_unpin:
+	dirty_unload();
+fail:
+	dirty_track_bpf__destroy(skel);
+	return 1;
+}
+
+/**
+ * Print the tracker's generation and counters.
+ *
+ * @returns Returns 0 if the tracker is loaded and 1 if it isn't.
+ */
+static int dirty_status(void)
+{
+	__u64 stats[DIRTY_STAT_COUNT] = { 0 };
+	struct dirty_key key, next;
+	unsigned long long entries = 0;
+	__u32 i;
+	int map;
+	int fd;
+
+	fd = bpf_obj_get(DIRTY_PIN_STATS);
+	map = bpf_obj_get(DIRTY_PIN_MAP);
+	if (fd < 0 || map < 0) {
+		printf("Tracker not loaded\n");
+		return 1;
+	}
+
+	for (i = 0; i < DIRTY_STAT_COUNT; i++)
+		bpf_map_lookup_elem(fd, &i, &stats[i]);
+
+	if (bpf_map_get_next_key(map, NULL, &key) == 0) {
+		entries++;
+		while (bpf_map_get_next_key(map, &key, &next) == 0) {
+			key = next;
+			entries++;
+		}
+	}
+
+	printf("generation: %016llx\n", (unsigned long long)stats[DIRTY_STAT_GEN]);
+	printf("dirty:      %llu\n", entries);
+	printf("marked:     %llu\n", (unsigned long long)stats[DIRTY_STAT_MARKED]);
+	printf("overflows:  %llu\n", (unsigned long long)stats[DIRTY_STAT_OVERFLOW]);
+	printf("drains:     %llu\n", (unsigned long long)stats[DIRTY_STAT_DRAINS]);
+
+	close(fd);
+	close(map);
+
+	return 0;
+}
+
+/**
+ * The entry point to the b2tag-dirtyd utility.
+ *
+ * @param argc  The number of command-line arguments.
+ * @param argv  The command-line arguments.
+ *
+ * @retval 0  Program completed successfully.
+ * @retval !0 An error occurred.
+ */
+int main(int argc, char *argv[])
+{
+	char *program = basename(argv[0]);
+
+	if (argc != 2) {
+		usage(program);
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(argv[1], "load") == 0)
+		return dirty_load();
+	if (strcmp(argv[1], "unload") == 0)
+		return dirty_unload();
+	if (strcmp(argv[1], "status") == 0)
+		return dirty_status();
+
+	usage(program);
+	return strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Event stream.
+ */
+
+#include "events.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "utilities.h"
+
+/** The longest event (a FIFO write of up to PIPE_BUF bytes is atomic). */
+#define EVENT_MAX 4096
+
+/** Publish progress at most this often (in seconds). */
+#define PROGRESS_INTERVAL 10
+
+/** How often to retry opening a FIFO without a reader (in seconds). */
+#define REOPEN_INTERVAL 1
+
+/**
+ * The event stream.
+ *
+ * Events may be published from worker threads (e.g. by the --gate workers),
+ * so the descriptor, timers and counters are protected by the lock.
+ */
+static struct {
+	bool enabled;            /**< Whether events are published. */
+	bool fifo;               /**< Whether the target is a FIFO (else a socket). */
+	int fd;                  /**< The socket or FIFO (-1 if the FIFO isn't open). */
+	struct sockaddr_un addr; /**< The socket's address. */
+	const char *path;        /**< The socket or FIFO's path. */
+	time_t next_open;        /**< When to next try opening the FIFO. */
+	time_t next_progress;    /**< When to next publish progress. */
+	uint64_t files;          /**< The files checked. */
+	uint64_t errors;         /**< The errors published. */
+	uint64_t dropped;        /**< The events dropped. */
+	pthread_mutex_t lock;    /**< Serializes delivery and the counters. */
+} events = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** Returns the current (coarse) monotonic time in seconds. */
+static time_t events_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec;
+}
+
+/** Open the FIFO (at most once every REOPEN_INTERVAL seconds). */
+static void events_open_fifo(void)
+{
+	time_t now = events_clock();
+
+	if (now < events.next_open)
+		return;
+
+	events.next_open = now + REOPEN_INTERVAL;
+
+	/* Fails with ENXIO while there's no reader. */
+	events.fd = open(events.path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+/** Deliver an event (or count it as dropped). The caller holds the lock. */
+static void events_send(const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (events.fifo) {
+		if (events.fd < 0)
+			events_open_fifo();
+		if (events.fd < 0) {
+			events.dropped++;
+			return;
+		}
+
+		ret = write(events.fd, buf, len);
+
+		/* The reader went away: reopen once there's a new one. */
+		if (ret < 0 && errno == EPIPE) {
+			close(events.fd);
+			events.fd = -1;
+		}
+	}
+	else {
+		ret = sendto(events.fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL,
+			(struct sockaddr *)&events.addr, sizeof(events.addr));
+	}
+
+	if (ret != (ssize_t)len)
+		events.dropped++;
+}
+
+/**
+ * Append formatted text to an event.
+ *
+ * @returns Returns the new length (EVENT_MAX if the event is too long).
+ */
+__attribute__((format(printf, 3, 4)))
+static size_t events_append(char *buf, size_t len, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (len >= EVENT_MAX)
+		return EVENT_MAX;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + len, EVENT_MAX - len, fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || (size_t)n >= EVENT_MAX - len)
+		return EVENT_MAX;
+
+	return len + (size_t)n;
+}
+
+/**
+ * Append a JSON string to an event.
+ *
+ * Bytes that aren't ASCII are copied as is (paths needn't be UTF-8).
+ *
+ * @returns Returns the new length (EVENT_MAX if the event is too long).
+ */
+static size_t events_append_str(char *buf, size_t len, const char *name, const char *s)
+{
+	len = events_append(buf, len, ",\"%s\":\"", name);
+
+	for (; *s != '\0' && len < EVENT_MAX; s++) {
+		unsigned char c = (unsigned char)*s;
+
+		if (c == '"' || c == '\\')
+			len = events_append(buf, len, "\\%c", c);
+		else if (c < 0x20)
+			len = events_append(buf, len, "\\u%04x", c);
+		else
+			len = events_append(buf, len, "%c", c);
+	}
+
+	return events_append(buf, len, "\"");
+}
+
+/** Start an event of type @p type. */
+static size_t events_begin(char *buf, const char *type)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return events_append(buf, 0, "{\"event\":\"%s\",\"time\":%lld.%03ld", type,
+		(long long)ts.tv_sec, ts.tv_nsec / 1000000);
+}
+
+/** Finish and deliver an event (dropping it if it was too long). */
+static void events_end(char *buf, size_t len)
+{
+	pthread_mutex_lock(&events.lock);
+
+	len = events_append(buf, len, ",\"dropped\":%llu}\n", (unsigned long long)events.dropped);
+
+	if (len >= EVENT_MAX)
+		events.dropped++;
+	else
+		events_send(buf, len);
+
+	pthread_mutex_unlock(&events.lock);
+}
+
+/** Publish running totals as an event of type @p type. */
+static void events_totals(const char *type, uint64_t files, uint64_t errors)
+{
+	char buf[EVENT_MAX];
+	size_t len;
+
+	len = events_begin(buf, type);
+	len = events_append(buf, len, ",\"files\":%llu,\"errors\":%llu",
+		(unsigned long long)files, (unsigned long long)errors);
+	events_end(buf, len);
+}
+
+int events_open(const char *path)
+{
+	struct stat st;
+	char buf[EVENT_MAX];
+	size_t len;
+
+	if (stat(path, &st) != 0) {
+		pr_err("Error: could not open event stream \"%s\": %m\n", path);
+		return -1;
+	}
+
+	events.path = path;
+
+	if (S_ISFIFO(st.st_mode)) {
+		events.fifo = true;
+		/* Don't die if the reader goes away. */
+		signal(SIGPIPE, SIG_IGN);
+	}
+	else if (S_ISSOCK(st.st_mode)) {
+		if (strlen(path) >= sizeof(events.addr.sun_path)) {
+			pr_err("Error: event socket path \"%s\" is too long\n", path);
+			return -1;
+		}
+
+		events.addr.sun_family = AF_UNIX;
+		strcpy(events.addr.sun_path, path);
+
+		events.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (events.fd < 0) {
+			pr_err("Error: could not create event socket: %m\n");
+			return -1;
+		}
+	}
+	else {
+		pr_err("Error: event stream \"%s\" is not a socket or FIFO\n", path);
+		return -1;
+	}
+
+	events.enabled = true;
+	events.next_progress = events_clock() + PROGRESS_INTERVAL;
+
+	len = events_begin(buf, "start");
+	len = events_append(buf, len, ",\"pid\":%ld", (long)getpid());
+	events_end(buf, len);
+
+	return 0;
+}
+
+void events_close(int status)
+{
+	char buf[EVENT_MAX];
+	uint64_t files, errors;
+	size_t len;
+
+	if (!events.enabled)
+		return;
+
+	pthread_mutex_lock(&events.lock);
+	files = events.files;
+	errors = events.errors;
+	pthread_mutex_unlock(&events.lock);
+
+	len = events_begin(buf, "end");
+	len = events_append(buf, len, ",\"files\":%llu,\"errors\":%llu,\"status\":%d",
+		(unsigned long long)files, (unsigned long long)errors, status);
+	events_end(buf, len);
+
+	pthread_mutex_lock(&events.lock);
+
+	if (events.dropped > 0)
+		pr_warn("Warning: %llu events couldn't be delivered\n", (unsigned long long)events.dropped);
+
+	if (events.fd >= 0)
+		close(events.fd);
+
+	events.fd = -1;
+	events.enabled = false;
+
+	pthread_mutex_unlock(&events.lock);
+}
+
+bool events_enabled(void)
+{
+	return events.enabled;
+}
+
+void events_state(const char *path, const char *state)
+{
+	char buf[EVENT_MAX];
+	size_t len;
+	int saved_errno = errno;
+
+	if (!events.enabled)
+		return;
+
+	len = events_begin(buf, "state");
+	len = events_append_str(buf, len, "path", path);
+	len = events_append_str(buf, len, "state", state);
+	events_end(buf, len);
+
+	errno = saved_errno;
+}
+
+void events_error(const char *path, int error)
+{
+	char buf[EVENT_MAX];
+	size_t len;
+	int saved_errno = errno;
+
+	if (!events.enabled)
+		return;
+
+	pthread_mutex_lock(&events.lock);
+	events.errors++;
+	pthread_mutex_unlock(&events.lock);
+
+	len = events_begin(buf, "error");
+	len = events_append_str(buf, len, "path", path);
+	len = events_append_str(buf, len, "error", error != 0 ? strerror(error) : "unknown");
+	events_end(buf, len);
+
+	errno = saved_errno;
+}
+
+void events_file(void)
+{
+	int saved_errno = errno;
+	uint64_t files, errors;
+	bool progress = false;
+
+	if (!events.enabled)
+		return;
+
+	pthread_mutex_lock(&events.lock);
+
+	events.files++;
+
+	if (events_clock() >= events.next_progress) {
+		events.next_progress = events_clock() + PROGRESS_INTERVAL;
+		progress = true;
+	}
+
+	files = events.files;
+	errors = events.errors;
+
+	pthread_mutex_unlock(&events.lock);
+
+	if (progress)
+		events_totals("progress", files, errors);
+
+	errno = saved_errno;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Event stream declarations.
+ *
+ * With --events, b2tag publishes one JSON object per line (or datagram) for
+ * every file whose state isn't OK, every file or directory that couldn't be
+ * checked, and periodic progress, to a local UNIX datagram socket or FIFO.
+ * All writes are non-blocking: an event that can't be delivered right away
+ * (no listener, a full socket buffer or pipe) is dropped and counted, so a
+ * slow consumer can never stall the scan. Every event carries the number of
+ * events dropped so far.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdbool.h>
+
+/**
+ * Start publishing events to @p path.
+ *
+ * @param path  An existing UNIX datagram socket or FIFO.
+ *
+ * @retval 0  Events will be published.
+ * @retval !0 @p path isn't a socket or FIFO (or the socket couldn't be created).
+ */
+int events_open(const char *path);
+
+/**
+ * Publish the final totals and stop publishing events.
+ *
+ * @param status  The program's exit status.
+ */
+void events_close(int status);
+
+/**
+ * Returns whether events are being published.
+ */
+bool events_enabled(void);
+
+/**
+ * Publish a file's state. This may be called from any thread.
+ *
+ * @param path   The file's path.
+ * @param state  The file's state (e.g. "CORRUPT").
+ */
+void events_state(const char *path, const char *state);
+
+/**
+ * Publish a file or directory that couldn't be checked.
+ *
+ * @param path   The file's path.
+ * @param error  The errno value describing the error (0 if unknown).
+ */
+void events_error(const char *path, int error);
+
+/**
+ * Account a checked file (publishing progress every few seconds).
+ */
+void events_file(void);
+
+#endif /* EVENTS_H */
@@ -0,0 +1,2189 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+
+/** @file
+ * Offline ext4 image reader.
+ *
+ * All of the in-use inodes are kept in an array sorted by inode number (the
+ * order the inode tables are read in), with their in-inode extended
+ * attributes copied to a separate pool. Directory entries are kept in one
+ * array, chained per directory (for readdir()) and in a hash table keyed by
+ * the directory and name (for path lookups). File data, external attribute
+ * blocks, and extent tree nodes are read from the image on demand.
+ */
+
+#include "ext4.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "b2tag.h"
+#include "budget.h"
+#include "cost.h"
+#include "coverage.h"
+#include "file.h"
+#include "policy.h"
+#include "utilities.h"
+
+/** The offset of the superblock in the image. */
+#define SUPER_OFFSET 1024
+
+/** The size of the superblock. */
+#define SUPER_SIZE 1024
+
+/** The superblock magic number. */
+#define SUPER_MAGIC 0xEF53
+
+/** The root directory's inode number. */
+#define ROOT_INO 2
+
+/** The size of an inode without the extra fields. */
+#define GOOD_OLD_INODE_SIZE 128
+
+/** The magic number of in-inode and external attribute blocks. */
+#define XATTR_MAGIC 0xEA020000
+
+/** The size of an external attribute block's header. */
+#define XATTR_HEADER_SIZE 32
+
+/** The magic number of an extent tree node. */
+#define EXTENT_MAGIC 0xF30A
+
+/** The deepest extent tree the kernel creates. */
+#define EXTENT_MAX_DEPTH 5
+
+/** Extents longer than this are uninitialized (read as zeros). */
+#define EXTENT_INIT_MAX_LEN 32768
+
+/** The most symbolic links followed while looking up a path. */
+#define MAX_SYMLINKS 40
+
+/** How much of an inode table is read at once. */
+#define ITABLE_CHUNK (1 << 20)
+
+/** File descriptors handed out by the ext4 backend start here. */
+#define FD_BASE 0x200000
+
+/** @name Superblock feature flags. */
+/** @{ */
+#define INCOMPAT_COMPRESSION 0x00001
+#define INCOMPAT_FILETYPE    0x00002
+#define INCOMPAT_RECOVER     0x00004
+#define INCOMPAT_JOURNAL_DEV 0x00008
+#define INCOMPAT_META_BG     0x00010
+#define INCOMPAT_64BIT       0x00080
+#define INCOMPAT_DIRDATA     0x01000
+#define RO_COMPAT_SPARSE_SUPER   0x0001
+#define RO_COMPAT_HUGE_FILE      0x0008
+#define RO_COMPAT_GDT_CSUM       0x0010
+#define RO_COMPAT_METADATA_CSUM  0x0400
+/** @} */
+
+/** The incompatible features that change how files have to be read. */
+#define INCOMPAT_UNSUPPORTED (INCOMPAT_COMPRESSION | INCOMPAT_JOURNAL_DEV | INCOMPAT_DIRDATA)
+
+/** Group descriptor flag: the group's inode table isn't initialized. */
+#define BG_INODE_UNINIT 0x0001
+
+/** @name Inode flags. */
+/** @{ */
+#define INODE_ENCRYPT_FL     0x00000800
+#define INODE_HUGE_FILE_FL   0x00040000
+#define INODE_EXTENTS_FL     0x00080000
+#define INODE_EA_INODE_FL    0x00200000
+#define INODE_INLINE_DATA_FL 0x10000000
+/** @} */
+
+/** An in-use inode. */
+struct ext4_inode {
+	uint32_t ino;            /**< The inode number. */
+	uint16_t mode;           /**< The file type and permissions. */
+	uint16_t links;          /**< The number of hard links. */
+	uint32_t flags;          /**< The inode flags. */
+	uint32_t uid;            /**< The owner. */
+	uint32_t gid;            /**< The group. */
+	uint64_t size;           /**< The file size. */
+	uint64_t blocks;         /**< The number of 512-byte blocks allocated. */
+	uint64_t file_acl;       /**< The external attribute block (0 if none). */
+	struct timespec atime;   /**< The access time. */
+	struct timespec mtime;   /**< The modification time. */
+	struct timespec ctime;   /**< The inode change time. */
+	unsigned char block[60]; /**< i_block (extent tree root, block map, or inline data). */
+	size_t xattr;            /**< The offset of the in-inode attributes in ext4.ibody. */
+	uint32_t xattr_len;      /**< The length of the in-inode attributes (0 if none). */
+	uint32_t parent;         /**< Directories: the parent's inode number. */
+	uint32_t children;       /**< Directories: the first entry's index + 1 (0 if empty). */
+	bool visited;            /**< Directories: whether ext4_process() has collected it. */
+};
+
+/** A directory entry. */
+struct ext4_dirent {
+	uint32_t dir;       /**< The directory's inode number. */
+	uint32_t ino;       /**< The entry's inode number. */
+	size_t name;        /**< The offset of the name in ext4.names. */
+	uint8_t name_len;   /**< The length of the name. */
+	uint32_t next;      /**< The index + 1 of the directory's next entry (0 at the end). */
+	uint32_t hash_next; /**< The index + 1 of the next entry in the hash chain. */
+};
+
+/** A run of file blocks (mapped from the extent tree or block map). */
+struct ext4_extent {
+	uint64_t logical;  /**< The first logical block. */
+	uint64_t len;      /**< The number of blocks. */
+	uint64_t physical; /**< The first physical block (0 for zeros). */
+};
+
+/** The block mapping of an open file. */
+struct ext4_map {
+	struct ext4_extent *extents; /**< The runs of blocks, in logical order. */
+	size_t count;                /**< The number of runs. */
+	size_t allocated;            /**< The number of runs allocated. */
+	unsigned char *inline_data;  /**< The file's data, if it's stored in the inode. */
+	size_t cursor;               /**< The run the last read ended in. */
+};
+
+/** An open file or directory. */
+struct ext4_fd {
+	const struct ext4_inode *inode; /**< The inode. */
+	uint64_t offset;     /**< The current read offset. */
+	bool mapped;         /**< Whether ext4_fd::map has been set up. */
+	struct ext4_map map; /**< The block mapping (set up by the first read). */
+};
+
+/** An open directory stream. */
+struct io_dir {
+	int fd;              /**< The directory's fd. */
+	unsigned pos;        /**< The number of entries returned. */
+	uint32_t next;       /**< The index + 1 of the next entry to return. */
+	struct dirent entry; /**< The entry returned by readdir(). */
+};
+
+/** The loaded image. */
+static struct {
+	int fd;                  /**< The image (-1 if no image is loaded). */
+	dev_t dev;               /**< The image's device (reported as st_dev). */
+	unsigned block_size;     /**< The filesystem block size. */
+	unsigned inode_size;     /**< The size of each on-disk inode. */
+	uint32_t inodes_per_group; /**< The number of inodes in each group. */
+	uint32_t blocks_per_group; /**< The number of blocks in each group. */
+	uint32_t first_data_block; /**< The block group 0 starts at. */
+	uint32_t first_meta_bg;  /**< The first meta_bg group of descriptors. */
+	uint32_t groups;         /**< The number of block groups. */
+	unsigned desc_size;      /**< The size of each group descriptor. */
+	uint32_t incompat;       /**< The incompatible feature flags. */
+	uint32_t ro_compat;      /**< The read-only compatible feature flags. */
+	struct ext4_inode *inodes;  /**< The in-use inodes, by inode number. */
+	size_t ninodes;          /**< The number of in-use inodes. */
+	size_t inodes_allocated; /**< The number of inodes allocated. */
+	unsigned char *ibody;    /**< The in-inode extended attributes. */
+	size_t ibody_len;        /**< The length of ext4.ibody. */
+	size_t ibody_allocated;  /**< The size of ext4.ibody. */
+	struct ext4_dirent *dirents; /**< The directory entries. */
+	size_t ndirents;         /**< The number of directory entries. */
+	size_t dirents_allocated; /**< The number of directory entries allocated. */
+	char *names;             /**< The directory entries' names. */
+	size_t names_len;        /**< The length of ext4.names. */
+	size_t names_allocated;  /**< The size of ext4.names. */
+	uint32_t *buckets;       /**< The directory entry hash table (index + 1). */
+	size_t nbuckets;         /**< The number of hash buckets (a power of two). */
+	struct ext4_fd **fds;    /**< The file descriptor table. */
+	size_t nfds;             /**< The number of file descriptor slots. */
+	pthread_mutex_t lock;    /**< Protects the file descriptor table. */
+} ext4 = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** Returns the little-endian 16-bit number at @p p. */
+static inline uint16_t get16(const unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+/** Returns the little-endian 32-bit number at @p p. */
+static inline uint32_t get32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+/**
+ * Read from the image (retrying short reads).
+ *
+ * @param buf     Where to store the data.
+ * @param count   The number of bytes to read.
+ * @param offset  The offset in the image.
+ *
+ * @retval 0  The data was read.
+ * @retval -1 An error occurred (errno is set; EIO if the image is truncated).
+ */
+static int image_read(void *buf, size_t count, uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		ssize_t len = pread(ext4.fd, (char *)buf + done, count - done, (off_t)(offset + done));
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return -1;
+		if (len == 0) {
+			errno = EIO;
+			return -1;
+		}
+
+		done += (size_t)len;
+	}
+
+	return 0;
+}
+
+/**
+ * Read a filesystem block into a (newly allocated) buffer.
+ *
+ * @returns Returns the block or NULL (with errno set) on failure.
+ */
+static unsigned char *read_block(uint64_t block)
+{
+	unsigned char *buf = malloc(ext4.block_size);
+
+	if (buf == NULL)
+		return NULL;
+
+	if (image_read(buf, ext4.block_size, block * ext4.block_size) != 0) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/**
+ * Look up an inode by number.
+ *
+ * @returns Returns the inode or NULL if it isn't in use.
+ */
+static struct ext4_inode *find_inode(uint32_t ino)
+{
+	size_t lo = 0;
+	size_t hi = ext4.ninodes;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ext4.inodes[mid].ino == ino)
+			return &ext4.inodes[mid];
+		if (ext4.inodes[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/*
+ * Block mapping.
+ */
+
+/**
+ * Append a run of blocks to a mapping (merging it with the last one if they're
+ * contiguous).
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int map_append(struct ext4_map *map, uint64_t logical, uint64_t len, uint64_t physical)
+{
+	struct ext4_extent *last = map->count > 0 ? &map->extents[map->count - 1] : NULL;
+
+	if (last != NULL && last->logical + last->len == logical &&
+		(last->physical == 0) == (physical == 0) &&
+		(physical == 0 || last->physical + last->len == physical)) {
+		last->len += len;
+		return 0;
+	}
+
+	if (map->count == map->allocated) {
+		size_t count = map->allocated ? map->allocated * 2 : 8;
+		void *tmp = realloc(map->extents, count * sizeof(map->extents[0]));
+
+		if (tmp == NULL)
+			return -1;
+
+		map->extents = tmp;
+		map->allocated = count;
+	}
+
+	map->extents[map->count++] = (struct ext4_extent){
+		.logical = logical,
+		.len = len,
+		.physical = physical,
+	};
+
+	return 0;
+}
+
+/**
+ * Map the extents of an extent tree node (and its children).
+ *
+ * @param node   The node.
+ * @param size   The size of the node.
+ * @param depth  The node's expected depth (-1 for the root, which says).
+ * @param map    The mapping to append to.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int map_extent_node(const unsigned char *node, size_t size, int depth,
+	struct ext4_map *map)
+{
+	unsigned entries = get16(node + 2);
+	unsigned i;
+
+	if (get16(node) != EXTENT_MAGIC || 12 + (size_t)entries * 12 > size ||
+		(depth >= 0 && get16(node + 6) != depth) || get16(node + 6) > EXTENT_MAX_DEPTH) {
+		errno = EUCLEAN;
+		return -1;
+	}
+
+	depth = get16(node + 6);
+
+	for (i = 0; i < entries; i++) {
+		const unsigned char *e = node + 12 + i * 12;
+
+		if (depth == 0) {
+			uint64_t len = get16(e + 4);
+			uint64_t physical = (uint64_t)get16(e + 6) << 32 | get32(e + 8);
+
+			/* Uninitialized (preallocated) extents read as zeros. */
+			if (len > EXTENT_INIT_MAX_LEN) {
+				len -= EXTENT_INIT_MAX_LEN;
+				physical = 0;
+			}
+
+			if (map_append(map, get32(e), len, physical) != 0)
+				return -1;
+		}
+		else {
+			uint64_t leaf = (uint64_t)get16(e + 8) << 32 | get32(e + 4);
+			unsigned char *child = read_block(leaf);
+			int err;
+
+			if (child == NULL)
+				return -1;
+
+			err = map_extent_node(child, ext4.block_size, depth - 1, map);
+			free(child);
+
+			if (err != 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Map the blocks of an indirect block (ext2/ext3 style block maps).
+ *
+ * @param block    The indirect block.
+ * @param level    The level of indirection (1 to 3).
+ * @param logical  The first logical block it maps (advanced past its blocks).
+ * @param total    The number of blocks in the file.
+ * @param map      The mapping to append to.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int map_indirect(uint32_t block, unsigned level, uint64_t *logical, uint64_t total,
+	struct ext4_map *map)
+{
+	uint64_t per_block = ext4.block_size / 4;
+	uint64_t span = 1;
+	unsigned char *buf;
+	uint64_t i;
+	unsigned l;
+
+	for (l = 1; l < level; l++)
+		span *= per_block;
+
+	/* A hole covering everything this block would map. */
+	if (block == 0) {
+		*logical += span * per_block;
+		return 0;
+	}
+
+	buf = read_block(block);
+	if (buf == NULL)
+		return -1;
+
+	for (i = 0; i < per_block && *logical < total; i++) {
+		uint32_t ptr = get32(buf + i * 4);
+		int err = 0;
+
+		if (level > 1) {
+			err = map_indirect(ptr, level - 1, logical, total, map);
+		}
+		else {
+			if (ptr != 0)
+				err = map_append(map, *logical, 1, ptr);
+			(*logical)++;
+		}
+
+		if (err != 0) {
+			free(buf);
+			return -1;
+		}
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+/**
+ * Get the value of an extended attribute.
+ *
+ * @param inode  The inode.
+ * @param name   The attribute's full name (e.g. "user.shatag.ts").
+ * @param value  Where to store the value (may be NULL to get its size).
+ * @param size   The size of @p value.
+ *
+ * @returns Returns the size of the value or -1 (with errno set) on failure.
+ */
+static ssize_t xattr_get(const struct ext4_inode *inode, const char *name, void *value,
+	size_t size);
+
+/**
+ * Set up the block mapping of an inode.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int map_inode(const struct ext4_inode *inode, struct ext4_map *map)
+{
+	uint64_t total = (inode->size + ext4.block_size - 1) / ext4.block_size;
+	uint64_t logical = 0;
+	unsigned i;
+
+	memset(map, 0, sizeof(*map));
+
+	if (inode->flags & INODE_ENCRYPT_FL) {
+		errno = ENOKEY;
+		return -1;
+	}
+
+	/* Inline data: the first 60 bytes are in i_block, the rest in system.data. */
+	if (inode->flags & INODE_INLINE_DATA_FL) {
+		size_t inline_size = inode->size < sizeof(inode->block) ? inode->size : sizeof(inode->block);
+
+		if (inode->size > sizeof(inode->block) + ext4.inode_size) {
+			errno = EUCLEAN;
+			return -1;
+		}
+
+		map->inline_data = malloc(inode->size + 1);
+		if (map->inline_data == NULL)
+			return -1;
+
+		memcpy(map->inline_data, inode->block, inline_size);
+
+		if (inode->size > inline_size &&
+			xattr_get(inode, "system.data", map->inline_data + inline_size,
+				inode->size - inline_size) != (ssize_t)(inode->size - inline_size)) {
+			free(map->inline_data);
+			map->inline_data = NULL;
+			errno = EUCLEAN;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/* Fast symbolic links keep their target in i_block. */
+	if (S_ISLNK(inode->mode) && inode->size < sizeof(inode->block)) {
+		map->inline_data = malloc(sizeof(inode->block));
+		if (map->inline_data == NULL)
+			return -1;
+
+		memcpy(map->inline_data, inode->block, sizeof(inode->block));
+		return 0;
+	}
+
+	if (inode->flags & INODE_EXTENTS_FL) {
+		if (map_extent_node(inode->block, sizeof(inode->block), -1, map) != 0)
+			goto fail;
+		return 0;
+	}
+
+	/* A block map: 12 direct blocks, then single, double, and triple indirect. */
+	for (i = 0; i < 15 && logical < total; i++) {
+		uint32_t ptr = get32(inode->block + i * 4);
+		int err = 0;
+
+		if (i < 12) {
+			if (ptr != 0)
+				err = map_append(map, logical, 1, ptr);
+			logical++;
+		}
+		else {
+			err = map_indirect(ptr, i - 11, &logical, total, map);
+		}
+
+		if (err != 0)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	free(map->extents);
+	memset(map, 0, sizeof(*map));
+	return -1;
+}
+
+/** Free a block mapping. */
+static void unmap_inode(struct ext4_map *map)
+{
+	free(map->extents);
+	free(map->inline_data);
+	memset(map, 0, sizeof(*map));
+}
+
+/**
+ * Read an inode's data.
+ *
+ * Holes and uninitialized extents read as zeros.
+ *
+ * @param inode   The inode.
+ * @param map     The inode's block mapping.
+ * @param buf     Where to store the data.
+ * @param count   The number of bytes to read.
+ * @param offset  The offset in the file.
+ *
+ * @returns Returns the number of bytes read (0 at the end of the file) or -1
+ *          (with errno set) on failure.
+ */
+static ssize_t map_read(const struct ext4_inode *inode, struct ext4_map *map, void *buf,
+	size_t count, uint64_t offset)
+{
+	size_t done = 0;
+
+	if (offset >= inode->size)
+		return 0;
+	if (count > inode->size - offset)
+		count = (size_t)(inode->size - offset);
+	if (count > SSIZE_MAX)
+		count = SSIZE_MAX;
+
+	if (map->inline_data != NULL) {
+		memcpy(buf, map->inline_data + offset, count);
+		return (ssize_t)count;
+	}
+
+	while (done < count) {
+		uint64_t pos = offset + done;
+		uint64_t block = pos / ext4.block_size;
+		const struct ext4_extent *e = NULL;
+		uint64_t run_end;
+		size_t len;
+
+		/* Reads are mostly sequential: start looking where the last one ended. */
+		if (map->cursor >= map->count || map->extents[map->cursor].logical > block)
+			map->cursor = 0;
+
+		while (map->cursor < map->count &&
+			map->extents[map->cursor].logical + map->extents[map->cursor].len <= block)
+			map->cursor++;
+
+		if (map->cursor < map->count && map->extents[map->cursor].logical <= block)
+			e = &map->extents[map->cursor];
+
+		/* The bytes up to the end of the run (or of the hole). */
+		if (e != NULL)
+			run_end = (e->logical + e->len) * ext4.block_size;
+		else if (map->cursor < map->count)
+			run_end = map->extents[map->cursor].logical * ext4.block_size;
+		else
+			run_end = inode->size;
+
+		len = count - done;
+		if (run_end - pos < len)
+			len = (size_t)(run_end - pos);
+
+		if (e == NULL || e->physical == 0) {
+			memset((char *)buf + done, 0, len);
+		}
+		else if (image_read((char *)buf + done, len,
+				(e->physical + block - e->logical) * ext4.block_size +
+				pos % ext4.block_size) != 0) {
+			return -1;
+		}
+
+		done += len;
+	}
+
+	return (ssize_t)count;
+}
+
+/**
+ * Returns the physical block an inode's data starts at (0 if it has none or
+ * it's stored in the inode). Used to order files by their place on the image.
+ */
+static uint64_t inode_start(const struct ext4_inode *inode)
+{
+	const unsigned char *node = inode->block;
+	unsigned char *buf = NULL;
+	uint64_t start = 0;
+	unsigned depth;
+
+	if (inode->flags & INODE_INLINE_DATA_FL)
+		return 0;
+
+	if (!(inode->flags & INODE_EXTENTS_FL))
+		return get32(inode->block);
+
+	/* Follow the first index entry of each level down to the first leaf. */
+	for (depth = 0; depth <= EXTENT_MAX_DEPTH; depth++) {
+		const unsigned char *e = node + 12;
+		size_t size = node == inode->block ? sizeof(inode->block) : ext4.block_size;
+
+		if (get16(node) != EXTENT_MAGIC || get16(node + 2) == 0 || 24 > size)
+			break;
+
+		if (get16(node + 6) == 0) {
+			start = (uint64_t)get16(e + 6) << 32 | get32(e + 8);
+			break;
+		}
+
+		free(buf);
+		buf = read_block((uint64_t)get16(e + 8) << 32 | get32(e + 4));
+		if (buf == NULL)
+			break;
+		node = buf;
+	}
+
+	free(buf);
+
+	return start;
+}
+
+/*
+ * Extended attributes.
+ */
+
+/** The prefixes of the attribute name indexes. */
+static const char *const xattr_prefixes[] = {
+	[1] = "user.",
+	[2] = "system.posix_acl_access",
+	[3] = "system.posix_acl_default",
+	[4] = "trusted.",
+	[6] = "security.",
+	[7] = "system.",
+	[8] = "system.richacl",
+};
+
+/**
+ * Called by xattr_each() for every attribute.
+ *
+ * @param name   The attribute's full name.
+ * @param value  The value (NULL if it's stored in a separate inode).
+ * @param size   The size of the value.
+ * @param inum   The inode the value is stored in (0 if @p value is set).
+ * @param arg    The argument passed to xattr_each().
+ *
+ * @returns Returns 0 to continue and anything else to stop (and return it).
+ */
+typedef ssize_t (*xattr_fn)(const char *name, const unsigned char *value, size_t size,
+	uint32_t inum, void *arg);
+
+/**
+ * Call @p fn for every attribute in a list of attribute entries.
+ *
+ * @param entries  The first entry.
+ * @param end      The end of the entries (and values).
+ * @param base     The address value offsets are relative to.
+ * @param fn       The function to call.
+ * @param arg      The argument to pass to @p fn.
+ *
+ * @returns Returns 0 if @p fn never stopped, the value it stopped with, or
+ *          -1 (with errno set to EUCLEAN) if the entries are corrupt.
+ */
+static ssize_t xattr_entries(const unsigned char *entries, const unsigned char *end,
+	const unsigned char *base, xattr_fn fn, void *arg)
+{
+	const unsigned char *e = entries;
+	char name[256 + 32];
+
+	while (e + 4 <= end && get32(e) != 0) {
+		unsigned name_len;
+		unsigned index;
+		size_t value_offs;
+		uint32_t inum;
+		size_t value_size;
+		const unsigned char *value = NULL;
+		const char *prefix = "";
+		ssize_t ret;
+
+		/* Don't decode the entry header before it's known to fit. */
+		if (e + 16 > end || e + 16 + e[0] > end)
+			goto corrupt;
+
+		name_len = e[0];
+		index = e[1];
+		value_offs = get16(e + 2);
+		inum = get32(e + 4);
+		value_size = get32(e + 8);
+
+		if (index < sizeof(xattr_prefixes) / sizeof(xattr_prefixes[0]) &&
+			xattr_prefixes[index] != NULL)
+			prefix = xattr_prefixes[index];
+		else if (index != 0)
+			prefix = "unknown.";
+
+		snprintf(name, sizeof(name), "%s%.*s", prefix, (int)name_len, (const char *)e + 16);
+
+		if (inum == 0) {
+			if (base + value_offs + value_size > end)
+				goto corrupt;
+			value = base + value_offs;
+		}
+
+		ret = fn(name, value, value_size, inum, arg);
+		if (ret != 0)
+			return ret;
+
+		e += (16 + name_len + 3) & ~3U;
+	}
+
+	return 0;
+
+corrupt:
+	errno = EUCLEAN;
+	return -1;
+}
+
+/**
+ * Call @p fn for every extended attribute of an inode (the in-inode ones,
+ * then the ones in the external block).
+ *
+ * @returns Returns 0 if @p fn never stopped, the value it stopped with, or -1
+ *          (with errno set) on failure.
+ */
+static ssize_t xattr_each(const struct ext4_inode *inode, xattr_fn fn, void *arg)
+{
+	unsigned char *block;
+	ssize_t ret = 0;
+
+	if (inode->xattr_len > 0) {
+		const unsigned char *p = ext4.ibody + inode->xattr;
+
+		ret = xattr_entries(p, p + inode->xattr_len, p, fn, arg);
+		if (ret != 0)
+			return ret;
+	}
+
+	if (inode->file_acl == 0)
+		return 0;
+
+	block = read_block(inode->file_acl);
+	if (block == NULL)
+		return -1;
+
+	if (get32(block) != XATTR_MAGIC || get32(block + 8) != 1) {
+		errno = EUCLEAN;
+		ret = -1;
+	}
+	else {
+		ret = xattr_entries(block + XATTR_HEADER_SIZE, block + ext4.block_size, block, fn, arg);
+	}
+
+	free(block);
+
+	return ret;
+}
+
+/** The arguments of xattr_get_fn(). */
+struct xattr_get_arg {
+	const char *name; /**< The attribute being looked for. */
+	void *value;      /**< Where to store its value. */
+	size_t size;      /**< The size of xattr_get_arg::value. */
+	uint32_t owner;   /**< The inode whose attributes are being read. */
+};
+
+/**
+ * Read the value stored in (extended attribute) inode @p inum.
+ *
+ * Only real value inodes are read: a corrupt entry pointing back at its owner
+ * (or at any inline-data inode) would otherwise recurse through map_inode().
+ */
+static ssize_t xattr_inode_value(uint32_t inum, uint32_t owner, void *value, size_t size)
+{
+	const struct ext4_inode *inode = find_inode(inum);
+	struct ext4_map map;
+	ssize_t ret;
+
+	if (inode == NULL || inum == owner || !(inode->flags & INODE_EA_INODE_FL) ||
+		(inode->flags & INODE_INLINE_DATA_FL)) {
+		errno = EUCLEAN;
+		return -1;
+	}
+
+	if (map_inode(inode, &map) != 0)
+		return -1;
+
+	ret = map_read(inode, &map, value, size, 0);
+	unmap_inode(&map);
+
+	if (ret >= 0 && (size_t)ret != size) {
+		errno = EUCLEAN;
+		return -1;
+	}
+
+	return ret;
+}
+
+/** Copies the value of xattr_get_arg::name (see xattr_fn). */
+static ssize_t xattr_get_fn(const char *name, const unsigned char *value, size_t size,
+	uint32_t inum, void *arg)
+{
+	struct xattr_get_arg *get = arg;
+
+	if (strcmp(name, get->name) != 0)
+		return 0;
+
+	/* The size is returned as size + 1 so that an empty value still stops. */
+	if (get->value == NULL || get->size == 0)
+		return (ssize_t)size + 1;
+
+	if (size > get->size) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	if (inum != 0)
+		return xattr_inode_value(inum, get->owner, get->value, size) < 0 ? -1 : (ssize_t)size + 1;
+
+	memcpy(get->value, value, size);
+
+	return (ssize_t)size + 1;
+}
+
+static ssize_t xattr_get(const struct ext4_inode *inode, const char *name, void *value,
+	size_t size)
+{
+	struct xattr_get_arg get = { .name = name, .value = value, .size = size, .owner = inode->ino };
+	ssize_t ret;
+
+	ret = xattr_each(inode, xattr_get_fn, &get);
+	if (ret == 0) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	return ret < 0 ? -1 : ret - 1;
+}
+
+/** The arguments of xattr_list_fn(). */
+struct xattr_list_arg {
+	char *list;  /**< Where to store the names. */
+	size_t size; /**< The size of xattr_list_arg::list (0 to only count). */
+	size_t len;  /**< The length of the names so far. */
+};
+
+/** Appends an attribute's name to the list (see xattr_fn). */
+static ssize_t xattr_list_fn(const char *name, const unsigned char *value __attribute__((unused)),
+	size_t size __attribute__((unused)), uint32_t inum __attribute__((unused)), void *arg)
+{
+	struct xattr_list_arg *list = arg;
+	size_t n = strlen(name) + 1;
+
+	if (list->size != 0) {
+		if (list->len + n > list->size) {
+			errno = ERANGE;
+			return -1;
+		}
+		memcpy(list->list + list->len, name, n);
+	}
+
+	list->len += n;
+
+	return 0;
+}
+
+/*
+ * Loading the image.
+ */
+
+/**
+ * Grow a budgeted array to hold at least @p needed elements.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int grow(void **array, size_t *allocated, size_t needed, size_t elem_size)
+{
+	size_t count = *allocated ? *allocated : 64;
+	void *tmp;
+
+	if (needed <= *allocated)
+		return 0;
+
+	while (count < needed)
+		count *= 2;
+
+	tmp = budget_realloc(*array, *allocated * elem_size, count * elem_size);
+	if (tmp == NULL)
+		return -1;
+
+	*array = tmp;
+	*allocated = count;
+
+	return 0;
+}
+
+/** Returns whether block group @p group has a copy of the superblock. */
+static bool group_has_super(uint32_t group)
+{
+	uint32_t n;
+
+	if (group <= 1 || !(ext4.ro_compat & RO_COMPAT_SPARSE_SUPER))
+		return true;
+
+	/* With sparse_super, only powers of 3, 5, and 7 do. */
+	for (n = 3; n <= group; n *= 3) {
+		if (n == group)
+			return true;
+	}
+	for (n = 5; n <= group; n *= 5) {
+		if (n == group)
+			return true;
+	}
+	for (n = 7; n <= group; n *= 7) {
+		if (n == group)
+			return true;
+	}
+
+	return false;
+}
+
+/** Returns the image offset of block group @p group's descriptor. */
+static uint64_t group_desc_offset(uint32_t group)
+{
+	uint32_t per_block = ext4.block_size / ext4.desc_size;
+	uint64_t first = ext4.first_data_block + 1;
+
+	/* With meta_bg, each group of descriptors is in the first block group
+	 * it describes (after the superblock copy, if there is one).
+	 */
+	if ((ext4.incompat & INCOMPAT_META_BG) && group / per_block >= ext4.first_meta_bg) {
+		uint32_t meta = group - group % per_block;
+
+		first = ext4.first_data_block + (uint64_t)meta * ext4.blocks_per_group +
+			(group_has_super(meta) ? 1 : 0);
+
+		return first * ext4.block_size + (uint64_t)(group % per_block) * ext4.desc_size;
+	}
+
+	return first * ext4.block_size + (uint64_t)group * ext4.desc_size;
+}
+
+/**
+ * Decode an inode timestamp (and its nanoseconds and epoch bits, if the inode
+ * has room for them).
+ */
+static struct timespec inode_time(const unsigned char *raw, size_t extra_end, size_t offset,
+	size_t extra_offset)
+{
+	struct timespec ts = { .tv_sec = (int32_t)get32(raw + offset) };
+
+	if (extra_offset + 4 <= extra_end) {
+		uint32_t extra = get32(raw + extra_offset);
+
+		ts.tv_sec += (time_t)(extra & 3) << 32;
+		ts.tv_nsec = extra >> 2;
+	}
+
+	return ts;
+}
+
+/**
+ * Add an on-disk inode to the in-use inodes (if it is in use).
+ *
+ * @param raw  The on-disk inode.
+ * @param ino  Its inode number.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int load_inode(const unsigned char *raw, uint32_t ino)
+{
+	struct ext4_inode *inode;
+	size_t extra_end = GOOD_OLD_INODE_SIZE;
+
+	/* Free (or deleted) inodes have no mode or links. */
+	if (get16(raw) == 0 || get16(raw + 0x1A) == 0)
+		return 0;
+
+	if (grow((void **)&ext4.inodes, &ext4.inodes_allocated, ext4.ninodes + 1,
+			sizeof(ext4.inodes[0])) != 0)
+		return -1;
+
+	inode = &ext4.inodes[ext4.ninodes++];
+	memset(inode, 0, sizeof(*inode));
+
+	inode->ino        = ino;
+	inode->mode       = get16(raw);
+	inode->uid        = get16(raw + 0x02) | (uint32_t)get16(raw + 0x78) << 16;
+	inode->size       = get32(raw + 0x04) | (uint64_t)get32(raw + 0x6C) << 32;
+	inode->gid        = get16(raw + 0x18) | (uint32_t)get16(raw + 0x7A) << 16;
+	inode->links      = get16(raw + 0x1A);
+	inode->blocks     = get32(raw + 0x1C) | (uint64_t)get16(raw + 0x74) << 32;
+	inode->flags      = get32(raw + 0x20);
+	inode->file_acl   = get32(raw + 0x68) | (uint64_t)get16(raw + 0x76) << 32;
+	memcpy(inode->block, raw + 0x28, sizeof(inode->block));
+
+	if ((ext4.ro_compat & RO_COMPAT_HUGE_FILE) && (inode->flags & INODE_HUGE_FILE_FL))
+		inode->blocks *= ext4.block_size / 512;
+
+	if (ext4.inode_size > GOOD_OLD_INODE_SIZE) {
+		size_t extra = get16(raw + 0x80);
+
+		if (GOOD_OLD_INODE_SIZE + extra <= ext4.inode_size && extra % 4 == 0)
+			extra_end = GOOD_OLD_INODE_SIZE + extra;
+	}
+
+	inode->ctime = inode_time(raw, extra_end, 0x0C, 0x84);
+	inode->mtime = inode_time(raw, extra_end, 0x10, 0x88);
+	inode->atime = inode_time(raw, extra_end, 0x08, 0x8C);
+
+	/* In-inode extended attributes follow the extra fields. */
+	if (extra_end > GOOD_OLD_INODE_SIZE && extra_end + 4 < ext4.inode_size &&
+		get32(raw + extra_end) == XATTR_MAGIC) {
+		size_t len = ext4.inode_size - extra_end - 4;
+
+		if (grow((void **)&ext4.ibody, &ext4.ibody_allocated, ext4.ibody_len + len, 1) != 0)
+			return -1;
+
+		memcpy(ext4.ibody + ext4.ibody_len, raw + extra_end + 4, len);
+		inode->xattr = ext4.ibody_len;
+		inode->xattr_len = (uint32_t)len;
+		ext4.ibody_len += len;
+	}
+
+	return 0;
+}
+
+/**
+ * Read every block group's inode table (skipping the uninitialized parts).
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int load_inodes(void)
+{
+	bool csum = ext4.ro_compat & (RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM);
+	size_t chunk = ITABLE_CHUNK - ITABLE_CHUNK % ext4.inode_size;
+	unsigned char desc[64];
+	unsigned char *buf;
+	uint32_t group;
+	int ret = 0;
+
+	buf = budget_malloc(chunk);
+	if (buf == NULL)
+		return -1;
+
+	for (group = 0; group < ext4.groups && ret == 0; group++) {
+		uint64_t table;
+		uint32_t count = ext4.inodes_per_group;
+		uint32_t done = 0;
+
+		if (image_read(desc, ext4.desc_size, group_desc_offset(group)) != 0) {
+			ret = -1;
+			break;
+		}
+
+		table = get32(desc + 0x08);
+		if (ext4.desc_size >= 64)
+			table |= (uint64_t)get32(desc + 0x28) << 32;
+
+		/* With group checksums, the unused tail of the table isn't initialized. */
+		if (csum) {
+			uint32_t unused = get16(desc + 0x1C);
+
+			if (ext4.desc_size >= 64)
+				unused |= (uint32_t)get16(desc + 0x32) << 16;
+
+			if (get16(desc + 0x12) & BG_INODE_UNINIT)
+				continue;
+
+			count = unused < count ? count - unused : 0;
+		}
+
+		while (done < count && ret == 0) {
+			uint32_t n = (uint32_t)(chunk / ext4.inode_size);
+			uint32_t i;
+
+			if (n > count - done)
+				n = count - done;
+
+			if (image_read(buf, (size_t)n * ext4.inode_size,
+					table * ext4.block_size + (uint64_t)done * ext4.inode_size) != 0) {
+				ret = -1;
+				break;
+			}
+
+			for (i = 0; i < n && ret == 0; i++)
+				ret = load_inode(buf + (size_t)i * ext4.inode_size,
+					group * ext4.inodes_per_group + done + i + 1);
+
+			done += n;
+		}
+	}
+
+	budget_free(buf, chunk);
+
+	return ret;
+}
+
+/** Returns the hash bucket of the entry @p name in directory @p dir. */
+static size_t dirent_bucket(uint32_t dir, const char *name, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ dir;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return (size_t)(h ^ (h >> 32)) & (ext4.nbuckets - 1);
+}
+
+/**
+ * Add a directory entry.
+ *
+ * @param dir   The directory's inode.
+ * @param tail  The directory's last entry (index + 1, updated).
+ * @param ino   The entry's inode number.
+ * @param name  The entry's name.
+ * @param len   The length of the name.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int add_dirent(struct ext4_inode *dir, uint32_t *tail, uint32_t ino, const char *name,
+	size_t len)
+{
+	struct ext4_dirent *d;
+
+	if (ext4.ndirents >= UINT32_MAX - 1) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	if (grow((void **)&ext4.dirents, &ext4.dirents_allocated, ext4.ndirents + 1,
+			sizeof(ext4.dirents[0])) != 0 ||
+		grow((void **)&ext4.names, &ext4.names_allocated, ext4.names_len + len, 1) != 0)
+		return -1;
+
+	d = &ext4.dirents[ext4.ndirents++];
+	d->dir = dir->ino;
+	d->ino = ino;
+	d->name = ext4.names_len;
+	d->name_len = (uint8_t)len;
+	d->next = 0;
+	d->hash_next = 0;
+
+	memcpy(ext4.names + ext4.names_len, name, len);
+	ext4.names_len += len;
+
+	if (*tail == 0)
+		dir->children = (uint32_t)ext4.ndirents;
+	else
+		ext4.dirents[*tail - 1].next = (uint32_t)ext4.ndirents;
+	*tail = (uint32_t)ext4.ndirents;
+
+	return 0;
+}
+
+/**
+ * Parse a block of directory entries.
+ *
+ * @param dir   The directory.
+ * @param tail  The directory's last entry (index + 1, updated).
+ * @param p     The block.
+ * @param len   The length of the block.
+ *
+ * @retval 0  The block was parsed.
+ * @retval >0 The block is corrupt (the entries before the corruption were added).
+ * @retval <0 An error occurred (errno is set).
+ */
+static int parse_dir_block(struct ext4_inode *dir, uint32_t *tail, const unsigned char *p,
+	size_t len)
+{
+	size_t off = 0;
+
+	while (off + 8 <= len) {
+		uint32_t ino = get32(p + off);
+		size_t rec_len = get16(p + off + 4);
+		size_t name_len = (ext4.incompat & INCOMPAT_FILETYPE) ? p[off + 6] : get16(p + off + 6);
+		const char *name = (const char *)p + off + 8;
+
+		/* 64 KiB blocks don't fit in rec_len: the low bits hold the rest. */
+		if (rec_len == 65535 || rec_len == 0)
+			rec_len = ext4.block_size;
+		else
+			rec_len = (rec_len & 65532) | (rec_len & 3) << 16;
+
+		if (rec_len < 8 || off + rec_len > len || 8 + name_len > rec_len || name_len > 255)
+			return 1;
+
+		/* Entries without an inode are free space (or checksums and htree nodes). */
+		if (ino != 0 && name_len == 2 && name[0] == '.' && name[1] == '.')
+			dir->parent = ino;
+		else if (ino != 0 && name_len > 0 && !(name_len == 1 && name[0] == '.') &&
+			add_dirent(dir, tail, ino, name, name_len) != 0)
+			return -1;
+
+		off += rec_len;
+	}
+
+	return 0;
+}
+
+/**
+ * Read and parse a directory.
+ *
+ * @retval 0  The directory was parsed.
+ * @retval >0 The directory is (partly) corrupt or couldn't be read (a
+ *            message was printed).
+ * @retval <0 An error occurred (errno is set).
+ */
+static int load_dir(struct ext4_inode *dir)
+{
+	struct ext4_map map;
+	unsigned char *buf;
+	uint32_t tail = 0;
+	uint64_t off;
+	int ret = 0;
+
+	if (map_inode(dir, &map) != 0) {
+		pr_err("Error: could not map directory inode %u: %m\n", dir->ino);
+		return 1;
+	}
+
+	/* Inline directories: the parent's inode number, then entries in the
+	 * rest of i_block, then more in the system.data attribute.
+	 */
+	if (map.inline_data != NULL) {
+		size_t size = dir->size;
+
+		if (size >= 4)
+			dir->parent = get32(map.inline_data);
+
+		if (size > 4)
+			ret = parse_dir_block(dir, &tail, map.inline_data + 4,
+				(size < sizeof(dir->block) ? size : sizeof(dir->block)) - 4);
+		if (ret >= 0 && size > sizeof(dir->block))
+			ret = parse_dir_block(dir, &tail, map.inline_data + sizeof(dir->block),
+				size - sizeof(dir->block));
+
+		unmap_inode(&map);
+		goto out;
+	}
+
+	buf = malloc(ext4.block_size);
+	if (buf == NULL) {
+		unmap_inode(&map);
+		return -1;
+	}
+
+	for (off = 0; off < dir->size && ret >= 0; off += ext4.block_size) {
+		ssize_t len = map_read(dir, &map, buf, ext4.block_size, off);
+
+		if (len < 0) {
+			pr_err("Error: could not read directory inode %u: %m\n", dir->ino);
+			ret = 1;
+			break;
+		}
+
+		if (parse_dir_block(dir, &tail, buf, (size_t)len) > 0)
+			ret = 1;
+	}
+
+	free(buf);
+	unmap_inode(&map);
+
+out:
+	if (ret > 0)
+		pr_err("Error: directory inode %u is corrupt\n", dir->ino);
+
+	return ret;
+}
+
+/**
+ * Read every directory and index the entries by directory and name.
+ *
+ * @retval 0  The directories were loaded (some may have been corrupt).
+ * @retval -1 An error occurred (errno is set).
+ */
+static int load_dirs(void)
+{
+	size_t i;
+
+	for (i = 0; i < ext4.ninodes; i++) {
+		if (S_ISDIR(ext4.inodes[i].mode) && load_dir(&ext4.inodes[i]) < 0)
+			return -1;
+	}
+
+	for (ext4.nbuckets = 1024; ext4.nbuckets < ext4.ndirents; )
+		ext4.nbuckets *= 2;
+
+	ext4.buckets = budget_malloc(ext4.nbuckets * sizeof(ext4.buckets[0]));
+	if (ext4.buckets == NULL)
+		return -1;
+
+	memset(ext4.buckets, 0, ext4.nbuckets * sizeof(ext4.buckets[0]));
+
+	for (i = 0; i < ext4.ndirents; i++) {
+		struct ext4_dirent *d = &ext4.dirents[i];
+		size_t b = dirent_bucket(d->dir, ext4.names + d->name, d->name_len);
+
+		d->hash_next = ext4.buckets[b];
+		ext4.buckets[b] = (uint32_t)(i + 1);
+	}
+
+	return 0;
+}
+
+/**
+ * Read and check the superblock.
+ *
+ * @retval 0  The superblock was read.
+ * @retval !0 The image isn't a supported ext4 filesystem (a message was printed).
+ */
+static int load_super(const char *image)
+{
+	unsigned char sb[SUPER_SIZE];
+	uint32_t log_block_size;
+	uint64_t blocks;
+
+	if (image_read(sb, sizeof(sb), SUPER_OFFSET) != 0) {
+		pr_err("Error: could not read the superblock of \"%s\": %m\n", image);
+		return 1;
+	}
+
+	if (get16(sb + 0x38) != SUPER_MAGIC) {
+		pr_err("Error: \"%s\" is not an ext2/3/4 filesystem image\n", image);
+		return 1;
+	}
+
+	log_block_size = get32(sb + 0x18);
+	ext4.incompat = get32(sb + 0x60);
+	ext4.ro_compat = get32(sb + 0x64);
+
+	if (log_block_size > 6) {
+		pr_err("Error: \"%s\" has an invalid block size\n", image);
+		return 1;
+	}
+
+	if (ext4.incompat & INCOMPAT_UNSUPPORTED) {
+		pr_err("Error: \"%s\" uses unsupported filesystem features (%#x)\n", image,
+			ext4.incompat & INCOMPAT_UNSUPPORTED);
+		return 1;
+	}
+
+	/* The journal isn't replayed, so the newest metadata may be missing. */
+	if (ext4.incompat & INCOMPAT_RECOVER)
+		pr_warn("Warning: \"%s\" was not cleanly unmounted (its journal needs recovery)\n",
+			image);
+
+	ext4.block_size = 1024U << log_block_size;
+	ext4.first_data_block = get32(sb + 0x14);
+	ext4.blocks_per_group = get32(sb + 0x20);
+	ext4.inodes_per_group = get32(sb + 0x28);
+	ext4.inode_size = get32(sb + 0x4C) >= 1 ? get16(sb + 0x58) : GOOD_OLD_INODE_SIZE;
+	ext4.desc_size = (ext4.incompat & INCOMPAT_64BIT) ? get16(sb + 0xFE) : 32;
+	ext4.first_meta_bg = get32(sb + 0x104);
+
+	blocks = get32(sb + 0x04);
+	if (ext4.incompat & INCOMPAT_64BIT)
+		blocks |= (uint64_t)get32(sb + 0x150) << 32;
+
+	if (ext4.inode_size < GOOD_OLD_INODE_SIZE || ext4.inode_size > ext4.block_size ||
+		(ext4.inode_size & (ext4.inode_size - 1)) != 0 ||
+		ext4.desc_size < 32 || ext4.desc_size > 64 ||
+		ext4.blocks_per_group == 0 || ext4.inodes_per_group == 0 ||
+		blocks <= ext4.first_data_block) {
+		pr_err("Error: \"%s\" has an invalid superblock\n", image);
+		return 1;
+	}
+
+	ext4.groups = (uint32_t)((blocks - ext4.first_data_block + ext4.blocks_per_group - 1) /
+		ext4.blocks_per_group);
+
+	pr_debug("%s: %u byte blocks, %u groups, %u byte inodes\n", image, ext4.block_size,
+		ext4.groups, ext4.inode_size);
+
+	return 0;
+}
+
+int ext4_open(const char *image)
+{
+	struct stat st;
+
+	ext4.fd = open(image, O_RDONLY | O_CLOEXEC);
+	if (ext4.fd < 0) {
+		pr_err("Error: could not open image \"%s\": %m\n", image);
+		return 1;
+	}
+
+	if (fstat(ext4.fd, &st) != 0) {
+		pr_err("Error: could not stat image \"%s\": %m\n", image);
+		goto fail;
+	}
+
+	ext4.dev = st.st_dev;
+
+	if (load_super(image) != 0)
+		goto fail;
+
+	if (load_inodes() != 0) {
+		pr_err("Error: could not read the inode tables of \"%s\": %m\n", image);
+		goto fail;
+	}
+
+	if (find_inode(ROOT_INO) == NULL || !S_ISDIR(find_inode(ROOT_INO)->mode)) {
+		pr_err("Error: \"%s\" has no root directory\n", image);
+		goto fail;
+	}
+
+	if (load_dirs() != 0) {
+		pr_err("Error: could not read the directories of \"%s\": %m\n", image);
+		goto fail;
+	}
+
+	pr_debug("%s: %zu inodes, %zu directory entries\n", image, ext4.ninodes, ext4.ndirents);
+
+	/* From now on, paths name files inside the image. */
+	io = &io_ext4_ops;
+
+	return 0;
+
+fail:
+	ext4_close();
+	return 1;
+}
+
+void ext4_close(void)
+{
+	size_t i;
+
+	if (ext4.fd < 0)
+		return;
+
+	for (i = 0; i < ext4.nfds; i++) {
+		if (ext4.fds[i] != NULL) {
+			unmap_inode(&ext4.fds[i]->map);
+			free(ext4.fds[i]);
+		}
+	}
+
+	free(ext4.fds);
+	budget_free(ext4.inodes, ext4.inodes_allocated * sizeof(ext4.inodes[0]));
+	budget_free(ext4.ibody, ext4.ibody_allocated);
+	budget_free(ext4.dirents, ext4.dirents_allocated * sizeof(ext4.dirents[0]));
+	budget_free(ext4.names, ext4.names_allocated);
+	budget_free(ext4.buckets, ext4.nbuckets * sizeof(ext4.buckets[0]));
+	close(ext4.fd);
+
+	ext4.fd = -1;
+	ext4.inodes = NULL;
+	ext4.ninodes = ext4.inodes_allocated = 0;
+	ext4.ibody = NULL;
+	ext4.ibody_len = ext4.ibody_allocated = 0;
+	ext4.dirents = NULL;
+	ext4.ndirents = ext4.dirents_allocated = 0;
+	ext4.names = NULL;
+	ext4.names_len = ext4.names_allocated = 0;
+	ext4.buckets = NULL;
+	ext4.nbuckets = 0;
+	ext4.fds = NULL;
+	ext4.nfds = 0;
+
+	if (io == &io_ext4_ops)
+		io = &io_real_ops;
+}
+
+bool ext4_enabled(void)
+{
+	return ext4.fd >= 0;
+}
+
+/*
+ * Path lookups.
+ */
+
+/**
+ * Look up an entry of a directory.
+ *
+ * @returns Returns the entry's inode number or 0 if there's no such entry.
+ */
+static uint32_t lookup_dirent(uint32_t dir, const char *name, size_t len)
+{
+	uint32_t i;
+
+	for (i = ext4.buckets[dirent_bucket(dir, name, len)]; i != 0; i = ext4.dirents[i - 1].hash_next) {
+		const struct ext4_dirent *d = &ext4.dirents[i - 1];
+
+		if (d->dir == dir && d->name_len == len && memcmp(ext4.names + d->name, name, len) == 0)
+			return d->ino;
+	}
+
+	return 0;
+}
+
+/**
+ * Read a symbolic link's target.
+ *
+ * @returns Returns the (NUL-terminated) target, to be freed with free(), or
+ *          NULL (with errno set) on failure.
+ */
+static char *read_link(const struct ext4_inode *inode)
+{
+	struct ext4_map map;
+	char *target;
+	ssize_t len;
+
+	if (inode->size >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	if (map_inode(inode, &map) != 0)
+		return NULL;
+
+	target = malloc(inode->size + 1);
+	len = target != NULL ? map_read(inode, &map, target, inode->size, 0) : -1;
+	unmap_inode(&map);
+
+	if (len != (ssize_t)inode->size) {
+		if (len >= 0)
+			errno = EUCLEAN;
+		free(target);
+		return NULL;
+	}
+
+	target[len] = '\0';
+
+	return target;
+}
+
+/**
+ * Look up a path in the image (relative to its root directory, whether or
+ * not it starts with a '/').
+ *
+ * Symbolic links are followed the way the kernel would, except that absolute
+ * targets are also taken to be relative to the image's root.
+ *
+ * @param path    The path.
+ * @param follow  Whether to follow a symbolic link in the last component.
+ *
+ * @returns Returns the inode or NULL (with errno set) on failure.
+ */
+static struct ext4_inode *lookup_path(const char *path, bool follow)
+{
+	struct ext4_inode *root = find_inode(ROOT_INO);
+	struct ext4_inode *cur = root;
+	unsigned links = 0;
+	char *buf;
+	char *p;
+
+	buf = strdup(path);
+	if (buf == NULL)
+		return NULL;
+
+	p = buf;
+
+	for (;;) {
+		struct ext4_inode *next;
+		const char *rest;
+		char *name;
+		size_t len;
+
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+
+		name = p;
+		while (*p != '\0' && *p != '/')
+			p++;
+		len = (size_t)(p - name);
+
+		for (rest = p; *rest == '/'; rest++)
+			;
+
+		if (!S_ISDIR(cur->mode)) {
+			errno = ENOTDIR;
+			goto fail;
+		}
+
+		if (len == 1 && name[0] == '.')
+			continue;
+
+		if (len == 2 && name[0] == '.' && name[1] == '.') {
+			next = find_inode(cur->parent);
+			if (next != NULL && S_ISDIR(next->mode))
+				cur = next;
+			continue;
+		}
+
+		if (len > 255) {
+			errno = ENAMETOOLONG;
+			goto fail;
+		}
+
+		next = find_inode(lookup_dirent(cur->ino, name, len));
+		if (next == NULL) {
+			errno = ENOENT;
+			goto fail;
+		}
+
+		if (S_ISLNK(next->mode) && (follow || *rest != '\0')) {
+			char *target;
+			char *tmp;
+
+			if (++links > MAX_SYMLINKS) {
+				errno = ELOOP;
+				goto fail;
+			}
+
+			target = read_link(next);
+			if (target == NULL)
+				goto fail;
+
+			/* Continue with the target, followed by the rest of the path. */
+			tmp = malloc(strlen(target) + strlen(rest) + 2);
+			if (tmp == NULL) {
+				free(target);
+				goto fail;
+			}
+
+			sprintf(tmp, "%s/%s", target, rest);
+			if (target[0] == '/')
+				cur = root;
+
+			free(target);
+			free(buf);
+			buf = p = tmp;
+			continue;
+		}
+
+		cur = next;
+	}
+
+	free(buf);
+
+	return cur;
+
+fail:
+	free(buf);
+	return NULL;
+}
+
+/*
+ * The io_ops backend.
+ */
+
+/**
+ * Look up an open fd.
+ *
+ * @returns Returns the fd or NULL (with errno set to EBADF).
+ */
+static struct ext4_fd *get_fd(int fd)
+{
+	size_t idx = (size_t)(fd - FD_BASE);
+	struct ext4_fd *f = NULL;
+
+	pthread_mutex_lock(&ext4.lock);
+	if (fd >= FD_BASE && idx < ext4.nfds)
+		f = ext4.fds[idx];
+	pthread_mutex_unlock(&ext4.lock);
+
+	if (f == NULL)
+		errno = EBADF;
+
+	return f;
+}
+
+/** Fill in a stat structure for @p inode. */
+static void fill_stat(const struct ext4_inode *inode, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev     = ext4.dev;
+	st->st_ino     = inode->ino;
+	st->st_mode    = inode->mode;
+	st->st_nlink   = inode->links;
+	st->st_uid     = inode->uid;
+	st->st_gid     = inode->gid;
+	st->st_size    = (off_t)inode->size;
+	st->st_blksize = ext4.block_size;
+	st->st_blocks  = (blkcnt_t)inode->blocks;
+	st->st_atim    = inode->atime;
+	st->st_mtim    = inode->mtime;
+	st->st_ctim    = inode->ctime;
+}
+
+static int img_open(const char *path, int flags)
+{
+	struct ext4_inode *inode;
+	struct ext4_fd *f;
+	size_t i;
+
+	if ((flags & O_ACCMODE) != O_RDONLY) {
+		errno = EROFS;
+		return -1;
+	}
+
+	inode = lookup_path(path, !(flags & O_NOFOLLOW));
+	if (inode == NULL)
+		return -1;
+
+	if (S_ISLNK(inode->mode)) {
+		errno = ELOOP;
+		return -1;
+	}
+
+	if ((flags & O_DIRECTORY) && !S_ISDIR(inode->mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return -1;
+
+	f->inode = inode;
+
+	pthread_mutex_lock(&ext4.lock);
+
+	for (i = 0; i < ext4.nfds; i++) {
+		if (ext4.fds[i] == NULL)
+			break;
+	}
+
+	if (i == ext4.nfds) {
+		size_t count = ext4.nfds ? ext4.nfds * 2 : 64;
+		void *tmp = realloc(ext4.fds, count * sizeof(ext4.fds[0]));
+
+		if (tmp == NULL) {
+			pthread_mutex_unlock(&ext4.lock);
+			free(f);
+			errno = EMFILE;
+			return -1;
+		}
+
+		ext4.fds = tmp;
+		memset(&ext4.fds[ext4.nfds], 0, (count - ext4.nfds) * sizeof(ext4.fds[0]));
+		ext4.nfds = count;
+	}
+
+	ext4.fds[i] = f;
+
+	pthread_mutex_unlock(&ext4.lock);
+
+	return (int)i + FD_BASE;
+}
+
+static int img_close(int fd)
+{
+	size_t idx = (size_t)(fd - FD_BASE);
+	struct ext4_fd *f = NULL;
+
+	pthread_mutex_lock(&ext4.lock);
+	if (fd >= FD_BASE && idx < ext4.nfds) {
+		f = ext4.fds[idx];
+		ext4.fds[idx] = NULL;
+	}
+	pthread_mutex_unlock(&ext4.lock);
+
+	if (f == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+
+	unmap_inode(&f->map);
+	free(f);
+
+	return 0;
+}
+
+static int img_fstat(int fd, struct stat *st)
+{
+	struct ext4_fd *f = get_fd(fd);
+
+	if (f == NULL)
+		return -1;
+
+	fill_stat(f->inode, st);
+
+	return 0;
+}
+
+static int img_stat(const char *path, struct stat *st)
+{
+	const struct ext4_inode *inode = lookup_path(path, true);
+
+	if (inode == NULL)
+		return -1;
+
+	fill_stat(inode, st);
+
+	return 0;
+}
+
+static ssize_t img_read(int fd, void *buf, size_t count)
+{
+	struct ext4_fd *f = get_fd(fd);
+	ssize_t len;
+
+	if (f == NULL)
+		return -1;
+
+	if (S_ISDIR(f->inode->mode)) {
+		errno = EISDIR;
+		return -1;
+	}
+
+	/* Map the blocks on the first read, so opening a file stays cheap. */
+	if (!f->mapped) {
+		if (map_inode(f->inode, &f->map) != 0)
+			return -1;
+		f->mapped = true;
+	}
+
+	len = map_read(f->inode, &f->map, buf, count, f->offset);
+	if (len > 0)
+		f->offset += (uint64_t)len;
+
+	return len;
+}
+
+static int img_fadvise(int fd, off_t offset __attribute__((unused)),
+	off_t len __attribute__((unused)), int advice __attribute__((unused)))
+{
+	return get_fd(fd) != NULL ? 0 : EBADF;
+}
+
+static io_dir_t *img_fdopendir(int fd)
+{
+	struct ext4_fd *f = get_fd(fd);
+	struct io_dir *dir;
+
+	if (f == NULL)
+		return NULL;
+
+	if (!S_ISDIR(f->inode->mode)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	dir = calloc(1, sizeof(*dir));
+	if (dir == NULL)
+		return NULL;
+
+	dir->fd = fd;
+	dir->next = f->inode->children;
+
+	return dir;
+}
+
+static struct dirent *img_readdir(io_dir_t *dir)
+{
+	struct ext4_fd *f = get_fd(dir->fd);
+	const struct ext4_dirent *d;
+	const struct ext4_inode *inode;
+
+	if (f == NULL)
+		return NULL;
+
+	if (dir->pos < 2) {
+		dir->entry.d_ino  = dir->pos == 0 ? f->inode->ino : f->inode->parent;
+		dir->entry.d_type = DT_DIR;
+		strcpy(dir->entry.d_name, dir->pos == 0 ? "." : "..");
+		dir->pos++;
+		return &dir->entry;
+	}
+
+	if (dir->next == 0)
+		return NULL;
+
+	d = &ext4.dirents[dir->next - 1];
+	inode = find_inode(d->ino);
+
+	dir->entry.d_ino  = d->ino;
+	dir->entry.d_type = inode != NULL ? IFTODT(inode->mode) : DT_UNKNOWN;
+	memcpy(dir->entry.d_name, ext4.names + d->name, d->name_len);
+	dir->entry.d_name[d->name_len] = '\0';
+
+	dir->next = d->next;
+	dir->pos++;
+
+	return &dir->entry;
+}
+
+static void img_rewinddir(io_dir_t *dir)
+{
+	struct ext4_fd *f = get_fd(dir->fd);
+
+	dir->pos = 0;
+	dir->next = f != NULL ? f->inode->children : 0;
+}
+
+static int img_closedir(io_dir_t *dir)
+{
+	int ret;
+
+	ret = img_close(dir->fd);
+	free(dir);
+
+	return ret;
+}
+
+static ssize_t img_fgetxattr(int fd, const char *name, void *value, size_t size)
+{
+	struct ext4_fd *f = get_fd(fd);
+
+	if (f == NULL)
+		return -1;
+
+	return xattr_get(f->inode, name, value, size);
+}
+
+static int img_fsetxattr(int fd, const char *name __attribute__((unused)),
+	const void *value __attribute__((unused)), size_t size __attribute__((unused)),
+	int flags __attribute__((unused)))
+{
+	if (get_fd(fd) == NULL)
+		return -1;
+
+	errno = EROFS;
+	return -1;
+}
+
+static int img_fremovexattr(int fd, const char *name __attribute__((unused)))
+{
+	if (get_fd(fd) == NULL)
+		return -1;
+
+	errno = EROFS;
+	return -1;
+}
+
+static ssize_t img_flistxattr(int fd, char *list, size_t size)
+{
+	struct xattr_list_arg arg = { .list = list, .size = size };
+	struct ext4_fd *f = get_fd(fd);
+
+	if (f == NULL)
+		return -1;
+
+	if (xattr_each(f->inode, xattr_list_fn, &arg) < 0)
+		return -1;
+
+	return (ssize_t)arg.len;
+}
+
+const struct io_ops io_ext4_ops = {
+	.name         = "ext4",
+	.open         = img_open,
+	.close        = img_close,
+	.fstat        = img_fstat,
+	.stat         = img_stat,
+	.read         = img_read,
+	.fadvise      = img_fadvise,
+	.fdopendir    = img_fdopendir,
+	.readdir      = img_readdir,
+	.rewinddir    = img_rewinddir,
+	.closedir     = img_closedir,
+	.fgetxattr    = img_fgetxattr,
+	.fsetxattr    = img_fsetxattr,
+	.fremovexattr = img_fremovexattr,
+	.flistxattr   = img_flistxattr,
+};
+
+/*
+ * Scanning in physical order.
+ */
+
+/** A file collected by ext4_process(). */
+struct ext4_found {
+	uint64_t start; /**< The physical block its data starts at. */
+	size_t order;   /**< The order it was found in (to keep sorting stable). */
+	char *path;     /**< Its path. */
+	size_t size;    /**< The size of ext4_found::path's allocation. */
+};
+
+/** The files collected by ext4_process(). */
+struct ext4_found_list {
+	struct ext4_found *files; /**< The files. */
+	size_t count;             /**< The number of files. */
+	size_t allocated;         /**< The number of files allocated. */
+};
+
+/**
+ * Collect the files below a directory (skipping the subtrees the policy
+ * excludes).
+ *
+ * @param dir   The directory.
+ * @param path  The directory's path.
+ * @param list  The list to append the files to.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int collect(struct ext4_inode *dir, const char *path, struct ext4_found_list *list)
+{
+	bool slash = path[0] != '\0' && path[strlen(path) - 1] == '/';
+	uint32_t i;
+
+	dir->visited = true;
+
+	for (i = dir->children; i != 0; i = ext4.dirents[i - 1].next) {
+		const struct ext4_dirent *d = &ext4.dirents[i - 1];
+		struct ext4_inode *inode = find_inode(d->ino);
+		size_t size = strlen(path) + d->name_len + 2;
+		char *child;
+
+		child = budget_malloc(size);
+		if (child == NULL)
+			return -1;
+
+		snprintf(child, size, "%s%s%.*s", path, slash ? "" : "/", (int)d->name_len,
+			ext4.names + d->name);
+
+		if (inode != NULL && S_ISDIR(inode->mode)) {
+			int err = 0;
+
+			if (!inode->visited &&
+				!(policy_enabled() && policy_excluded(policy_lookup(child, 0, NULL, DT_DIR))))
+				err = collect(inode, child, list);
+
+			budget_free(child, size);
+			if (err != 0)
+				return err;
+			continue;
+		}
+
+		if (grow((void **)&list->files, &list->allocated, list->count + 1,
+				sizeof(list->files[0])) != 0) {
+			budget_free(child, size);
+			return -1;
+		}
+
+		/* Everything else is left to process_path() (which reports it). */
+		list->files[list->count] = (struct ext4_found){
+			.start = inode != NULL && S_ISREG(inode->mode) ? inode_start(inode) : 0,
+			.order = list->count,
+			.path = child,
+			.size = size,
+		};
+		list->count++;
+	}
+
+	return 0;
+}
+
+/** Orders collected files by their first data block. */
+static int found_compare(const void *a, const void *b)
+{
+	const struct ext4_found *x = a;
+	const struct ext4_found *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+
+	return (x->order > y->order) - (x->order < y->order);
+}
+
+int ext4_process(const char *path)
+{
+	struct ext4_found_list list = { NULL, 0, 0 };
+	struct ext4_inode *dir;
+	int ret = 0;
+	size_t i;
+
+	/* Per-directory reports need the normal directory walk. */
+	if (!args.recursive || cost_enabled() || coverage_enabled())
+		return process_path(path);
+
+	dir = lookup_path(path, true);
+	if (dir == NULL || !S_ISDIR(dir->mode))
+		return process_path(path);
+
+	for (i = 0; i < ext4.ninodes; i++)
+		ext4.inodes[i].visited = false;
+
+	if (collect(dir, path, &list) != 0) {
+		pr_err("Error: could not list the files below \"%s\": %m\n", path);
+		ret = -1;
+	}
+	else {
+		pr_debug("Checking %zu files below \"%s\" in disk order\n", list.count, path);
+
+		qsort(list.files, list.count, sizeof(list.files[0]), found_compare);
+
+		for (i = 0; i < list.count; i++) {
+			int err = process_path(list.files[i].path);
+
+			if (err < 0) {
+				ret = err;
+				break;
+			}
+			else if (ret == 0 && err > 0) {
+				ret = err;
+			}
+		}
+	}
+
+	for (i = 0; i < list.count; i++)
+		budget_free(list.files[i].path, list.files[i].size);
+	budget_free(list.files, list.allocated * sizeof(list.files[0]));
+
+	return ret;
+}
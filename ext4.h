@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+
+/** @file
+ * Offline ext4 image reader declarations.
+ *
+ * With --ext4-image, b2tag reads an unmounted ext4 image directly instead of
+ * going through a mounted filesystem. ext4_open() reads the superblock, the
+ * group descriptors, and every inode table sequentially, then all of the
+ * directories, and makes ::io_ext4_ops the active backend (see io.h). From
+ * then on, paths name files inside the image (relative to its root), the
+ * extended attributes come from the inodes' in-inode and external attribute
+ * blocks, and file data is read by following the extents. The image is
+ * only ever read, so no privileges beyond read access to it are needed.
+ *
+ * A recursive scan checks the files in the order of their first data block
+ * on the image (see ext4_process()), so the data is mostly read in one pass
+ * from the start of the image to its end.
+ */
+
+#ifndef EXT4_H
+#define EXT4_H
+
+#include <stdbool.h>
+
+#include "io.h"
+
+/** The ext4 image backend. */
+extern const struct io_ops io_ext4_ops;
+
+/**
+ * Load an ext4 image's metadata and make it the active backend (::io).
+ *
+ * @param image  The image file (or block device).
+ *
+ * @retval 0  The image was loaded.
+ * @retval !0 The image couldn't be read or isn't a supported ext4 filesystem
+ *            (a message was printed).
+ */
+int ext4_open(const char *image);
+
+/**
+ * Free the image's metadata and restore the real backend.
+ */
+void ext4_close(void);
+
+/**
+ * Returns whether an ext4 image is in use.
+ */
+bool ext4_enabled(void);
+
+/**
+ * Process a path inside the image (like process_path()).
+ *
+ * With --recursive, the regular files below a directory are collected first
+ * and then checked in the order of their first data block, unless a
+ * per-directory report (--cost-report or --coverage) needs the directory walk.
+ *
+ * @param path  The path inside the image.
+ *
+ * @retval 0  The path was processed successfully.
+ * @retval >0 A recoverable error occurred.
+ * @retval <0 A fatal error occurred.
+ */
+int ext4_process(const char *path);
+
+#endif /* EXT4_H */
@@ -35,12 +35,30 @@
 
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "blockdev.h"
+#include "budget.h"
+#include "cost.h"
+#include "coverage.h"
+#include "devslot.h"
+#include "dircache.h"
+#include "dirty.h"
+#include "events.h"
+#include "io.h"
+#include "migrate.h"
+#include "pathtree.h"
+#include "policy.h"
+#include "stats.h"
+#include "tagcache.h"
 #include "utilities.h"
+#include "verify.h"
 #include "xa.h"
 
 /** Call the kernel's fadvise() on files larger than this. */
@@ -50,8 +68,10 @@
  * An array holding the inode and dev numbers for a directory.
  */
 struct dir_no {
-	dev_t device; /**< The directory's device ID. */
-	ino_t inode;  /**< The directory's inode number. */
+	dev_t device;     /**< The directory's device ID. */
+	ino_t inode;      /**< The directory's inode number. */
+	size_t path_len;  /**< The length of the directory's path. */
+	pathtree_id node; /**< The directory's path tree node (if it has one). */
 };
 
 /**
@@ -74,6 +94,7 @@ enum file_state {
 	FILE_BACKDATED, /**< File hash differs, mtime is older. */
 	FILE_CORRUPT,   /**< File hash differs, mtime matches. */
 	FILE_INVALID,   /**< Xattrs corrupted. */
+	FILE_DEFERRED,  /**< File needs hashing but its device is busy. */
 };
 
 /** The string representation of the ::file_state enum values. */
@@ -86,11 +107,29 @@ static char const * const file_state_str[] = {
 	"BACKDATED",
 	"CORRUPT",
 	"INVALID",
+	"DEFERRED",
 };
 
+/**
+ * Files that need hashing but were skipped since another b2tag process was
+ * reading their device.
+ */
+static struct {
+	pathtree_id *files; /**< The files' path tree nodes. */
+	size_t count;       /**< The number of files. */
+	size_t allocated;   /**< The number of files allocated. */
+	bool draining;      /**< Whether the deferred files are being processed. */
+} deferred;
+
+/** The combined result of the files verified in the background. */
+static int verify_ret;
+
+/** The manifest to record every checked file in (NULL if not in use). */
+struct manifest_writer *manifest_out;
 
 /* Forward declarations. */
-static int process_path2(const char *filename, struct parent_dirs *parents);
+static int process_path2(const char *filename, const struct policy_rule *rule,
+	struct parent_dirs *parents);
 
 /**
  * Prints information about a file's state.
@@ -159,6 +198,106 @@ static void print_sum(enum file_state state __attribute__((unused)),
 		pr_err("Error no hash found for \"%s\"\n", filename);
 }
 
+/**
+ * Report a file's state (publishing it as an event if it isn't OK).
+ *
+ * @param state     The file's state (e.g. ok).
+ * @param filename  The name of the file.
+ * @param st        The file's stat() structure.
+ * @param stored    The file's stored attributes (may be NULL).
+ * @param actual    The file's actual attributes (may be NULL).
+ */
+static void report_state(enum file_state state, const char *filename, const struct stat *st,
+	xa_t *stored, xa_t *actual)
+{
+	stats_state(state, file_state_str[state], st->st_dev, st->st_size);
+
+	if (state != FILE_OK)
+		events_state(filename, file_state_str[state]);
+
+	/* Whether to print the file status or the sha*sum data. */
+	if (args.print)
+		print_sum(state, filename, stored, actual);
+	else
+		print_state(state, filename, stored, actual);
+}
+
+/**
+ * Report a file or directory that couldn't be checked.
+ *
+ * @param filename  The name of the file or directory.
+ * @param error     The errno value describing the error.
+ */
+static void report_error(const char *filename, int error)
+{
+	stats_error();
+	events_error(filename, error);
+}
+
+/**
+ * Record a file in the output manifest (if there is one).
+ *
+ * @param filename  The file's name.
+ * @param st        The file's stat() structure.
+ * @param xa        The file's hash.
+ *
+ * @retval 0  The file was recorded (or there's no manifest).
+ * @retval <0 The manifest entry couldn't be added.
+ */
+static int record_manifest(const char *filename, const struct stat *st, const xa_t *xa)
+{
+	struct manifest_entry e = {
+		.path  = filename,
+		.size  = (uint64_t)st->st_size,
+		.mtime = st->st_mtim,
+	};
+
+	if (manifest_out == NULL || !xa->valid)
+		return 0;
+
+	if (hex2bin(e.digest, sizeof(e.digest), xa->hash) < 0 ||
+		manifest_writer_add(manifest_out, &e) != 0) {
+		pr_err("Error: could not add \"%s\" to the manifest: %m\n", filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Work out a file's state from its stored and actual attributes.
+ *
+ * @param err         The xa_read() result for the stored attributes.
+ * @param comparison  The ts_compare() result of the stored and actual mtimes.
+ * @param stored      The file's stored attributes.
+ * @param actual      The file's current hash and mtime.
+ *
+ * @returns Returns the file's state.
+ */
+static enum file_state compare_state(int err, int comparison, const xa_t *stored, const xa_t *actual)
+{
+	if (err == 1)
+		return FILE_NEW;
+
+	if (err >= 2)
+		return FILE_INVALID;
+
+	/* hash and mtime matches -> ok, hash matches and mtime differs -> same */
+	if (strcmp(stored->hash, actual->hash) == 0)
+		return (comparison == 0) ? FILE_OK : FILE_SAME;
+
+	/* file mtime is newer than the xattr mtime. */
+	if (comparison < 0)
+		return FILE_OUTDATED;
+
+	/* file mtime is older than the xattr mtime. */
+	if (comparison > 0)
+		return FILE_BACKDATED;
+
+	/* Same timestamp, different hashes. */
+	return FILE_CORRUPT;
+}
+
 /**
  * Checks if a file's stored hash and timestamp match the current values.
  *
@@ -167,17 +306,20 @@ static void print_sum(enum file_state state __attribute__((unused)),
  *       Also, @p actual->mtime will not be changed if non-zero.
  *
  * @param[in]     fd      The file to get the state of.
+ * @param[in]     st      The file's stat() structure.
  * @param[out]    stored  The xa structure to hold the file's stored attributes.
  * @param[in,out] actual  The xa structure to hold the file's current hash+mtime.
+ * @param[in]     deep    Whether to hash the file even if its timestamps match.
  *
  * @returns Returns the file's state.
  *
  * @see file_state
  */
-static enum file_state get_file_state(int fd, xa_t *stored, xa_t *actual)
+static enum file_state get_file_state(int fd, const struct stat *st, xa_t *stored, xa_t *actual,
+	bool deep)
 {
 	int err;
-	int comparison;
+	int comparison = 0;
 
 	assert(fd >= 0);
 	assert(stored != NULL);
@@ -186,51 +328,225 @@ static enum file_state get_file_state(int fd, xa_t *stored, xa_t *actual)
 
 	/* Skip the fstat call if mtime seconds is already set. */
 	if (actual->mtime.tv_sec == 0) {
-		struct stat st;
+		struct stat cur;
 
-		err = fstat(fd, &st);
+		err = io->fstat(fd, &cur);
 		if (err != 0)
 			return FILE_FAULT;
 
-		actual->mtime = st.st_mtim;
+		actual->mtime = cur.st_mtim;
 	}
 
 	err = xa_read(fd, stored);
 	if (err < 0)
 		return FILE_FAULT;
 
-	if (err == 1) {
-		xa_compute(fd, actual);
-		return FILE_NEW;
+	if (err == 0) {
+		comparison = ts_compare(stored->mtime, actual->mtime, stored->fuzzy);
+
+		/* Quick check. If stored timestamps match, skip hashing. */
+		if (comparison == 0 && !deep)
+			return FILE_OK;
 	}
 
-	if (err >= 2) {
+	/* The file has to be read, so wait for a turn on its device (unless
+	 * there's other work to do in the meantime).
+	 */
+	if (devslot_acquire(st->st_dev, deferred.draining) > 0)
+		return FILE_DEFERRED;
+
+	if (cost_enabled()) {
+		uint64_t start = cost_now();
+
+		xa_compute(fd, actual);
+		cost_hash((uint64_t)st->st_size, cost_now() - start);
+	}
+	else {
 		xa_compute(fd, actual);
-		return FILE_INVALID;
 	}
 
-	comparison = ts_compare(stored->mtime, actual->mtime, stored->fuzzy);
+	return compare_state(err, comparison, stored, actual);
+}
 
-	/* Quick check. If stored timestamps match, skip hashing. */
-	if (comparison == 0 && !args.check)
-		return FILE_OK;
+/**
+ * Add a file to the path tree, adding the directories above it that aren't
+ * there yet.
+ *
+ * @param filename  The file.
+ * @param parents   The file's parent directories.
+ *
+ * @returns Returns the file's node or #PATHTREE_NONE if out of memory.
+ */
+static pathtree_id file_node(const char *filename, struct parent_dirs *parents)
+{
+	pathtree_id node = PATHTREE_NONE;
+	size_t start = 0;
+	size_t i;
 
-	xa_compute(fd, actual);
+	/* Every parent's path is a prefix of filename. */
+	for (i = 0; i < parents->count; i++) {
+		struct dir_no *dir = &parents->data[i];
 
-	/* hash and mtime matches -> ok, hash matches and mtime differs -> same */
-	if (strcmp(stored->hash, actual->hash) == 0)
-		return (comparison == 0) ? FILE_OK : FILE_SAME;
+		if (dir->node == PATHTREE_NONE) {
+			dir->node = pathtree_add(node, filename + start, dir->path_len - start);
+			if (dir->node == PATHTREE_NONE)
+				return PATHTREE_NONE;
+		}
 
-	/* file mtime is newer than the xattr mtime. */
-	if (comparison < 0)
-		return FILE_OUTDATED;
+		node = dir->node;
+		start = dir->path_len + 1;
+	}
 
-	/* file mtime is older than the xattr mtime. */
-	if (comparison > 0)
-		return FILE_BACKDATED;
+	return pathtree_add(node, filename + start, strlen(filename + start));
+}
 
-	/* Same timestamp, different hashes. */
-	return FILE_CORRUPT;
+/**
+ * Queue a file to be processed once the walk is done.
+ *
+ * @param filename  The file.
+ * @param node      The file's path tree node (or #PATHTREE_NONE if there was
+ *                  no memory for it).
+ *
+ * @retval 0  The file was queued.
+ * @retval <0 Out of memory.
+ */
+static int defer_node(const char *filename, pathtree_id node)
+{
+	if (node == PATHTREE_NONE)
+		goto fail;
+
+	if (deferred.count >= deferred.allocated) {
+		size_t size = deferred.allocated * sizeof(deferred.files[0]);
+		void *tmp;
+
+		tmp = budget_realloc(deferred.files, size, size ? size * 2 : 64 * sizeof(deferred.files[0]));
+		if (tmp == NULL)
+			goto fail;
+
+		deferred.files = tmp;
+		deferred.allocated = deferred.allocated ? deferred.allocated * 2 : 64;
+	}
+
+	deferred.files[deferred.count++] = node;
+	stats_queue(STATS_QUEUE_DEFERRED, deferred.count);
+
+	return 0;
+
+fail:
+	pr_err("Error: could not queue \"%s\": %m\n", filename);
+	return -1;
+}
+
+/**
+ * Queue a file to be processed once its device is free.
+ *
+ * @param filename  The file.
+ * @param parents   The file's parent directories.
+ *
+ * @retval 0  The file was queued.
+ * @retval <0 Out of memory.
+ */
+static int defer_file(const char *filename, struct parent_dirs *parents)
+{
+	pr_debug("Device busy, deferring file: %s\n", filename);
+
+	return defer_node(filename, file_node(filename, parents));
+}
+
+/**
+ * Record that a file's data was just hashed and matches its (new) tag.
+ *
+ * @param fd        The file.
+ * @param filename  The file's name.
+ *
+ * @returns Returns whether the attribute was written (changing the file's ctime).
+ */
+static bool record_verified(int fd, const char *filename)
+{
+	struct timespec now;
+
+	if (!args.record_verified || args.dry_run)
+		return false;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	if (xa_write_verified(fd, now) != E_OK) {
+		pr_warn("Warning: could not record the verification of \"%s\": %m\n", filename);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Update a checked file's stored attributes and tag cache entry as its state
+ * requires.
+ *
+ * @param fd        A readable open file descriptor to the file.
+ * @param filename  The file's name.
+ * @param st        The file's stat() structure (updated if the xattrs change).
+ * @param state     The file's state.
+ * @param s         The file's stored attributes.
+ * @param a         The file's actual attributes.
+ *
+ * @retval 0  The file was processed successfully.
+ * @retval >0 An recoverable error occurred.
+ */
+static int update_file(int fd, const char *filename, struct stat *st, enum file_state state,
+	xa_t *s, xa_t *a)
+{
+	int err = 0;
+
+	if (state == FILE_OK) {
+		/* A file that was only quick-checked wasn't verified. */
+		if (a->valid && record_verified(fd, filename) && tagcache_enabled())
+			io->fstat(fd, st);
+
+		tagcache_update(filename, st, s);
+		return 0;
+	}
+
+	switch (state) {
+	case FILE_BACKDATED:
+	case FILE_CORRUPT:
+	case FILE_FAULT:
+	case FILE_INVALID:
+		err = 1;
+
+		/* Don't update the stored xattrs unless -f is specified for backdated,
+		 * corrupt, fault, or invalid files.
+		 */
+		if (!args.force) {
+			tagcache_remove(st);
+			return 1;
+		}
+
+		break;
+
+	default:
+		break;
+	}
+
+	if (args.dry_run) {
+		tagcache_remove(st);
+		return err;
+	}
+
+	err = xa_write(fd, a);
+	if (err != 0) {
+		pr_err("Error: could not write extended attributes to file \"%s\": %m\n", filename);
+		report_error(filename, errno);
+		tagcache_remove(st);
+		return 2;
+	}
+
+	record_verified(fd, filename);
+
+	/* Writing the xattrs changed the file's ctime. */
+	if (tagcache_enabled() && io->fstat(fd, st) == 0)
+		tagcache_update(filename, st, a);
+
+	return 0;
 }
 
 /**
@@ -239,15 +555,21 @@ static enum file_state get_file_state(int fd, xa_t *stored, xa_t *actual)
  * @param fd        A readable open file descriptor to the file to check.
  * @param filename  The file to check.
  * @param st        The stat() structure of the file to check.
+ * @param rule      The file's policy rule (NULL for the defaults).
+ * @param parents   The file's parent directories.
  *
  * @retval 0  The file was processed successfully.
  * @retval >0 An recoverable error occurred.
  * @retval <0 A fatal error occurred.
  */
-static int check_file(int fd, const char *filename, struct stat *st)
+static int check_file(int fd, const char *filename, struct stat *st,
+	const struct policy_rule *rule, struct parent_dirs *parents)
 {
 	enum file_state state;
 	int err = 0;
+	hash_alg_t alg = policy_alg(rule);
+	bool check = policy_check(rule, st);
+	bool deep = check && !verify_enabled();
 	xa_t a;
 	xa_t s;
 
@@ -263,58 +585,251 @@ static int check_file(int fd, const char *filename, struct stat *st)
 	 * sequentially.
 	 */
 	if (st->st_size > FADVISE_THRESHOLD) {
-		err = posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		err = io->fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 		/* Ignore if fadvise fails for some reason (just print a warning). */
 		if (err != 0)
 			pr_warn("Warning: fadvise failed: %m\n");
 	}
 
-	a = s = (xa_t){ .alg = args.alg };
+again:
+	a = s = (xa_t){ .alg = alg };
 
 	a.mtime = st->st_mtim;
 
-	state = get_file_state(fd, &s, &a);
-	if (state == FILE_FAULT)
+	state = get_file_state(fd, st, &s, &a, deep);
+	if (state == FILE_FAULT) {
+		report_error(filename, errno);
 		return -1;
+	}
 
-	/* Whether to print the file status or the sha*sum data. */
-	if (args.print)
-		print_sum(state, filename, &s, &a);
-	else
-		print_state(state, filename, &s, &a);
+	if (state == FILE_DEFERRED)
+		return defer_file(filename, parents);
+
+	if (a.valid)
+		policy_throttle(rule, (uint64_t)st->st_size);
 
-	if (state == FILE_OK)
+	/* With --two-phase, files that passed the quick check are verified in
+	 * the background (or now, if the memory budget is exhausted). If the
+	 * queue is full, the walk moves on and verifies them once it's done.
+	 */
+	if (state == FILE_OK && check && !deep) {
+		pathtree_id node = file_node(filename, parents);
+
+		err = node != PATHTREE_NONE ? verify_queue(node, st, alg) : 1;
+		if (err == 2 && !deferred.draining) {
+			pr_debug("Verification queue full, deferring file: %s\n", filename);
+			return defer_node(filename, node);
+		}
+		if (err != 0) {
+			deep = true;
+			goto again;
+		}
+
+		if (record_manifest(filename, st, &s) != 0)
+			return -1;
+
+		tagcache_update(filename, st, &s);
 		return 0;
+	}
 
-	switch (state) {
-	case FILE_BACKDATED:
-	case FILE_CORRUPT:
-	case FILE_FAULT:
-	case FILE_INVALID:
-		err = 1;
+	report_state(state, filename, st, &s, &a);
 
-		/* Don't update the stored xattrs unless -f is specified for backdated,
-		 * corrupt, fault, or invalid files.
-		 */
-		if (!args.force)
-			return 1;
+	if (record_manifest(filename, st, a.valid ? &a : &s) != 0)
+		return -1;
 
-		break;
+	return update_file(fd, filename, st, state, &s, &a);
+}
 
-	default:
-		break;
+/**
+ * Report a file verified in the background and update its attributes.
+ *
+ * @param item  The verified file.
+ *
+ * @retval 0  The file was processed successfully.
+ * @retval >0 An recoverable error occurred.
+ */
+static int report_verified(struct verify_item *item)
+{
+	enum file_state state;
+	const char *path;
+	int comparison = 0;
+	int ret;
+	int fd;
+
+	path = pathtree_path(item->node);
+	if (path == NULL) {
+		pr_err("Error: could not rebuild a verified file's path: %m\n");
+		return 1;
 	}
 
-	if (args.dry_run)
-		return err;
+	if (item->err < 0) {
+		errno = item->error;
+		pr_err("Error: could not verify file \"%s\": %m\n", path);
+		report_error(path, errno);
+		return 1;
+	}
 
-	err = xa_write(fd, &a);
-	if (err != 0) {
-		pr_err("Error: could not write extended attributes to file \"%s\": %m\n", filename);
-		return 2;
+	if (item->err == 0)
+		comparison = ts_compare(item->stored.mtime, item->actual.mtime, item->stored.fuzzy);
+
+	state = compare_state(item->err, comparison, &item->stored, &item->actual);
+
+	report_state(state, path, &item->st, &item->stored, &item->actual);
+
+	/* The tag cache was updated when the file was queued. */
+	if (state == FILE_OK && (!args.record_verified || args.dry_run))
+		return 0;
+
+	fd = io->open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("Error: could not open file \"%s\": %m\n", path);
+		report_error(path, errno);
+		return 1;
 	}
 
-	return 0;
+	ret = update_file(fd, path, &item->st, state, &item->stored, &item->actual);
+	io->close(fd);
+
+	return ret;
+}
+
+/**
+ * Report the files verified in the background so far.
+ *
+ * @param wait  Whether to wait until all queued files are verified.
+ */
+static void drain_verified(bool wait)
+{
+	struct verify_item *item;
+
+	while ((item = verify_next(wait)) != NULL) {
+		int err = report_verified(item);
+
+		if (verify_ret == 0 && err > 0)
+			verify_ret = err;
+
+		verify_free(item);
+	}
+}
+
+/**
+ * Quick-checks a file using only its stat() data and the tag cache.
+ *
+ * @param filename  The file to check.
+ * @param rule      The file's policy rule (resolved if it's #POLICY_UNRESOLVED).
+ * @param depth     The number of directories above the file.
+ *
+ * @retval true  The file's metadata matched the tag cache and it was reported.
+ * @retval false The file has to be checked normally.
+ */
+static bool check_file_cached(const char *filename, const struct policy_rule **rule, size_t depth)
+{
+	struct stat st;
+	xa_t s;
+
+	if (io->stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	if (*rule == POLICY_UNRESOLVED)
+		*rule = policy_lookup(filename, depth, &st, DT_REG);
+
+	/* Deep-checked files always have to be hashed. */
+	if (policy_excluded(*rule) || policy_check(*rule, &st))
+		return false;
+
+	s = (xa_t){ .alg = policy_alg(*rule) };
+
+	if (!tagcache_lookup(&st, &s))
+		return false;
+
+	pr_debug("Using cached tag for file: %s\n", filename);
+
+	/* On failure, the normal check will fail (and stop) the same way. */
+	if (record_manifest(filename, &st, &s) != 0)
+		return false;
+
+	report_state(FILE_OK, filename, &st, &s, NULL);
+
+	cost_file();
+	events_file();
+
+	return true;
+}
+
+/**
+ * Returns whether a directory entry can be skipped because the dirty-inode
+ * tracker says it hasn't been modified since the last run, or because an
+ * earlier --migrate run already migrated its directory.
+ *
+ * Only regular files are skipped: directories must still be walked, and
+ * entries of unknown type are processed normally.
+ *
+ * @param dev       The device of the entry's directory.
+ * @param ino       The entry's inode number.
+ * @param type      The entry's type (DT_* from dirent.h).
+ * @param migrated  Whether the entry's directory was already migrated.
+ */
+static bool skip_entry(dev_t dev, ino_t ino, unsigned char type, bool migrated)
+{
+	if (type != DT_REG)
+		return false;
+
+	return migrated || (dirty_enabled() && !dirty_contains(dev, ino));
+}
+
+/**
+ * Process a single entry of a directory.
+ *
+ * @param dirname  The path of the directory containing the entry.
+ * @param name     The name of the entry.
+ * @param type     The entry's type (DT_* from dirent.h).
+ * @param parents  The parent directories' inodes (to check for loops).
+ *
+ * @retval 0  The entry was processed successfully.
+ * @retval >0 An recoverable error occurred.
+ * @retval <0 A fatal error occurred.
+ */
+static int check_dir_entry(const char *dirname, const char *name, unsigned char type,
+	struct parent_dirs *parents)
+{
+	const struct policy_rule *rule = POLICY_UNRESOLVED;
+	char *buffer;
+	size_t len;
+	int err;
+
+	/* Ignore "." and ".." entries. */
+	if (name[0] == '.') {
+		if (name[1] == '\0')
+			return 0;
+		if (name[1] == '.' && name[2] == '\0')
+			return 0;
+	}
+
+	len = strlen(dirname) + strlen(name) + 2;
+
+	buffer = budget_malloc(len);
+	if (buffer == NULL) {
+		pr_err("Error formatting directory entry \"%s\"/\"%s\": %m\n",
+			dirname, name);
+		return -1;
+	}
+
+	snprintf(buffer, len, "%s/%s", dirname, name);
+
+	/* Excluded entries (and subtrees) aren't even opened. */
+	if (policy_enabled()) {
+		rule = policy_lookup(buffer, parents->count, NULL, type);
+		if (policy_excluded(rule)) {
+			pr_debug("Excluded by policy: %s\n", buffer);
+			budget_free(buffer, len);
+			return 0;
+		}
+	}
+
+	err = process_path2(buffer, rule, parents);
+	budget_free(buffer, len);
+
+	return err;
 }
 
 /**
@@ -336,18 +851,27 @@ static int check_file(int fd, const char *filename, struct stat *st)
  */
 static int check_dir(int fd, const char *filename, struct stat *st, struct parent_dirs *parents)
 {
-	char *buffer;
+	const struct dircache_dir *listing = NULL;
+	struct migrate_dir *mdir = NULL;
+	bool migrated = false;
+	struct cost_mark cost;
+	struct coverage_mark coverage;
 	int ret = 0;
 	int err;
 	size_t i;
 	struct dirent *entry;
-	DIR *dirp;
+	io_dir_t *dirp;
 
 	assert(filename != NULL);
 	assert(parents != NULL);
 
 	pr_debug("Processing dir: %s\n", filename);
 
+	if (cost_enabled())
+		cost_begin(&cost);
+	if (coverage_enabled())
+		coverage_begin(&coverage);
+
 	/* Check for filesystem loop. */
 	for (i = 0; i < parents->count; i++) {
 		if (parents->data[i].inode != st->st_ino)
@@ -356,7 +880,9 @@ static int check_dir(int fd, const char *filename, struct stat *st, struct paren
 			continue;
 
 		pr_err("File system loop detected at \"%s\"\n", filename);
-		close(fd);
+		report_error(filename, ELOOP);
+		cost_error();
+		io->close(fd);
 		return 1;
 	}
 
@@ -364,62 +890,114 @@ static int check_dir(int fd, const char *filename, struct stat *st, struct paren
 	if (parents->count >= parents->allocated) {
 		void *tmp;
 
-		parents->allocated += 16;
-
-		tmp = realloc(parents->data, parents->allocated * sizeof(parents->data[0]));
+		tmp = budget_realloc(parents->data, parents->allocated * sizeof(parents->data[0]),
+			(parents->allocated + 16) * sizeof(parents->data[0]));
 		if (tmp == NULL) {
-			parents->allocated -= 16;
-			close(fd);
+			pr_err("Error: not enough memory to descend into \"%s\": %m\n", filename);
+			cost_error();
+			io->close(fd);
 			return -1;
 		}
 
+		parents->allocated += 16;
+
 		parents->data = tmp;
 	}
 
-	dirp = fdopendir(fd);
+	if (policy_enter_dir(filename, parents->count) != 0) {
+		pr_err("Error: not enough memory to descend into \"%s\": %m\n", filename);
+		cost_error();
+		io->close(fd);
+		return -1;
+	}
+
+	dirp = io->fdopendir(fd);
 	if (dirp == NULL) {
 		pr_err("Failed to open directory \"%s\": %m\n", filename);
-		close(fd);
+		report_error(filename, errno);
+		cost_error();
+		io->close(fd);
 		return 1;
 	}
 
 	fd = -1;
 
+	/* Use (or fill) the cached listing if there is one. */
+	if (dircache_enabled()) {
+		listing = dircache_lookup(st);
+		if (listing != NULL)
+			pr_debug("Using cached listing for dir: %s\n", filename);
+		else
+			listing = dircache_read(dirp, st);
+
+		/* Over the memory limit, just read the directory normally. */
+		if (listing == NULL && errno != ENOMEM) {
+			pr_err("Failed to read directory \"%s\": %m\n", filename);
+			report_error(filename, errno);
+			cost_error();
+			io->closedir(dirp);
+			return 1;
+		}
+	}
+
+	stats_dir();
+
 	/* Add the current dir to the parents struct. */
 	parents->data[parents->count].device = st->st_dev;
 	parents->data[parents->count].inode  = st->st_ino;
+	parents->data[parents->count].path_len = strlen(filename);
+	parents->data[parents->count].node = PATHTREE_NONE;
 	parents->count++;
 
-	while ((entry = readdir(dirp)) != NULL) {
-		/* Ignore "." and ".." entries. */
-		if (entry->d_name[0] == '.') {
-			if (entry->d_name[1] == '\0')
-				continue;
-			if (entry->d_name[1] == '.' && entry->d_name[2] == '\0')
+	if (migrate_enabled())
+		mdir = migrate_dir_begin(st, &migrated);
+
+	if (listing != NULL) {
+		/* The cached listing is all we need. */
+		io->closedir(dirp);
+		dirp = NULL;
+
+		for (i = 0; i < listing->count; i++) {
+			if (skip_entry(st->st_dev, listing->entries[i].ino, listing->entries[i].type,
+					migrated))
 				continue;
-		}
 
-		err = asprintf(&buffer, "%s/%s", filename, entry->d_name);
-		if (err < 0) {
-			pr_err("Error formatting directory entry \"%s\"/\"%s\": %m\n",
-				filename, entry->d_name);
-			ret = -1;
-			break;
+			err = check_dir_entry(filename, listing->entries[i].name,
+				listing->entries[i].type, parents);
+			if (err != 0) {
+				ret = err;
+				if (err < 0)
+					break;
+			}
 		}
 
-		err = process_path2(buffer, parents);
-		free(buffer);
-		if (err != 0) {
-			ret = err;
-			if (err < 0)
-				break;
-		}
+		dircache_release(listing);
+	}
+	else {
+		while ((entry = io->readdir(dirp)) != NULL) {
+			if (skip_entry(st->st_dev, entry->d_ino, entry->d_type, migrated))
+				continue;
 
+			err = check_dir_entry(filename, entry->d_name, entry->d_type, parents);
+			if (err != 0) {
+				ret = err;
+				if (err < 0)
+					break;
+			}
+		}
 	}
 
+	if (migrate_enabled())
+		migrate_dir_end(mdir);
+
 	parents->count--;
 	parents->data[parents->count].inode = 0;
-	closedir(dirp);
+	if (cost_enabled())
+		cost_end(&cost, filename, (unsigned int)parents->count);
+	if (coverage_enabled())
+		coverage_end(&coverage, filename, (unsigned int)parents->count);
+	if (dirp != NULL)
+		io->closedir(dirp);
 
 	return ret;
 }
@@ -433,13 +1011,15 @@ static int check_dir(int fd, const char *filename, struct stat *st, struct paren
  * this will pass it on to check_dir().
  *
  * @param filename  The path to check.
+ * @param rule      The path's policy rule (#POLICY_UNRESOLVED to look it up).
  * @param parents   The parent directories' inodes (to check for loops).
  *
  * @retval 0  The file was processed successfully.
  * @retval >0 An recoverable error occurred.
  * @retval <0 A fatal error occurred.
  */
-static int process_path2(const char *filename, struct parent_dirs *parents)
+static int process_path2(const char *filename, const struct policy_rule *rule,
+	struct parent_dirs *parents)
 {
 	int ret = 0;
 	int err;
@@ -448,35 +1028,76 @@ static int process_path2(const char *filename, struct parent_dirs *parents)
 
 	assert(filename != NULL);
 
-	fd = open(filename, O_RDONLY);
+	if (verify_enabled())
+		drain_verified(false);
+
+	/* Unless it's deep-checked, a file that matches the tag cache doesn't
+	 * even need to be opened.
+	 */
+	if (tagcache_enabled() && !migrate_enabled() && !coverage_enabled() &&
+		(!args.check || policy_enabled()) &&
+		check_file_cached(filename, &rule, parents->count))
+		return 0;
+
+	fd = io->open(filename, O_RDONLY);
 	if (fd < 0) {
 		pr_err("Error: could not open file \"%s\": %m\n", filename);
+		report_error(filename, errno);
 		return 1;
 	}
 
-	err = fstat(fd, &st);
+	err = io->fstat(fd, &st);
 	if (err != 0) {
 		pr_err("Error: could not stat file \"%s\": %m\n", filename);
-		close(fd);
+		report_error(filename, errno);
+		io->close(fd);
 		return -1;
 	}
 
-	if (S_ISREG(st.st_mode)) {
-		ret = check_file(fd, filename, &st);
-		close(fd);
+	if (rule == POLICY_UNRESOLVED)
+		rule = policy_lookup(filename, parents->count, &st, DT_UNKNOWN);
+
+	if (policy_excluded(rule)) {
+		pr_debug("Excluded by policy: %s\n", filename);
+		io->close(fd);
+		return 0;
+	}
+
+	if (S_ISREG(st.st_mode) && coverage_enabled()) {
+		ret = coverage_file(fd, filename, &st);
+		events_file();
+		io->close(fd);
+	}
+	else if (S_ISREG(st.st_mode) && migrate_enabled()) {
+		/* The migration workers close the file. */
+		ret = migrate_file(fd, filename, &st);
+		events_file();
+	}
+	else if (S_ISREG(st.st_mode)) {
+		ret = check_file(fd, filename, &st, rule, parents);
+		cost_file();
+		events_file();
+		if (ret != 0)
+			cost_error();
+		io->close(fd);
 	}
 	else if (S_ISDIR(st.st_mode)) {
 		if (!args.recursive) {
 			pr_err("Error: \"%s\" is a directory\n", filename);
-			close(fd);
+			io->close(fd);
 			return 1;
 		}
 
 		ret = check_dir(fd, filename, &st, parents);
 	}
+	else if (S_ISBLK(st.st_mode) && blockdev_enabled() && !migrate_enabled()) {
+		io->close(fd);
+		ret = blockdev_check(filename, &st);
+		events_file();
+	}
 	else {
 		pr_err("Error: \"%s\": not a regular file or directory\n", filename);
-		close(fd);
+		io->close(fd);
 		return 1;
 	}
 
@@ -488,9 +1109,78 @@ int process_path(const char *filename)
 	int ret;
 	struct parent_dirs parents = { NULL, 0, 0 };
 
-	ret = process_path2(filename, &parents);
+	ret = process_path2(filename, POLICY_UNRESOLVED, &parents);
+
+	budget_free(parents.data, parents.allocated * sizeof(parents.data[0]));
+
+	return ret;
+}
+
+int process_deferred(void)
+{
+	int ret = 0;
+	size_t i;
+
+	if (deferred.count > 0)
+		pr_debug("Processing %zu deferred files\n", deferred.count);
+
+	deferred.draining = true;
+
+	for (i = 0; i < deferred.count; i++) {
+		const char *node_path = pathtree_path(deferred.files[i]);
+		char *path;
+		int err;
+
+		/* Copy it, since reporting verified files rebuilds their paths. */
+		path = node_path != NULL ? strdup(node_path) : NULL;
+		if (path == NULL) {
+			pr_err("Error: could not rebuild a deferred file's path: %m\n");
+			ret = -1;
+			break;
+		}
+
+		stats_queue(STATS_QUEUE_DEFERRED, deferred.count - i - 1);
+
+		err = process_path(path);
+		free(path);
+		if (err < 0) {
+			ret = err;
+			break;
+		}
+		else if (ret == 0 && err > 0) {
+			ret = err;
+		}
+	}
+
+	if (deferred.count > 0)
+		pr_debug("Deferred files used %zu bytes of path storage\n", pathtree_size());
+
+	budget_free(deferred.files, deferred.allocated * sizeof(deferred.files[0]));
+	memset(&deferred, 0, sizeof(deferred));
+	stats_queue(STATS_QUEUE_DEFERRED, 0);
+
+	/* The walk is done reading, so let other processes have its device. */
+	devslot_release();
+
+	/* Files queued for verification still need their nodes. */
+	if (!verify_enabled())
+		pathtree_clear();
+
+	return ret;
+}
+
+int process_verified(void)
+{
+	int ret;
+
+	if (!verify_enabled())
+		return 0;
+
+	drain_verified(true);
+	pathtree_clear();
 
-	free(parents.data);
+	ret = verify_ret;
+	verify_ret = 0;
 
 	return ret;
 }
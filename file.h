@@ -34,6 +34,11 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include "manifest.h"
+
+/** The manifest to record every checked file in (NULL if not in use). */
+extern struct manifest_writer *manifest_out;
+
 /**
  * Figure out whether a file path is a file or directory and process it.
  *
@@ -50,4 +55,24 @@
  */
 int process_path(const char *filename);
 
+/**
+ * Process the files that process_path() deferred because another b2tag
+ * process was reading their device (see --device-slots), waiting for the
+ * devices as necessary.
+ *
+ * @retval 0  The files were processed successfully.
+ * @retval >0 An recoverable error occurred.
+ * @retval <0 A fatal error occurred.
+ */
+int process_deferred(void);
+
+/**
+ * Report the files queued for background verification (see --two-phase),
+ * waiting for them to be verified as necessary.
+ *
+ * @retval 0  The files were verified successfully.
+ * @retval >0 An recoverable error occurred.
+ */
+int process_verified(void);
+
 #endif /* FILE_H */
@@ -0,0 +1,629 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Columnar file table.
+ *
+ * The fixed-size columns live in a single block, so growing the table either
+ * succeeds for every column or leaves the table untouched. Directories are
+ * interned in an open-addressing hash table; consecutive rows usually share a
+ * directory, so the last one is checked first.
+ */
+
+#include "ftable.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "budget.h"
+
+/** The initial number of rows allocated. */
+#define FTABLE_MIN_ROWS 64
+
+/** The initial number of directory hash table slots (a power of 2). */
+#define FTABLE_MIN_SLOTS 256
+
+struct ftable {
+	size_t digest_len;    /**< The digest length (0 for no digests). */
+	bool inodes;          /**< Whether inode numbers are stored. */
+	size_t count;         /**< The number of rows. */
+	size_t allocated;     /**< The number of rows allocated. */
+	void *block;          /**< The memory holding the fixed-size columns. */
+	size_t block_size;    /**< The size of ftable::block. */
+	uint64_t *size;       /**< The file sizes. */
+	int64_t *sec;         /**< The mtimes (seconds). */
+	uint64_t *ino;        /**< The inode numbers (NULL without inodes). */
+	uint32_t *dir;        /**< The directory ids. */
+	uint32_t *name;       /**< The offsets of the names in ftable::names. */
+	uint32_t *nsec;       /**< The mtimes (nanoseconds). */
+	uint32_t *order;      /**< The rows in path order (see ftable_sort_path()). */
+	unsigned char *digest; /**< The digests. */
+	char *names;          /**< The NUL-terminated names. */
+	size_t names_len;     /**< The used length of ftable::names. */
+	size_t names_alloc;   /**< The allocated length of ftable::names. */
+	char *dirs;           /**< The NUL-terminated directories (with a trailing '/'). */
+	size_t dirs_len;      /**< The used length of ftable::dirs. */
+	size_t dirs_alloc;    /**< The allocated length of ftable::dirs. */
+	uint64_t *dir_off;    /**< The offsets of the directories in ftable::dirs. */
+	uint32_t ndirs;       /**< The number of directories. */
+	uint32_t dir_off_alloc; /**< The number of directory offsets allocated. */
+	uint32_t *slots;      /**< The directory hash table (directory id + 1, 0 if empty). */
+	uint32_t nslots;      /**< The number of hash table slots. */
+	uint32_t last_dir;    /**< The directory of the last row added. */
+};
+
+/** Returns the size of one row of the fixed-size columns. */
+static size_t row_size(const struct ftable *t)
+{
+	return 2 * sizeof(uint64_t) + (t->inodes ? sizeof(uint64_t) : 0) +
+		4 * sizeof(uint32_t) + t->digest_len;
+}
+
+/** Point the columns at their parts of @p block (holding @p rows rows). */
+static void set_columns(struct ftable *t, void *block, size_t rows)
+{
+	unsigned char *p = block;
+
+	/* Widest first, so every column is aligned. */
+	t->size = (uint64_t *)p;
+	p += rows * sizeof(uint64_t);
+	t->sec = (int64_t *)p;
+	p += rows * sizeof(int64_t);
+	t->ino = NULL;
+	if (t->inodes) {
+		t->ino = (uint64_t *)p;
+		p += rows * sizeof(uint64_t);
+	}
+	t->dir = (uint32_t *)p;
+	p += rows * sizeof(uint32_t);
+	t->name = (uint32_t *)p;
+	p += rows * sizeof(uint32_t);
+	t->nsec = (uint32_t *)p;
+	p += rows * sizeof(uint32_t);
+	t->order = (uint32_t *)p;
+	p += rows * sizeof(uint32_t);
+	t->digest = p;
+}
+
+/**
+ * Double the number of rows allocated.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int grow_rows(struct ftable *t)
+{
+	size_t rows = t->allocated ? t->allocated * 2 : FTABLE_MIN_ROWS;
+	struct ftable old = *t;
+	size_t size;
+	void *block;
+
+	/* Row numbers are 32-bit. */
+	if (rows > (size_t)UINT32_MAX + 1) {
+		if (t->allocated == (size_t)UINT32_MAX + 1) {
+			errno = EFBIG;
+			return -1;
+		}
+		rows = (size_t)UINT32_MAX + 1;
+	}
+
+	size = rows * row_size(t);
+
+	block = budget_malloc(size);
+	if (block == NULL)
+		return -1;
+
+	set_columns(t, block, rows);
+
+	if (old.count > 0) {
+		memcpy(t->size, old.size, old.count * sizeof(t->size[0]));
+		memcpy(t->sec, old.sec, old.count * sizeof(t->sec[0]));
+		if (t->inodes)
+			memcpy(t->ino, old.ino, old.count * sizeof(t->ino[0]));
+		memcpy(t->dir, old.dir, old.count * sizeof(t->dir[0]));
+		memcpy(t->name, old.name, old.count * sizeof(t->name[0]));
+		memcpy(t->nsec, old.nsec, old.count * sizeof(t->nsec[0]));
+		memcpy(t->digest, old.digest, old.count * t->digest_len);
+	}
+
+	budget_free(old.block, old.block_size);
+
+	t->block = block;
+	t->block_size = size;
+	t->allocated = rows;
+
+	return 0;
+}
+
+struct ftable *ftable_new(size_t digest_len, bool inodes)
+{
+	struct ftable *t;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+
+	t->digest_len = digest_len;
+	t->inodes = inodes;
+	t->last_dir = UINT32_MAX;
+
+	return t;
+}
+
+void ftable_free(struct ftable *t)
+{
+	if (t == NULL)
+		return;
+
+	budget_free(t->block, t->block_size);
+	budget_free(t->names, t->names_alloc);
+	budget_free(t->dirs, t->dirs_alloc);
+	budget_free(t->dir_off, t->dir_off_alloc * sizeof(t->dir_off[0]));
+	budget_free(t->slots, t->nslots * sizeof(t->slots[0]));
+	free(t);
+}
+
+void ftable_clear(struct ftable *t)
+{
+	t->count = 0;
+	t->names_len = 0;
+	t->dirs_len = 0;
+	t->ndirs = 0;
+	t->last_dir = UINT32_MAX;
+
+	if (t->slots != NULL)
+		memset(t->slots, 0, t->nslots * sizeof(t->slots[0]));
+}
+
+/**
+ * Append @p len bytes of @p s and a NUL to a string arena.
+ *
+ * @returns Returns the offset of the copy or -1 (with errno set) on failure.
+ */
+static int64_t arena_add(char **arena, size_t *used, size_t *alloc, const char *s, size_t len)
+{
+	size_t off = *used;
+
+	/* Offsets are 32-bit. */
+	if (off + len + 1 > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (off + len + 1 > *alloc) {
+		size_t size = *alloc ? *alloc : 4096;
+		void *tmp;
+
+		while (size < off + len + 1)
+			size *= 2;
+
+		tmp = budget_realloc(*arena, *alloc, size);
+		if (tmp == NULL)
+			return -1;
+
+		*arena = tmp;
+		*alloc = size;
+	}
+
+	memcpy(*arena + off, s, len);
+	(*arena)[off + len] = '\0';
+	*used = off + len + 1;
+
+	return (int64_t)off;
+}
+
+/** FNV-1a hash of a directory. */
+static uint32_t dir_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/** Returns whether directory @p id is @p s. */
+static bool dir_equals(const struct ftable *t, uint32_t id, const char *s, size_t len)
+{
+	const char *d = t->dirs + t->dir_off[id];
+
+	return strncmp(d, s, len) == 0 && d[len] == '\0';
+}
+
+/**
+ * Double the size of the directory hash table (rehashing every directory).
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int grow_slots(struct ftable *t)
+{
+	uint32_t nslots = t->nslots ? t->nslots * 2 : FTABLE_MIN_SLOTS;
+	uint32_t *slots;
+	uint32_t id;
+
+	slots = budget_malloc(nslots * sizeof(slots[0]));
+	if (slots == NULL)
+		return -1;
+
+	memset(slots, 0, nslots * sizeof(slots[0]));
+
+	for (id = 0; id < t->ndirs; id++) {
+		const char *d = t->dirs + t->dir_off[id];
+		uint32_t i = dir_hash(d, strlen(d)) & (nslots - 1);
+
+		while (slots[i] != 0)
+			i = (i + 1) & (nslots - 1);
+
+		slots[i] = id + 1;
+	}
+
+	budget_free(t->slots, t->nslots * sizeof(t->slots[0]));
+	t->slots = slots;
+	t->nslots = nslots;
+
+	return 0;
+}
+
+/**
+ * Find (or add) a directory.
+ *
+ * @returns Returns the directory's id or -1 (with errno set) on failure.
+ */
+static int64_t intern_dir(struct ftable *t, const char *s, size_t len)
+{
+	int64_t off;
+	uint32_t i;
+
+	if (t->last_dir != UINT32_MAX && dir_equals(t, t->last_dir, s, len))
+		return t->last_dir;
+
+	/* Keep the hash table at most half full. */
+	if ((t->ndirs + 1) * 2 > t->nslots && grow_slots(t) != 0)
+		return -1;
+
+	i = dir_hash(s, len) & (t->nslots - 1);
+
+	while (t->slots[i] != 0) {
+		uint32_t id = t->slots[i] - 1;
+
+		if (dir_equals(t, id, s, len)) {
+			t->last_dir = id;
+			return id;
+		}
+
+		i = (i + 1) & (t->nslots - 1);
+	}
+
+	if (t->ndirs >= t->dir_off_alloc) {
+		uint32_t alloc = t->dir_off_alloc ? t->dir_off_alloc * 2 : FTABLE_MIN_SLOTS;
+		void *tmp;
+
+		tmp = budget_realloc(t->dir_off, t->dir_off_alloc * sizeof(t->dir_off[0]),
+			alloc * sizeof(t->dir_off[0]));
+		if (tmp == NULL)
+			return -1;
+
+		t->dir_off = tmp;
+		t->dir_off_alloc = alloc;
+	}
+
+	off = arena_add(&t->dirs, &t->dirs_len, &t->dirs_alloc, s, len);
+	if (off < 0)
+		return -1;
+
+	t->dir_off[t->ndirs] = (uint64_t)off;
+	t->slots[i] = t->ndirs + 1;
+	t->last_dir = t->ndirs;
+
+	return t->ndirs++;
+}
+
+int ftable_add(struct ftable *t, const char *path, uint64_t ino, uint64_t size,
+	const struct timespec *mtime, const unsigned char *digest)
+{
+	const char *slash = strrchr(path, '/');
+	size_t dir_len = slash != NULL ? (size_t)(slash - path) + 1 : 0;
+	int64_t dir;
+	int64_t name;
+
+	assert(t != NULL && path != NULL && mtime != NULL);
+
+	if (strlen(path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (t->count >= t->allocated && grow_rows(t) != 0)
+		return 1;
+
+	dir = intern_dir(t, path, dir_len);
+	if (dir < 0)
+		return 1;
+
+	name = arena_add(&t->names, &t->names_len, &t->names_alloc, path + dir_len,
+		strlen(path + dir_len));
+	if (name < 0)
+		return 1;
+
+	t->size[t->count] = size;
+	t->sec[t->count] = (int64_t)mtime->tv_sec;
+	t->nsec[t->count] = (uint32_t)mtime->tv_nsec;
+	t->dir[t->count] = (uint32_t)dir;
+	t->name[t->count] = (uint32_t)name;
+	if (t->inodes)
+		t->ino[t->count] = ino;
+	if (t->digest_len > 0)
+		memcpy(t->digest + t->count * t->digest_len, digest, t->digest_len);
+
+	t->count++;
+
+	return 0;
+}
+
+size_t ftable_count(const struct ftable *t)
+{
+	return t->count;
+}
+
+size_t ftable_bytes(const struct ftable *t)
+{
+	return t->block_size + t->names_alloc + t->dirs_alloc +
+		t->dir_off_alloc * sizeof(t->dir_off[0]) + t->nslots * sizeof(t->slots[0]);
+}
+
+size_t ftable_path(const struct ftable *t, uint32_t row, char *buf, size_t size)
+{
+	assert(row < t->count);
+
+	return (size_t)snprintf(buf, size, "%s%s", t->dirs + t->dir_off[t->dir[row]],
+		t->names + t->name[row]);
+}
+
+/** Returns an integer column. */
+static const uint64_t *column(const struct ftable *t, enum ftable_column col)
+{
+	if (col == FTABLE_INO) {
+		assert(t->inodes);
+		return t->ino;
+	}
+
+	return t->size;
+}
+
+uint64_t ftable_get(const struct ftable *t, enum ftable_column col, uint32_t row)
+{
+	assert(row < t->count);
+
+	return column(t, col)[row];
+}
+
+struct timespec ftable_mtime(const struct ftable *t, uint32_t row)
+{
+	assert(row < t->count);
+
+	return (struct timespec){ .tv_sec = (time_t)t->sec[row], .tv_nsec = t->nsec[row] };
+}
+
+const unsigned char *ftable_digest(const struct ftable *t, uint32_t row)
+{
+	assert(row < t->count);
+
+	return t->digest_len > 0 ? t->digest + row * t->digest_len : NULL;
+}
+
+/**
+ * Compare the concatenations a1 + a2 and b1 + b2 (like strcmp()) without
+ * building them.
+ */
+static int concat_compare(const char *a1, const char *a2, const char *b1, const char *b2)
+{
+	const unsigned char *a = (const unsigned char *)a1;
+	const unsigned char *b = (const unsigned char *)b1;
+	const unsigned char *an = (const unsigned char *)a2;
+	const unsigned char *bn = (const unsigned char *)b2;
+
+	for (;;) {
+		if (*a == '\0' && an != NULL) {
+			a = an;
+			an = NULL;
+			continue;
+		}
+
+		if (*b == '\0' && bn != NULL) {
+			b = bn;
+			bn = NULL;
+			continue;
+		}
+
+		if (*a != *b || *a == '\0')
+			return (*a > *b) - (*a < *b);
+
+		a++;
+		b++;
+	}
+}
+
+/** qsort_r() comparison function to sort rows by path (then row number). */
+static int path_compare(const void *a, const void *b, void *arg)
+{
+	const struct ftable *t = arg;
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	int cmp;
+
+	if (t->dir[x] == t->dir[y])
+		cmp = strcmp(t->names + t->name[x], t->names + t->name[y]);
+	else
+		cmp = concat_compare(t->dirs + t->dir_off[t->dir[x]], t->names + t->name[x],
+			t->dirs + t->dir_off[t->dir[y]], t->names + t->name[y]);
+
+	if (cmp != 0)
+		return cmp;
+
+	return (x > y) - (x < y);
+}
+
+const uint32_t *ftable_sort_path(struct ftable *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->count; i++)
+		t->order[i] = (uint32_t)i;
+
+	qsort_r(t->order, t->count, sizeof(t->order[0]), path_compare, t);
+
+	return t->order;
+}
+
+uint32_t *ftable_rows_alloc(size_t n)
+{
+	return budget_malloc((n ? n : 1) * sizeof(uint32_t));
+}
+
+void ftable_rows_free(uint32_t *rows, size_t n)
+{
+	budget_free(rows, (n ? n : 1) * sizeof(uint32_t));
+}
+
+uint32_t *ftable_sort(const struct ftable *t, enum ftable_column col, uint32_t *rows, size_t n)
+{
+	const uint64_t *values = column(t, col);
+	uint32_t *out = rows;
+	uint64_t *keys;
+	uint64_t *src_keys, *dst_keys;
+	uint32_t *src_rows, *dst_rows;
+	uint32_t *tmp;
+	unsigned int shift;
+	size_t i;
+
+	if (rows == NULL) {
+		n = t->count;
+		out = ftable_rows_alloc(n);
+		if (out == NULL)
+			return NULL;
+
+		for (i = 0; i < n; i++)
+			out[i] = (uint32_t)i;
+	}
+
+	/* The keys are gathered once, so each pass reads them sequentially. */
+	keys = budget_malloc((n ? n : 1) * 2 * sizeof(keys[0]));
+	tmp = ftable_rows_alloc(n);
+	if (keys == NULL || tmp == NULL) {
+		budget_free(keys, (n ? n : 1) * 2 * sizeof(keys[0]));
+		ftable_rows_free(tmp, n);
+		if (rows == NULL)
+			ftable_rows_free(out, n);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++)
+		keys[i] = values[out[i]];
+
+	src_keys = keys;
+	dst_keys = keys + n;
+	src_rows = out;
+	dst_rows = tmp;
+
+	/* LSD radix sort, one byte per pass (ping-ponging between the buffers). */
+	for (shift = 0; shift < 64; shift += 8) {
+		size_t count[256] = { 0 };
+		size_t sum = 0;
+		unsigned int b;
+		void *swap;
+
+		for (i = 0; i < n; i++)
+			count[(src_keys[i] >> shift) & 0xff]++;
+
+		/* Skip the passes where every key has the same byte. */
+		if (n == 0 || count[(src_keys[0] >> shift) & 0xff] == n)
+			continue;
+
+		for (b = 0; b < 256; b++) {
+			size_t c = count[b];
+
+			count[b] = sum;
+			sum += c;
+		}
+
+		for (i = 0; i < n; i++) {
+			size_t pos = count[(src_keys[i] >> shift) & 0xff]++;
+
+			dst_keys[pos] = src_keys[i];
+			dst_rows[pos] = src_rows[i];
+		}
+
+		swap = src_keys;
+		src_keys = dst_keys;
+		dst_keys = swap;
+		swap = src_rows;
+		src_rows = dst_rows;
+		dst_rows = swap;
+	}
+
+	if (src_rows != out)
+		memcpy(out, src_rows, n * sizeof(out[0]));
+
+	budget_free(keys, (n ? n : 1) * 2 * sizeof(keys[0]));
+	ftable_rows_free(tmp, n);
+
+	return out;
+}
+
+size_t ftable_filter(const struct ftable *t, enum ftable_column col, uint64_t lo, uint64_t hi,
+	const uint32_t *rows, size_t n, uint32_t *out)
+{
+	const uint64_t *values = column(t, col);
+	uint64_t range = hi - lo;
+	size_t selected = 0;
+	size_t i;
+
+	if (lo > hi)
+		return 0;
+
+	if (rows == NULL)
+		n = t->count;
+
+	/* Branch-free: every row is written, but only kept if it's in range. */
+	for (i = 0; i < n; i++) {
+		uint32_t row = rows != NULL ? rows[i] : (uint32_t)i;
+
+		out[selected] = row;
+		selected += values[row] - lo <= range;
+	}
+
+	return selected;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Columnar file table declarations.
+ *
+ * An ftable holds the metadata of a large number of files (their path, inode
+ * number, size, mtime, and digest) as a structure of arrays: each field is a
+ * separate, densely packed column, indexed by row number. Paths are split
+ * into an interned directory (stored once, however many files it holds) and
+ * a name, so a row costs 32 bytes plus its digest and name (40 with inode
+ * numbers), including the room to sort it by path.
+ *
+ * Rows are never reordered: sorting and filtering produce arrays of row
+ * numbers (permutations and selections), so the columns stay compact and
+ * several orders can be used at once.
+ */
+
+#ifndef FTABLE_H
+#define FTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/** A columnar file table. */
+struct ftable;
+
+/** The integer columns that can be sorted and filtered on. */
+enum ftable_column {
+	FTABLE_SIZE, /**< The file size. */
+	FTABLE_INO,  /**< The inode number (tables created with inodes only). */
+};
+
+/**
+ * Create an empty table.
+ *
+ * @param digest_len  The length of the (raw) digests (0 for no digest column).
+ * @param inodes      Whether to store inode numbers.
+ *
+ * @returns Returns the table or NULL (with errno set) on failure.
+ */
+struct ftable *ftable_new(size_t digest_len, bool inodes);
+
+/**
+ * Free a table.
+ *
+ * @param t  The table (may be NULL).
+ */
+void ftable_free(struct ftable *t);
+
+/**
+ * Remove all rows (keeping the memory allocated).
+ *
+ * @param t  The table.
+ */
+void ftable_clear(struct ftable *t);
+
+/**
+ * Add a row.
+ *
+ * The columns grow from the memory budget, so a table can fill up before
+ * memory actually runs out; the caller can then spill the rows somewhere
+ * and ftable_clear() the table.
+ *
+ * @param t       The table.
+ * @param path    The file's path.
+ * @param ino     The file's inode number (ignored without an inode column).
+ * @param size    The file's size.
+ * @param mtime   The file's mtime.
+ * @param digest  The file's raw digest (ignored without a digest column).
+ *
+ * @retval 0  The row was added.
+ * @retval >0 The table is full (errno is set to ENOMEM or EFBIG).
+ * @retval <0 @p path is too long (errno is set to ENAMETOOLONG).
+ */
+int ftable_add(struct ftable *t, const char *path, uint64_t ino, uint64_t size,
+	const struct timespec *mtime, const unsigned char *digest);
+
+/**
+ * Returns the number of rows.
+ */
+size_t ftable_count(const struct ftable *t);
+
+/**
+ * Returns the number of bytes the table's columns use.
+ */
+size_t ftable_bytes(const struct ftable *t);
+
+/**
+ * Rebuild a row's path.
+ *
+ * @param t     The table.
+ * @param row   The row.
+ * @param buf   The buffer to write the path to.
+ * @param size  The size of @p buf.
+ *
+ * @returns Returns the path's length (truncated if it's >= @p size).
+ */
+size_t ftable_path(const struct ftable *t, uint32_t row, char *buf, size_t size);
+
+/**
+ * Returns a row's value in an integer column.
+ */
+uint64_t ftable_get(const struct ftable *t, enum ftable_column col, uint32_t row);
+
+/**
+ * Returns a row's mtime.
+ */
+struct timespec ftable_mtime(const struct ftable *t, uint32_t row);
+
+/**
+ * Returns a row's digest (NULL if the table has no digest column).
+ */
+const unsigned char *ftable_digest(const struct ftable *t, uint32_t row);
+
+/**
+ * Sort the rows by path.
+ *
+ * Rows with the same path stay in the order they were added. The order is
+ * kept in space reserved with the rows, so sorting a full table (e.g. to
+ * spill it) doesn't need any more memory.
+ *
+ * @param t  The table.
+ *
+ * @returns Returns the row numbers in path order (valid until the table is
+ *          changed).
+ */
+const uint32_t *ftable_sort_path(struct ftable *t);
+
+/**
+ * Sort rows by an integer column (a stable radix sort).
+ *
+ * @param t     The table.
+ * @param col   The column to sort by.
+ * @param rows  The rows to sort, sorted in place (NULL for all rows).
+ * @param n     The number of rows in @p rows.
+ *
+ * @returns Returns the sorted rows (@p rows, or a new array to free with
+ *          ftable_rows_free() if @p rows is NULL) or NULL on failure.
+ */
+uint32_t *ftable_sort(const struct ftable *t, enum ftable_column col, uint32_t *rows, size_t n);
+
+/**
+ * Select the rows whose value in an integer column is in [@p lo, @p hi].
+ *
+ * @param t     The table.
+ * @param col   The column to filter on.
+ * @param lo    The smallest value to select.
+ * @param hi    The largest value to select.
+ * @param rows  The rows to filter (NULL for all rows).
+ * @param n     The number of rows in @p rows.
+ * @param out   The selected rows (may be @p rows; must have room for @p n rows,
+ *              or all rows if @p rows is NULL).
+ *
+ * @returns Returns the number of rows selected (in their original order).
+ */
+size_t ftable_filter(const struct ftable *t, enum ftable_column col, uint64_t lo, uint64_t hi,
+	const uint32_t *rows, size_t n, uint32_t *out);
+
+/**
+ * Allocate an array of row numbers (from the memory budget).
+ *
+ * @param n  The number of rows.
+ *
+ * @returns Returns the array or NULL on failure.
+ */
+uint32_t *ftable_rows_alloc(size_t n);
+
+/**
+ * Free an array of row numbers.
+ *
+ * @param rows  The array (may be NULL).
+ * @param n     The number of rows it was allocated for.
+ */
+void ftable_rows_free(uint32_t *rows, size_t n);
+
+#endif /* FTABLE_H */
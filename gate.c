@@ -0,0 +1,727 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+
+/** @file
+ * Verify-on-open gate (fanotify permission events).
+ *
+ * The main thread reads the permission events and answers cache hits itself,
+ * so the common case costs an fstat() and a hash table probe. Everything else
+ * is queued for the workers; the main thread only wakes up again to answer
+ * the opens whose deadline passed.
+ */
+
+#include "gate.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/fanotify.h>
+
+#include "b2tag.h"
+#include "budget.h"
+#include "events.h"
+#include "io.h"
+#include "utilities.h"
+#include "xa.h"
+
+/** Call the kernel's fadvise() on files larger than this. */
+#define FADVISE_THRESHOLD 65536
+
+/** The number of entries in each verified cache set. */
+#define CACHE_WAYS 4
+
+/** The number of locks the verified cache's sets are spread over. */
+#define CACHE_LOCKS 64
+
+/** The number of queued opens per worker. */
+#define QUEUE_PER_WORKER 4
+
+/** A file whose contents were verified. */
+struct cache_entry {
+	dev_t dev;             /**< The file's device (0 if the entry is unused). */
+	ino_t ino;             /**< The file's inode number. */
+	struct timespec mtime; /**< The file's mtime when it was verified. */
+	struct timespec ctime; /**< The file's ctime when it was verified. */
+	off_t size;            /**< The file's size when it was verified. */
+	time_t verified;       /**< When it was verified (CLOCK_MONOTONIC_COARSE seconds). */
+};
+
+/** The verified cache (a set-associative hash table keyed by device and inode). */
+static struct {
+	struct cache_entry *entries;          /**< The entries (CACHE_WAYS per set). */
+	size_t nsets;                         /**< The number of sets (a power of two). */
+	unsigned int shift;                   /**< 64 - log2(nsets), to pick a set. */
+	time_t ttl;                           /**< How long an entry is trusted (0 for no limit). */
+	pthread_mutex_t locks[CACHE_LOCKS];   /**< Protect the sets. */
+} cache;
+
+/** An open waiting for a worker. */
+struct gate_job {
+	int fd;              /**< The event's file descriptor (-1 if the slot is free). */
+	bool running;        /**< Whether a worker is verifying the file. */
+	bool answered;       /**< Whether the open was already answered. */
+	uint64_t deadline;   /**< When to answer without waiting (0 for never). */
+	struct stat st;      /**< The file's stat() structure. */
+	char path[PATH_MAX]; /**< The file's path. */
+};
+
+/** The gate daemon's state. */
+static struct {
+	const struct gate_config *cfg; /**< The gate's settings. */
+	int fan_fd;                 /**< The fanotify group. */
+	char **roots;               /**< The gated paths (canonicalized). */
+	size_t nroots;              /**< The number of gated paths. */
+	struct gate_job *jobs;      /**< The job slots. */
+	size_t njobs;               /**< The number of job slots. */
+	size_t *queue;              /**< The queued job slots (a ring of njobs entries). */
+	size_t head;                /**< The next queued slot to verify. */
+	size_t queued;              /**< The number of queued slots. */
+	bool stop;                  /**< Whether the workers should exit. */
+	pthread_t *workers;         /**< The worker threads. */
+	unsigned int nworkers;      /**< The number of worker threads started. */
+	pthread_mutex_t lock;       /**< Protects the jobs, queue, and stop. */
+	pthread_cond_t wake;        /**< Signalled when a job is queued (or on stop). */
+
+	uint64_t opens;     /**< Permission events received. */
+	uint64_t fast;      /**< Opens allowed by gate_lookup(). */
+	uint64_t fast_ns;   /**< Total time spent on those decisions. */
+	uint64_t ignored;   /**< Opens outside the gated paths. */
+	uint64_t verified;  /**< Opens allowed by a worker. */
+	uint64_t denied;    /**< Opens denied. */
+	uint64_t timeouts;  /**< Opens answered after --gate-timeout. */
+	uint64_t full;      /**< Opens answered because the queue was full. */
+} gate = {
+	.fan_fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+/** Set by the signal handler to stop the gate. */
+static volatile sig_atomic_t gate_stopping;
+
+/** Returns the current monotonic time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/** Returns the current (coarse) monotonic time in seconds. */
+static time_t now_coarse(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec;
+}
+
+/*
+ * The verified cache.
+ */
+
+int gate_cache_init(size_t entries, time_t ttl)
+{
+	unsigned int shift = 64;
+	size_t nsets = 1;
+	size_t i;
+
+	while (nsets * CACHE_WAYS < entries) {
+		nsets *= 2;
+		shift--;
+	}
+
+	cache.entries = budget_malloc(nsets * CACHE_WAYS * sizeof(cache.entries[0]));
+	if (cache.entries == NULL)
+		return -1;
+
+	memset(cache.entries, 0, nsets * CACHE_WAYS * sizeof(cache.entries[0]));
+	cache.nsets = nsets;
+	cache.shift = shift;
+	cache.ttl = ttl;
+
+	for (i = 0; i < CACHE_LOCKS; i++)
+		pthread_mutex_init(&cache.locks[i], NULL);
+
+	return 0;
+}
+
+void gate_cache_free(void)
+{
+	size_t i;
+
+	if (cache.entries == NULL)
+		return;
+
+	for (i = 0; i < CACHE_LOCKS; i++)
+		pthread_mutex_destroy(&cache.locks[i]);
+
+	budget_free(cache.entries, cache.nsets * CACHE_WAYS * sizeof(cache.entries[0]));
+	cache.entries = NULL;
+	cache.nsets = 0;
+}
+
+/** Returns the cache set of a file. */
+static size_t cache_set(const struct stat *st)
+{
+	uint64_t h = ((uint64_t)st->st_dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)st->st_ino;
+
+	/* Fibonacci hashing: the top bits are the well-mixed ones. */
+	h *= 0x9E3779B97F4A7C15ULL;
+
+	return cache.shift < 64 ? (size_t)(h >> cache.shift) : 0;
+}
+
+/** Returns whether a cache entry describes the file @p st unchanged. */
+static bool cache_matches(const struct cache_entry *e, const struct stat *st)
+{
+	return e->ino == st->st_ino && e->dev == st->st_dev && e->size == st->st_size &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+		e->ctime.tv_sec == st->st_ctim.tv_sec && e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/** Returns whether the file @p st was verified recently and hasn't changed since. */
+static bool cache_lookup(const struct stat *st)
+{
+	size_t set = cache_set(st);
+	struct cache_entry *e = &cache.entries[set * CACHE_WAYS];
+	pthread_mutex_t *lock = &cache.locks[set % CACHE_LOCKS];
+	bool hit = false;
+	size_t i;
+
+	pthread_mutex_lock(lock);
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		if (cache_matches(&e[i], st)) {
+			hit = cache.ttl == 0 || now_coarse() - e[i].verified < cache.ttl;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(lock);
+
+	return hit;
+}
+
+/** Record that the file @p st was verified (replacing the set's oldest entry). */
+static void cache_insert(const struct stat *st)
+{
+	size_t set = cache_set(st);
+	struct cache_entry *e = &cache.entries[set * CACHE_WAYS];
+	pthread_mutex_t *lock = &cache.locks[set % CACHE_LOCKS];
+	size_t victim = 0;
+	size_t i;
+
+	pthread_mutex_lock(lock);
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		/* The same file (possibly changed since). */
+		if (e[i].ino == st->st_ino && e[i].dev == st->st_dev) {
+			victim = i;
+			break;
+		}
+
+		if (e[i].verified < e[victim].verified)
+			victim = i;
+	}
+
+	e[victim] = (struct cache_entry){
+		.dev = st->st_dev,
+		.ino = st->st_ino,
+		.mtime = st->st_mtim,
+		.ctime = st->st_ctim,
+		.size = st->st_size,
+		.verified = now_coarse(),
+	};
+
+	pthread_mutex_unlock(lock);
+}
+
+/*
+ * Decisions.
+ */
+
+enum gate_decision gate_lookup(int fd, struct stat *st)
+{
+	/* Let gate_verify() report the error. */
+	if (io->fstat(fd, st) != 0) {
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFREG;
+		return GATE_VERIFY;
+	}
+
+	if (!S_ISREG(st->st_mode))
+		return GATE_ALLOW;
+
+	return cache_lookup(st) ? GATE_ALLOW : GATE_VERIFY;
+}
+
+enum gate_decision gate_verify(int fd, const struct stat *st, const char *path, bool fail_closed)
+{
+	enum gate_decision failed = fail_closed ? GATE_DENY : GATE_ALLOW;
+	const char *state;
+	xa_t stored;
+	xa_t actual;
+	int comparison;
+	int err;
+
+	/* gate_lookup() zeroes the stat() structure if fstat() failed. */
+	if (st->st_ino == 0) {
+		pr_err("Error: could not stat \"%s\"\n", path);
+		return failed;
+	}
+
+	memset(&stored, 0, sizeof(stored));
+	memset(&actual, 0, sizeof(actual));
+	stored.alg = actual.alg = args.alg;
+
+	err = xa_read(fd, &stored);
+	if (err == 1)
+		return GATE_ALLOW;
+
+	if (err != 0) {
+		pr_err("Error: could not read the tag of \"%s\"\n", path);
+		return failed;
+	}
+
+	/* Modified since it was tagged: there's nothing to verify against. */
+	comparison = ts_compare(stored.mtime, st->st_mtim, stored.fuzzy);
+	if (comparison < 0)
+		return GATE_ALLOW;
+
+	if (st->st_size > FADVISE_THRESHOLD)
+		io->fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	actual.mtime = st->st_mtim;
+	if (xa_compute(fd, &actual) != 0) {
+		pr_err("Error: could not hash \"%s\"\n", path);
+		return failed;
+	}
+
+	if (strcmp(stored.hash, actual.hash) == 0) {
+		cache_insert(st);
+		return GATE_ALLOW;
+	}
+
+	state = comparison == 0 ? "CORRUPT" : "BACKDATED";
+	if (check_crit())
+		printf("%s: %s (open denied)\n", path, state);
+	events_state(path, state);
+
+	return GATE_DENY;
+}
+
+/*
+ * The daemon.
+ */
+
+/** Answer a permission event. */
+static void respond(int fd, enum gate_decision decision)
+{
+	struct fanotify_response r = {
+		.fd = fd,
+		.response = decision == GATE_DENY ? FAN_DENY : FAN_ALLOW,
+	};
+
+	if (write(gate.fan_fd, &r, sizeof(r)) != sizeof(r))
+		pr_err("Error: could not answer a permission event: %m\n");
+}
+
+/** Returns the decision for opens that can't wait for a worker. */
+static enum gate_decision fallback(void)
+{
+	return gate.cfg->fail_closed ? GATE_DENY : GATE_ALLOW;
+}
+
+/** Returns whether @p path is one of the gated paths or below one. */
+static bool gated(const char *path)
+{
+	size_t i;
+
+	for (i = 0; i < gate.nroots; i++) {
+		size_t len = strlen(gate.roots[i]);
+
+		if (strncmp(path, gate.roots[i], len) == 0 &&
+			(path[len] == '\0' || path[len] == '/' || (len == 1 && path[0] == '/')))
+			return true;
+	}
+
+	return false;
+}
+
+/** A gate worker thread. */
+static void *gate_worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&gate.lock);
+
+	for (;;) {
+		enum gate_decision decision;
+		struct gate_job *job;
+
+		while (gate.queued == 0 && !gate.stop)
+			pthread_cond_wait(&gate.wake, &gate.lock);
+
+		if (gate.queued == 0)
+			break;
+
+		job = &gate.jobs[gate.queue[gate.head]];
+		gate.head = (gate.head + 1) % gate.njobs;
+		gate.queued--;
+		job->running = true;
+
+		pthread_mutex_unlock(&gate.lock);
+		decision = gate_verify(job->fd, &job->st, job->path, gate.cfg->fail_closed);
+		pthread_mutex_lock(&gate.lock);
+
+		if (!job->answered)
+			respond(job->fd, decision);
+		else if (decision == GATE_DENY && !gate.cfg->fail_closed)
+			pr_err("Error: \"%s\" was opened before it was found to be corrupt (see --gate-timeout)\n",
+				job->path);
+
+		if (decision == GATE_DENY)
+			gate.denied++;
+		else
+			gate.verified++;
+
+		close(job->fd);
+		job->fd = -1;
+		job->running = false;
+	}
+
+	pthread_mutex_unlock(&gate.lock);
+
+	return NULL;
+}
+
+/**
+ * Answer the opens whose deadline passed.
+ *
+ * @returns Returns the number of milliseconds until the next deadline (-1 if
+ *          there is none).
+ */
+static int gate_expire(void)
+{
+	uint64_t now = now_ns();
+	uint64_t next = UINT64_MAX;
+	size_t i;
+
+	pthread_mutex_lock(&gate.lock);
+
+	for (i = 0; i < gate.njobs; i++) {
+		struct gate_job *job = &gate.jobs[i];
+
+		if (job->fd < 0 || job->answered || job->deadline == 0)
+			continue;
+
+		if (job->deadline <= now) {
+			respond(job->fd, fallback());
+			job->answered = true;
+			gate.timeouts++;
+			pr_debug("Answered the open of \"%s\" before it was verified\n", job->path);
+		}
+		else if (job->deadline < next) {
+			next = job->deadline;
+		}
+	}
+
+	pthread_mutex_unlock(&gate.lock);
+
+	if (next == UINT64_MAX)
+		return -1;
+
+	/* Round up, so the deadline has passed when poll() returns. */
+	return (int)((next - now + 999999) / 1000000);
+}
+
+/** Handle a FAN_OPEN_PERM event. */
+static void gate_event(int fd)
+{
+	char link[32];
+	struct gate_job *job = NULL;
+	struct stat st;
+	uint64_t start;
+	ssize_t len;
+	size_t i;
+
+	gate.opens++;
+
+	start = now_ns();
+	if (gate_lookup(fd, &st) == GATE_ALLOW) {
+		respond(fd, GATE_ALLOW);
+		gate.fast_ns += now_ns() - start;
+		gate.fast++;
+		close(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&gate.lock);
+
+	for (i = 0; i < gate.njobs; i++) {
+		if (gate.jobs[i].fd < 0) {
+			job = &gate.jobs[i];
+			break;
+		}
+	}
+
+	if (job == NULL) {
+		pthread_mutex_unlock(&gate.lock);
+		respond(fd, fallback());
+		gate.full++;
+		close(fd);
+		return;
+	}
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, job->path, sizeof(job->path) - 1);
+	if (len < 0 || !gated((job->path[len] = '\0', job->path))) {
+		pthread_mutex_unlock(&gate.lock);
+		respond(fd, GATE_ALLOW);
+		gate.ignored++;
+		close(fd);
+		return;
+	}
+
+	job->fd = fd;
+	job->st = st;
+	job->answered = false;
+	job->deadline = gate.cfg->timeout_ms ? start + gate.cfg->timeout_ms * 1000000ULL : 0;
+	gate.queue[(gate.head + gate.queued) % gate.njobs] = i;
+	gate.queued++;
+	pthread_cond_signal(&gate.wake);
+
+	pthread_mutex_unlock(&gate.lock);
+}
+
+/**
+ * Read and handle the pending fanotify events.
+ *
+ * @returns Returns 0 on success and -1 if the events couldn't be read.
+ */
+static int gate_read_events(void)
+{
+	char buf[64 * 1024] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	const struct fanotify_event_metadata *meta;
+	ssize_t len;
+
+	len = read(gate.fan_fd, buf, sizeof(buf));
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	for (meta = (void *)buf; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+		if (meta->vers != FANOTIFY_METADATA_VERSION) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		if (meta->fd < 0)
+			continue;
+
+		/* Our own opens (e.g. of the hash backend cache) must never wait on us. */
+		if (meta->pid == getpid() || !(meta->mask & FAN_OPEN_PERM)) {
+			if (meta->mask & FAN_OPEN_PERM)
+				respond(meta->fd, GATE_ALLOW);
+			close(meta->fd);
+			continue;
+		}
+
+		gate_event(meta->fd);
+	}
+
+	return 0;
+}
+
+/** Signal handler to stop the gate. */
+static void on_signal(int sig)
+{
+	(void)sig;
+	gate_stopping = 1;
+}
+
+/** Stop the workers, answer the opens still queued, and free everything. */
+static void gate_cleanup(void)
+{
+	unsigned int i;
+	size_t j;
+
+	pthread_mutex_lock(&gate.lock);
+
+	gate.stop = true;
+	for (; gate.queued > 0; gate.queued--) {
+		struct gate_job *job = &gate.jobs[gate.queue[gate.head]];
+
+		if (!job->answered)
+			respond(job->fd, GATE_ALLOW);
+		close(job->fd);
+		job->fd = -1;
+		gate.head = (gate.head + 1) % gate.njobs;
+	}
+
+	pthread_cond_broadcast(&gate.wake);
+	pthread_mutex_unlock(&gate.lock);
+
+	for (i = 0; i < gate.nworkers; i++)
+		pthread_join(gate.workers[i], NULL);
+
+	if (gate.fan_fd >= 0)
+		close(gate.fan_fd);
+
+	for (j = 0; j < gate.nroots; j++)
+		free(gate.roots[j]);
+
+	free(gate.roots);
+	free(gate.workers);
+	free(gate.jobs);
+	free(gate.queue);
+	gate_cache_free();
+}
+
+/** Print the gate's counters. */
+static void gate_report(void)
+{
+	if (!check_err())
+		return;
+
+	printf("Gate: %llu opens, %llu allowed without verifying (%.0f ns each), %llu outside the gated paths,\n"
+		"      %llu verified, %llu denied, %llu timed out, %llu answered with the queue full\n",
+		(unsigned long long)gate.opens, (unsigned long long)gate.fast,
+		gate.fast ? (double)gate.fast_ns / (double)gate.fast : 0.0,
+		(unsigned long long)gate.ignored, (unsigned long long)gate.verified,
+		(unsigned long long)gate.denied, (unsigned long long)gate.timeouts,
+		(unsigned long long)gate.full);
+}
+
+int gate_run(char * const *paths, size_t npaths, const struct gate_config *cfg)
+{
+	struct sigaction sa;
+	struct pollfd pfd;
+	int ret = 1;
+	size_t i;
+
+	gate.cfg = cfg;
+
+	if (gate_cache_init(cfg->cache_entries, cfg->ttl) != 0) {
+		pr_err("Error: could not allocate the verified cache: %m\n");
+		return 1;
+	}
+
+	gate.njobs = (size_t)cfg->workers * QUEUE_PER_WORKER;
+	gate.jobs = calloc(gate.njobs, sizeof(gate.jobs[0]));
+	gate.queue = calloc(gate.njobs, sizeof(gate.queue[0]));
+	gate.roots = calloc(npaths, sizeof(gate.roots[0]));
+	gate.workers = calloc(cfg->workers, sizeof(gate.workers[0]));
+	if (gate.jobs == NULL || gate.queue == NULL || gate.roots == NULL || gate.workers == NULL) {
+		pr_err("Error: could not allocate the gate: %m\n");
+		goto out;
+	}
+
+	for (i = 0; i < gate.njobs; i++)
+		gate.jobs[i].fd = -1;
+
+	gate.fan_fd = fanotify_init(FAN_CLASS_CONTENT | FAN_CLOEXEC | FAN_NONBLOCK | FAN_UNLIMITED_QUEUE,
+		O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (gate.fan_fd < 0) {
+		pr_err("Error: could not create the fanotify group: %m\n");
+		goto out;
+	}
+
+	for (i = 0; i < npaths; i++) {
+		gate.roots[i] = realpath(paths[i], NULL);
+		if (gate.roots[i] == NULL) {
+			pr_err("Error: could not resolve \"%s\": %m\n", paths[i]);
+			goto out;
+		}
+		gate.nroots++;
+
+		if (fanotify_mark(gate.fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN_PERM,
+				AT_FDCWD, gate.roots[i]) != 0) {
+			pr_err("Error: could not watch the mount of \"%s\": %m\n", gate.roots[i]);
+			goto out;
+		}
+	}
+
+	for (; gate.nworkers < cfg->workers; gate.nworkers++) {
+		int err = pthread_create(&gate.workers[gate.nworkers], NULL, gate_worker, NULL);
+
+		if (err != 0) {
+			errno = err;
+			pr_err("Error: could not start a gate worker: %m\n");
+			goto out;
+		}
+	}
+
+	/* Without SA_RESTART, so the signals interrupt poll(). */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pr_warn("Gating opens below %zu path(s) with %u worker(s)\n", npaths, cfg->workers);
+
+	pfd.fd = gate.fan_fd;
+	pfd.events = POLLIN;
+
+	while (!gate_stopping) {
+		int timeout = gate_expire();
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			pr_err("Error: could not wait for fanotify events: %m\n");
+			goto out;
+		}
+
+		if ((pfd.revents & POLLIN) && gate_read_events() != 0) {
+			pr_err("Error: could not read fanotify events: %m\n");
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	gate_cleanup();
+	if (ret == 0)
+		gate_report();
+
+	return ret;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+
+/** @file
+ * Verify-on-open gate declarations.
+ *
+ * With --gate, b2tag runs as a daemon that receives a fanotify permission
+ * event (FAN_OPEN_PERM) for every open of a file below the FILEs and answers
+ * it before the opening program can read anything:
+ *
+ * @li Opens of files whose tag was verified recently, and whose metadata
+ *     hasn't changed since, are allowed straight from an in-memory cache.
+ * @li Other files are queued for a pool of worker threads, which check the
+ *     file's contents against its tag and deny the open if they don't match.
+ * @li An open still waiting for a worker after --gate-timeout (or one that
+ *     finds the queue full) is answered without waiting, allowed unless
+ *     --gate-fail-closed was given. The worker still verifies the file.
+ *
+ * Files that aren't tagged, or were modified since they were tagged, have
+ * nothing to verify against and are always allowed.
+ */
+
+#ifndef GATE_H
+#define GATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+/** The number of files the verified cache holds by default. */
+#define GATE_CACHE_ENTRIES 65536
+
+/** A gate decision. */
+enum gate_decision {
+	GATE_ALLOW,  /**< Allow the open. */
+	GATE_DENY,   /**< Deny the open. */
+	GATE_VERIFY, /**< The file needs to be verified first. */
+};
+
+/** The gate's settings. */
+struct gate_config {
+	unsigned int workers;    /**< The number of worker threads. */
+	unsigned int timeout_ms; /**< The longest an open waits for a worker (0 for no limit). */
+	time_t ttl;              /**< How long a verification is trusted (0 for no limit). */
+	size_t cache_entries;    /**< The number of files the verified cache can hold. */
+	bool fail_closed;        /**< Deny the opens that can't be verified in time. */
+};
+
+/**
+ * Allocate the verified cache.
+ *
+ * @param entries  The number of files the cache can hold.
+ * @param ttl      How long an entry is trusted for (in seconds, 0 for no limit).
+ *
+ * @retval 0  The cache was allocated.
+ * @retval -1 Out of memory.
+ */
+int gate_cache_init(size_t entries, time_t ttl);
+
+/**
+ * Free the verified cache.
+ */
+void gate_cache_free(void);
+
+/**
+ * Decide on an open from the file's metadata and the verified cache alone.
+ *
+ * @param fd  The opened file.
+ * @param st  Where to store the file's stat() structure.
+ *
+ * @retval GATE_ALLOW   The file isn't a regular file or was verified recently.
+ * @retval GATE_VERIFY  The file needs to be passed to gate_verify().
+ */
+enum gate_decision gate_lookup(int fd, struct stat *st);
+
+/**
+ * Verify a file against its tag (adding it to the verified cache if it
+ * matches).
+ *
+ * @param fd           The opened file (read from its current offset).
+ * @param st           The file's stat() structure from gate_lookup().
+ * @param path         The file's path (for messages).
+ * @param fail_closed  Whether to deny the open if the file can't be read.
+ *
+ * @retval GATE_ALLOW  The file matches its tag (or has nothing to match).
+ * @retval GATE_DENY   The file doesn't match its tag.
+ */
+enum gate_decision gate_verify(int fd, const struct stat *st, const char *path, bool fail_closed);
+
+/**
+ * Gate the opens of the files below @p paths until SIGINT or SIGTERM.
+ *
+ * @param paths   The files and directories to gate.
+ * @param npaths  The number of paths.
+ * @param cfg     The gate's settings.
+ *
+ * @retval 0  The gate ran and stopped normally.
+ * @retval >0 The gate couldn't be set up.
+ */
+int gate_run(char * const *paths, size_t npaths, const struct gate_config *cfg);
+
+#endif /* GATE_H */
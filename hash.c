@@ -35,14 +35,42 @@
 #include "hash.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <openssl/crypto.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "afalg.h"
+#include "budget.h"
+#ifdef HAVE_BTRFS_ENCODED
+#include "btrfs_read.h"
+#endif
+#include "io.h"
+#include "k12.h"
+#include "stats.h"
 #include "utilities.h"
 
 /** The size of the file read buffer. */
 #define BUFSZ 65536
 
+/** The size of the data backends are cross-validated with. */
+#define VALIDATE_SIZE (65536 + 7)
+
+/** The size of the data backends are benchmarked with. */
+#define CALIBRATE_SIZE (1 << 20)
+
+/** How long to benchmark each backend for (in nanoseconds). */
+#define CALIBRATE_NS 50000000ULL
+
 /** The function signature of the OpenSSL EVP algorithms. */
 typedef const EVP_MD *(*evp_func)(void);
 
@@ -50,49 +78,666 @@ typedef const EVP_MD *(*evp_func)(void);
 struct alg_data {
 	/** The name of the algorithm (lowercase). */
 	const char *name;
-	/** The OpenSSL EVP function of the algorithm. */
+	/** The OpenSSL EVP function of the algorithm (NULL if it's built in). */
 	evp_func md;
+	/** The kernel crypto API's name for the algorithm (NULL if it has none). */
+	const char *kernel;
+	/** The hash size of a built-in algorithm. */
+	int size;
+};
+
+/** An in-progress hash computation. */
+struct hash_ctx {
+	/** The hash algorithm. */
+	hash_alg_t alg;
+	/** The backend computing the hash. */
+	const struct hash_backend *backend;
+	/** The OpenSSL digest context (for the evp backend). */
+	EVP_MD_CTX *evp;
+	/** The AF_ALG operation socket (for the kernel backend). */
+	int afalg;
+	/** The KangarooTwelve state (for the builtin backend). */
+	struct k12_ctx k12;
+};
+
+/** An implementation of (some of) the hash algorithms. */
+struct hash_backend {
+	/** The backend's name (for --hash-backend). */
+	const char *name;
+	/** Returns whether the backend can compute @p alg. */
+	bool (*supports)(hash_alg_t alg);
+	/** Start a computation of hash_ctx::alg (0 on success). */
+	int (*init)(hash_ctx_t *c);
+	/** Hash more data (0 on success). */
+	int (*update)(hash_ctx_t *c, const void *data, size_t len);
+	/** Finish the computation (returns the hash length or -1). */
+	int (*final)(hash_ctx_t *c, unsigned char *out);
+	/** Free the backend's state (even if init() failed). */
+	void (*cleanup)(hash_ctx_t *c);
 };
 
 /** Data about all the hash algorithms b2tag supports. */
 static struct alg_data hash_alg_data[] = {
 	[HASH_ALG_MD5]     = {
 		.name = "md5",
-		.md = EVP_md5
+		.md = EVP_md5,
+		.kernel = "md5"
 	},
 	[HASH_ALG_SHA1]    = {
 		.name ="sha1",
-		.md = EVP_sha1
+		.md = EVP_sha1,
+		.kernel = "sha1"
 	},
 	[HASH_ALG_SHA256]  = {
 		.name ="sha256",
-		.md = EVP_sha256
+		.md = EVP_sha256,
+		.kernel = "sha256"
 	},
 	[HASH_ALG_SHA512]  = {
 		.name ="sha512",
-		.md = EVP_sha512
+		.md = EVP_sha512,
+		.kernel = "sha512"
 	},
 	[HASH_ALG_BLAKE2B] = {
 		.name ="blake2b512",
-		.md = EVP_blake2b512
+		.md = EVP_blake2b512,
+		.kernel = "blake2b-512"
 	},
 	[HASH_ALG_BLAKE2S] = {
 		.name ="blake2s256",
-		.md = EVP_blake2s256
+		.md = EVP_blake2s256,
+		.kernel = "blake2s-256"
+	},
+	[HASH_ALG_SHA3_256] = {
+		.name ="sha3-256",
+		.md = EVP_sha3_256,
+		.kernel = "sha3-256"
+	},
+	[HASH_ALG_SHA3_512] = {
+		.name ="sha3-512",
+		.md = EVP_sha3_512,
+		.kernel = "sha3-512"
+	},
+	[HASH_ALG_K12] = {
+		.name ="k12",
+		.size = 32
+	},
+};
+
+/*
+ * The OpenSSL EVP backend.
+ */
+
+static bool evp_supports(hash_alg_t alg)
+{
+	return hash_alg_data[alg].md != NULL;
+}
+
+static int evp_init(hash_ctx_t *c)
+{
+	c->evp = EVP_MD_CTX_new();
+	if (c->evp == NULL || EVP_DigestInit_ex(c->evp, hash_alg_data[c->alg].md(), NULL) == 0)
+		return -1;
+
+	return 0;
+}
+
+static int evp_update(hash_ctx_t *c, const void *data, size_t len)
+{
+	return EVP_DigestUpdate(c->evp, data, len) == 0 ? -1 : 0;
+}
+
+static int evp_final(hash_ctx_t *c, unsigned char *out)
+{
+	unsigned int len;
+
+	if (EVP_DigestFinal_ex(c->evp, out, &len) == 0)
+		return -1;
+
+	return (int)len;
+}
+
+static void evp_cleanup(hash_ctx_t *c)
+{
+	EVP_MD_CTX_free(c->evp);
+}
+
+/*
+ * The kernel crypto API (AF_ALG) backend.
+ */
+
+/** The AF_ALG transform sockets (bound the first time an algorithm is probed). */
+static struct {
+	bool probed[HASH_ALG_COUNT]; /**< Whether binding the algorithm was tried. */
+	int tfm[HASH_ALG_COUNT];     /**< The transform sockets (-1 if unsupported). */
+} kernel;
+
+/** @note Only called with backends.lock held. */
+static bool kernel_supports(hash_alg_t alg)
+{
+	if (hash_alg_data[alg].kernel == NULL)
+		return false;
+
+	if (!kernel.probed[alg]) {
+		kernel.probed[alg] = true;
+		kernel.tfm[alg] = afalg_bind(hash_alg_data[alg].kernel);
+		if (kernel.tfm[alg] < 0)
+			pr_debug("The kernel can't compute %s: %m\n", hash_alg_data[alg].kernel);
+	}
+
+	return kernel.tfm[alg] >= 0;
+}
+
+static int kernel_init(hash_ctx_t *c)
+{
+	c->afalg = afalg_start(kernel.tfm[c->alg]);
+
+	return c->afalg < 0 ? -1 : 0;
+}
+
+static int kernel_update(hash_ctx_t *c, const void *data, size_t len)
+{
+	return afalg_update(c->afalg, data, len);
+}
+
+static int kernel_final(hash_ctx_t *c, unsigned char *out)
+{
+	size_t len = get_alg_size(c->alg);
+
+	if (afalg_final(c->afalg, out, len) != 0)
+		return -1;
+
+	return (int)len;
+}
+
+static void kernel_cleanup(hash_ctx_t *c)
+{
+	if (c->afalg >= 0)
+		close(c->afalg);
+}
+
+/*
+ * The built-in backend.
+ */
+
+static bool builtin_supports(hash_alg_t alg)
+{
+	return alg == HASH_ALG_K12;
+}
+
+static int builtin_init(hash_ctx_t *c)
+{
+	k12_init(&c->k12);
+	return 0;
+}
+
+static int builtin_update(hash_ctx_t *c, const void *data, size_t len)
+{
+	k12_update(&c->k12, data, len);
+	return 0;
+}
+
+static int builtin_final(hash_ctx_t *c, unsigned char *out)
+{
+	k12_final(&c->k12, out, (size_t)hash_alg_data[c->alg].size);
+	return hash_alg_data[c->alg].size;
+}
+
+static void builtin_cleanup(hash_ctx_t *c)
+{
+	(void)c;
+}
+
+/** The indexes of the backends in hash_backends[]. */
+enum {
+	BACKEND_EVP,
+	BACKEND_KERNEL,
+	BACKEND_BUILTIN,
+};
+
+/** Every hash backend. */
+static const struct hash_backend hash_backends[] = {
+	[BACKEND_EVP] = {
+		.name     = "evp",
+		.supports = evp_supports,
+		.init     = evp_init,
+		.update   = evp_update,
+		.final    = evp_final,
+		.cleanup  = evp_cleanup,
+	},
+	[BACKEND_KERNEL] = {
+		.name     = "kernel",
+		.supports = kernel_supports,
+		.init     = kernel_init,
+		.update   = kernel_update,
+		.final    = kernel_final,
+		.cleanup  = kernel_cleanup,
+	},
+	[BACKEND_BUILTIN] = {
+		.name     = "builtin",
+		.supports = builtin_supports,
+		.init     = builtin_init,
+		.update   = builtin_update,
+		.final    = builtin_final,
+		.cleanup  = builtin_cleanup,
 	},
 };
 
+/** The backend selection. */
+static struct {
+	bool autoselect;                     /**< Whether to benchmark the backends. */
+	const struct hash_backend *forced;   /**< The backend to use (NULL for the reference). */
+	const struct hash_backend *selected[HASH_ALG_COUNT]; /**< The backend of each algorithm. */
+	pthread_mutex_t lock;                /**< Protects everything above. */
+} backends = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Returns the reference backend for @p alg (the one every other backend is
+ * cross-validated against and the default).
+ */
+static const struct hash_backend *reference_backend(hash_alg_t alg)
+{
+	return &hash_backends[evp_supports(alg) ? BACKEND_EVP : BACKEND_BUILTIN];
+}
+
+/**
+ * Hash @p data with a specific backend (without counting it in the
+ * statistics).
+ *
+ * @param b      The backend.
+ * @param alg    The hash algorithm.
+ * @param data   The data to hash.
+ * @param len    The length of @p data.
+ * @param chunk  How much data to pass to each update.
+ * @param out    Where to store the hash.
+ *
+ * @returns Returns the length of the hash, or -1 if an error occurred.
+ */
+static int backend_digest(const struct hash_backend *b, hash_alg_t alg,
+	const unsigned char *data, size_t len, size_t chunk, unsigned char *out)
+{
+	hash_ctx_t c = { .alg = alg, .backend = b, .afalg = -1 };
+	int ret = -1;
+
+	if (b->init(&c) != 0)
+		goto out;
+
+	while (len > 0) {
+		size_t n = len < chunk ? len : chunk;
+
+		if (b->update(&c, data, n) != 0)
+			goto out;
+
+		data += n;
+		len -= n;
+	}
+
+	ret = b->final(&c, out);
+
+out:
+	b->cleanup(&c);
+	return ret;
+}
+
+/**
+ * Cross-validate a backend against the reference backend.
+ *
+ * @param b     The backend to validate.
+ * @param alg   The hash algorithm.
+ * @param data  #VALIDATE_SIZE bytes of test data.
+ *
+ * @returns Returns whether @p b computes the same hashes as the reference.
+ */
+static bool backend_validate(const struct hash_backend *b, hash_alg_t alg,
+	const unsigned char *data)
+{
+	static const size_t lengths[] = { 0, 1, 4093, VALIDATE_SIZE };
+	const struct hash_backend *ref = reference_backend(alg);
+	unsigned char expect[MAX_HASH_SIZE];
+	unsigned char actual[MAX_HASH_SIZE];
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		int len = backend_digest(ref, alg, data, lengths[i], VALIDATE_SIZE, expect);
+
+		/* Uneven updates catch mistakes in the backend's buffering. */
+		if (len < 0 || backend_digest(b, alg, data, lengths[i], 1000, actual) != len ||
+			memcmp(expect, actual, (size_t)len) != 0) {
+			pr_warn("Warning: the %s backend computes %s incorrectly, not using it\n",
+				b->name, get_alg_name(alg));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Returns the current monotonic time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Measure a backend's speed.
+ *
+ * @param b     The backend to measure.
+ * @param alg   The hash algorithm.
+ * @param data  #CALIBRATE_SIZE bytes of test data.
+ *
+ * @returns Returns the backend's speed in MiB/s (0 if it failed).
+ */
+static double backend_speed(const struct hash_backend *b, hash_alg_t alg,
+	const unsigned char *data)
+{
+	unsigned char out[MAX_HASH_SIZE];
+	uint64_t bytes = 0;
+	uint64_t start;
+	uint64_t elapsed;
+
+	/* Warm up (e.g. load the kernel module or fault in the tables). */
+	if (backend_digest(b, alg, data, CALIBRATE_SIZE, BUFSZ, out) < 0)
+		return 0;
+
+	start = now_ns();
+
+	do {
+		if (backend_digest(b, alg, data, CALIBRATE_SIZE, BUFSZ, out) < 0)
+			return 0;
+
+		bytes += CALIBRATE_SIZE;
+		elapsed = now_ns() - start;
+	} while (elapsed < CALIBRATE_NS);
+
+	return (double)bytes / 1048576.0 / ((double)elapsed / 1e9);
+}
+
+/**
+ * Format the path of the calibration cache.
+ *
+ * @returns Returns the path (free with free()) or NULL if there's no home
+ *          directory.
+ */
+static char *cache_path(void)
+{
+	const char *dir = getenv("XDG_CACHE_HOME");
+	char *path;
+
+	if (dir != NULL && dir[0] == '/') {
+		if (asprintf(&path, "%s/b2tag/hash-backends", dir) < 0)
+			return NULL;
+		return path;
+	}
+
+	dir = getenv("HOME");
+	if (dir == NULL || dir[0] != '/')
+		return NULL;
+
+	if (asprintf(&path, "%s/.cache/b2tag/hash-backends", dir) < 0)
+		return NULL;
+
+	return path;
+}
+
 /**
- * Converts a raw array into a hex string.
+ * Format the first line of the calibration cache, which identifies the
+ * machine (so a cache shared with another machine, or made before a kernel
+ * or OpenSSL upgrade, is ignored).
  *
- * @param out     The buffer to store the hex string in.
- * @param outlen  The length of @p out.
- * @param bin     The input raw data array.
- * @param len     The length of @p bin.
+ * @param buf   Where to store the line (including the '\n').
+ * @param size  The size of @p buf.
+ */
+static void cache_key(char *buf, size_t size)
+{
+	struct utsname u;
+
+	if (uname(&u) != 0)
+		memset(&u, 0, sizeof(u));
+
+	snprintf(buf, size, "# b2tag hash backends: %s %s %s %s, %s\n", u.nodename, u.sysname,
+		u.release, u.machine, OpenSSL_version(OPENSSL_VERSION));
+}
+
+/**
+ * Look up the backend calibrated for @p alg in the cache.
  *
- * @note @p out must be at least (@p len * 2) + 1 in length.
+ * @returns Returns the cached backend or NULL if there isn't one.
+ */
+static const struct hash_backend *cache_lookup(hash_alg_t alg)
+{
+	const struct hash_backend *b = NULL;
+	char key[512];
+	char line[512];
+	char *path;
+	FILE *f;
+
+	path = cache_path();
+	if (path == NULL)
+		return NULL;
+
+	f = fopen(path, "re");
+	free(path);
+	if (f == NULL)
+		return NULL;
+
+	cache_key(key, sizeof(key));
+
+	if (fgets(line, sizeof(line), f) != NULL && strcmp(line, key) == 0) {
+		size_t name_len = strlen(get_alg_name(alg));
+
+		while (b == NULL && fgets(line, sizeof(line), f) != NULL) {
+			size_t i;
+
+			if (strncmp(line, get_alg_name(alg), name_len) != 0 || line[name_len] != ' ')
+				continue;
+
+			line[strcspn(line, "\n")] = '\0';
+
+			for (i = 0; i < ARRAY_SIZE(hash_backends); i++) {
+				if (strcmp(line + name_len + 1, hash_backends[i].name) == 0)
+					b = &hash_backends[i];
+			}
+		}
+	}
+
+	fclose(f);
+
+	return b;
+}
+
+/**
+ * Record the backend calibrated for @p alg in the cache (keeping the other
+ * algorithms' entries). Failures are ignored: the next run recalibrates.
  */
-static int bin2hex(char *out, int outlen, unsigned char *bin, int len)
+static void cache_store(hash_alg_t alg, const struct hash_backend *b)
+{
+	char key[512];
+	char line[512];
+	char *path;
+	char *tmp = NULL;
+	char *slash;
+	FILE *in;
+	FILE *out;
+
+	path = cache_path();
+	if (path == NULL)
+		return;
+
+	/* Create the directory (and its parent). */
+	slash = strrchr(path, '/');
+	*slash = '\0';
+	if (mkdir(path, 0755) != 0 && errno == ENOENT) {
+		char *parent = strrchr(path, '/');
+
+		*parent = '\0';
+		mkdir(path, 0700);
+		*parent = '/';
+		mkdir(path, 0755);
+	}
+	*slash = '/';
+
+	if (asprintf(&tmp, "%s.%d", path, (int)getpid()) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+
+	out = fopen(tmp, "we");
+	if (out == NULL)
+		goto out;
+
+	cache_key(key, sizeof(key));
+	fputs(key, out);
+
+	in = fopen(path, "re");
+	if (in != NULL) {
+		size_t name_len = strlen(get_alg_name(alg));
+
+		if (fgets(line, sizeof(line), in) != NULL && strcmp(line, key) == 0) {
+			while (fgets(line, sizeof(line), in) != NULL) {
+				if (strncmp(line, get_alg_name(alg), name_len) != 0 ||
+					line[name_len] != ' ')
+					fputs(line, out);
+			}
+		}
+
+		fclose(in);
+	}
+
+	fprintf(out, "%s %s\n", get_alg_name(alg), b->name);
+
+	if (fclose(out) != 0 || rename(tmp, path) != 0) {
+		pr_debug("Could not save the hash backend calibration: %m\n");
+		unlink(tmp);
+	}
+
+out:
+	free(tmp);
+	free(path);
+}
+
+/**
+ * Pick the fastest correct backend for @p alg (or the cached choice).
+ *
+ * @param alg   The hash algorithm.
+ * @param data  #CALIBRATE_SIZE bytes of test data.
+ *
+ * @returns Returns the backend to use.
+ */
+static const struct hash_backend *calibrate(hash_alg_t alg, const unsigned char *data)
+{
+	const struct hash_backend *ref = reference_backend(alg);
+	const struct hash_backend *candidates[ARRAY_SIZE(hash_backends)];
+	const struct hash_backend *best = ref;
+	const struct hash_backend *b;
+	double best_speed;
+	size_t count = 0;
+	size_t i;
+
+	/* A cached choice only has to be cross-validated. */
+	b = cache_lookup(alg);
+	if (b == ref || (b != NULL && b->supports(alg) && backend_validate(b, alg, data)))
+		return b;
+
+	for (i = 0; i < ARRAY_SIZE(hash_backends); i++) {
+		b = &hash_backends[i];
+
+		if (b != ref && b->supports(alg) && backend_validate(b, alg, data))
+			candidates[count++] = b;
+	}
+
+	/* There's nothing to choose from. */
+	if (count == 0)
+		return ref;
+
+	best_speed = backend_speed(ref, alg, data);
+	pr_debug("Hash backend %s for %s: %.0f MiB/s\n", ref->name, get_alg_name(alg), best_speed);
+
+	for (i = 0; i < count; i++) {
+		double speed = backend_speed(candidates[i], alg, data);
+
+		pr_debug("Hash backend %s for %s: %.0f MiB/s\n", candidates[i]->name,
+			get_alg_name(alg), speed);
+
+		if (speed > best_speed) {
+			best = candidates[i];
+			best_speed = speed;
+		}
+	}
+
+	cache_store(alg, best);
+
+	return best;
+}
+
+/**
+ * Select the backend for @p alg.
+ *
+ * @note The caller must hold backends.lock.
+ */
+static const struct hash_backend *select_backend(hash_alg_t alg)
+{
+	const struct hash_backend *ref = reference_backend(alg);
+	const struct hash_backend *b;
+	unsigned char *data;
+	size_t i;
+
+	if (!backends.autoselect && (backends.forced == NULL || backends.forced == ref))
+		return ref;
+
+	if (backends.forced != NULL && !backends.forced->supports(alg)) {
+		pr_warn("Warning: the %s backend can't compute %s, using %s\n",
+			backends.forced->name, get_alg_name(alg), ref->name);
+		return ref;
+	}
+
+	data = budget_malloc(CALIBRATE_SIZE);
+	if (data == NULL) {
+		pr_warn("Warning: not enough memory to select a backend for %s, using %s\n",
+			get_alg_name(alg), ref->name);
+		return ref;
+	}
+
+	for (i = 0; i < CALIBRATE_SIZE; i++)
+		data[i] = (unsigned char)(i * 131 + (i >> 11));
+
+	if (backends.forced != NULL)
+		b = backend_validate(backends.forced, alg, data) ? backends.forced : ref;
+	else
+		b = calibrate(alg, data);
+
+	budget_free(data, CALIBRATE_SIZE);
+
+	pr_debug("Using the %s backend for %s\n", b->name, get_alg_name(alg));
+
+	return b;
+}
+
+int hash_set_backend(const char *name)
+{
+	size_t i;
+
+	if (strcmp(name, "auto") == 0) {
+		backends.autoselect = true;
+		return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hash_backends); i++) {
+		if (strcmp(name, hash_backends[i].name) == 0) {
+			backends.forced = &hash_backends[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int bin2hex(char *out, int outlen, const unsigned char *bin, int len)
 {
 	char hexval[] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 	int i;
@@ -116,12 +761,81 @@ static int bin2hex(char *out, int outlen, unsigned char *bin, int len)
 	return 0;
 }
 
+int hex2bin(unsigned char *out, int outlen, const char *hex)
+{
+	int i;
+
+	assert(out != NULL);
+	assert(hex != NULL);
+
+	for (i = 0; hex[2 * i] != '\0'; i++) {
+		char c[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+		char *end;
+
+		if (i >= outlen || !isxdigit(c[0]) || !isxdigit(c[1]))
+			return -1;
+
+		out[i] = (unsigned char)strtoul(c, &end, 16);
+	}
+
+	return i;
+}
+
+hash_ctx_t *hash_ctx_new(hash_alg_t alg)
+{
+	hash_ctx_t *c;
+
+	assert(alg < ARRAY_SIZE(hash_alg_data));
+
+	c = budget_malloc(sizeof(*c));
+	if (c == NULL)
+		return NULL;
+
+	c->alg = alg;
+	c->evp = NULL;
+	c->afalg = -1;
+
+	pthread_mutex_lock(&backends.lock);
+	if (backends.selected[alg] == NULL)
+		backends.selected[alg] = select_backend(alg);
+	c->backend = backends.selected[alg];
+	pthread_mutex_unlock(&backends.lock);
+
+	if (c->backend->init(c) != 0) {
+		hash_ctx_free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+int hash_update(hash_ctx_t *c, const void *data, size_t len)
+{
+	stats_hashed(len);
+
+	return c->backend->update(c, data, len);
+}
+
+int hash_final(hash_ctx_t *c, unsigned char *out)
+{
+	return c->backend->final(c, out);
+}
+
+void hash_ctx_free(hash_ctx_t *c)
+{
+	if (c == NULL)
+		return;
+
+	c->backend->cleanup(c);
+	budget_free(c, sizeof(*c));
+}
+
 int fhash(int fd, char *hashbuf, int hashlen, hash_alg_t alg)
 {
 	int err = -1;
-	EVP_MD_CTX *c;
+	hash_ctx_t *c;
 	char *buf;
-	unsigned char rawhash[EVP_MAX_MD_SIZE];
+	unsigned char rawhash[MAX_HASH_SIZE];
 	ssize_t len;
 	int alg_len;
 
@@ -129,35 +843,40 @@ int fhash(int fd, char *hashbuf, int hashlen, hash_alg_t alg)
 	assert(hashbuf != NULL);
 	assert(hashlen > 0);
 	assert(alg < ARRAY_SIZE(hash_alg_data));
-	assert(hash_alg_data[alg].md != NULL);
-	assert(hash_alg_data[alg].md() != NULL);
-
-	buf = malloc(BUFSZ);
-	c = EVP_MD_CTX_new();
-
-	if (buf == NULL || c == NULL) {
-		pr_err("Insufficient memory for hashing file");
-		goto out;
-	}
-
-	if (EVP_DigestInit_ex(c, hash_alg_data[alg].md(), NULL) == 0) {
-		pr_err("Failed to initialize digest\n");
-		goto out;
-	}
 
 	/* The length of the algorithm's hash. */
-	alg_len = EVP_MD_CTX_size(c);
+	alg_len = (int)get_alg_size(alg);
 
 	assert(alg_len > 0);
 	assert(alg_len <= MAX_HASH_SIZE);
 
 	if ((alg_len * 2) >= hashlen) {
 		pr_err("Hash exceeds buffer size: %d > %d\n", alg_len * 2 + 1, hashlen);
+		return -1;
+	}
+
+	buf = budget_malloc(BUFSZ);
+	if (buf == NULL) {
+		pr_err("Insufficient memory for hashing file\n");
+		return -1;
+	}
+
+	c = hash_ctx_new(alg);
+	if (c == NULL) {
+		pr_err("Failed to initialize digest\n");
 		goto out;
 	}
 
-	while ((len = read(fd, buf, BUFSZ)) > 0) {
-		if (EVP_DigestUpdate(c, buf, (size_t)len) == 0) {
+#ifdef HAVE_BTRFS_ENCODED
+	/* Read the file normally unless it was digested with encoded reads. */
+	len = btrfs_encoded_hash(fd, c);
+	if (len < 0)
+		goto out;
+
+	if (len > 0)
+#endif
+	while ((len = io->read(fd, buf, BUFSZ)) > 0) {
+		if (hash_update(c, buf, (size_t)len) != 0) {
 			pr_err("Failed to update digest\n");
 			goto out;
 		}
@@ -168,7 +887,8 @@ int fhash(int fd, char *hashbuf, int hashlen, hash_alg_t alg)
 		goto out;
 	}
 
-	if (EVP_DigestFinal_ex(c, rawhash, (unsigned int *)&alg_len) == 0) {
+	alg_len = hash_final(c, rawhash);
+	if (alg_len < 0) {
 		pr_err("Failed to finalize digest\n");
 		goto out;
 	}
@@ -181,8 +901,8 @@ int fhash(int fd, char *hashbuf, int hashlen, hash_alg_t alg)
 	err = 0;
 
 out:
-	EVP_MD_CTX_free(c);
-	free(buf);
+	hash_ctx_free(c);
+	budget_free(buf, BUFSZ);
 
 	return err;
 }
@@ -192,7 +912,10 @@ size_t get_alg_size(hash_alg_t alg)
 	int len;
 
 	assert(alg < ARRAY_SIZE(hash_alg_data));
-	assert(hash_alg_data[alg].md != NULL);
+
+	if (hash_alg_data[alg].md == NULL)
+		return (size_t)hash_alg_data[alg].size;
+
 	assert(hash_alg_data[alg].md() != NULL);
 
 	len = EVP_MD_size(hash_alg_data[alg].md());
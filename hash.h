@@ -82,9 +82,92 @@ typedef enum hash_alg {
 	 * @warning MD5 is not secure and is not recommended.
 	 */
 	HASH_ALG_MD5,
+	/**
+	 * The SHA3-256 hash algorithm (256-bit).
+	 *
+	 * SHA-3 is slower than Blake2 and SHA-2 in software; it's included for
+	 * sites that require it.
+	 */
+	HASH_ALG_SHA3_256,
+	/**
+	 * The SHA3-512 hash algorithm (512-bit).
+	 *
+	 * SHA3-512 is roughly half as fast as SHA3-256.
+	 */
+	HASH_ALG_SHA3_512,
+	/**
+	 * The KangarooTwelve (KT128) hash algorithm (256-bit output).
+	 *
+	 * KangarooTwelve uses a reduced-round Keccak permutation and a tree
+	 * mode for inputs over 8 KiB, so it's much faster than SHA-3.
+	 * (Built in since OpenSSL doesn't provide it.)
+	 */
+	HASH_ALG_K12,
 
+	/** The number of supported hash algorithms (not an algorithm). */
+	HASH_ALG_COUNT
 } hash_alg_t;
 
+/** An in-progress hash computation. */
+typedef struct hash_ctx hash_ctx_t;
+
+/**
+ * Start a hash computation.
+ *
+ * @param alg  The hash algorithm to use.
+ *
+ * @returns Returns the new context or NULL on failure.
+ */
+hash_ctx_t *hash_ctx_new(hash_alg_t alg);
+
+/**
+ * Hash more data.
+ *
+ * @param c     The hash context.
+ * @param data  The data to hash.
+ * @param len   The length of @p data.
+ *
+ * @retval 0  The data was hashed.
+ * @retval -1 An error occurred.
+ */
+int hash_update(hash_ctx_t *c, const void *data, size_t len);
+
+/**
+ * Finish a hash computation.
+ *
+ * @param c    The hash context.
+ * @param out  Where to store the hash (at least MAX_HASH_SIZE bytes).
+ *
+ * @returns Returns the length of the hash, or -1 if an error occurred.
+ */
+int hash_final(hash_ctx_t *c, unsigned char *out);
+
+/**
+ * Free a hash context.
+ *
+ * @param c  The hash context (may be NULL).
+ */
+void hash_ctx_free(hash_ctx_t *c);
+
+/**
+ * Select the backends that compute the hashes.
+ *
+ * By default, every algorithm is computed by its reference backend (OpenSSL
+ * EVP, or the built-in implementation of the algorithms OpenSSL lacks).
+ * Another backend is cross-validated against the reference before its first
+ * use, and isn't used if it computes a different hash.
+ *
+ * @param name  A backend ("evp", "kernel" for the kernel crypto API, or
+ *              "builtin") or "auto" to benchmark the correct backends the
+ *              first time each algorithm is used and use the fastest. The
+ *              choices are cached (per machine, kernel, and OpenSSL version)
+ *              in $XDG_CACHE_HOME/b2tag/hash-backends.
+ *
+ * @retval 0  The backend was selected.
+ * @retval -1 There's no such backend.
+ */
+int hash_set_backend(const char *name);
+
 /**
  * Hash the contents of file @p fd using the @p alg hash algorithm.
  *
@@ -100,6 +183,32 @@ typedef enum hash_alg {
  */
 int fhash(int fd, char *hashbuf, int hashlen, hash_alg_t alg);
 
+/**
+ * Converts a raw array into a hex string.
+ *
+ * @param out     The buffer to store the hex string in.
+ * @param outlen  The length of @p out.
+ * @param bin     The input raw data array.
+ * @param len     The length of @p bin.
+ *
+ * @note @p out must be at least (@p len * 2) + 1 in length.
+ *
+ * @returns Returns 0 on success and a negative number on failure.
+ */
+int bin2hex(char *out, int outlen, const unsigned char *bin, int len);
+
+/**
+ * Converts a (NUL-terminated) hex string into a raw array.
+ *
+ * @param out     The buffer to store the raw data in.
+ * @param outlen  The length of @p out.
+ * @param hex     The input hex string.
+ *
+ * @returns Returns the number of bytes stored in @p out, or a negative number
+ *          if @p hex is malformed or doesn't fit in @p out.
+ */
+int hex2bin(unsigned char *out, int outlen, const char *hex);
+
 /**
  * Returns the hash size of @p alg.
  *
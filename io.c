@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * The real (system call) filesystem backend.
+ *
+ * Where the libc signature matches, the operations table points straight at
+ * the libc function so the only overhead is a single indirect call.
+ */
+
+#include "io.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/xattr.h>
+
+/** Wrapper for the (variadic) open() call. */
+static int real_open(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+/** Wrapper for fdopendir() to convert the return type. */
+static io_dir_t *real_fdopendir(int fd)
+{
+	return (io_dir_t *)fdopendir(fd);
+}
+
+/** Wrapper for readdir() to convert the argument type. */
+static struct dirent *real_readdir(io_dir_t *dir)
+{
+	return readdir((DIR *)dir);
+}
+
+/** Wrapper for rewinddir() to convert the argument type. */
+static void real_rewinddir(io_dir_t *dir)
+{
+	rewinddir((DIR *)dir);
+}
+
+/** Wrapper for closedir() to convert the argument type. */
+static int real_closedir(io_dir_t *dir)
+{
+	return closedir((DIR *)dir);
+}
+
+const struct io_ops io_real_ops = {
+	.name         = "real",
+	.open         = real_open,
+	.close        = close,
+	.fstat        = fstat,
+	.stat         = stat,
+	.read         = read,
+	.fadvise      = posix_fadvise,
+	.fdopendir    = real_fdopendir,
+	.readdir      = real_readdir,
+	.rewinddir    = real_rewinddir,
+	.closedir     = real_closedir,
+	.fgetxattr    = fgetxattr,
+	.fsetxattr    = fsetxattr,
+	.fremovexattr = fremovexattr,
+	.flistxattr   = flistxattr,
+};
+
+const struct io_ops *io = &io_real_ops;
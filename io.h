@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Filesystem access layer declarations.
+ *
+ * All of b2tag's filesystem accesses go through the ::io operations table so
+ * the real system calls can be swapped out (e.g. for the in-memory backend in
+ * io_mem.h when benchmarking).
+ */
+
+#ifndef IO_H
+#define IO_H
+
+#include <dirent.h>
+#include <stddef.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/** An open directory stream (a DIR for the real backend). */
+typedef struct io_dir io_dir_t;
+
+/**
+ * The filesystem operations used by b2tag.
+ *
+ * Each operation has the same semantics (return values and errno) as the
+ * system call or libc function of the same name.
+ */
+struct io_ops {
+	/** The name of the backend (for messages). */
+	const char *name;
+
+	/** Open a file (read-only flags only). */
+	int (*open)(const char *path, int flags);
+	/** Close a file descriptor returned by io_ops::open. */
+	int (*close)(int fd);
+	/** Get the status of an open file. */
+	int (*fstat)(int fd, struct stat *st);
+	/** Get the status of a file by path (following symlinks). */
+	int (*stat)(const char *path, struct stat *st);
+	/** Read from an open file. */
+	ssize_t (*read)(int fd, void *buf, size_t count);
+	/** Give the kernel a hint about the file access pattern. */
+	int (*fadvise)(int fd, off_t offset, off_t len, int advice);
+
+	/** Open a directory stream from a directory fd (which it takes over). */
+	io_dir_t *(*fdopendir)(int fd);
+	/** Read the next directory entry (NULL at the end or on error). */
+	struct dirent *(*readdir)(io_dir_t *dir);
+	/** Reset a directory stream to the first entry. */
+	void (*rewinddir)(io_dir_t *dir);
+	/** Close a directory stream (and its fd). */
+	int (*closedir)(io_dir_t *dir);
+
+	/** Read an extended attribute of an open file. */
+	ssize_t (*fgetxattr)(int fd, const char *name, void *value, size_t size);
+	/** Set an extended attribute of an open file. */
+	int (*fsetxattr)(int fd, const char *name, const void *value, size_t size, int flags);
+	/** Remove an extended attribute of an open file. */
+	int (*fremovexattr)(int fd, const char *name);
+	/** List the extended attributes of a file. */
+	ssize_t (*flistxattr)(int fd, char *list, size_t size);
+};
+
+/** The real (system call) filesystem backend. */
+extern const struct io_ops io_real_ops;
+
+/** The filesystem backend currently in use (defaults to ::io_real_ops). */
+extern const struct io_ops *io;
+
+#endif /* IO_H */
@@ -0,0 +1,1002 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * The in-memory filesystem backend (used for benchmarking).
+ *
+ * Directory ids are assigned in heap order: the root is 0 and the i'th
+ * subdirectory of directory d is (d * fanout + 1 + i). Files in directory d
+ * get inode numbers starting at (#FILE_INO_BASE + d * files).
+ *
+ * Corruptions are applied to the data as it's copied out by read(), so the
+ * shared pattern (and every other file) is unaffected.
+ */
+
+#include "io_mem.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/xattr.h>
+
+#include "utilities.h"
+
+/** File descriptors handed out by the in-memory backend start here. */
+#define FD_BASE 0x100000
+
+/** Inode numbers of regular files start here (directories are below). */
+#define FILE_INO_BASE ((uint64_t)1 << 40)
+
+/** The size of the pseudo-random pattern file data is taken from. */
+#define PATTERN_SIZE (1 << 20)
+
+/** The device number reported for the in-memory tree. */
+#define MEM_DEV 0xb2
+
+/** The mtime reported for every file and directory. */
+#define MEM_MTIME ((struct timespec){ .tv_sec = 1500000000, .tv_nsec = 123456789 })
+
+/** A node (file or directory) in the in-memory tree. */
+struct mem_node {
+	bool dir;        /**< Whether the node is a directory. */
+	unsigned depth;  /**< The directory depth (0 is the root). */
+	uint64_t id;     /**< The directory id (or the inode number for files). */
+};
+
+/** An open file descriptor. */
+struct mem_fd {
+	bool used;            /**< Whether the slot is in use. */
+	struct mem_node node; /**< The file or directory this refers to. */
+	off_t offset;         /**< The current read offset. */
+};
+
+/** A stored extended attribute. */
+struct mem_xattr {
+	struct mem_xattr *next; /**< The next attribute in the hash chain. */
+	uint64_t ino;           /**< The inode the attribute belongs to. */
+	size_t size;            /**< The length of the value. */
+	char *name;             /**< The attribute name. */
+	char value[];           /**< The attribute value. */
+};
+
+/** A corrupted bit of a file. */
+struct mem_corruption {
+	uint64_t ino;                 /**< The corrupted file's inode number. */
+	bool delivered;               /**< Whether read() returned the bit (since the last close). */
+	struct io_mem_corruption pub; /**< The publicly visible state. */
+};
+
+/** An open directory stream. */
+struct io_dir {
+	int fd;              /**< The directory's fd. */
+	unsigned long pos;   /**< The index of the next entry to return. */
+	struct dirent entry; /**< The entry returned by readdir(). */
+};
+
+/** The in-memory backend's state. */
+static struct {
+	struct io_mem_config cfg;   /**< The tree configuration. */
+	unsigned char *pattern;     /**< File data is drawn from this. */
+	struct mem_fd *fds;         /**< The file descriptor table. */
+	size_t nfds;                /**< The number of allocated fd slots. */
+	struct mem_xattr **xattrs;  /**< The extended attribute hash table. */
+	size_t nbuckets;            /**< The number of buckets in the hash table. */
+	unsigned long ops;          /**< The number of operations performed. */
+	struct io_mem_stats stats;  /**< Operation counters. */
+	struct mem_corruption *corrupt; /**< The corrupted bits. */
+	size_t ncorrupt;            /**< The number of corrupted bits. */
+	pthread_mutex_t lock;       /**< Protects everything above. */
+} mem = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Account for an operation: apply the configured latency and decide whether
+ * it should fail.
+ *
+ * @param counter  The statistics counter to increment.
+ *
+ * @retval true  The operation should fail (errno has been set to EIO).
+ * @retval false The operation should proceed.
+ */
+static bool mem_op(unsigned long *counter)
+{
+	unsigned long ops;
+
+	pthread_mutex_lock(&mem.lock);
+	(*counter)++;
+	ops = ++mem.ops;
+	pthread_mutex_unlock(&mem.lock);
+
+	if (mem.cfg.latency_ns > 0) {
+		struct timespec ts = {
+			.tv_sec  = mem.cfg.latency_ns / 1000000000,
+			.tv_nsec = mem.cfg.latency_ns % 1000000000,
+		};
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+			;
+	}
+
+	if (mem.cfg.fail_every > 0 && ops % mem.cfg.fail_every == 0) {
+		pthread_mutex_lock(&mem.lock);
+		mem.stats.faults++;
+		pthread_mutex_unlock(&mem.lock);
+		errno = EIO;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Parse a decimal number from a path component.
+ *
+ * @param s    The string to parse (advanced past the number).
+ * @param val  Where to store the number.
+ *
+ * @returns Returns 0 on success and a negative number on failure.
+ */
+static int parse_num(const char **s, uint64_t *val)
+{
+	char *end;
+
+	if (**s < '0' || **s > '9')
+		return -1;
+
+	errno = 0;
+	*val = strtoull(*s, &end, 10);
+	if (errno != 0)
+		return -1;
+
+	*s = end;
+	return 0;
+}
+
+/**
+ * Look up a path in the in-memory tree.
+ *
+ * @param path  The path to look up.
+ * @param node  Where to store the node.
+ *
+ * @returns Returns 0 on success and a negative errno value on failure.
+ */
+static int mem_lookup(const char *path, struct mem_node *node)
+{
+	size_t root_len = strlen(IO_MEM_ROOT);
+
+	if (strncmp(path, IO_MEM_ROOT, root_len) != 0)
+		return -ENOENT;
+
+	path += root_len;
+	*node = (struct mem_node){ .dir = true };
+
+	while (*path != '\0') {
+		uint64_t n;
+		char type;
+
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+
+		if (!node->dir)
+			return -ENOTDIR;
+
+		type = *path++;
+		if (parse_num(&path, &n) != 0 || (*path != '/' && *path != '\0'))
+			return -ENOENT;
+
+		if (type == 'd' && node->depth < mem.cfg.depth && n < mem.cfg.fanout) {
+			node->id = node->id * mem.cfg.fanout + 1 + n;
+			node->depth++;
+		}
+		else if (type == 'f' && n < mem.cfg.files) {
+			node->id = FILE_INO_BASE + node->id * mem.cfg.files + n;
+			node->dir = false;
+		}
+		else {
+			return -ENOENT;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Look up an open fd.
+ *
+ * @note The caller must hold mem.lock.
+ *
+ * @returns Returns the fd's slot or NULL (with errno set to EBADF).
+ */
+static struct mem_fd *mem_get_fd(int fd)
+{
+	size_t idx = (size_t)(fd - FD_BASE);
+
+	if (fd < FD_BASE || idx >= mem.nfds || !mem.fds[idx].used) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	return &mem.fds[idx];
+}
+
+/** Returns the inode number of @p node. */
+static uint64_t mem_ino(const struct mem_node *node)
+{
+	return node->dir ? node->id + 2 : node->id;
+}
+
+static int mem_open(const char *path, int flags)
+{
+	struct mem_node node;
+	size_t i;
+	int err;
+
+	if (mem_op(&mem.stats.opens))
+		return -1;
+
+	if ((flags & O_ACCMODE) != O_RDONLY) {
+		errno = EROFS;
+		return -1;
+	}
+
+	err = mem_lookup(path, &node);
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+
+	pthread_mutex_lock(&mem.lock);
+
+	for (i = 0; i < mem.nfds; i++) {
+		if (!mem.fds[i].used)
+			break;
+	}
+
+	if (i == mem.nfds) {
+		size_t count = mem.nfds ? mem.nfds * 2 : 64;
+		void *tmp = realloc(mem.fds, count * sizeof(mem.fds[0]));
+
+		if (tmp == NULL) {
+			pthread_mutex_unlock(&mem.lock);
+			errno = EMFILE;
+			return -1;
+		}
+
+		mem.fds = tmp;
+		memset(&mem.fds[mem.nfds], 0, (count - mem.nfds) * sizeof(mem.fds[0]));
+		mem.nfds = count;
+	}
+
+	mem.fds[i] = (struct mem_fd){ .used = true, .node = node };
+
+	pthread_mutex_unlock(&mem.lock);
+
+	return (int)i + FD_BASE;
+}
+
+/**
+ * Record that the corrupted bits read through an fd of file @p ino reached
+ * b2tag (which has now read as much of the file as it's going to).
+ *
+ * @note The caller must hold mem.lock.
+ */
+static void mem_close_corrupt(uint64_t ino)
+{
+	size_t i;
+
+	for (i = 0; i < mem.ncorrupt; i++) {
+		struct mem_corruption *c = &mem.corrupt[i];
+
+		if (c->ino != ino || !c->delivered)
+			continue;
+
+		c->delivered = false;
+		if (c->pub.read)
+			continue;
+
+		c->pub.read = true;
+		c->pub.bytes = mem.stats.bytes;
+		clock_gettime(CLOCK_MONOTONIC, &c->pub.time);
+	}
+}
+
+static int mem_close(int fd)
+{
+	struct mem_fd *f;
+
+	pthread_mutex_lock(&mem.lock);
+	f = mem_get_fd(fd);
+	if (f != NULL) {
+		f->used = false;
+		if (!f->node.dir && mem.ncorrupt > 0)
+			mem_close_corrupt(f->node.id);
+	}
+	pthread_mutex_unlock(&mem.lock);
+
+	return f != NULL ? 0 : -1;
+}
+
+/** Fill in a stat structure for @p node. */
+static void mem_fill_stat(const struct mem_node *node, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev     = MEM_DEV;
+	st->st_ino     = mem_ino(node);
+	st->st_mode    = node->dir ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+	st->st_nlink   = node->dir ? 2 : 1;
+	st->st_size    = node->dir ? 4096 : mem.cfg.file_size;
+	st->st_blksize = 4096;
+	st->st_blocks  = (st->st_size + 511) / 512;
+	st->st_atim    = MEM_MTIME;
+	st->st_mtim    = MEM_MTIME;
+	st->st_ctim    = MEM_MTIME;
+}
+
+static int mem_fstat(int fd, struct stat *st)
+{
+	struct mem_node node;
+	struct mem_fd *f;
+
+	if (mem_op(&mem.stats.stats))
+		return -1;
+
+	pthread_mutex_lock(&mem.lock);
+	f = mem_get_fd(fd);
+	if (f != NULL)
+		node = f->node;
+	pthread_mutex_unlock(&mem.lock);
+
+	if (f == NULL)
+		return -1;
+
+	mem_fill_stat(&node, st);
+
+	return 0;
+}
+
+static int mem_stat(const char *path, struct stat *st)
+{
+	struct mem_node node;
+	int err;
+
+	if (mem_op(&mem.stats.stats))
+		return -1;
+
+	err = mem_lookup(path, &node);
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+
+	mem_fill_stat(&node, st);
+
+	return 0;
+}
+
+/**
+ * Flip the corrupted bits of file @p ino in data just read from it.
+ *
+ * @param ino    The file's inode number.
+ * @param start  The file offset the data was read from.
+ * @param buf    The data.
+ * @param count  The length of the data.
+ */
+static void mem_read_corrupt(uint64_t ino, off_t start, unsigned char *buf, size_t count)
+{
+	size_t i;
+
+	pthread_mutex_lock(&mem.lock);
+	for (i = 0; i < mem.ncorrupt; i++) {
+		struct mem_corruption *c = &mem.corrupt[i];
+
+		if (c->ino != ino || c->pub.offset < start || c->pub.offset - start >= (off_t)count)
+			continue;
+
+		buf[c->pub.offset - start] ^= (unsigned char)(1 << c->pub.bit);
+		c->delivered = true;
+	}
+	pthread_mutex_unlock(&mem.lock);
+}
+
+static ssize_t mem_read(int fd, void *buf, size_t count)
+{
+	struct mem_fd *f;
+	size_t done = 0;
+	bool corrupt;
+	off_t offset;
+	off_t start;
+	uint64_t ino;
+
+	if (mem_op(&mem.stats.reads))
+		return -1;
+
+	pthread_mutex_lock(&mem.lock);
+	f = mem_get_fd(fd);
+	if (f == NULL) {
+		pthread_mutex_unlock(&mem.lock);
+		return -1;
+	}
+
+	if (f->node.dir) {
+		pthread_mutex_unlock(&mem.lock);
+		errno = EISDIR;
+		return -1;
+	}
+
+	if (f->offset >= mem.cfg.file_size)
+		count = 0;
+	else if ((off_t)count > mem.cfg.file_size - f->offset)
+		count = (size_t)(mem.cfg.file_size - f->offset);
+
+	offset = f->offset;
+	start = offset;
+	ino = f->node.id;
+	f->offset += (off_t)count;
+	mem.stats.bytes += count;
+	corrupt = mem.ncorrupt > 0;
+	pthread_mutex_unlock(&mem.lock);
+
+	/* Each file starts at a different (but fixed) place in the pattern. */
+	offset += (off_t)((ino * 4099) % PATTERN_SIZE);
+
+	while (done < count) {
+		size_t pos = (size_t)(offset % PATTERN_SIZE);
+		size_t len = PATTERN_SIZE - pos;
+
+		if (len > count - done)
+			len = count - done;
+
+		memcpy((char *)buf + done, mem.pattern + pos, len);
+		done += len;
+		offset += (off_t)len;
+	}
+
+	if (corrupt)
+		mem_read_corrupt(ino, start, buf, count);
+
+	return (ssize_t)count;
+}
+
+static int mem_fadvise(int fd, off_t offset __attribute__((unused)),
+	off_t len __attribute__((unused)), int advice __attribute__((unused)))
+{
+	struct mem_fd *f;
+
+	pthread_mutex_lock(&mem.lock);
+	f = mem_get_fd(fd);
+	pthread_mutex_unlock(&mem.lock);
+
+	return f != NULL ? 0 : EBADF;
+}
+
+static io_dir_t *mem_fdopendir(int fd)
+{
+	struct io_dir *dir;
+	struct mem_fd *f;
+	bool is_dir;
+
+	pthread_mutex_lock(&mem.lock);
+	f = mem_get_fd(fd);
+	is_dir = (f != NULL && f->node.dir);
+	pthread_mutex_unlock(&mem.lock);
+
+	if (f == NULL)
+		return NULL;
+
+	if (!is_dir) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	dir = calloc(1, sizeof(*dir));
+	if (dir == NULL)
+		return NULL;
+
+	dir->fd = fd;
+
+	return dir;
+}
+
+static struct dirent *mem_readdir(io_dir_t *dir)
+{
+	struct mem_node node;
+	unsigned long dirs;
+	unsigned long pos;
+	struct mem_fd *f;
+
+	if (mem_op(&mem.stats.readdirs))
+		return NULL;
+
+	pthread_mutex_lock(&mem.lock);
+	f = mem_get_fd(dir->fd);
+	if (f != NULL)
+		node = f->node;
+	pthread_mutex_unlock(&mem.lock);
+
+	if (f == NULL)
+		return NULL;
+
+	dirs = (node.depth < mem.cfg.depth) ? mem.cfg.fanout : 0;
+	pos = dir->pos++;
+
+	if (pos < 2) {
+		dir->entry.d_ino  = mem_ino(&node);
+		dir->entry.d_type = DT_DIR;
+		strcpy(dir->entry.d_name, pos == 0 ? "." : "..");
+	}
+	else if (pos - 2 < dirs) {
+		dir->entry.d_ino  = node.id * mem.cfg.fanout + 1 + (pos - 2) + 2;
+		dir->entry.d_type = DT_DIR;
+		snprintf(dir->entry.d_name, sizeof(dir->entry.d_name), "d%lu", pos - 2);
+	}
+	else if (pos - 2 - dirs < mem.cfg.files) {
+		dir->entry.d_ino  = FILE_INO_BASE + node.id * mem.cfg.files + (pos - 2 - dirs);
+		dir->entry.d_type = DT_REG;
+		snprintf(dir->entry.d_name, sizeof(dir->entry.d_name), "f%lu", pos - 2 - dirs);
+	}
+	else {
+		return NULL;
+	}
+
+	return &dir->entry;
+}
+
+static void mem_rewinddir(io_dir_t *dir)
+{
+	dir->pos = 0;
+}
+
+static int mem_closedir(io_dir_t *dir)
+{
+	int ret;
+
+	ret = mem_close(dir->fd);
+	free(dir);
+
+	return ret;
+}
+
+/**
+ * Find a stored extended attribute.
+ *
+ * @note The caller must hold mem.lock.
+ *
+ * @param ino   The inode the attribute belongs to.
+ * @param name  The attribute name.
+ *
+ * @returns Returns a pointer to the link pointing at the attribute (which
+ *          points to NULL if the attribute doesn't exist).
+ */
+static struct mem_xattr **mem_find_xattr(uint64_t ino, const char *name)
+{
+	struct mem_xattr **x = &mem.xattrs[ino & (mem.nbuckets - 1)];
+
+	for (; *x != NULL; x = &(*x)->next) {
+		if ((*x)->ino == ino && strcmp((*x)->name, name) == 0)
+			break;
+	}
+
+	return x;
+}
+
+/**
+ * Look up the inode number of an open fd.
+ *
+ * @returns Returns 0 on success and -1 (with errno set) on failure.
+ */
+static int mem_fd_ino(int fd, uint64_t *ino)
+{
+	struct mem_fd *f;
+
+	pthread_mutex_lock(&mem.lock);
+	f = mem_get_fd(fd);
+	if (f != NULL)
+		*ino = mem_ino(&f->node);
+	pthread_mutex_unlock(&mem.lock);
+
+	return f != NULL ? 0 : -1;
+}
+
+static ssize_t mem_fgetxattr(int fd, const char *name, void *value, size_t size)
+{
+	struct mem_xattr *x;
+	ssize_t ret;
+	uint64_t ino;
+
+	if (mem_op(&mem.stats.getxattr))
+		return -1;
+
+	if (mem_fd_ino(fd, &ino) != 0)
+		return -1;
+
+	pthread_mutex_lock(&mem.lock);
+	x = *mem_find_xattr(ino, name);
+	if (x == NULL) {
+		errno = ENODATA;
+		ret = -1;
+	}
+	else if (size == 0) {
+		ret = (ssize_t)x->size;
+	}
+	else if (size < x->size) {
+		errno = ERANGE;
+		ret = -1;
+	}
+	else {
+		memcpy(value, x->value, x->size);
+		ret = (ssize_t)x->size;
+	}
+	pthread_mutex_unlock(&mem.lock);
+
+	return ret;
+}
+
+static int mem_fsetxattr(int fd, const char *name, const void *value, size_t size, int flags)
+{
+	struct mem_xattr **link;
+	struct mem_xattr *x;
+	uint64_t ino;
+
+	if (mem_op(&mem.stats.setxattr))
+		return -1;
+
+	if (mem_fd_ino(fd, &ino) != 0)
+		return -1;
+
+	x = malloc(sizeof(*x) + size);
+	if (x == NULL)
+		return -1;
+
+	x->name = strdup(name);
+	if (x->name == NULL) {
+		free(x);
+		return -1;
+	}
+
+	x->ino = ino;
+	x->size = size;
+	memcpy(x->value, value, size);
+
+	pthread_mutex_lock(&mem.lock);
+	link = mem_find_xattr(ino, name);
+
+	if ((*link != NULL && (flags & XATTR_CREATE)) || (*link == NULL && (flags & XATTR_REPLACE))) {
+		pthread_mutex_unlock(&mem.lock);
+		free(x->name);
+		free(x);
+		errno = (flags & XATTR_CREATE) ? EEXIST : ENODATA;
+		return -1;
+	}
+
+	if (*link != NULL) {
+		x->next = (*link)->next;
+		free((*link)->name);
+		free(*link);
+	}
+	else {
+		x->next = NULL;
+	}
+
+	*link = x;
+	pthread_mutex_unlock(&mem.lock);
+
+	return 0;
+}
+
+static int mem_fremovexattr(int fd, const char *name)
+{
+	struct mem_xattr **link;
+	struct mem_xattr *x;
+	uint64_t ino;
+
+	if (mem_op(&mem.stats.setxattr))
+		return -1;
+
+	if (mem_fd_ino(fd, &ino) != 0)
+		return -1;
+
+	pthread_mutex_lock(&mem.lock);
+	link = mem_find_xattr(ino, name);
+	x = *link;
+	if (x != NULL)
+		*link = x->next;
+	pthread_mutex_unlock(&mem.lock);
+
+	if (x == NULL) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	free(x->name);
+	free(x);
+
+	return 0;
+}
+
+static ssize_t mem_flistxattr(int fd, char *list, size_t size)
+{
+	struct mem_xattr *x;
+	size_t len = 0;
+	uint64_t ino;
+
+	if (mem_op(&mem.stats.getxattr))
+		return -1;
+
+	if (mem_fd_ino(fd, &ino) != 0)
+		return -1;
+
+	pthread_mutex_lock(&mem.lock);
+	for (x = mem.xattrs[ino & (mem.nbuckets - 1)]; x != NULL; x = x->next) {
+		size_t n = strlen(x->name) + 1;
+
+		if (x->ino != ino)
+			continue;
+
+		if (size != 0 && len + n > size) {
+			pthread_mutex_unlock(&mem.lock);
+			errno = ERANGE;
+			return -1;
+		}
+
+		if (size != 0)
+			memcpy(list + len, x->name, n);
+		len += n;
+	}
+	pthread_mutex_unlock(&mem.lock);
+
+	return (ssize_t)len;
+}
+
+const struct io_ops io_mem_ops = {
+	.name         = "mem",
+	.open         = mem_open,
+	.close        = mem_close,
+	.fstat        = mem_fstat,
+	.stat         = mem_stat,
+	.read         = mem_read,
+	.fadvise      = mem_fadvise,
+	.fdopendir    = mem_fdopendir,
+	.readdir      = mem_readdir,
+	.rewinddir    = mem_rewinddir,
+	.closedir     = mem_closedir,
+	.fgetxattr    = mem_fgetxattr,
+	.fsetxattr    = mem_fsetxattr,
+	.fremovexattr = mem_fremovexattr,
+	.flistxattr   = mem_flistxattr,
+};
+
+uint64_t io_mem_file_count(void)
+{
+	uint64_t dirs = 1;
+	uint64_t level = 1;
+	unsigned i;
+
+	for (i = 0; i < mem.cfg.depth; i++) {
+		level *= mem.cfg.fanout;
+		dirs += level;
+	}
+
+	return dirs * mem.cfg.files;
+}
+
+int io_mem_init(const struct io_mem_config *cfg)
+{
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	uint64_t files;
+	size_t i;
+
+	assert(cfg != NULL);
+
+	io_mem_cleanup();
+
+	mem.cfg = *cfg;
+	mem.ops = 0;
+	memset(&mem.stats, 0, sizeof(mem.stats));
+
+	mem.pattern = malloc(PATTERN_SIZE);
+	if (mem.pattern == NULL)
+		return -ENOMEM;
+
+	/* Deterministic (xorshift) file data. */
+	for (i = 0; i < PATTERN_SIZE; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		mem.pattern[i] = (unsigned char)seed;
+	}
+
+	/* Size the xattr hash table for about one file per bucket. */
+	files = io_mem_file_count();
+	for (mem.nbuckets = 1024; mem.nbuckets < files && mem.nbuckets < (1 << 24); )
+		mem.nbuckets *= 2;
+
+	mem.xattrs = calloc(mem.nbuckets, sizeof(mem.xattrs[0]));
+	if (mem.xattrs == NULL) {
+		io_mem_cleanup();
+		return -ENOMEM;
+	}
+
+	io = &io_mem_ops;
+
+	return 0;
+}
+
+void io_mem_cleanup(void)
+{
+	size_t i;
+
+	for (i = 0; i < mem.nbuckets && mem.xattrs != NULL; i++) {
+		struct mem_xattr *x = mem.xattrs[i];
+
+		while (x != NULL) {
+			struct mem_xattr *next = x->next;
+
+			free(x->name);
+			free(x);
+			x = next;
+		}
+	}
+
+	free(mem.xattrs);
+	free(mem.fds);
+	free(mem.pattern);
+	free(mem.corrupt);
+
+	mem.xattrs = NULL;
+	mem.nbuckets = 0;
+	mem.fds = NULL;
+	mem.nfds = 0;
+	mem.pattern = NULL;
+	mem.corrupt = NULL;
+	mem.ncorrupt = 0;
+
+	if (io == &io_mem_ops)
+		io = &io_real_ops;
+}
+
+void io_mem_get_stats(struct io_mem_stats *stats, bool reset)
+{
+	pthread_mutex_lock(&mem.lock);
+	*stats = mem.stats;
+	if (reset)
+		memset(&mem.stats, 0, sizeof(mem.stats));
+	pthread_mutex_unlock(&mem.lock);
+}
+
+/**
+ * Build the path of directory @p id.
+ *
+ * @param id    The directory id.
+ * @param path  Where to store the path.
+ * @param size  The size of @p path.
+ * @param len   The length of the path so far (updated).
+ *
+ * @returns Returns 0 on success and a negative errno value on failure.
+ */
+static int mem_dir_path(uint64_t id, char *path, size_t size, size_t *len)
+{
+	int n;
+
+	if (id == 0) {
+		n = snprintf(path, size, "%s", IO_MEM_ROOT);
+	}
+	else {
+		int err = mem_dir_path((id - 1) / mem.cfg.fanout, path, size, len);
+
+		if (err < 0)
+			return err;
+
+		n = snprintf(path + *len, size - *len, "/d%llu",
+			(unsigned long long)((id - 1) % mem.cfg.fanout));
+	}
+
+	if (n < 0 || (size_t)n >= size - *len)
+		return -ENAMETOOLONG;
+
+	*len += (size_t)n;
+
+	return 0;
+}
+
+int io_mem_file_path(uint64_t n, char *path, size_t size)
+{
+	size_t len = 0;
+	int err;
+	int ret;
+
+	if (n >= io_mem_file_count())
+		return -ENOENT;
+
+	err = mem_dir_path(n / mem.cfg.files, path, size, &len);
+	if (err < 0)
+		return err;
+
+	ret = snprintf(path + len, size - len, "/f%llu", (unsigned long long)(n % mem.cfg.files));
+	if (ret < 0 || (size_t)ret >= size - len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+int io_mem_corrupt(const char *path, off_t offset, unsigned bit)
+{
+	struct mem_corruption *tmp;
+	struct mem_node node;
+	int idx;
+	int err;
+
+	err = mem_lookup(path, &node);
+	if (err < 0)
+		return err;
+
+	if (node.dir)
+		return -EISDIR;
+
+	if (offset < 0 || offset >= mem.cfg.file_size || bit > 7)
+		return -EINVAL;
+
+	pthread_mutex_lock(&mem.lock);
+
+	tmp = realloc(mem.corrupt, (mem.ncorrupt + 1) * sizeof(mem.corrupt[0]));
+	if (tmp == NULL) {
+		pthread_mutex_unlock(&mem.lock);
+		return -ENOMEM;
+	}
+
+	mem.corrupt = tmp;
+	mem.corrupt[mem.ncorrupt] = (struct mem_corruption){
+		.ino = node.id,
+		.pub = { .offset = offset, .bit = bit },
+	};
+	idx = (int)mem.ncorrupt++;
+
+	pthread_mutex_unlock(&mem.lock);
+
+	return idx;
+}
+
+int io_mem_get_corruption(int idx, struct io_mem_corruption *c)
+{
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&mem.lock);
+	if (idx >= 0 && (size_t)idx < mem.ncorrupt) {
+		*c = mem.corrupt[idx].pub;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&mem.lock);
+
+	return ret;
+}
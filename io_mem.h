@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * In-memory filesystem backend declarations.
+ *
+ * The in-memory backend simulates a synthetic directory tree rooted at
+ * ::IO_MEM_ROOT. Nothing but the extended attributes is stored: the tree
+ * shape and the file contents are computed from the path, so very large trees
+ * cost no memory until they are tagged.
+ *
+ * Directories are named "d<N>" and regular files "f<N>", e.g.
+ * "/mem/d0/d3/f12".
+ *
+ * Bits of file data can be flipped "underneath" b2tag (without changing the
+ * file's timestamps), to measure how long a scan schedule takes to notice.
+ */
+
+#ifndef IO_MEM_H
+#define IO_MEM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "io.h"
+
+/** The path of the root directory of the in-memory tree. */
+#define IO_MEM_ROOT "/mem"
+
+/** The shape and behaviour of the in-memory tree. */
+struct io_mem_config {
+	/** The number of directory levels below the root. */
+	unsigned depth;
+	/** The number of subdirectories in each directory (except the deepest). */
+	unsigned fanout;
+	/** The number of regular files in each directory. */
+	unsigned files;
+	/** The size of each regular file (in bytes). */
+	off_t file_size;
+	/** Delay added to every operation (in nanoseconds). */
+	unsigned long latency_ns;
+	/** Fail every Nth operation with EIO (0 to never fail). */
+	unsigned long fail_every;
+};
+
+/** Operation counters for the in-memory backend. */
+struct io_mem_stats {
+	unsigned long opens;    /**< Calls to open(). */
+	unsigned long stats;    /**< Calls to fstat(). */
+	unsigned long reads;    /**< Calls to read(). */
+	uint64_t      bytes;    /**< Bytes returned by read(). */
+	unsigned long readdirs; /**< Calls to readdir(). */
+	unsigned long getxattr; /**< Calls to fgetxattr(). */
+	unsigned long setxattr; /**< Calls to fsetxattr() and fremovexattr(). */
+	unsigned long faults;   /**< Injected failures. */
+};
+
+/** A bit flipped in a file's data (see io_mem_corrupt()). */
+struct io_mem_corruption {
+	off_t offset;         /**< The offset of the corrupted byte. */
+	unsigned bit;         /**< The flipped bit (0-7). */
+	bool read;            /**< Whether the corrupted byte has been read back. */
+	uint64_t bytes;       /**< io_mem_stats::bytes when the file was first closed after that. */
+	struct timespec time; /**< The (CLOCK_MONOTONIC) time it was closed. */
+};
+
+/** The in-memory filesystem backend. */
+extern const struct io_ops io_mem_ops;
+
+/**
+ * Set up the in-memory tree and make it the active backend (::io).
+ *
+ * @param cfg  The tree shape and behaviour.
+ *
+ * @retval 0  The in-memory tree was set up successfully.
+ * @retval <0 An error occurred (the backend is left unchanged).
+ */
+int io_mem_init(const struct io_mem_config *cfg);
+
+/**
+ * Free the in-memory tree's stored attributes and restore the real backend.
+ */
+void io_mem_cleanup(void);
+
+/**
+ * Returns the total number of regular files in the in-memory tree.
+ */
+uint64_t io_mem_file_count(void);
+
+/**
+ * Retrieve (and optionally reset) the operation counters.
+ *
+ * @param[out] stats  Where to store the counters.
+ * @param      reset  Whether to zero the counters afterwards.
+ */
+void io_mem_get_stats(struct io_mem_stats *stats, bool reset);
+
+/**
+ * Build the path of a regular file in the in-memory tree.
+ *
+ * @param n     The file's number (0 to io_mem_file_count() - 1).
+ * @param path  Where to store the path.
+ * @param size  The size of @p path.
+ *
+ * @retval 0  The path was stored.
+ * @retval <0 There's no such file or @p path is too small.
+ */
+int io_mem_file_path(uint64_t n, char *path, size_t size);
+
+/**
+ * Silently flip a bit of a regular file's data.
+ *
+ * The file's size and timestamps are left unchanged, as with bit rot or a
+ * misdirected write below the filesystem.
+ *
+ * @param path    The file's path.
+ * @param offset  The offset of the byte to corrupt.
+ * @param bit     The bit to flip (0-7).
+ *
+ * @returns Returns the corruption's index (for io_mem_get_corruption()) or a
+ *          negative errno value on failure.
+ */
+int io_mem_corrupt(const char *path, off_t offset, unsigned bit);
+
+/**
+ * Retrieve the state of a corruption.
+ *
+ * @param      idx  The index returned by io_mem_corrupt().
+ * @param[out] c    Where to store the corruption's state.
+ *
+ * @retval 0  The state was stored.
+ * @retval <0 There's no such corruption.
+ */
+int io_mem_get_corruption(int idx, struct io_mem_corruption *c);
+
+#endif /* IO_MEM_H */
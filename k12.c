@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * KangarooTwelve (KT128, RFC 9861).
+ */
+
+#include "k12.h"
+
+#include <string.h>
+
+/** The sponge's rate (in bytes). */
+#define K12_RATE 168
+
+/** The size of a leaf (in bytes). */
+#define K12_CHUNK 8192
+
+/** The size of a leaf's chaining value (in bytes). */
+#define K12_CV 32
+
+/** The round constants of the last 12 Keccak-f[1600] rounds. */
+static const uint64_t k12_rc[12] = {
+	0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL,
+	0x8000000000008003ULL, 0x8000000000008002ULL, 0x8000000000000080ULL,
+	0x000000000000800aULL, 0x800000008000000aULL, 0x8000000080008081ULL,
+	0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL,
+};
+
+/** Rotate @p x left by @p n bits. */
+static inline uint64_t rol64(uint64_t x, unsigned int n)
+{
+	return (x << n) | (x >> ((64 - n) & 63));
+}
+
+/** Load a little-endian 64-bit value. */
+static inline uint64_t load64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+
+	return v;
+}
+
+/** The Keccak-p[1600, 12] permutation. */
+static void keccak_p12(uint64_t *a)
+{
+	unsigned int round;
+
+	for (round = 0; round < 12; round++) {
+		uint64_t c0, c1, c2, c3, c4, d0, d1, d2, d3, d4;
+		uint64_t b[25];
+		unsigned int y;
+
+		/* Theta. */
+		c0 = a[0] ^ a[5] ^ a[10] ^ a[15] ^ a[20];
+		c1 = a[1] ^ a[6] ^ a[11] ^ a[16] ^ a[21];
+		c2 = a[2] ^ a[7] ^ a[12] ^ a[17] ^ a[22];
+		c3 = a[3] ^ a[8] ^ a[13] ^ a[18] ^ a[23];
+		c4 = a[4] ^ a[9] ^ a[14] ^ a[19] ^ a[24];
+		d0 = c4 ^ rol64(c1, 1);
+		d1 = c0 ^ rol64(c2, 1);
+		d2 = c1 ^ rol64(c3, 1);
+		d3 = c2 ^ rol64(c4, 1);
+		d4 = c3 ^ rol64(c0, 1);
+
+		/* Rho and pi (with theta's column parities applied). */
+		b[0]  = a[0] ^ d0;
+		b[10] = rol64(a[1] ^ d1, 1);
+		b[20] = rol64(a[2] ^ d2, 62);
+		b[5]  = rol64(a[3] ^ d3, 28);
+		b[15] = rol64(a[4] ^ d4, 27);
+		b[16] = rol64(a[5] ^ d0, 36);
+		b[1]  = rol64(a[6] ^ d1, 44);
+		b[11] = rol64(a[7] ^ d2, 6);
+		b[21] = rol64(a[8] ^ d3, 55);
+		b[6]  = rol64(a[9] ^ d4, 20);
+		b[7]  = rol64(a[10] ^ d0, 3);
+		b[17] = rol64(a[11] ^ d1, 10);
+		b[2]  = rol64(a[12] ^ d2, 43);
+		b[12] = rol64(a[13] ^ d3, 25);
+		b[22] = rol64(a[14] ^ d4, 39);
+		b[23] = rol64(a[15] ^ d0, 41);
+		b[8]  = rol64(a[16] ^ d1, 45);
+		b[18] = rol64(a[17] ^ d2, 15);
+		b[3]  = rol64(a[18] ^ d3, 21);
+		b[13] = rol64(a[19] ^ d4, 8);
+		b[14] = rol64(a[20] ^ d0, 18);
+		b[24] = rol64(a[21] ^ d1, 2);
+		b[9]  = rol64(a[22] ^ d2, 61);
+		b[19] = rol64(a[23] ^ d3, 56);
+		b[4]  = rol64(a[24] ^ d4, 14);
+
+		/* Chi. */
+		for (y = 0; y < 25; y += 5) {
+			a[y + 0] = b[y + 0] ^ (~b[y + 1] & b[y + 2]);
+			a[y + 1] = b[y + 1] ^ (~b[y + 2] & b[y + 3]);
+			a[y + 2] = b[y + 2] ^ (~b[y + 3] & b[y + 4]);
+			a[y + 3] = b[y + 3] ^ (~b[y + 4] & b[y + 0]);
+			a[y + 4] = b[y + 4] ^ (~b[y + 0] & b[y + 1]);
+		}
+
+		/* Iota. */
+		a[0] ^= k12_rc[round];
+	}
+}
+
+/** Absorb data into a sponge. */
+static void sponge_absorb(struct k12_sponge *s, const unsigned char *p, size_t len)
+{
+	/* Finish a partial block a byte at a time. */
+	while (len > 0 && s->pos != 0) {
+		s->lanes[s->pos / 8] ^= (uint64_t)*p++ << (8 * (s->pos % 8));
+		len--;
+		if (++s->pos == K12_RATE) {
+			keccak_p12(s->lanes);
+			s->pos = 0;
+		}
+	}
+
+	/* Whole blocks a lane at a time. */
+	while (len >= K12_RATE) {
+		unsigned int i;
+
+		for (i = 0; i < K12_RATE / 8; i++)
+			s->lanes[i] ^= load64(p + 8 * i);
+		keccak_p12(s->lanes);
+		p += K12_RATE;
+		len -= K12_RATE;
+	}
+
+	for (; len > 0; len--, s->pos++)
+		s->lanes[s->pos / 8] ^= (uint64_t)*p++ << (8 * (s->pos % 8));
+}
+
+/** Pad a sponge with domain separation byte @p d and squeeze @p len bytes. */
+static void sponge_final(struct k12_sponge *s, unsigned char d, unsigned char *out, size_t len)
+{
+	size_t i;
+
+	s->lanes[s->pos / 8] ^= (uint64_t)d << (8 * (s->pos % 8));
+	s->lanes[(K12_RATE - 1) / 8] ^= (uint64_t)0x80 << (8 * ((K12_RATE - 1) % 8));
+	keccak_p12(s->lanes);
+
+	for (i = 0; i < len; i++) {
+		if (i > 0 && i % K12_RATE == 0)
+			keccak_p12(s->lanes);
+		out[i] = (unsigned char)(s->lanes[(i % K12_RATE) / 8] >> (8 * (i % 8)));
+	}
+}
+
+/** Finish the current leaf and absorb its chaining value into the final node. */
+static void k12_end_leaf(struct k12_ctx *c)
+{
+	unsigned char cv[K12_CV];
+
+	sponge_final(&c->leaf, 0x0B, cv, sizeof(cv));
+	sponge_absorb(&c->final, cv, sizeof(cv));
+	memset(&c->leaf, 0, sizeof(c->leaf));
+	c->leaves++;
+}
+
+void k12_init(struct k12_ctx *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+void k12_update(struct k12_ctx *c, const void *data, size_t len)
+{
+	static const unsigned char marker[8] = { 0x03 };
+	const unsigned char *p = data;
+
+	while (len > 0) {
+		size_t n;
+
+		if (c->total < K12_CHUNK) {
+			/* The first chunk goes straight into the final node. */
+			n = K12_CHUNK - c->total;
+			if (n > len)
+				n = len;
+			sponge_absorb(&c->final, p, n);
+		}
+		else {
+			size_t used = (c->total - K12_CHUNK) % K12_CHUNK;
+
+			/* A leaf is only finished once more data follows it. */
+			if (c->total == K12_CHUNK)
+				sponge_absorb(&c->final, marker, sizeof(marker));
+			else if (used == 0)
+				k12_end_leaf(c);
+
+			n = K12_CHUNK - used;
+			if (n > len)
+				n = len;
+			sponge_absorb(&c->leaf, p, n);
+		}
+
+		p += n;
+		len -= n;
+		c->total += n;
+	}
+}
+
+void k12_final(struct k12_ctx *c, unsigned char *out, size_t len)
+{
+	static const unsigned char empty_custom = 0x00; /* length_encode(0) */
+	unsigned char enc[sizeof(uint64_t) + 3];
+	unsigned int n = 0;
+	unsigned int i;
+	uint64_t v;
+
+	/* The (empty) customization string and its length. */
+	k12_update(c, &empty_custom, 1);
+
+	if (c->total <= K12_CHUNK) {
+		sponge_final(&c->final, 0x07, out, len);
+		return;
+	}
+
+	k12_end_leaf(c);
+
+	/* length_encode(leaves) followed by 0xFFFF. */
+	for (v = c->leaves; v != 0; v >>= 8)
+		n++;
+	for (i = 0, v = c->leaves; i < n; i++, v >>= 8)
+		enc[n - 1 - i] = (unsigned char)v;
+	enc[n] = (unsigned char)n;
+	enc[n + 1] = 0xFF;
+	enc[n + 2] = 0xFF;
+
+	sponge_absorb(&c->final, enc, n + 3);
+	sponge_final(&c->final, 0x06, out, len);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * KangarooTwelve (KT128, RFC 9861) declarations.
+ *
+ * OpenSSL doesn't provide KangarooTwelve, so b2tag carries a portable
+ * implementation. Messages longer than 8 KiB are split into 8 KiB leaves
+ * whose chaining values are computed independently (which is what lets
+ * optimized implementations hash several leaves at once in SIMD lanes) and
+ * absorbed by the final node.
+ */
+
+#ifndef K12_H
+#define K12_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The Keccak-p[1600] sponge state used by KangarooTwelve. */
+struct k12_sponge {
+	uint64_t lanes[25]; /**< The state. */
+	unsigned int pos;   /**< The next byte to absorb within the rate. */
+};
+
+/** An in-progress KangarooTwelve computation (with an empty customization string). */
+struct k12_ctx {
+	struct k12_sponge final; /**< The final node. */
+	struct k12_sponge leaf;  /**< The current leaf. */
+	uint64_t total;          /**< The bytes absorbed so far. */
+	uint64_t leaves;         /**< The leaves completed so far. */
+};
+
+/**
+ * Start a KangarooTwelve computation.
+ *
+ * @param c  The context to initialize.
+ */
+void k12_init(struct k12_ctx *c);
+
+/**
+ * Absorb message data.
+ *
+ * @param c     The context.
+ * @param data  The data.
+ * @param len   The length of @p data.
+ */
+void k12_update(struct k12_ctx *c, const void *data, size_t len);
+
+/**
+ * Finish the computation and produce @p len bytes of output.
+ *
+ * @param c    The context (which must be reinitialized to be reused).
+ * @param out  Where to store the output.
+ * @param len  The number of bytes of output.
+ */
+void k12_final(struct k12_ctx *c, unsigned char *out, size_t len);
+
+#endif /* K12_H */
@@ -0,0 +1,836 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Binary manifests.
+ *
+ * The file layout (all integers little-endian):
+ * @li A struct mf_header.
+ * @li The blocks. Each entry is: varint shared path length, varint suffix
+ *     length, the path suffix, varint size, zigzag varint mtime seconds,
+ *     varint mtime nanoseconds, and the raw digest. The first entry of each
+ *     block has a shared length of 0.
+ * @li The index: the 64-bit file offset of each block.
+ *
+ * An unsorted writer buffers its entries in a columnar file table (see
+ * ftable.h). When the memory budget runs out, the table is sorted and spilled
+ * to a temporary manifest (a run), and the runs are merged when the manifest
+ * is closed.
+ */
+
+#include "manifest.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "budget.h"
+#include "ftable.h"
+#include "utilities.h"
+
+/** The magic string (and version) at the start of a manifest. */
+#define MANIFEST_MAGIC "B2TMANI1"
+
+/** The on-disk manifest header. */
+struct mf_header {
+	char magic[8];          /**< #MANIFEST_MAGIC. */
+	char alg[16];           /**< The hash algorithm's name (NUL-padded). */
+	uint32_t hash_len;      /**< The digest length. */
+	uint32_t block_entries; /**< The number of entries per block. */
+	uint64_t count;         /**< The number of entries. */
+	uint64_t blocks;        /**< The number of blocks. */
+	uint64_t index_off;     /**< The offset of the block index. */
+};
+
+struct manifest_writer {
+	char *path;               /**< The manifest file. */
+	hash_alg_t alg;           /**< The hash algorithm. */
+	size_t hash_len;          /**< The digest length. */
+	struct ftable *table;     /**< The entries waiting to be written. */
+	unsigned int runs;        /**< The number of runs spilled to disk. */
+	bool sorted;              /**< Whether entries are written as they're added. */
+	FILE *f;                  /**< The output file. */
+	char *tmp;                /**< The output file's (temporary) name. */
+	uint64_t off;             /**< The current output offset. */
+	uint64_t written;         /**< The number of entries written. */
+	uint64_t *index;          /**< The (little-endian) block offsets. */
+	uint64_t blocks;          /**< The number of blocks written. */
+	size_t index_alloc;       /**< The number of block offsets allocated. */
+	char prev[PATH_MAX];      /**< The last path written. */
+};
+
+struct manifest {
+	unsigned char *map;       /**< The mapped file. */
+	size_t size;              /**< The size of the file. */
+	hash_alg_t alg;           /**< The hash algorithm. */
+	size_t hash_len;          /**< The digest length. */
+	uint64_t count;           /**< The number of entries. */
+	uint64_t blocks;          /**< The number of blocks. */
+	uint64_t index_off;       /**< The offset of the block index. */
+};
+
+/** Append a varint to @p buf, returning its length. */
+static size_t put_varint(unsigned char *buf, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (unsigned char)v;
+
+	return n;
+}
+
+/**
+ * Read a varint.
+ *
+ * @returns Returns 0 on success and -1 if the varint runs past @p end.
+ */
+static int get_varint(const unsigned char **pos, const unsigned char *end, uint64_t *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+
+	while (*pos < end && shift < 64) {
+		unsigned char c = *(*pos)++;
+
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/* Forward declarations. */
+static int mw_begin(struct manifest_writer *w);
+static int mw_spill(struct manifest_writer *w);
+
+struct manifest_writer *manifest_writer_open(const char *path, hash_alg_t alg, bool sorted)
+{
+	struct manifest_writer *w;
+
+	assert(path != NULL);
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return NULL;
+
+	w->path = strdup(path);
+	if (w->path == NULL) {
+		free(w);
+		return NULL;
+	}
+
+	w->alg = alg;
+	w->hash_len = get_alg_size(alg);
+	w->sorted = sorted;
+
+	if (!sorted) {
+		w->table = ftable_new(w->hash_len, false);
+		if (w->table == NULL) {
+			manifest_writer_abort(w);
+			return NULL;
+		}
+	}
+
+	if (sorted && mw_begin(w) != 0) {
+		manifest_writer_abort(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+/**
+ * Create the temporary output file and skip over the header.
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int mw_begin(struct manifest_writer *w)
+{
+	if (asprintf(&w->tmp, "%s.%d", w->path, (int)getpid()) < 0) {
+		w->tmp = NULL;
+		return -1;
+	}
+
+	w->f = fopen(w->tmp, "wb");
+	if (w->f == NULL) {
+		pr_err("Error: could not create \"%s\": %m\n", w->tmp);
+		free(w->tmp);
+		w->tmp = NULL;
+		return -1;
+	}
+
+	w->off = sizeof(struct mf_header);
+
+	if (fseek(w->f, (long)w->off, SEEK_SET) != 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Encode and write a single entry (entries must be written in order).
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int mw_put(struct manifest_writer *w, const char *path, uint64_t size,
+	int64_t sec, uint32_t nsec, const unsigned char *digest)
+{
+	unsigned char buf[5 * 10 + PATH_MAX + MAX_HASH_SIZE];
+	size_t shared = 0;
+	size_t len;
+	size_t n;
+
+	if (w->written % MANIFEST_BLOCK_ENTRIES == 0) {
+		if (w->blocks >= w->index_alloc) {
+			size_t alloc = w->index_alloc ? w->index_alloc * 2 : 1024;
+			void *tmp;
+
+			tmp = budget_realloc(w->index, w->index_alloc * sizeof(w->index[0]),
+				alloc * sizeof(w->index[0]));
+			if (tmp == NULL)
+				return -1;
+
+			w->index = tmp;
+			w->index_alloc = alloc;
+		}
+
+		w->index[w->blocks++] = htole64(w->off);
+	}
+	else {
+		while (path[shared] != '\0' && path[shared] == w->prev[shared])
+			shared++;
+	}
+
+	len = strlen(path + shared);
+
+	n  = put_varint(buf, shared);
+	n += put_varint(buf + n, len);
+	memcpy(buf + n, path + shared, len);
+	n += len;
+	n += put_varint(buf + n, size);
+	n += put_varint(buf + n, ((uint64_t)sec << 1) ^ (uint64_t)(sec >> 63));
+	n += put_varint(buf + n, nsec);
+	memcpy(buf + n, digest, w->hash_len);
+	n += w->hash_len;
+
+	if (fwrite(buf, 1, n, w->f) != n)
+		return -1;
+
+	memcpy(w->prev + shared, path + shared, len + 1);
+	w->off += n;
+	w->written++;
+
+	return 0;
+}
+
+int manifest_writer_add(struct manifest_writer *w, const struct manifest_entry *entry)
+{
+	size_t len;
+	int err;
+
+	assert(w != NULL);
+	assert(entry != NULL && entry->path != NULL);
+
+	len = strlen(entry->path) + 1;
+	if (len > PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (w->sorted) {
+		if (w->written > 0 && strcmp(entry->path, w->prev) <= 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		return mw_put(w, entry->path, entry->size, entry->mtime.tv_sec,
+			(uint32_t)entry->mtime.tv_nsec, entry->digest);
+	}
+
+	err = ftable_add(w->table, entry->path, 0, entry->size, &entry->mtime, entry->digest);
+
+	/* Out of memory: spill the entries so far and try again. */
+	if (err > 0 && ftable_count(w->table) > 0) {
+		if (mw_spill(w) != 0)
+			return -1;
+
+		err = ftable_add(w->table, entry->path, 0, entry->size, &entry->mtime, entry->digest);
+	}
+
+	return err != 0 ? -1 : 0;
+}
+
+/**
+ * Write a table's entries to a writer in path order (skipping duplicates).
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int mw_write_table(struct manifest_writer *w, struct ftable *t)
+{
+	const uint32_t *rows = ftable_sort_path(t);
+	size_t count = ftable_count(t);
+	char paths[2][PATH_MAX];
+	unsigned int cur = 0;
+	size_t i;
+
+	if (count > 0)
+		ftable_path(t, rows[0], paths[cur], PATH_MAX);
+
+	for (i = 0; i < count; i++) {
+		struct timespec mtime;
+
+		/* Duplicates are sorted oldest first; keep the newest. */
+		if (i + 1 < count) {
+			ftable_path(t, rows[i + 1], paths[!cur], PATH_MAX);
+			if (strcmp(paths[cur], paths[!cur]) == 0) {
+				cur = !cur;
+				continue;
+			}
+		}
+
+		mtime = ftable_mtime(t, rows[i]);
+
+		if (mw_put(w, paths[cur], ftable_get(t, FTABLE_SIZE, rows[i]), mtime.tv_sec,
+				(uint32_t)mtime.tv_nsec, ftable_digest(t, rows[i])) != 0)
+			return -1;
+
+		cur = !cur;
+	}
+
+	return 0;
+}
+
+/** Format the name of spilled run @p run. */
+static void mw_run_name(const struct manifest_writer *w, unsigned int run, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s.%d.%u", w->path, (int)getpid(), run);
+}
+
+/**
+ * Sort the buffered entries and write them to a new run.
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int mw_spill(struct manifest_writer *w)
+{
+	struct manifest_writer *run;
+	char name[PATH_MAX + 32];
+
+	mw_run_name(w, w->runs, name, sizeof(name));
+
+	pr_debug("Spilling %zu manifest entries (%zu bytes) to %s\n", ftable_count(w->table),
+		ftable_bytes(w->table), name);
+
+	run = manifest_writer_open(name, w->alg, true);
+	if (run == NULL)
+		return -1;
+
+	/* Count the run first, so it's removed even if it's incomplete. */
+	w->runs++;
+
+	if (mw_write_table(run, w->table) != 0) {
+		manifest_writer_abort(run);
+		return -1;
+	}
+
+	if (manifest_writer_close(run) != 0)
+		return -1;
+
+	ftable_clear(w->table);
+
+	return 0;
+}
+
+/**
+ * Merge the spilled runs into the manifest. Where runs have the same path,
+ * the entry from the latest run wins.
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int mw_merge_runs(struct manifest_writer *w)
+{
+	struct manifest **runs;
+	struct manifest_iter *its;
+	struct manifest_entry *heads;
+	int *have;
+	char name[PATH_MAX + 32];
+	unsigned int i;
+	int ret = -1;
+
+	runs = calloc(w->runs, sizeof(*runs));
+	its = malloc(w->runs * sizeof(*its));
+	heads = malloc(w->runs * sizeof(*heads));
+	have = calloc(w->runs, sizeof(*have));
+	if (runs == NULL || its == NULL || heads == NULL || have == NULL)
+		goto out;
+
+	for (i = 0; i < w->runs; i++) {
+		mw_run_name(w, i, name, sizeof(name));
+
+		runs[i] = manifest_open(name);
+		if (runs[i] == NULL)
+			goto out;
+
+		manifest_iter_init(&its[i], runs[i]);
+		have[i] = manifest_iter_next(&its[i], &heads[i]);
+		if (have[i] < 0)
+			goto out;
+	}
+
+	for (;;) {
+		int best = -1;
+
+		/* Ties go to the later run (the newer entry). */
+		for (i = 0; i < w->runs; i++) {
+			if (have[i] > 0 && (best < 0 || strcmp(heads[i].path, heads[best].path) <= 0))
+				best = (int)i;
+		}
+
+		if (best < 0)
+			break;
+
+		if (mw_put(w, heads[best].path, heads[best].size, heads[best].mtime.tv_sec,
+				(uint32_t)heads[best].mtime.tv_nsec, heads[best].digest) != 0)
+			goto out;
+
+		/* Skip the same path in the other runs. */
+		for (i = 0; i < w->runs; i++) {
+			if (i != (unsigned int)best && have[i] > 0 &&
+				strcmp(heads[i].path, heads[best].path) == 0)
+				have[i] = manifest_iter_next(&its[i], &heads[i]);
+		}
+
+		have[best] = manifest_iter_next(&its[best], &heads[best]);
+
+		for (i = 0; i < w->runs; i++) {
+			if (have[i] < 0)
+				goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	for (i = 0; runs != NULL && i < w->runs; i++)
+		manifest_close(runs[i]);
+	free(runs);
+	free(its);
+	free(heads);
+	free(have);
+	return ret;
+}
+
+/**
+ * Write the buffered entries (merging them with the spilled runs, if any).
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int mw_write_buffered(struct manifest_writer *w)
+{
+	if (w->runs == 0)
+		return mw_write_table(w, w->table);
+
+	/* Once anything was spilled, everything is spilled and merged. */
+	if (ftable_count(w->table) > 0 && mw_spill(w) != 0)
+		return -1;
+
+	return mw_merge_runs(w);
+}
+
+/**
+ * Write the index and header.
+ *
+ * @returns Returns 0 on success and -1 on failure.
+ */
+static int mw_finish(struct manifest_writer *w)
+{
+	struct mf_header hdr = { .magic = MANIFEST_MAGIC };
+
+	if (w->blocks > 0 && fwrite(w->index, sizeof(w->index[0]), w->blocks, w->f) != w->blocks)
+		return -1;
+
+	strncpy(hdr.alg, get_alg_name(w->alg), sizeof(hdr.alg) - 1);
+	hdr.hash_len      = htole32((uint32_t)w->hash_len);
+	hdr.block_entries = htole32(MANIFEST_BLOCK_ENTRIES);
+	hdr.count         = htole64(w->written);
+	hdr.blocks        = htole64(w->blocks);
+	hdr.index_off     = htole64(w->off);
+
+	if (fseek(w->f, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, w->f) != 1)
+		return -1;
+
+	return 0;
+}
+
+int manifest_writer_close(struct manifest_writer *w)
+{
+	int ret = -1;
+
+	assert(w != NULL);
+
+	if (!w->sorted && mw_begin(w) != 0)
+		goto out;
+
+	if ((!w->sorted && mw_write_buffered(w) != 0) || mw_finish(w) != 0) {
+		pr_err("Error: could not write manifest \"%s\": %m\n", w->tmp);
+		goto out;
+	}
+
+	ret = fclose(w->f);
+	w->f = NULL;
+
+	if (ret != 0 || rename(w->tmp, w->path) != 0) {
+		pr_err("Error: could not write manifest \"%s\": %m\n", w->path);
+		ret = -1;
+		goto out;
+	}
+
+	free(w->tmp);
+	w->tmp = NULL;
+
+out:
+	manifest_writer_abort(w);
+	return ret;
+}
+
+void manifest_writer_abort(struct manifest_writer *w)
+{
+	if (w == NULL)
+		return;
+
+	if (w->f != NULL)
+		fclose(w->f);
+	if (w->tmp != NULL) {
+		unlink(w->tmp);
+		free(w->tmp);
+	}
+
+	while (w->runs > 0) {
+		char name[PATH_MAX + 32];
+
+		mw_run_name(w, --w->runs, name, sizeof(name));
+		unlink(name);
+	}
+
+	ftable_free(w->table);
+	budget_free(w->index, w->index_alloc * sizeof(w->index[0]));
+	free(w->path);
+	free(w);
+}
+
+struct manifest *manifest_open(const char *path)
+{
+	struct manifest *m;
+	struct mf_header hdr;
+	struct stat st;
+	int fd;
+
+	assert(path != NULL);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_err("Error: could not open manifest \"%s\": %m\n", path);
+		return NULL;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		goto fail;
+
+	if (fstat(fd, &st) != 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.alg[sizeof(hdr.alg) - 1] != '\0' ||
+		get_alg_by_name(hdr.alg, &m->alg) != 0) {
+		pr_err("Error: \"%s\" is not a b2tag manifest\n", path);
+		goto fail;
+	}
+
+	m->size      = (size_t)st.st_size;
+	m->hash_len  = le32toh(hdr.hash_len);
+	m->count     = le64toh(hdr.count);
+	m->blocks    = le64toh(hdr.blocks);
+	m->index_off = le64toh(hdr.index_off);
+
+	if (m->hash_len != get_alg_size(m->alg) ||
+		le32toh(hdr.block_entries) != MANIFEST_BLOCK_ENTRIES ||
+		m->blocks != (m->count + MANIFEST_BLOCK_ENTRIES - 1) / MANIFEST_BLOCK_ENTRIES ||
+		m->index_off < sizeof(hdr) || m->index_off > m->size ||
+		(m->size - m->index_off) / sizeof(uint64_t) < m->blocks) {
+		pr_err("Error: manifest \"%s\" is corrupt\n", path);
+		goto fail;
+	}
+
+	m->map = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m->map == MAP_FAILED) {
+		pr_err("Error: could not map manifest \"%s\": %m\n", path);
+		goto fail;
+	}
+
+	close(fd);
+	return m;
+
+fail:
+	free(m);
+	close(fd);
+	return NULL;
+}
+
+void manifest_close(struct manifest *m)
+{
+	if (m == NULL)
+		return;
+
+	munmap(m->map, m->size);
+	free(m);
+}
+
+hash_alg_t manifest_alg(const struct manifest *m)
+{
+	return m->alg;
+}
+
+uint64_t manifest_count(const struct manifest *m)
+{
+	return m->count;
+}
+
+/**
+ * Find a block's start and end.
+ *
+ * @returns Returns 0 on success and -1 if the index is corrupt.
+ */
+static int mf_block(const struct manifest *m, uint64_t block,
+	const unsigned char **start, const unsigned char **end)
+{
+	uint64_t s, e;
+
+	memcpy(&s, m->map + m->index_off + block * sizeof(s), sizeof(s));
+	s = le64toh(s);
+
+	if (block + 1 < m->blocks) {
+		memcpy(&e, m->map + m->index_off + (block + 1) * sizeof(e), sizeof(e));
+		e = le64toh(e);
+	}
+	else {
+		e = m->index_off;
+	}
+
+	if (s < sizeof(struct mf_header) || s > e || e > m->index_off)
+		return -1;
+
+	*start = m->map + s;
+	*end = m->map + e;
+
+	return 0;
+}
+
+/** Load a block into an iterator. */
+static int mf_load(struct manifest_iter *it, uint64_t block)
+{
+	const struct manifest *m = it->m;
+
+	if (mf_block(m, block, &it->pos, &it->end) != 0)
+		return -1;
+
+	it->next_block = block + 1;
+	it->left = block + 1 < m->blocks ? MANIFEST_BLOCK_ENTRIES :
+		(unsigned int)(m->count - block * MANIFEST_BLOCK_ENTRIES);
+	it->len = 0;
+	it->pending = false;
+
+	return 0;
+}
+
+/**
+ * Decode the next entry into it->cur.
+ *
+ * @retval 1  An entry was decoded.
+ * @retval 0  There are no more entries.
+ * @retval <0 The manifest is corrupt.
+ */
+static int mf_decode(struct manifest_iter *it)
+{
+	const struct manifest *m = it->m;
+	uint64_t shared, len, size, sec, nsec;
+
+	if (it->left == 0) {
+		if (it->next_block >= m->blocks)
+			return 0;
+		if (mf_load(it, it->next_block) != 0)
+			return -1;
+	}
+
+	if (get_varint(&it->pos, it->end, &shared) != 0 ||
+		get_varint(&it->pos, it->end, &len) != 0 ||
+		shared > it->len || len >= sizeof(it->path) - shared ||
+		len > (size_t)(it->end - it->pos))
+		return -1;
+
+	memcpy(it->path + shared, it->pos, len);
+	it->pos += len;
+	it->len = shared + len;
+	it->path[it->len] = '\0';
+
+	if (get_varint(&it->pos, it->end, &size) != 0 ||
+		get_varint(&it->pos, it->end, &sec) != 0 ||
+		get_varint(&it->pos, it->end, &nsec) != 0 ||
+		nsec >= 1000000000 || m->hash_len > (size_t)(it->end - it->pos))
+		return -1;
+
+	it->cur.path = it->path;
+	it->cur.size = size;
+	it->cur.mtime.tv_sec = (time_t)((sec >> 1) ^ -(sec & 1));
+	it->cur.mtime.tv_nsec = (long)nsec;
+	memcpy(it->cur.digest, it->pos, m->hash_len);
+	it->pos += m->hash_len;
+	it->left--;
+
+	return 1;
+}
+
+void manifest_iter_init(struct manifest_iter *it, const struct manifest *m)
+{
+	it->m = m;
+	it->next_block = 0;
+	it->left = 0;
+	it->len = 0;
+	it->pending = false;
+}
+
+int manifest_iter_next(struct manifest_iter *it, struct manifest_entry *entry)
+{
+	int ret;
+
+	if (it->pending) {
+		it->pending = false;
+		*entry = it->cur;
+		return 1;
+	}
+
+	ret = mf_decode(it);
+	if (ret > 0)
+		*entry = it->cur;
+
+	return ret;
+}
+
+/**
+ * Compare the first path of a block with @p path.
+ *
+ * @returns Returns <0, 0, or >0 like strcmp(), or sets @p err on corruption.
+ */
+static int mf_compare_first(const struct manifest *m, uint64_t block, const char *path, int *err)
+{
+	const unsigned char *pos, *end;
+	uint64_t shared, len;
+	size_t plen = strlen(path);
+	int cmp;
+
+	if (mf_block(m, block, &pos, &end) != 0 ||
+		get_varint(&pos, end, &shared) != 0 || get_varint(&pos, end, &len) != 0 ||
+		shared != 0 || len > (size_t)(end - pos)) {
+		*err = -1;
+		return 0;
+	}
+
+	cmp = memcmp(pos, path, len < plen ? len : plen);
+	if (cmp != 0)
+		return cmp;
+
+	return (len > plen) - (len < plen);
+}
+
+int manifest_iter_seek(struct manifest_iter *it, const struct manifest *m, const char *path)
+{
+	uint64_t lo = 0, hi = m->blocks;
+	int err = 0;
+	int ret;
+
+	manifest_iter_init(it, m);
+
+	if (m->blocks == 0)
+		return 0;
+
+	/* Find the last block whose first path is <= path. */
+	while (hi - lo > 1) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (mf_compare_first(m, mid, path, &err) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+
+		if (err != 0)
+			return err;
+	}
+
+	if (mf_load(it, lo) != 0)
+		return -1;
+
+	/* Scan forward to the first entry that's >= path. */
+	while ((ret = mf_decode(it)) > 0) {
+		if (strcmp(it->path, path) >= 0) {
+			it->pending = true;
+			return 0;
+		}
+	}
+
+	return ret;
+}
+
+int manifest_find(const struct manifest *m, const char *path,
+	struct manifest_iter *it, struct manifest_entry *entry)
+{
+	int ret;
+
+	ret = manifest_iter_seek(it, m, path);
+	if (ret < 0)
+		return ret;
+
+	ret = manifest_iter_next(it, entry);
+	if (ret <= 0)
+		return ret;
+
+	return strcmp(entry->path, path) == 0;
+}
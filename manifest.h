@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Binary manifest declarations.
+ *
+ * A manifest records the path, size, mtime, and (raw) digest of a set of
+ * files. Unlike a sha*sum text file, a manifest is sorted by path, so it can
+ * be binary-searched in place (it's mmap()ed, never loaded) and two manifests
+ * can be diffed or merged in a single linear pass.
+ *
+ * Entries are stored in blocks of #MANIFEST_BLOCK_ENTRIES. Within a block,
+ * each path only stores the suffix that differs from the previous path (front
+ * coding), and the numbers are stored as varints. An index of block offsets at
+ * the end of the file allows binary searching on the first path of each block.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "hash.h"
+
+/** The number of entries per block. */
+#define MANIFEST_BLOCK_ENTRIES 64
+
+/** A single manifest entry. */
+struct manifest_entry {
+	const char *path;     /**< The file's path. */
+	uint64_t size;        /**< The file's size. */
+	struct timespec mtime; /**< The file's mtime. */
+	unsigned char digest[MAX_HASH_SIZE]; /**< The file's raw digest. */
+};
+
+/** A manifest being written. */
+struct manifest_writer;
+
+/** A manifest opened for reading. */
+struct manifest;
+
+/** A position in a manifest. */
+struct manifest_iter {
+	const struct manifest *m;  /**< The manifest. */
+	uint64_t next_block;       /**< The next block to read. */
+	unsigned int left;         /**< The entries left in the current block. */
+	const unsigned char *pos;  /**< The next entry in the current block. */
+	const unsigned char *end;  /**< The end of the current block. */
+	bool pending;              /**< Whether manifest_iter::cur hasn't been returned yet. */
+	struct manifest_entry cur; /**< The current entry. */
+	size_t len;                /**< The length of the current entry's path. */
+	char path[PATH_MAX];       /**< The current entry's path. */
+};
+
+/**
+ * Start writing a manifest.
+ *
+ * Unless @p sorted is set, entries may be added in any order; they're kept in
+ * memory and sorted when the manifest is written out by manifest_writer_close().
+ * With @p sorted, entries must be added in strictly increasing path order and
+ * are written out immediately (e.g. when merging manifests).
+ *
+ * @param path    The manifest file.
+ * @param alg     The hash algorithm of the digests.
+ * @param sorted  Whether the entries will be added in order.
+ *
+ * @returns Returns the writer or NULL on failure.
+ */
+struct manifest_writer *manifest_writer_open(const char *path, hash_alg_t alg, bool sorted);
+
+/**
+ * Add a file to a manifest.
+ *
+ * If a path is added more than once, the last entry wins (unsorted writers
+ * only; sorted writers reject out-of-order and duplicate paths with EINVAL).
+ *
+ * @param w      The writer.
+ * @param entry  The file's entry.
+ *
+ * @retval 0  The entry was added.
+ * @retval !0 An error occurred.
+ */
+int manifest_writer_add(struct manifest_writer *w, const struct manifest_entry *entry);
+
+/**
+ * Sort the entries, write the manifest (atomically replacing @p path), and
+ * free the writer.
+ *
+ * @param w  The writer.
+ *
+ * @retval 0  The manifest was written successfully.
+ * @retval !0 An error occurred (the old file is left in place).
+ */
+int manifest_writer_close(struct manifest_writer *w);
+
+/**
+ * Free a writer without writing the manifest.
+ *
+ * @param w  The writer (may be NULL).
+ */
+void manifest_writer_abort(struct manifest_writer *w);
+
+/**
+ * Open (map) a manifest.
+ *
+ * @param path  The manifest file.
+ *
+ * @returns Returns the manifest or NULL on failure.
+ */
+struct manifest *manifest_open(const char *path);
+
+/**
+ * Unmap a manifest.
+ *
+ * @param m  The manifest (may be NULL).
+ */
+void manifest_close(struct manifest *m);
+
+/** Returns the hash algorithm of a manifest's digests. */
+hash_alg_t manifest_alg(const struct manifest *m);
+
+/** Returns the number of entries in a manifest. */
+uint64_t manifest_count(const struct manifest *m);
+
+/**
+ * Position an iterator at the first entry of a manifest.
+ *
+ * @param it  The iterator.
+ * @param m   The manifest.
+ */
+void manifest_iter_init(struct manifest_iter *it, const struct manifest *m);
+
+/**
+ * Position an iterator at the first entry whose path is not less than @p path
+ * (in byte order).
+ *
+ * @param it    The iterator.
+ * @param m     The manifest.
+ * @param path  The path to look for.
+ *
+ * @retval 0  The iterator was positioned.
+ * @retval <0 The manifest is corrupt.
+ */
+int manifest_iter_seek(struct manifest_iter *it, const struct manifest *m, const char *path);
+
+/**
+ * Read the next entry.
+ *
+ * @param it     The iterator.
+ * @param entry  Where to store the entry (entry->path points into @p it and
+ *               is valid until the next call).
+ *
+ * @retval 1  An entry was read.
+ * @retval 0  There are no more entries.
+ * @retval <0 The manifest is corrupt.
+ */
+int manifest_iter_next(struct manifest_iter *it, struct manifest_entry *entry);
+
+/**
+ * Look up a single path.
+ *
+ * @param m      The manifest.
+ * @param path   The path to look for.
+ * @param it     Iterator storage (entry->path points into it).
+ * @param entry  Where to store the entry.
+ *
+ * @retval 1  The path was found.
+ * @retval 0  The path isn't in the manifest.
+ * @retval <0 The manifest is corrupt.
+ */
+int manifest_find(const struct manifest *m, const char *path,
+	struct manifest_iter *it, struct manifest_entry *entry);
+
+#endif /* MANIFEST_H */
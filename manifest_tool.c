@@ -0,0 +1,652 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Binary manifest utility (b2tag-manifest).
+ *
+ * Converts between binary manifests (see manifest.h) and the coreutils
+ * sha*sum text format, and diffs, merges, and verifies manifests, and finds
+ * duplicate files.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "b2tag.h"
+#include "ftable.h"
+#include "hash.h"
+#include "io.h"
+#include "manifest.h"
+#include "utilities.h"
+
+/** The options set by command-line arguments. */
+struct args_s args;
+
+/**
+ * Prints a usage message for b2tag-manifest.
+ *
+ * @param program  The name of the program being run.
+ */
+static void usage(const char *program)
+{
+	printf(
+		"Usage: %s [OPTION]... COMMAND ARG...\n"
+		"\n"
+		"Work with b2tag binary manifests.\n"
+		"\n"
+		"Commands:\n"
+		"  from-text TEXT MANIFEST   convert a sha*sum file (- for stdin) to a manifest\n"
+		"  to-text MANIFEST          print a manifest in the sha*sum format\n"
+		"  lookup MANIFEST PATH...   print the entries for PATHs\n"
+		"  diff OLD NEW              list the paths added (+), removed (-), or\n"
+		"                            changed (M) between two manifests\n"
+		"  merge OLD NEW OUT         write OLD updated with the entries of NEW to OUT\n"
+		"  verify MANIFEST           hash every file in MANIFEST and compare\n"
+		"  dupes MANIFEST            list the groups of (non-empty) files in MANIFEST\n"
+		"                            with the same size and digest\n"
+		"\n"
+		"Optional arguments:\n"
+		"  -a, --alg=ALG             the hash algorithm for from-text (default: blake2b512)\n"
+		"  -h, --help                show this help message and exit\n"
+		"  -q, --quiet               only print differences and failures\n",
+		program);
+}
+
+/** Long options to pass to getopt. */
+static const struct option long_opts[] = {
+	{ "alg",   required_argument, 0, 'a' },
+	{ "help",  no_argument,       0, 'h' },
+	{ "quiet", no_argument,       0, 'q' },
+	{ NULL, 0, 0, 0 }
+};
+
+/**
+ * Print a manifest entry in the sha*sum format.
+ *
+ * Like coreutils, paths containing a newline or backslash are escaped and the
+ * line is prefixed with a backslash.
+ */
+static void print_entry(const struct manifest *m, const struct manifest_entry *e)
+{
+	char hex[MAX_HASH_STRING_LENGTH + 1];
+	const char *p;
+
+	bin2hex(hex, sizeof(hex), e->digest, (int)get_alg_size(manifest_alg(m)));
+
+	if (strpbrk(e->path, "\\\n") == NULL) {
+		printf("%s  %s\n", hex, e->path);
+		return;
+	}
+
+	printf("\\%s  ", hex);
+	for (p = e->path; *p != '\0'; p++) {
+		if (*p == '\\')
+			fputs("\\\\", stdout);
+		else if (*p == '\n')
+			fputs("\\n", stdout);
+		else
+			putchar(*p);
+	}
+	putchar('\n');
+}
+
+/**
+ * Parse a single sha*sum line into @p e.
+ *
+ * @returns Returns 0 on success and -1 if the line is malformed.
+ */
+static int parse_line(char *line, size_t hash_len, struct manifest_entry *e)
+{
+	bool escaped = false;
+	char *path;
+	char *sep;
+	char *in, *out;
+
+	line[strcspn(line, "\n")] = '\0';
+
+	if (line[0] == '\\') {
+		escaped = true;
+		line++;
+	}
+
+	sep = strchr(line, ' ');
+	if (sep == NULL || (sep[1] != ' ' && sep[1] != '*') || sep[2] == '\0')
+		return -1;
+
+	*sep = '\0';
+	path = sep + 2;
+
+	if (hex2bin(e->digest, sizeof(e->digest), line) != (int)hash_len)
+		return -1;
+
+	if (escaped) {
+		for (in = out = path; *in != '\0'; in++, out++) {
+			if (*in == '\\') {
+				in++;
+				if (*in == 'n')
+					*out = '\n';
+				else if (*in == '\\')
+					*out = '\\';
+				else
+					return -1;
+			}
+			else {
+				*out = *in;
+			}
+		}
+		*out = '\0';
+	}
+
+	e->path = path;
+	e->size = 0;
+	e->mtime = (struct timespec){ 0, 0 };
+
+	return 0;
+}
+
+/** Convert a sha*sum text file to a manifest. */
+static int cmd_from_text(const char *text, const char *out, hash_alg_t alg)
+{
+	struct manifest_writer *w;
+	struct manifest_entry e;
+	unsigned long lineno = 0;
+	char *line = NULL;
+	size_t alloc = 0;
+	FILE *f;
+	int ret = 0;
+
+	f = strcmp(text, "-") == 0 ? stdin : fopen(text, "r");
+	if (f == NULL)
+		die("Error: could not open \"%s\": %m\n", text);
+
+	w = manifest_writer_open(out, alg, false);
+	if (w == NULL)
+		die("Error: could not create manifest \"%s\": %m\n", out);
+
+	while (getline(&line, &alloc, f) >= 0) {
+		lineno++;
+
+		if (parse_line(line, get_alg_size(alg), &e) != 0) {
+			pr_err("%s:%lu: not a %s line\n", text, lineno, get_alg_name(alg));
+			ret = 1;
+			continue;
+		}
+
+		if (manifest_writer_add(w, &e) != 0)
+			die("Error: could not add \"%s\": %m\n", e.path);
+	}
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+
+	if (manifest_writer_close(w) != 0)
+		return 2;
+
+	return ret;
+}
+
+/** Print a manifest in the sha*sum format. */
+static int cmd_to_text(const struct manifest *m)
+{
+	struct manifest_iter it;
+	struct manifest_entry e;
+	int ret;
+
+	manifest_iter_init(&it, m);
+
+	while ((ret = manifest_iter_next(&it, &e)) > 0)
+		print_entry(m, &e);
+
+	return ret < 0 ? 2 : 0;
+}
+
+/** Look up paths in a manifest. */
+static int cmd_lookup(const struct manifest *m, char **paths, int count)
+{
+	struct manifest_iter it;
+	struct manifest_entry e;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		int found = manifest_find(m, paths[i], &it, &e);
+
+		if (found < 0)
+			return 2;
+
+		if (found) {
+			print_entry(m, &e);
+		}
+		else {
+			pr_err("%s: not in manifest\n", paths[i]);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Walk two manifests in path order.
+ *
+ * Calls @p fn for every path in either manifest, with NULL for the side that
+ * doesn't have it.
+ *
+ * @returns Returns 0 on success, 2 if a manifest is corrupt, or the first
+ *          non-zero value returned by @p fn.
+ */
+static int walk_pair(const struct manifest *a, const struct manifest *b,
+	int (*fn)(const struct manifest_entry *x, const struct manifest_entry *y, void *arg),
+	void *arg)
+{
+	struct manifest_iter *ia, *ib;
+	struct manifest_entry ea, eb;
+	int ra, rb;
+	int ret = 0;
+
+	/* The iterators are big (they hold a path each). */
+	ia = malloc(sizeof(*ia));
+	ib = malloc(sizeof(*ib));
+	if (ia == NULL || ib == NULL)
+		die("Error: %m\n");
+
+	manifest_iter_init(ia, a);
+	manifest_iter_init(ib, b);
+
+	ra = manifest_iter_next(ia, &ea);
+	rb = manifest_iter_next(ib, &eb);
+
+	while (ret == 0 && ra > 0 && rb > 0) {
+		int cmp = strcmp(ea.path, eb.path);
+
+		if (cmp < 0) {
+			ret = fn(&ea, NULL, arg);
+			ra = manifest_iter_next(ia, &ea);
+		}
+		else if (cmp > 0) {
+			ret = fn(NULL, &eb, arg);
+			rb = manifest_iter_next(ib, &eb);
+		}
+		else {
+			ret = fn(&ea, &eb, arg);
+			ra = manifest_iter_next(ia, &ea);
+			rb = manifest_iter_next(ib, &eb);
+		}
+	}
+
+	while (ret == 0 && ra > 0) {
+		ret = fn(&ea, NULL, arg);
+		ra = manifest_iter_next(ia, &ea);
+	}
+
+	while (ret == 0 && rb > 0) {
+		ret = fn(NULL, &eb, arg);
+		rb = manifest_iter_next(ib, &eb);
+	}
+
+	free(ia);
+	free(ib);
+
+	if (ret == 0 && (ra < 0 || rb < 0))
+		ret = 2;
+
+	return ret;
+}
+
+/** The state of a diff. */
+struct diff_state {
+	size_t hash_len; /**< The digest length. */
+	bool differ;     /**< Whether any differences were found. */
+};
+
+/** walk_pair() callback for diff. */
+static int diff_one(const struct manifest_entry *x, const struct manifest_entry *y, void *arg)
+{
+	struct diff_state *state = arg;
+
+	if (y == NULL)
+		printf("- %s\n", x->path);
+	else if (x == NULL)
+		printf("+ %s\n", y->path);
+	else if (memcmp(x->digest, y->digest, state->hash_len) != 0)
+		printf("M %s\n", x->path);
+	else
+		return 0;
+
+	state->differ = true;
+
+	return 0;
+}
+
+/** List the differences between two manifests. */
+static int cmd_diff(const struct manifest *a, const struct manifest *b)
+{
+	struct diff_state state = { .hash_len = get_alg_size(manifest_alg(a)) };
+	int ret;
+
+	if (manifest_alg(a) != manifest_alg(b))
+		die("Error: the manifests use different hash algorithms\n");
+
+	ret = walk_pair(a, b, diff_one, &state);
+	if (ret != 0)
+		return ret;
+
+	return state.differ ? 1 : 0;
+}
+
+/** walk_pair() callback for merge. */
+static int merge_one(const struct manifest_entry *x, const struct manifest_entry *y, void *arg)
+{
+	return manifest_writer_add(arg, y != NULL ? y : x) != 0 ? 2 : 0;
+}
+
+/** Merge two manifests (entries in @p b win). */
+static int cmd_merge(const struct manifest *a, const struct manifest *b, const char *out)
+{
+	struct manifest_writer *w;
+	int ret;
+
+	if (manifest_alg(a) != manifest_alg(b))
+		die("Error: the manifests use different hash algorithms\n");
+
+	w = manifest_writer_open(out, manifest_alg(a), true);
+	if (w == NULL)
+		die("Error: could not create manifest \"%s\": %m\n", out);
+
+	ret = walk_pair(a, b, merge_one, w);
+	if (ret != 0) {
+		pr_err("Error: could not merge manifests: %m\n");
+		manifest_writer_abort(w);
+		return ret;
+	}
+
+	return manifest_writer_close(w) != 0 ? 2 : 0;
+}
+
+/** Hash every file in a manifest and compare it with its digest. */
+static int cmd_verify(const struct manifest *m)
+{
+	char hex[MAX_HASH_STRING_LENGTH + 1];
+	unsigned char digest[MAX_HASH_SIZE];
+	size_t hash_len = get_alg_size(manifest_alg(m));
+	struct manifest_iter *it;
+	struct manifest_entry e;
+	unsigned long failed = 0;
+	int ret;
+
+	it = malloc(sizeof(*it));
+	if (it == NULL)
+		die("Error: %m\n");
+
+	manifest_iter_init(it, m);
+
+	while ((ret = manifest_iter_next(it, &e)) > 0) {
+		int fd = io->open(e.path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+
+		if (fd < 0) {
+			printf("%s: FAILED open or read\n", e.path);
+			failed++;
+			continue;
+		}
+
+		if (fhash(fd, hex, sizeof(hex), manifest_alg(m)) != 0 ||
+			hex2bin(digest, sizeof(digest), hex) != (int)hash_len) {
+			printf("%s: FAILED open or read\n", e.path);
+			failed++;
+		}
+		else if (memcmp(digest, e.digest, hash_len) != 0) {
+			printf("%s: FAILED\n", e.path);
+			failed++;
+		}
+		else if (check_err()) {
+			printf("%s: OK\n", e.path);
+		}
+
+		io->close(fd);
+	}
+
+	free(it);
+
+	if (ret < 0) {
+		pr_err("Error: the manifest is corrupt\n");
+		return 2;
+	}
+
+	if (failed > 0)
+		pr_warn("WARNING: %lu files failed verification\n", failed);
+
+	return failed > 0 ? 1 : 0;
+}
+
+/** The file table searched for duplicates. */
+struct dupes_table {
+	struct ftable *t; /**< The table. */
+	size_t hash_len;  /**< The digest length. */
+};
+
+/** qsort_r() comparison function to sort rows by digest (then row number). */
+static int digest_compare(const void *a, const void *b, void *arg)
+{
+	const struct dupes_table *d = arg;
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	int cmp;
+
+	cmp = memcmp(ftable_digest(d->t, x), ftable_digest(d->t, y), d->hash_len);
+	if (cmp != 0)
+		return cmp;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Print the groups of identical files in a manifest (separated by blank
+ * lines).
+ *
+ * The entries are loaded into a file table, the non-empty files are sorted
+ * by size, and only the files that share their size are sorted by digest.
+ */
+static int cmd_dupes(const struct manifest *m)
+{
+	struct dupes_table d = { .hash_len = get_alg_size(manifest_alg(m)) };
+	struct manifest_iter *it;
+	struct manifest_entry e;
+	char path[PATH_MAX];
+	unsigned long groups = 0;
+	uint32_t *rows;
+	size_t count;
+	size_t n;
+	size_t i, j, k, l;
+	int ret;
+
+	d.t = ftable_new(d.hash_len, false);
+	it = malloc(sizeof(*it));
+	if (d.t == NULL || it == NULL)
+		die("Error: %m\n");
+
+	manifest_iter_init(it, m);
+
+	while ((ret = manifest_iter_next(it, &e)) > 0) {
+		if (ftable_add(d.t, e.path, 0, e.size, &e.mtime, e.digest) != 0)
+			die("Error: could not load \"%s\": %m\n", e.path);
+	}
+
+	free(it);
+
+	if (ret < 0) {
+		pr_err("Error: the manifest is corrupt\n");
+		ftable_free(d.t);
+		return 2;
+	}
+
+	count = ftable_count(d.t);
+	rows = ftable_rows_alloc(count);
+	if (rows == NULL)
+		die("Error: %m\n");
+
+	/* Empty files are all identical, but not interesting. */
+	n = ftable_filter(d.t, FTABLE_SIZE, 1, UINT64_MAX, NULL, 0, rows);
+	if (ftable_sort(d.t, FTABLE_SIZE, rows, n) == NULL)
+		die("Error: %m\n");
+
+	for (i = 0; i < n; i = j) {
+		uint64_t size = ftable_get(d.t, FTABLE_SIZE, rows[i]);
+
+		for (j = i + 1; j < n && ftable_get(d.t, FTABLE_SIZE, rows[j]) == size; j++)
+			;
+
+		if (j - i < 2)
+			continue;
+
+		qsort_r(rows + i, j - i, sizeof(rows[0]), digest_compare, &d);
+
+		for (k = i; k < j; k = l) {
+			const unsigned char *digest = ftable_digest(d.t, rows[k]);
+
+			for (l = k + 1; l < j && memcmp(ftable_digest(d.t, rows[l]), digest, d.hash_len) == 0; l++)
+				;
+
+			if (l - k < 2)
+				continue;
+
+			if (groups++ > 0)
+				putchar('\n');
+
+			for (; k < l; k++) {
+				ftable_path(d.t, rows[k], path, sizeof(path));
+				e.path = path;
+				memcpy(e.digest, ftable_digest(d.t, rows[k]), d.hash_len);
+				print_entry(m, &e);
+			}
+		}
+	}
+
+	ftable_rows_free(rows, count);
+	ftable_free(d.t);
+
+	return 0;
+}
+
+static struct manifest *open_or_die(const char *path)
+{
+	struct manifest *m = manifest_open(path);
+
+	if (m == NULL)
+		exit(2);
+
+	return m;
+}
+
+/**
+ * The entry point to the b2tag-manifest utility.
+ *
+ * @param argc  The number of command-line arguments.
+ * @param argv  The command-line arguments.
+ *
+ * @retval 0  Program completed successfully (and found no differences).
+ * @retval 1  Differences or verification failures were found.
+ * @retval 2  An error occurred.
+ */
+int main(int argc, char *argv[])
+{
+	char *program = basename(argv[0]);
+	hash_alg_t alg = HASH_ALG_BLAKE2B;
+	struct manifest *a, *b;
+	const char *cmd;
+	int ret;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "+a:hq", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			if (get_alg_by_name(optarg, &alg) != 0)
+				die("Unknown hash algorithm: \"%s\"\n", optarg);
+			break;
+		case 'h':
+			usage(program);
+			return EXIT_SUCCESS;
+		case 'q':
+			args.verbose--;
+			break;
+		default:
+			usage(program);
+			return 2;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2) {
+		usage(program);
+		return 2;
+	}
+
+	cmd = argv[0];
+
+	if (strcmp(cmd, "from-text") == 0 && argc == 3)
+		return cmd_from_text(argv[1], argv[2], alg);
+
+	if (strcmp(cmd, "to-text") == 0 && argc == 2) {
+		a = open_or_die(argv[1]);
+		ret = cmd_to_text(a);
+	}
+	else if (strcmp(cmd, "lookup") == 0 && argc >= 3) {
+		a = open_or_die(argv[1]);
+		ret = cmd_lookup(a, argv + 2, argc - 2);
+	}
+	else if (strcmp(cmd, "verify") == 0 && argc == 2) {
+		a = open_or_die(argv[1]);
+		ret = cmd_verify(a);
+	}
+	else if (strcmp(cmd, "dupes") == 0 && argc == 2) {
+		a = open_or_die(argv[1]);
+		ret = cmd_dupes(a);
+	}
+	else if ((strcmp(cmd, "diff") == 0 && argc == 3) ||
+		(strcmp(cmd, "merge") == 0 && argc == 4)) {
+		a = open_or_die(argv[1]);
+		b = open_or_die(argv[2]);
+		ret = argc == 3 ? cmd_diff(a, b) : cmd_merge(a, b, argv[3]);
+		manifest_close(b);
+	}
+	else {
+		usage(program);
+		return 2;
+	}
+
+	manifest_close(a);
+
+	return ret;
+}
@@ -0,0 +1,766 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Metadata-only tag migration between attribute layouts (and tag removal).
+ */
+
+#include "migrate.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "b2tag.h"
+#include "budget.h"
+#include "io.h"
+#include "stats.h"
+#include "utilities.h"
+
+/** The most queued files per worker. */
+#define QUEUE_PER_JOB 64
+
+/** Flush the resume file after this many directories. */
+#define RESUME_FLUSH 256
+
+/** The longest resume file header. */
+#define RESUME_HEADER_MAX 256
+
+/** What happened to a file's tag. */
+enum migrate_result {
+	MIGRATE_DONE,     /**< The tag was migrated (or removed). */
+	MIGRATE_STALE,    /**< The tag's mtime doesn't match the file's. */
+	MIGRATE_UNTAGGED, /**< There's no tag in the old layout. */
+	MIGRATE_INVALID,  /**< The tag is malformed. */
+	MIGRATE_FAILED,   /**< An error occurred (try again later). */
+	MIGRATE_COUNT     /**< The number of results (not a result). */
+};
+
+/** The names of the results (for --stats). */
+static const char * const migrate_result_str[MIGRATE_COUNT] = {
+	"MIGRATED",
+	"OUTDATED",
+	"UNTAGGED",
+	"INVALID",
+	"FAILED",
+};
+
+/** A directory being (or that was just) listed. */
+struct migrate_dir {
+	struct migrate_dir *parent; /**< The directory listed before this one. */
+	dev_t dev;          /**< The directory's device. */
+	ino_t ino;          /**< The directory's inode number. */
+	size_t pending;     /**< The queued files that haven't been migrated yet. */
+	bool listed;        /**< Whether all of its files were queued. */
+	bool failed;        /**< Whether one of its files couldn't be migrated. */
+};
+
+/** A file to migrate. */
+struct migrate_item {
+	struct migrate_item *next; /**< The next item in the queue. */
+	size_t size;               /**< The size of this allocation. */
+	int fd;                    /**< The open file. */
+	dev_t dev;                 /**< The file's device. */
+	struct timespec mtime;     /**< The file's mtime. */
+	struct migrate_dir *dir;   /**< The file's directory (NULL for arguments). */
+	char path[];               /**< The file's path. */
+};
+
+/** The results of one device's files that weren't passed to the statistics yet. */
+struct migrate_tally {
+	dev_t dev;                               /**< The files' device. */
+	unsigned long long count[MIGRATE_COUNT]; /**< The files with each result. */
+};
+
+/** A directory recorded in the resume file. */
+struct resume_key {
+	uint64_t dev; /**< The directory's device. */
+	uint64_t ino; /**< The directory's inode number. */
+};
+
+/** The migration state. */
+static struct {
+	bool running;               /**< Whether the workers were started. */
+	bool stop;                  /**< Whether the workers should exit when idle. */
+	xa_layout_t from;           /**< The layout to migrate from. */
+	xa_layout_t to;             /**< The layout to migrate to. */
+	hash_alg_t alg;             /**< The algorithm of the tags to migrate. */
+	unsigned int remove;        /**< The algorithms whose tags to remove (0 to migrate). */
+	unsigned int rate;          /**< The most files per second (0 for no limit). */
+	struct timespec start;      /**< When the migration started (for the rate). */
+	unsigned long long sent;    /**< The files queued so far (for the rate). */
+
+	struct migrate_dir *top;    /**< The directory being listed. */
+	struct migrate_item *head;  /**< The first queued file. */
+	struct migrate_item *tail;  /**< The last queued file. */
+	size_t count;               /**< The number of queued files. */
+	size_t max;                 /**< The most files that may be queued. */
+	size_t active;              /**< The queued files and those being migrated. */
+
+	struct resume_key *done;    /**< Directories done before (sorted). */
+	size_t ndone;               /**< The number of directories done before. */
+	size_t done_size;           /**< The memory reserved for @c done. */
+	FILE *resume;               /**< The resume file (NULL if not in use). */
+	unsigned long unflushed;    /**< Directories recorded since the last flush. */
+
+	unsigned long long results[MIGRATE_COUNT]; /**< The files with each result. */
+	struct migrate_tally tally[STATS_MAX_DEVICES]; /**< The results since report_stats(). */
+	size_t ntally;              /**< The devices in @c tally. */
+	unsigned long long removed; /**< The attributes removed. */
+
+	unsigned int nthreads;      /**< The number of worker threads. */
+	pthread_t *threads;         /**< The worker threads. */
+	pthread_mutex_t lock;       /**< Protects everything above. */
+	pthread_cond_t queued;      /**< Signalled when a file is queued. */
+	pthread_cond_t dequeued;    /**< Signalled when a file is dequeued. */
+	pthread_cond_t released;    /**< Signalled when a file's memory is released. */
+} migrate = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.dequeued = PTHREAD_COND_INITIALIZER,
+	.released = PTHREAD_COND_INITIALIZER,
+};
+
+/** Compare two resume keys (for qsort() and bsearch()). */
+static int resume_cmp(const void *a, const void *b)
+{
+	const struct resume_key *x = a;
+	const struct resume_key *y = b;
+
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Load the directories recorded by earlier runs and open the resume file
+ * for appending.
+ *
+ * The file starts with a header naming the operation and its parameters, so
+ * a resume file can't skip directories that were done by a different run
+ * (e.g. a migration between other layouts).
+ *
+ * @param path    The resume file.
+ * @param header  The header line for this run.
+ *
+ * @retval 0  The resume file was loaded (or doesn't exist yet).
+ * @retval -1 An error occurred (or the file belongs to a different run).
+ */
+static int resume_open(const char *path, const char *header)
+{
+	char line[RESUME_HEADER_MAX];
+	unsigned long long dev, ino;
+	bool empty = true;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL && errno != ENOENT) {
+		pr_err("Error: could not read \"%s\": %m\n", path);
+		return -1;
+	}
+
+	if (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		empty = false;
+		if (strcmp(line, header) != 0) {
+			line[strcspn(line, "\n")] = '\0';
+			pr_err("Error: \"%s\" was written by a different run (\"%s\", not \"%.*s\")\n",
+				path, line, (int)strcspn(header, "\n"), header);
+			fclose(f);
+			return -1;
+		}
+	}
+
+	/* A partial last line (from an interrupted run) doesn't match. */
+	while (f != NULL && fscanf(f, "%llx %llx\n", &dev, &ino) == 2) {
+		if ((migrate.ndone + 1) * sizeof(migrate.done[0]) > migrate.done_size) {
+			size_t size = migrate.done_size ? migrate.done_size * 2 : 4096;
+			void *tmp = budget_realloc(migrate.done, migrate.done_size, size);
+
+			if (tmp == NULL) {
+				pr_err("Error: not enough memory to load \"%s\": %m\n", path);
+				fclose(f);
+				return -1;
+			}
+
+			migrate.done = tmp;
+			migrate.done_size = size;
+		}
+
+		migrate.done[migrate.ndone].dev = dev;
+		migrate.done[migrate.ndone].ino = ino;
+		migrate.ndone++;
+	}
+
+	if (f != NULL)
+		fclose(f);
+
+	if (migrate.ndone > 0) {
+		qsort(migrate.done, migrate.ndone, sizeof(migrate.done[0]), resume_cmp);
+		pr_warn("Resuming: skipping the files of %zu directories\n", migrate.ndone);
+	}
+
+	migrate.resume = fopen(path, "a");
+	if (migrate.resume == NULL) {
+		pr_err("Error: could not open \"%s\": %m\n", path);
+		return -1;
+	}
+
+	if (empty && (fputs(header, migrate.resume) == EOF || fflush(migrate.resume) != 0)) {
+		pr_err("Error: could not write \"%s\": %m\n", path);
+		fclose(migrate.resume);
+		migrate.resume = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Drop a directory's reference, recording it once all of its files are done.
+ *
+ * @note The caller must hold migrate.lock.
+ */
+static void dir_put(struct migrate_dir *dir)
+{
+	if (dir == NULL || dir->pending > 0 || !dir->listed)
+		return;
+
+	if (!dir->failed && migrate.resume != NULL) {
+		fprintf(migrate.resume, "%" PRIx64 " %" PRIx64 "\n", (uint64_t)dir->dev,
+			(uint64_t)dir->ino);
+		if (++migrate.unflushed >= RESUME_FLUSH) {
+			fflush(migrate.resume);
+			migrate.unflushed = 0;
+		}
+	}
+
+	budget_free(dir, sizeof(*dir));
+}
+
+/**
+ * Count a file's result.
+ *
+ * @note The caller must hold migrate.lock.
+ */
+static void count_result(dev_t dev, enum migrate_result result)
+{
+	size_t i;
+
+	migrate.results[result]++;
+
+	for (i = 0; i < migrate.ntally && migrate.tally[i].dev != dev; i++)
+		;
+
+	if (i == migrate.ntally) {
+		/* The segment doesn't track more devices than this anyway, so
+		 * lump the rest in with the last one until the next report.
+		 */
+		if (i == STATS_MAX_DEVICES) {
+			i--;
+		}
+		else {
+			memset(&migrate.tally[i], 0, sizeof(migrate.tally[i]));
+			migrate.tally[i].dev = dev;
+			migrate.ntally++;
+		}
+	}
+
+	migrate.tally[i].count[result]++;
+}
+
+/**
+ * Migrate one file's tag.
+ *
+ * @returns Returns what happened to the tag.
+ */
+static enum migrate_result migrate_one(int fd, const char *path, struct timespec mtime)
+{
+	xa_t xa = { .alg = migrate.alg };
+	int err;
+
+	err = xa_read_layout(fd, &xa, migrate.from);
+	if (err < 0) {
+		pr_err("Error: could not read the tag of \"%s\"\n", path);
+		return MIGRATE_FAILED;
+	}
+
+	if (err == 1)
+		return MIGRATE_UNTAGGED;
+
+	if (err >= 2) {
+		pr_err("Error: \"%s\" has a malformed tag (not migrated)\n", path);
+		return MIGRATE_INVALID;
+	}
+
+	/* The data may have changed since it was tagged: leave it for a
+	 * normal run to rehash.
+	 */
+	if (ts_compare(xa.mtime, mtime, xa.fuzzy) != 0) {
+		pr_debug("Skipping outdated tag: %s\n", path);
+		return MIGRATE_STALE;
+	}
+
+	/* Store the full mtime (a truncated one only matches fuzzily). */
+	xa.mtime = mtime;
+	xa.fuzzy = false;
+
+	if (args.dry_run) {
+		pr_debug("Would migrate: %s\n", path);
+		return MIGRATE_DONE;
+	}
+
+	if (xa_write_layout(fd, &xa, migrate.to) != 0) {
+		pr_err("Error: could not write the new tag of \"%s\"\n", path);
+		return MIGRATE_FAILED;
+	}
+
+	if (xa_remove_layout(fd, migrate.alg, migrate.from) != 0) {
+		pr_err("Error: could not remove the old tag of \"%s\": %m\n", path);
+		return MIGRATE_FAILED;
+	}
+
+	pr_debug("Migrated: %s\n", path);
+
+	return MIGRATE_DONE;
+}
+
+/**
+ * Remove one file's tags.
+ *
+ * @returns Returns what happened to the tags.
+ */
+static enum migrate_result remove_one(int fd, const char *path)
+{
+	int removed;
+
+	removed = xa_remove_tags(fd, migrate.remove, args.dry_run);
+	if (removed < 0) {
+		pr_err("Error: could not remove the tags of \"%s\": %m\n", path);
+		return MIGRATE_FAILED;
+	}
+
+	if (removed == 0)
+		return MIGRATE_UNTAGGED;
+
+	pr_debug("%s %d attributes: %s\n", args.dry_run ? "Would remove" : "Removed", removed,
+		path);
+
+	pthread_mutex_lock(&migrate.lock);
+	migrate.removed += (unsigned long long)removed;
+	pthread_mutex_unlock(&migrate.lock);
+
+	return MIGRATE_DONE;
+}
+
+/** Migrate (or remove) one file's tags. */
+static enum migrate_result process_one(int fd, const char *path, struct timespec mtime)
+{
+	return migrate.remove != 0 ? remove_one(fd, path) : migrate_one(fd, path, mtime);
+}
+
+/** A migration worker thread. */
+static void *migrate_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&migrate.lock);
+
+	for (;;) {
+		struct migrate_item *item;
+		enum migrate_result result;
+
+		while (migrate.head == NULL && !migrate.stop)
+			pthread_cond_wait(&migrate.queued, &migrate.lock);
+
+		item = migrate.head;
+		if (item == NULL)
+			break;
+
+		migrate.head = item->next;
+		if (migrate.head == NULL)
+			migrate.tail = NULL;
+		migrate.count--;
+		pthread_cond_signal(&migrate.dequeued);
+
+		pthread_mutex_unlock(&migrate.lock);
+		result = process_one(item->fd, item->path, item->mtime);
+		io->close(item->fd);
+		pthread_mutex_lock(&migrate.lock);
+
+		count_result(item->dev, result);
+
+		if (item->dir != NULL) {
+			if (result == MIGRATE_FAILED)
+				item->dir->failed = true;
+			item->dir->pending--;
+			dir_put(item->dir);
+		}
+
+		budget_free(item, item->size);
+		migrate.active--;
+		pthread_cond_signal(&migrate.released);
+	}
+
+	pthread_mutex_unlock(&migrate.lock);
+
+	return NULL;
+}
+
+/**
+ * Start the workers (once the operation is set up).
+ *
+ * @param header  The resume file header describing the operation.
+ *
+ * @retval 0  The workers were started.
+ * @retval !0 An error occurred.
+ */
+static int start_workers(unsigned int jobs, unsigned int rate, const char *resume,
+	const char *header)
+{
+	struct rlimit rl;
+	unsigned int i;
+	int err;
+
+	migrate.rate = rate;
+	migrate.max = (size_t)jobs * QUEUE_PER_JOB;
+
+	/* Every queued file holds a file descriptor. */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+		migrate.max + jobs + 64 > rl.rlim_cur)
+		migrate.max = rl.rlim_cur > jobs + 80 ? rl.rlim_cur - jobs - 64 : 16;
+
+	if (resume != NULL && resume_open(resume, header) != 0)
+		return -1;
+
+	migrate.threads = budget_malloc(jobs * sizeof(migrate.threads[0]));
+	if (migrate.threads == NULL) {
+		pr_err("Error: not enough memory for the migration threads: %m\n");
+		return -1;
+	}
+
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&migrate.threads[i], NULL, migrate_thread, NULL);
+		if (err != 0) {
+			errno = err;
+			pr_err("Error: could not start a migration thread: %m\n");
+			break;
+		}
+		migrate.nthreads++;
+	}
+
+	migrate.running = true;
+	clock_gettime(CLOCK_MONOTONIC, &migrate.start);
+
+	if (migrate.nthreads < jobs) {
+		migrate_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+int migrate_start(xa_layout_t from, xa_layout_t to, hash_alg_t alg, unsigned int jobs,
+	unsigned int rate, const char *resume)
+{
+	char header[RESUME_HEADER_MAX];
+
+	migrate.from = from;
+	migrate.to = to;
+	migrate.alg = alg;
+
+	snprintf(header, sizeof(header), "b2tag-resume 1 migrate %s %s %s\n",
+		xa_layout_name(from), xa_layout_name(to), get_alg_name(alg));
+
+	return start_workers(jobs, rate, resume, header);
+}
+
+int migrate_start_removal(unsigned int algs, unsigned int jobs, unsigned int rate,
+	const char *resume)
+{
+	char header[RESUME_HEADER_MAX];
+	size_t len;
+	unsigned int i;
+
+	migrate.remove = algs;
+
+	/* Every algorithm's name fits, so this can't be truncated. */
+	len = (size_t)snprintf(header, sizeof(header), "b2tag-resume 1 remove ");
+	for (i = 0; i < HASH_ALG_COUNT; i++) {
+		if ((algs & (1U << i)) != 0)
+			len += (size_t)snprintf(header + len, sizeof(header) - len, "%s,",
+				get_alg_name((hash_alg_t)i));
+	}
+	header[len - 1] = '\n';
+
+	return start_workers(jobs, rate, resume, header);
+}
+
+bool migrate_enabled(void)
+{
+	return migrate.running;
+}
+
+/** Wait until the next file may be queued without exceeding the rate. */
+static void throttle(void)
+{
+	struct timespec now, delay;
+	double due, elapsed;
+
+	if (migrate.rate == 0)
+		return;
+
+	due = (double)migrate.sent++ / migrate.rate;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (double)(now.tv_sec - migrate.start.tv_sec) +
+		(double)(now.tv_nsec - migrate.start.tv_nsec) / 1e9;
+
+	if (due <= elapsed)
+		return;
+
+	delay.tv_sec = (time_t)(due - elapsed);
+	delay.tv_nsec = (long)((due - elapsed - (double)delay.tv_sec) * 1e9);
+	nanosleep(&delay, NULL);
+}
+
+/**
+ * Pass the results since the last call to the statistics segment (which only
+ * the walking thread may update).
+ */
+static void report_stats(void)
+{
+	struct migrate_tally tally[STATS_MAX_DEVICES];
+	size_t ntally, i;
+	unsigned int j;
+
+	pthread_mutex_lock(&migrate.lock);
+	ntally = migrate.ntally;
+	memcpy(tally, migrate.tally, ntally * sizeof(tally[0]));
+	migrate.ntally = 0;
+	pthread_mutex_unlock(&migrate.lock);
+
+	for (i = 0; i < ntally; i++) {
+		for (j = 0; j < MIGRATE_COUNT; j++) {
+			const char *name = j == MIGRATE_DONE && migrate.remove != 0 ? "REMOVED" :
+				migrate_result_str[j];
+
+			if (tally[i].count[j] == 0)
+				continue;
+
+			stats_states(j, name, tally[i].dev, tally[i].count[j], 0);
+			if (j == MIGRATE_FAILED)
+				stats_errors(tally[i].count[j]);
+		}
+	}
+}
+
+/**
+ * Migrate a file on the walking thread (when there's no memory to queue it).
+ *
+ * @returns Returns 0 (like queueing it would).
+ */
+static int migrate_inline(int fd, const char *filename, const struct stat *st)
+{
+	enum migrate_result result;
+
+	pr_debug("Not enough memory to queue \"%s\": migrating it now\n", filename);
+
+	result = process_one(fd, filename, st->st_mtim);
+	io->close(fd);
+
+	pthread_mutex_lock(&migrate.lock);
+	count_result(st->st_dev, result);
+	/* It belongs to the directory being listed. */
+	if (result == MIGRATE_FAILED && migrate.top != NULL)
+		migrate.top->failed = true;
+	pthread_mutex_unlock(&migrate.lock);
+
+	return 0;
+}
+
+int migrate_file(int fd, const char *filename, const struct stat *st)
+{
+	size_t len = strlen(filename);
+	size_t size = sizeof(struct migrate_item) + len + 1;
+	struct migrate_item *item;
+	int err;
+
+	throttle();
+	report_stats();
+
+	/* Wait for memory while the workers catch up, but only while they have
+	 * some to release: the rest of the budget may be held by the walk itself.
+	 */
+	pthread_mutex_lock(&migrate.lock);
+	while ((err = budget_reserve(size, false)) != 0 && migrate.active > 0)
+		pthread_cond_wait(&migrate.released, &migrate.lock);
+	pthread_mutex_unlock(&migrate.lock);
+
+	if (err != 0)
+		return migrate_inline(fd, filename, st);
+
+	item = malloc(size);
+	if (item == NULL) {
+		budget_release(size);
+		goto fail;
+	}
+
+	item->next = NULL;
+	item->size = size;
+	item->fd = fd;
+	item->dev = st->st_dev;
+	item->mtime = st->st_mtim;
+	memcpy(item->path, filename, len + 1);
+
+	pthread_mutex_lock(&migrate.lock);
+
+	while (migrate.count >= migrate.max)
+		pthread_cond_wait(&migrate.dequeued, &migrate.lock);
+
+	item->dir = migrate.top;
+	if (item->dir != NULL)
+		item->dir->pending++;
+
+	if (migrate.tail != NULL)
+		migrate.tail->next = item;
+	else
+		migrate.head = item;
+	migrate.tail = item;
+	migrate.count++;
+	migrate.active++;
+
+	pthread_cond_signal(&migrate.queued);
+	pthread_mutex_unlock(&migrate.lock);
+
+	return 0;
+
+fail:
+	pr_err("Error: not enough memory to queue \"%s\": %m\n", filename);
+	io->close(fd);
+	return -1;
+}
+
+struct migrate_dir *migrate_dir_begin(const struct stat *st, bool *done)
+{
+	struct resume_key key = { (uint64_t)st->st_dev, (uint64_t)st->st_ino };
+	struct migrate_dir *dir;
+
+	*done = migrate.ndone > 0 &&
+		bsearch(&key, migrate.done, migrate.ndone, sizeof(key), resume_cmp) != NULL;
+
+	dir = budget_malloc(sizeof(*dir));
+
+	pthread_mutex_lock(&migrate.lock);
+
+	if (dir != NULL) {
+		memset(dir, 0, sizeof(*dir));
+		dir->dev = st->st_dev;
+		dir->ino = st->st_ino;
+		/* Don't record it in the resume file again. */
+		dir->failed = *done;
+		dir->parent = migrate.top;
+		migrate.top = dir;
+	}
+	else if (migrate.top != NULL) {
+		/* The files are counted against the parent, which then can't be
+		 * recorded (it would look like they were done).
+		 */
+		migrate.top->failed = true;
+	}
+
+	pthread_mutex_unlock(&migrate.lock);
+
+	return dir;
+}
+
+void migrate_dir_end(struct migrate_dir *dir)
+{
+	if (dir == NULL)
+		return;
+
+	pthread_mutex_lock(&migrate.lock);
+	migrate.top = dir->parent;
+	dir->listed = true;
+	dir_put(dir);
+	pthread_mutex_unlock(&migrate.lock);
+}
+
+int migrate_stop(void)
+{
+	unsigned int i;
+
+	if (!migrate.running)
+		return 0;
+
+	pthread_mutex_lock(&migrate.lock);
+	migrate.stop = true;
+	pthread_cond_broadcast(&migrate.queued);
+	pthread_mutex_unlock(&migrate.lock);
+
+	for (i = 0; i < migrate.nthreads; i++)
+		pthread_join(migrate.threads[i], NULL);
+
+	report_stats();
+
+	budget_free(migrate.threads, migrate.nthreads * sizeof(migrate.threads[0]));
+	migrate.threads = NULL;
+	migrate.running = false;
+
+	if (migrate.resume != NULL && fclose(migrate.resume) != 0) {
+		pr_err("Error: could not write the resume file: %m\n");
+		migrate.results[MIGRATE_FAILED]++;
+	}
+	migrate.resume = NULL;
+
+	budget_free(migrate.done, migrate.done_size);
+	migrate.done = NULL;
+
+	if (check_err() && migrate.remove != 0)
+		printf("%s %llu attributes from %llu files (%llu untagged, %llu errors)\n",
+			args.dry_run ? "Would remove" : "Removed", migrate.removed,
+			migrate.results[MIGRATE_DONE], migrate.results[MIGRATE_UNTAGGED],
+			migrate.results[MIGRATE_FAILED]);
+	else if (check_err())
+		printf("%s %llu tags from the %s to the %s layout (%llu outdated, %llu untagged, "
+			"%llu malformed, %llu errors)\n", args.dry_run ? "Would migrate" : "Migrated",
+			migrate.results[MIGRATE_DONE], xa_layout_name(migrate.from),
+			xa_layout_name(migrate.to), migrate.results[MIGRATE_STALE],
+			migrate.results[MIGRATE_UNTAGGED], migrate.results[MIGRATE_INVALID],
+			migrate.results[MIGRATE_FAILED]);
+
+	return migrate.results[MIGRATE_FAILED] > 0 ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Tag migration declarations.
+ *
+ * With --migrate, b2tag moves the tags stored in one attribute layout to
+ * another (see ::xa_layout) without reading any file data: each file's stored
+ * tag is read, checked against the file's current mtime, written in the new
+ * layout, and removed from the old one. Files whose mtime no longer matches
+ * their tag are left alone, so the next normal run rehashes them.
+ *
+ * The walk opens the files and hands them to a pool of worker threads that
+ * do the attribute I/O. The rate can be limited, and directories whose files
+ * were all migrated can be recorded in a resume file so an interrupted
+ * migration doesn't have to open them again.
+ *
+ * With --remove-tags, the same walk and workers remove tags instead (see
+ * xa_remove_tags()).
+ */
+
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+#include <stdbool.h>
+
+#include <sys/stat.h>
+
+#include "xa.h"
+
+/**
+ * Start the migration workers.
+ *
+ * @param from    The layout to migrate tags from.
+ * @param to      The layout to migrate tags to.
+ * @param alg     The algorithm of the tags to migrate.
+ * @param jobs    The number of worker threads.
+ * @param rate    The most files to migrate per second (0 for no limit).
+ * @param resume  The resume file (NULL if not in use).
+ *
+ * @retval 0  The workers were started.
+ * @retval !0 An error occurred.
+ */
+int migrate_start(xa_layout_t from, xa_layout_t to, hash_alg_t alg, unsigned int jobs,
+	unsigned int rate, const char *resume);
+
+/**
+ * Start the workers to remove tags instead of migrating them.
+ *
+ * @param algs    The algorithms whose tags to remove (see xa_remove_tags()).
+ * @param jobs    The number of worker threads.
+ * @param rate    The most files to process per second (0 for no limit).
+ * @param resume  The resume file (NULL if not in use).
+ *
+ * @retval 0  The workers were started.
+ * @retval !0 An error occurred.
+ */
+int migrate_start_removal(unsigned int algs, unsigned int jobs, unsigned int rate,
+	const char *resume);
+
+/**
+ * Returns whether tags are being migrated (or removed).
+ */
+bool migrate_enabled(void);
+
+/**
+ * Queue a file for migration (waiting if the queue is full). If there's no
+ * memory to queue it and none will be released, it's migrated right away.
+ *
+ * @param fd        The open file (closed by the worker, or before returning).
+ * @param filename  The file's path.
+ * @param st        The file's stat() structure.
+ *
+ * @retval 0  The file was queued (or migrated).
+ * @retval <0 The file couldn't be queued (it's closed).
+ */
+int migrate_file(int fd, const char *filename, const struct stat *st);
+
+/** A directory whose files are being migrated. */
+struct migrate_dir;
+
+/**
+ * Start listing a directory (the files queued until migrate_dir_end() are
+ * its files).
+ *
+ * @param st    The directory's stat() structure.
+ * @param done  Set if the directory's files were all migrated by an earlier
+ *              run (according to the resume file), so they can be skipped.
+ *
+ * @returns Returns the directory to pass to migrate_dir_end() (NULL if it
+ *          couldn't be tracked).
+ */
+struct migrate_dir *migrate_dir_begin(const struct stat *st, bool *done);
+
+/**
+ * Finish listing a directory.
+ *
+ * @param dir  The directory returned by migrate_dir_begin() (may be NULL).
+ */
+void migrate_dir_end(struct migrate_dir *dir);
+
+/**
+ * Wait for the queued files, stop the workers, and print a summary.
+ *
+ * @retval 0  Every file was migrated (or didn't need migrating).
+ * @retval >0 Some files couldn't be migrated.
+ */
+int migrate_stop(void);
+
+#endif /* MIGRATE_H */
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Compact path tree.
+ */
+
+#include "pathtree.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "budget.h"
+
+/** A directory or file in the tree. */
+struct pt_node {
+	pathtree_id parent; /**< The parent node (or #PATHTREE_NONE). */
+	uint32_t name;      /**< The offset of the name in pt::names. */
+};
+
+/** The path tree. */
+static struct {
+	struct pt_node *nodes; /**< The nodes. */
+	size_t count;          /**< The number of nodes. */
+	size_t allocated;      /**< The number of nodes allocated. */
+	char *names;           /**< The NUL-terminated node names. */
+	size_t names_len;      /**< The used length of pt::names. */
+	size_t names_alloc;    /**< The allocated length of pt::names. */
+	pthread_rwlock_t lock; /**< Keeps adding nodes apart from rebuilding paths. */
+} pt = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+/** Each thread's buffer for rebuilt paths. */
+static __thread struct {
+	char *path;  /**< The buffer. */
+	size_t size; /**< The buffer's size. */
+} pt_buf;
+
+pathtree_id pathtree_add(pathtree_id parent, const char *name, size_t len)
+{
+	pathtree_id id = PATHTREE_NONE;
+
+	assert(name != NULL);
+
+	pthread_rwlock_wrlock(&pt.lock);
+
+	assert(parent == PATHTREE_NONE || parent < pt.count);
+
+	if (pt.count >= PATHTREE_NONE || pt.names_len + len + 1 > UINT32_MAX) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	if (pt.count >= pt.allocated) {
+		size_t alloc = pt.allocated ? pt.allocated * 2 : 1024;
+		void *tmp;
+
+		tmp = budget_realloc(pt.nodes, pt.allocated * sizeof(pt.nodes[0]),
+			alloc * sizeof(pt.nodes[0]));
+		if (tmp == NULL)
+			goto out;
+
+		pt.nodes = tmp;
+		pt.allocated = alloc;
+	}
+
+	if (pt.names_len + len + 1 > pt.names_alloc) {
+		size_t alloc = (pt.names_len + len + 1) * 2;
+		void *tmp;
+
+		if (alloc < 16384)
+			alloc = 16384;
+
+		tmp = budget_realloc(pt.names, pt.names_alloc, alloc);
+		if (tmp == NULL)
+			goto out;
+
+		pt.names = tmp;
+		pt.names_alloc = alloc;
+	}
+
+	memcpy(pt.names + pt.names_len, name, len);
+	pt.names[pt.names_len + len] = '\0';
+
+	id = (pathtree_id)pt.count++;
+	pt.nodes[id].parent = parent;
+	pt.nodes[id].name = (uint32_t)pt.names_len;
+	pt.names_len += len + 1;
+
+out:
+	pthread_rwlock_unlock(&pt.lock);
+	return id;
+}
+
+const char *pathtree_path(pathtree_id id)
+{
+	const char *path = NULL;
+	size_t len = 0;
+	pathtree_id i;
+
+	pthread_rwlock_rdlock(&pt.lock);
+
+	assert(id < pt.count);
+
+	/* Measure the path (each component plus a '/' or the final NUL). */
+	for (i = id; i != PATHTREE_NONE; i = pt.nodes[i].parent)
+		len += strlen(pt.names + pt.nodes[i].name) + 1;
+
+	if (len > pt_buf.size) {
+		void *tmp;
+
+		tmp = budget_realloc(pt_buf.path, pt_buf.size, len);
+		if (tmp == NULL)
+			goto out;
+
+		pt_buf.path = tmp;
+		pt_buf.size = len;
+	}
+
+	/* Fill in the path from the end. */
+	pt_buf.path[--len] = '\0';
+
+	for (i = id; i != PATHTREE_NONE; i = pt.nodes[i].parent) {
+		const char *name = pt.names + pt.nodes[i].name;
+		size_t n = strlen(name);
+
+		len -= n;
+		memcpy(pt_buf.path + len, name, n);
+
+		if (len > 0)
+			pt_buf.path[--len] = '/';
+	}
+
+	path = pt_buf.path;
+
+out:
+	pthread_rwlock_unlock(&pt.lock);
+	return path;
+}
+
+void pathtree_free_buffer(void)
+{
+	budget_free(pt_buf.path, pt_buf.size);
+	pt_buf.path = NULL;
+	pt_buf.size = 0;
+}
+
+size_t pathtree_size(void)
+{
+	size_t size;
+
+	pthread_rwlock_rdlock(&pt.lock);
+	size = pt.allocated * sizeof(pt.nodes[0]) + pt.names_alloc;
+	pthread_rwlock_unlock(&pt.lock);
+
+	return size;
+}
+
+void pathtree_clear(void)
+{
+	pthread_rwlock_wrlock(&pt.lock);
+
+	budget_free(pt.nodes, pt.allocated * sizeof(pt.nodes[0]));
+	budget_free(pt.names, pt.names_alloc);
+	pt.nodes = NULL;
+	pt.count = 0;
+	pt.allocated = 0;
+	pt.names = NULL;
+	pt.names_len = 0;
+	pt.names_alloc = 0;
+
+	pthread_rwlock_unlock(&pt.lock);
+
+	pathtree_free_buffer();
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Compact path tree declarations.
+ *
+ * Queuing a file by its full path costs the length of the path per file, which
+ * adds up on deep trees with millions of queued files. Instead, a path tree
+ * stores every directory once, as a node holding its parent's ID and its own
+ * name, so a queued file costs one node plus its name. Paths are rebuilt on
+ * demand into a per-thread buffer.
+ *
+ * Nodes are only ever added (until pathtree_clear()), so node IDs stay valid.
+ * Nodes may be added while other threads rebuild paths, but pathtree_clear()
+ * must only be called once no thread uses the tree any more.
+ */
+
+#ifndef PATHTREE_H
+#define PATHTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** A node in the path tree. */
+typedef uint32_t pathtree_id;
+
+/** The "parent" of top-level nodes (and the return value on error). */
+#define PATHTREE_NONE ((pathtree_id)UINT32_MAX)
+
+/**
+ * Add a node to the tree.
+ *
+ * @param parent  The parent node (or #PATHTREE_NONE for a top-level path).
+ * @param name    The node's name (a single component unless @p parent is
+ *                #PATHTREE_NONE). It doesn't need to be NUL-terminated.
+ * @param len     The length of @p name.
+ *
+ * @returns Returns the new node's ID or #PATHTREE_NONE on failure.
+ */
+pathtree_id pathtree_add(pathtree_id parent, const char *name, size_t len);
+
+/**
+ * Rebuild a node's full path.
+ *
+ * @param id  The node.
+ *
+ * @returns Returns the path (valid until the thread's next call) or NULL on
+ *          failure.
+ */
+const char *pathtree_path(pathtree_id id);
+
+/**
+ * Free the calling thread's path buffer (e.g. before the thread exits).
+ */
+void pathtree_free_buffer(void);
+
+/**
+ * Returns the number of bytes used by the tree.
+ */
+size_t pathtree_size(void);
+
+/**
+ * Remove all nodes and free the tree (and the calling thread's path buffer).
+ */
+void pathtree_clear(void);
+
+#endif /* PATHTREE_H */
@@ -0,0 +1,597 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Per-subtree scan policy.
+ *
+ * The policy file has one rule per line:
+ *
+ *     PATTERN [CONDITION]... [ACTION]...
+ *
+ * Patterns without a '/' are matched against an entry's name, the others
+ * against its whole path (as walked), with fnmatch() (so '*' also matches
+ * '/'). Patterns without wildcards, with only a leading '*', or with only a
+ * trailing '*' are compiled to plain string comparisons. The conditions
+ * (size>SIZE, size<SIZE, age>DURATION, age<DURATION) only apply to regular
+ * files. The actions are exclude, alg=ALG, check=never|always|DURATION, and
+ * rate=SIZE (bytes per second).
+ */
+
+#include "policy.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "b2tag.h"
+#include "budget.h"
+#include "utilities.h"
+
+/** How a rule's pattern is matched. */
+enum policy_match {
+	MATCH_EXACT,  /**< The pattern has no wildcards. */
+	MATCH_PREFIX, /**< The pattern is a literal followed by '*'. */
+	MATCH_SUFFIX, /**< The pattern is '*' followed by a literal. */
+	MATCH_GLOB,   /**< Anything else (fnmatch()). */
+};
+
+/** How often a rule's files are deep-checked. */
+enum policy_check {
+	CHECK_DEFAULT,  /**< Only with --check. */
+	CHECK_NEVER,    /**< Never (even with --check). */
+	CHECK_ALWAYS,   /**< On every run. */
+	CHECK_PERIODIC, /**< Once per policy_rule::period days. */
+};
+
+/** A compiled policy rule. */
+struct policy_rule {
+	char *pattern;            /**< The pattern. */
+	const char *literal;      /**< The pattern without its '*' (not MATCH_GLOB). */
+	size_t literal_len;       /**< The length of policy_rule::literal. */
+	enum policy_match match;  /**< How the pattern is matched. */
+	bool path;                /**< Match the whole path (not just the name). */
+	unsigned int line;        /**< The rule's line in the policy file. */
+	bool conditional;         /**< Whether the rule has size or age conditions. */
+	long long min_size;       /**< Only files larger than this (-1 for any). */
+	long long max_size;       /**< Only files smaller than this (-1 for any). */
+	time_t min_age;           /**< Only files modified longer ago than this (-1 for any). */
+	time_t max_age;           /**< Only files modified more recently than this (-1 for any). */
+	bool exclude;             /**< Skip matching files and directories. */
+	bool set_alg;             /**< Whether policy_rule::alg is set. */
+	hash_alg_t alg;           /**< The hash algorithm. */
+	enum policy_check check;  /**< How often to deep-check. */
+	unsigned long period;     /**< The deep-check period in days (CHECK_PERIODIC). */
+	unsigned long long rate;  /**< The most bytes to hash per second (0 for no limit). */
+	double due;               /**< When the rate allows hashing again. */
+	unsigned long matched;    /**< The number of entries the rule applied to. */
+};
+
+const struct policy_rule policy_unresolved;
+
+/** The loaded policy. */
+static struct {
+	struct policy_rule *rules; /**< The rules, in file order. */
+	size_t count;      /**< The number of rules. */
+	size_t words;      /**< The number of words in a rule mask. */
+	uint64_t *stack;   /**< The rule masks of the directories being walked. */
+	size_t depth;      /**< The number of masks allocated on the stack. */
+	uint64_t *scratch; /**< The rule mask of a path's ancestors. */
+	time_t now;        /**< The time the policy was loaded (for ages). */
+	unsigned long day; /**< The day number (for periodic deep checks). */
+} policy;
+
+/** Returns whether bit @p i of @p mask is set. */
+static inline bool mask_test(const uint64_t *mask, size_t i)
+{
+	return (mask[i / 64] >> (i % 64)) & 1;
+}
+
+/** Set bit @p i of @p mask. */
+static inline void mask_set(uint64_t *mask, size_t i)
+{
+	mask[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+/** Compile a rule's pattern. */
+static void compile_pattern(struct policy_rule *r)
+{
+	const char *p = r->pattern;
+	size_t len = strlen(p);
+	size_t wild = strcspn(p, "*?[\\");
+
+	r->path = strchr(p, '/') != NULL;
+	r->match = MATCH_GLOB;
+
+	if (wild == len) {
+		r->match = MATCH_EXACT;
+		r->literal = p;
+		r->literal_len = len;
+	}
+	else if (wild == 0 && strcspn(p + 1, "*?[\\") == len - 1) {
+		r->match = MATCH_SUFFIX;
+		r->literal = p + 1;
+		r->literal_len = len - 1;
+	}
+	else if (wild == len - 1) {
+		r->match = MATCH_PREFIX;
+		r->literal = p;
+		r->literal_len = len - 1;
+	}
+}
+
+/**
+ * Parse one option (a condition or action) of a rule.
+ *
+ * @returns Returns 0 on success and -1 if @p opt is malformed.
+ */
+static int parse_option(struct policy_rule *r, const char *opt)
+{
+	unsigned long long size;
+	time_t age;
+
+	if (strcmp(opt, "exclude") == 0) {
+		r->exclude = true;
+	}
+	else if (strncmp(opt, "alg=", 4) == 0) {
+		if (get_alg_by_name(opt + 4, &r->alg) != 0)
+			return -1;
+		r->set_alg = true;
+	}
+	else if (strcmp(opt, "check=never") == 0) {
+		r->check = CHECK_NEVER;
+	}
+	else if (strcmp(opt, "check=always") == 0) {
+		r->check = CHECK_ALWAYS;
+	}
+	else if (strncmp(opt, "check=", 6) == 0) {
+		if (parse_duration(opt + 6, &age) != 0 || age <= 0)
+			return -1;
+		r->check = CHECK_PERIODIC;
+		r->period = (unsigned long)((age + 24 * 60 * 60 - 1) / (24 * 60 * 60));
+	}
+	else if (strncmp(opt, "rate=", 5) == 0) {
+		if (parse_size(opt + 5, &size) != 0 || size == 0)
+			return -1;
+		r->rate = size;
+	}
+	else if (strncmp(opt, "size>", 5) == 0 || strncmp(opt, "size<", 5) == 0) {
+		if (parse_size(opt + 5, &size) != 0 || size > LLONG_MAX)
+			return -1;
+		if (opt[4] == '>')
+			r->min_size = (long long)size;
+		else
+			r->max_size = (long long)size;
+		r->conditional = true;
+	}
+	else if (strncmp(opt, "age>", 4) == 0 || strncmp(opt, "age<", 4) == 0) {
+		if (parse_duration(opt + 4, &age) != 0)
+			return -1;
+		if (opt[3] == '>')
+			r->min_age = age;
+		else
+			r->max_age = age;
+		r->conditional = true;
+	}
+	else {
+		return -1;
+	}
+
+	return 0;
+}
+
+int policy_load(const char *path)
+{
+	struct policy_rule *rules = NULL;
+	size_t allocated = 0;
+	size_t count = 0;
+	unsigned int lineno = 0;
+	size_t alloc = 0;
+	char *line = NULL;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (f == NULL) {
+		pr_err("Error: could not open policy \"%s\": %m\n", path);
+		return 1;
+	}
+
+	while (getline(&line, &alloc, f) >= 0) {
+		struct policy_rule *r;
+		char *save;
+		char *tok;
+
+		lineno++;
+
+		tok = strtok_r(line, " \t\r\n", &save);
+		if (tok == NULL || tok[0] == '#')
+			continue;
+
+		if (count >= allocated) {
+			void *tmp = realloc(rules, (allocated + 16) * sizeof(*rules));
+
+			if (tmp == NULL)
+				goto fail_errno;
+
+			rules = tmp;
+			allocated += 16;
+		}
+
+		r = &rules[count];
+		*r = (struct policy_rule){
+			.line = lineno,
+			.min_size = -1,
+			.max_size = -1,
+			.min_age = -1,
+			.max_age = -1,
+		};
+
+		/* Ignore a trailing slash (paths are walked without one). */
+		if (strlen(tok) > 1 && tok[strlen(tok) - 1] == '/')
+			tok[strlen(tok) - 1] = '\0';
+
+		r->pattern = strdup(tok);
+		if (r->pattern == NULL)
+			goto fail_errno;
+		count++;
+
+		compile_pattern(r);
+
+		while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			if (tok[0] == '#')
+				break;
+
+			if (parse_option(r, tok) != 0) {
+				pr_err("Error: %s:%u: invalid rule option \"%s\"\n", path, lineno, tok);
+				goto fail;
+			}
+		}
+	}
+
+	if (ferror(f))
+		goto fail_errno;
+
+	fclose(f);
+	free(line);
+
+	policy.rules = rules;
+	policy.count = count;
+	policy.words = (count + 63) / 64;
+	policy_set_time(time(NULL));
+
+	if (count > 0) {
+		policy.scratch = calloc(policy.words, sizeof(*policy.scratch));
+		if (policy.scratch == NULL) {
+			pr_err("Error: could not load policy \"%s\": %m\n", path);
+			policy_close();
+			return 1;
+		}
+	}
+
+	pr_debug("Loaded %zu policy rules from %s\n", count, path);
+
+	return 0;
+
+fail_errno:
+	pr_err("Error: could not read policy \"%s\": %m\n", path);
+fail:
+	while (count-- > 0)
+		free(rules[count].pattern);
+	free(rules);
+	free(line);
+	fclose(f);
+	return 1;
+}
+
+void policy_close(void)
+{
+	size_t i;
+
+	for (i = 0; i < policy.count; i++) {
+		pr_debug("Policy rule at line %u (%s): %lu matches\n", policy.rules[i].line,
+			policy.rules[i].pattern, policy.rules[i].matched);
+		free(policy.rules[i].pattern);
+	}
+
+	free(policy.rules);
+	free(policy.scratch);
+	budget_free(policy.stack, policy.depth * policy.words * sizeof(*policy.stack));
+
+	memset(&policy, 0, sizeof(policy));
+}
+
+bool policy_enabled(void)
+{
+	return policy.count > 0;
+}
+
+bool policy_sets_alg(void)
+{
+	size_t i;
+
+	for (i = 0; i < policy.count; i++) {
+		if (policy.rules[i].set_alg && policy.rules[i].alg != args.alg)
+			return true;
+	}
+
+	return false;
+}
+
+bool policy_deep_checks(void)
+{
+	size_t i;
+
+	for (i = 0; i < policy.count; i++) {
+		if (policy.rules[i].check == CHECK_ALWAYS || policy.rules[i].check == CHECK_PERIODIC)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Returns whether a rule's pattern matches a path.
+ *
+ * @param r     The rule.
+ * @param path  The path (without a trailing slash).
+ */
+static bool rule_matches(const struct policy_rule *r, const char *path)
+{
+	const char *s = path;
+	size_t len;
+
+	if (!r->path) {
+		const char *slash = strrchr(path, '/');
+
+		if (slash != NULL)
+			s = slash + 1;
+	}
+
+	if (r->match == MATCH_GLOB)
+		return fnmatch(r->pattern, s, 0) == 0;
+
+	len = strlen(s);
+
+	switch (r->match) {
+	case MATCH_EXACT:
+		return len == r->literal_len && memcmp(s, r->literal, len) == 0;
+	case MATCH_PREFIX:
+		return len >= r->literal_len && memcmp(s, r->literal, r->literal_len) == 0;
+	case MATCH_SUFFIX:
+		return len >= r->literal_len &&
+			memcmp(s + len - r->literal_len, r->literal, r->literal_len) == 0;
+	default:
+		return false;
+	}
+}
+
+/** Set the bits of the rules whose patterns match @p path in @p mask. */
+static void match_rules(const char *path, uint64_t *mask)
+{
+	size_t i;
+
+	for (i = 0; i < policy.count; i++) {
+		if (!mask_test(mask, i) && rule_matches(&policy.rules[i], path))
+			mask_set(mask, i);
+	}
+}
+
+/**
+ * Work out which rules match one of a path's ancestors (for the entries that
+ * aren't reached by walking down to them, e.g. deferred files).
+ *
+ * @param path  The path.
+ * @param mask  The mask to fill in.
+ */
+static void match_ancestors(const char *path, uint64_t *mask)
+{
+	char buf[PATH_MAX];
+	size_t len = strlen(path);
+	size_t i;
+
+	memset(mask, 0, policy.words * sizeof(*mask));
+
+	/* Longer paths can't be opened anyway. */
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	memcpy(buf, path, len);
+	buf[len] = '\0';
+
+	for (i = 1; i < len; i++) {
+		if (buf[i] != '/')
+			continue;
+
+		buf[i] = '\0';
+		match_rules(buf, mask);
+		buf[i] = '/';
+	}
+}
+
+int policy_enter_dir(const char *path, size_t depth)
+{
+	uint64_t *mask;
+
+	if (policy.count == 0)
+		return 0;
+
+	if (depth >= policy.depth) {
+		size_t size = policy.words * sizeof(*policy.stack);
+		void *tmp;
+
+		tmp = budget_realloc(policy.stack, policy.depth * size, (policy.depth + 16) * size);
+		if (tmp == NULL)
+			return -1;
+
+		policy.stack = tmp;
+		policy.depth += 16;
+	}
+
+	mask = policy.stack + depth * policy.words;
+
+	if (depth == 0)
+		match_ancestors(path, mask);
+	else
+		memcpy(mask, mask - policy.words, policy.words * sizeof(*mask));
+
+	match_rules(path, mask);
+
+	return 0;
+}
+
+/** Returns whether a regular file meets a rule's size and age conditions. */
+static bool conditions_match(const struct policy_rule *r, const struct stat *st)
+{
+	time_t age = policy.now - st->st_mtim.tv_sec;
+
+	if (r->min_size >= 0 && st->st_size <= r->min_size)
+		return false;
+	if (r->max_size >= 0 && st->st_size >= r->max_size)
+		return false;
+	if (r->min_age >= 0 && age <= r->min_age)
+		return false;
+	if (r->max_age >= 0 && age >= r->max_age)
+		return false;
+
+	return true;
+}
+
+const struct policy_rule *policy_lookup(const char *path, size_t depth, const struct stat *st,
+	unsigned char type)
+{
+	const uint64_t *inherited;
+	size_t i;
+
+	if (policy.count == 0)
+		return NULL;
+
+	if (depth > 0 && depth <= policy.depth) {
+		inherited = policy.stack + (depth - 1) * policy.words;
+	}
+	else {
+		match_ancestors(path, policy.scratch);
+		inherited = policy.scratch;
+	}
+
+	if (st != NULL)
+		type = S_ISDIR(st->st_mode) ? DT_DIR : S_ISREG(st->st_mode) ? DT_REG : DT_UNKNOWN;
+
+	for (i = 0; i < policy.count; i++) {
+		struct policy_rule *r = &policy.rules[i];
+
+		if (!mask_test(inherited, i) && !rule_matches(r, path))
+			continue;
+
+		/* Size and age conditions only apply to regular files. */
+		if (r->conditional) {
+			if (type == DT_DIR)
+				continue;
+			if (st == NULL)
+				return POLICY_UNRESOLVED;
+			if (!S_ISREG(st->st_mode) || !conditions_match(r, st))
+				continue;
+		}
+
+		r->matched++;
+		return r;
+	}
+
+	return NULL;
+}
+
+bool policy_excluded(const struct policy_rule *rule)
+{
+	return rule != NULL && rule != POLICY_UNRESOLVED && rule->exclude;
+}
+
+hash_alg_t policy_alg(const struct policy_rule *rule)
+{
+	if (rule == NULL || rule == POLICY_UNRESOLVED || !rule->set_alg)
+		return args.alg;
+
+	return rule->alg;
+}
+
+void policy_set_time(time_t now)
+{
+	policy.now = now;
+	policy.day = (unsigned long)(now / (24 * 60 * 60));
+}
+
+bool policy_check(const struct policy_rule *rule, const struct stat *st)
+{
+	if (rule == NULL || rule == POLICY_UNRESOLVED)
+		return args.check;
+
+	switch (rule->check) {
+	case CHECK_NEVER:
+		return false;
+	case CHECK_ALWAYS:
+		return true;
+	case CHECK_PERIODIC:
+		/* Deep-check a different slice of the files every day. */
+		return args.check || (st->st_ino + policy.day) % rule->period == 0;
+	default:
+		return args.check;
+	}
+}
+
+void policy_throttle(const struct policy_rule *rule, uint64_t bytes)
+{
+	struct policy_rule *r;
+	struct timespec ts;
+	double now;
+
+	if (rule == NULL || rule == POLICY_UNRESOLVED || rule->rate == 0)
+		return;
+
+	r = &policy.rules[rule - policy.rules];
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+
+	/* Don't let an idle period build up a burst allowance. */
+	if (r->due < now)
+		r->due = now;
+
+	r->due += (double)bytes / (double)r->rate;
+
+	if (r->due > now) {
+		double wait = r->due - now;
+
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Per-subtree scan policy declarations.
+ *
+ * A policy file (--policy) maps path patterns, optionally narrowed by file
+ * size and age, to how matching files are treated: excluded, hashed with a
+ * different algorithm, deep-checked never, always, or periodically, and
+ * hashed at a limited rate. A rule whose pattern matches a directory applies
+ * to everything below it; the first matching rule wins.
+ *
+ * The rules are compiled when the file is loaded, and the walker keeps the
+ * set of rules that matched each directory on a stack, so an entry is only
+ * matched against the rules by its own name or path.
+ */
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include "hash.h"
+
+/** A compiled policy rule (NULL means no rule applies: use the defaults). */
+struct policy_rule;
+
+/** The placeholder returned by policy_lookup() when a rule needs the stat() data. */
+extern const struct policy_rule policy_unresolved;
+
+/** The rule of an entry that hasn't been (fully) looked up yet. */
+#define POLICY_UNRESOLVED (&policy_unresolved)
+
+/**
+ * Load and compile a policy file.
+ *
+ * @param path  The policy file.
+ *
+ * @retval 0  The policy was loaded.
+ * @retval !0 The file couldn't be read or has an error (a message was printed).
+ */
+int policy_load(const char *path);
+
+/**
+ * Free the policy (printing how often each rule matched in verbose mode).
+ */
+void policy_close(void);
+
+/**
+ * Returns whether a policy is in use.
+ */
+bool policy_enabled(void);
+
+/**
+ * Returns whether any rule changes the hash algorithm.
+ */
+bool policy_sets_alg(void);
+
+/**
+ * Returns whether any rule can deep-check files (without --check).
+ */
+bool policy_deep_checks(void);
+
+/**
+ * Record the rules that match a directory being walked.
+ *
+ * @param path   The directory's path.
+ * @param depth  The directory's depth in the walk (0 for the top directory).
+ *
+ * @retval 0  The directory was recorded.
+ * @retval <0 Out of memory.
+ */
+int policy_enter_dir(const char *path, size_t depth);
+
+/**
+ * Find the rule that applies to a directory entry.
+ *
+ * @param path   The entry's path.
+ * @param depth  The number of directories above the entry recorded with
+ *               policy_enter_dir() (0 to match the path's ancestors instead).
+ * @param st     The entry's stat() structure (NULL if it hasn't been stat()ed).
+ * @param type   The entry's type (DT_* from dirent.h, or DT_UNKNOWN).
+ *
+ * @returns Returns the rule, NULL if no rule applies, or #POLICY_UNRESOLVED if
+ *          a rule's size or age condition needs @p st.
+ */
+const struct policy_rule *policy_lookup(const char *path, size_t depth, const struct stat *st,
+	unsigned char type);
+
+/**
+ * Returns whether a rule excludes its files from the scan.
+ */
+bool policy_excluded(const struct policy_rule *rule);
+
+/**
+ * Returns the hash algorithm a rule's files are tagged with.
+ */
+hash_alg_t policy_alg(const struct policy_rule *rule);
+
+/**
+ * Pretend the current time is @p now (for file ages and periodic deep checks).
+ *
+ * Used by b2tag-bench to simulate a schedule running over several days.
+ *
+ * @param now  The time to use.
+ */
+void policy_set_time(time_t now);
+
+/**
+ * Returns whether a file should be deep-checked (hashed even if its mtime
+ * matches) on this run.
+ *
+ * @param rule  The file's rule.
+ * @param st    The file's stat() structure.
+ */
+bool policy_check(const struct policy_rule *rule, const struct stat *st);
+
+/**
+ * Wait as long as needed to keep to a rule's hashing rate.
+ *
+ * @param rule   The file's rule.
+ * @param bytes  The number of bytes just hashed.
+ */
+void policy_throttle(const struct policy_rule *rule, uint64_t bytes);
+
+#endif /* POLICY_H */
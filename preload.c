@@ -0,0 +1,842 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Write-time tagging interposer (libb2tag-preload.so).
+ *
+ * Loaded with LD_PRELOAD, this library tracks the regular files a program
+ * opens for writing. As long as a file is written strictly sequentially from
+ * offset 0 (with write(), writev(), or pwrite() at the current end), the data
+ * is hashed as it's written, and the shatag attributes are set when the file
+ * is closed, so b2tag doesn't have to read freshly written data again.
+ *
+ * Anything that could change the file behind the library's back (seeking
+ * backwards, overwrites, truncation, mmap(), dup(), fdopen(), fork(), or
+ * concurrent writes to the same fd) marks the file dirty instead: it's left
+ * untagged (its old tag, if any, looks outdated to b2tag) and its path is
+ * appended to the B2TAG_DIRTY_LIST file for a later rehash.
+ *
+ * Environment variables:
+ * @li B2TAG_ALG: the hash algorithm (default: blake2b512; k12 isn't supported).
+ * @li B2TAG_PREFIX: only track files under these colon-separated directories.
+ * @li B2TAG_DIRTY_LIST: the file to append the paths of dirty files to.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+
+/** The highest fd number + 1 that is tracked. */
+#define MAX_FDS 65536
+
+/** The prefix of the attribute names (see xa.c). */
+#define XATTR_NAMESPACE "user.shatag"
+
+/** A file opened for writing. */
+struct tracked {
+	pthread_mutex_t lock; /**< Protects everything below. */
+	EVP_MD_CTX *ctx;      /**< The hash of the data written so far. */
+	uint64_t hashed;      /**< The bytes hashed (the offset of the next write). */
+	uint64_t pos;         /**< The fd's file position. */
+	unsigned writers;     /**< The writes in progress. */
+	bool append;          /**< Whether the file was opened with O_APPEND. */
+	bool written;         /**< Whether the file was written to. */
+	bool dirty;           /**< Whether the hash no longer covers the data. */
+};
+
+/** The tracked files, indexed by fd. */
+static struct tracked *tracked[MAX_FDS];
+
+/** The hash algorithm (NULL if tagging is disabled). */
+static const EVP_MD *md;
+
+/** The hash algorithm's name (for the attribute name). */
+static const char *alg_name = "blake2b512";
+
+/** The directories to track files under (NULL for all). */
+static const char *prefixes;
+
+/** The file to append the paths of dirty files to (NULL if not in use). */
+static const char *dirty_list;
+
+/** The real libc functions. */
+static struct {
+	int (*open)(const char *, int, ...);
+	int (*open64)(const char *, int, ...);
+	int (*openat)(int, const char *, int, ...);
+	int (*openat64)(int, const char *, int, ...);
+	int (*creat)(const char *, mode_t);
+	int (*creat64)(const char *, mode_t);
+	int (*close)(int);
+	ssize_t (*write)(int, const void *, size_t);
+	ssize_t (*writev)(int, const struct iovec *, int);
+	ssize_t (*pwrite)(int, const void *, size_t, off_t);
+	ssize_t (*pwrite64)(int, const void *, size_t, off64_t);
+	ssize_t (*pwritev)(int, const struct iovec *, int, off_t);
+	ssize_t (*pwritev2)(int, const struct iovec *, int, off_t, int);
+	off_t (*lseek)(int, off_t, int);
+	off64_t (*lseek64)(int, off64_t, int);
+	int (*ftruncate)(int, off_t);
+	int (*ftruncate64)(int, off64_t);
+	int (*fallocate)(int, int, off_t, off_t);
+	ssize_t (*copy_file_range)(int, off64_t *, int, off64_t *, size_t, unsigned int);
+	ssize_t (*sendfile)(int, int, off_t *, size_t);
+	void *(*mmap)(void *, size_t, int, int, int, off_t);
+	void *(*mmap64)(void *, size_t, int, int, int, off64_t);
+	int (*dup)(int);
+	int (*dup2)(int, int);
+	int (*dup3)(int, int, int);
+	FILE *(*fdopen)(int, const char *);
+} real;
+
+/** Ensures init() only runs once. */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/** Mark every tracked file dirty (after a fork(), both processes can write). */
+static void mark_all_dirty(void)
+{
+	int fd;
+
+	for (fd = 0; fd < MAX_FDS; fd++) {
+		struct tracked *t = __atomic_load_n(&tracked[fd], __ATOMIC_ACQUIRE);
+
+		if (t != NULL)
+			t->dirty = true;
+	}
+}
+
+/** Look up the real functions and read the configuration. */
+static void init(void)
+{
+	const char *alg;
+
+#define REAL(name) real.name = dlsym(RTLD_NEXT, #name)
+	REAL(open);
+	REAL(open64);
+	REAL(openat);
+	REAL(openat64);
+	REAL(creat);
+	REAL(creat64);
+	REAL(close);
+	REAL(write);
+	REAL(writev);
+	REAL(pwrite);
+	REAL(pwrite64);
+	REAL(pwritev);
+	REAL(pwritev2);
+	REAL(lseek);
+	REAL(lseek64);
+	REAL(ftruncate);
+	REAL(ftruncate64);
+	REAL(fallocate);
+	REAL(copy_file_range);
+	REAL(sendfile);
+	REAL(mmap);
+	REAL(mmap64);
+	REAL(dup);
+	REAL(dup2);
+	REAL(dup3);
+	REAL(fdopen);
+#undef REAL
+
+	alg = getenv("B2TAG_ALG");
+	if (alg != NULL && alg[0] != '\0')
+		alg_name = alg;
+
+	/* Tagging is simply disabled for unknown algorithms. */
+	md = EVP_get_digestbyname(alg_name);
+
+	prefixes = getenv("B2TAG_PREFIX");
+	if (prefixes != NULL && prefixes[0] == '\0')
+		prefixes = NULL;
+
+	dirty_list = getenv("B2TAG_DIRTY_LIST");
+	if (dirty_list != NULL && dirty_list[0] == '\0')
+		dirty_list = NULL;
+
+	pthread_atfork(NULL, mark_all_dirty, mark_all_dirty);
+}
+
+/** Make sure init() ran. */
+#define INIT() pthread_once(&once, init)
+
+/** Returns the tracked file for @p fd (or NULL). */
+static struct tracked *get_tracked(int fd)
+{
+	if (fd < 0 || fd >= MAX_FDS)
+		return NULL;
+
+	return __atomic_load_n(&tracked[fd], __ATOMIC_ACQUIRE);
+}
+
+/** Stop tracking @p fd and return its tracked file (or NULL). */
+static struct tracked *take_tracked(int fd)
+{
+	if (fd < 0 || fd >= MAX_FDS)
+		return NULL;
+
+	return __atomic_exchange_n(&tracked[fd], NULL, __ATOMIC_ACQ_REL);
+}
+
+/** Free a tracked file. */
+static void free_tracked(struct tracked *t)
+{
+	if (t == NULL)
+		return;
+
+	EVP_MD_CTX_free(t->ctx);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+/** Mark @p fd's file dirty (if it's tracked). */
+static void mark_dirty(int fd)
+{
+	struct tracked *t = get_tracked(fd);
+
+	if (t == NULL)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	t->dirty = true;
+	t->written = true;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ * Get the path of an open file.
+ *
+ * @returns Returns the length of the path or -1 on failure.
+ */
+static ssize_t fd_path(int fd, char *path, size_t size)
+{
+	char link[64];
+	ssize_t len;
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+
+	len = readlink(link, path, size - 1);
+	if (len >= 0)
+		path[len] = '\0';
+
+	return len;
+}
+
+/** Returns whether @p path is under one of the B2TAG_PREFIX directories. */
+static bool want_path(const char *path)
+{
+	const char *p = prefixes;
+
+	while (p != NULL && *p != '\0') {
+		const char *end = strchr(p, ':');
+		size_t len = end != NULL ? (size_t)(end - p) : strlen(p);
+
+		/* Ignore a trailing slash in the prefix. */
+		while (len > 1 && p[len - 1] == '/')
+			len--;
+
+		if (len > 0 && strncmp(path, p, len) == 0 && (path[len] == '/' || path[len] == '\0'))
+			return true;
+
+		p = end != NULL ? end + 1 : NULL;
+	}
+
+	return false;
+}
+
+/**
+ * Start tracking a newly opened file (if it was opened for writing).
+ *
+ * @param fd     The file descriptor returned by open().
+ * @param flags  The open() flags.
+ */
+static void track(int fd, int flags)
+{
+	char path[PATH_MAX];
+	struct tracked *t;
+	struct stat st;
+	int err = errno;
+
+	/* A reused fd number (e.g. closed with fclose()) starts over. */
+	free_tracked(take_tracked(fd));
+
+	if (md == NULL || fd < 0 || fd >= MAX_FDS || (flags & O_ACCMODE) == O_RDONLY)
+		goto out;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		goto out;
+
+	if (prefixes != NULL && (fd_path(fd, path, sizeof(path)) < 0 || !want_path(path)))
+		goto out;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		goto out;
+
+	t->ctx = EVP_MD_CTX_new();
+	if (t->ctx == NULL || EVP_DigestInit_ex(t->ctx, md, NULL) == 0) {
+		free_tracked(t);
+		goto out;
+	}
+
+	pthread_mutex_init(&t->lock, NULL);
+	t->append = (flags & O_APPEND) != 0;
+
+	/* Existing data wasn't hashed, so only an empty file can be tagged. */
+	t->dirty = st.st_size != 0;
+
+	__atomic_store_n(&tracked[fd], t, __ATOMIC_RELEASE);
+
+out:
+	errno = err;
+}
+
+/**
+ * Start a write to a tracked file.
+ *
+ * @returns Returns the tracked file (or NULL if @p fd isn't tracked).
+ */
+static struct tracked *write_begin(int fd)
+{
+	struct tracked *t = get_tracked(fd);
+
+	if (t == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&t->lock);
+	/* The order of concurrent writes to the same fd isn't known. */
+	if (t->writers++ > 0)
+		t->dirty = true;
+	t->written = true;
+	pthread_mutex_unlock(&t->lock);
+
+	return t;
+}
+
+/**
+ * Account a write to a tracked file.
+ *
+ * @param t       The tracked file (may be NULL).
+ * @param iov     The data that was written.
+ * @param iovcnt  The number of buffers in @p iov.
+ * @param offset  Where the data was written (-1 for the file position).
+ * @param len     The number of bytes written (or -1 on failure).
+ */
+static void write_end(struct tracked *t, const struct iovec *iov, int iovcnt, off_t offset,
+	ssize_t len)
+{
+	size_t left;
+	int i;
+
+	if (t == NULL)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+
+	t->writers--;
+
+	if (len <= 0)
+		goto out;
+
+	if (offset < 0) {
+		/* O_APPEND writes go to the end, which is the hashed length
+		 * as long as the file is clean.
+		 */
+		offset = t->append ? (off_t)t->hashed : (off_t)t->pos;
+		t->pos = (uint64_t)offset + (uint64_t)len;
+	}
+
+	if (t->dirty || (uint64_t)offset != t->hashed) {
+		t->dirty = true;
+		goto out;
+	}
+
+	left = (size_t)len;
+	for (i = 0; i < iovcnt && left > 0; i++) {
+		size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+
+		if (EVP_DigestUpdate(t->ctx, iov[i].iov_base, n) == 0) {
+			t->dirty = true;
+			break;
+		}
+
+		left -= n;
+	}
+
+	t->hashed += (uint64_t)len;
+
+out:
+	pthread_mutex_unlock(&t->lock);
+}
+
+/** Append the path of a dirty file to B2TAG_DIRTY_LIST. */
+static void record_dirty(int fd)
+{
+	char line[PATH_MAX + 1];
+	ssize_t len;
+	int list;
+
+	if (dirty_list == NULL)
+		return;
+
+	len = fd_path(fd, line, sizeof(line) - 1);
+	if (len < 0)
+		return;
+
+	line[len++] = '\n';
+
+	list = real.open(dirty_list, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (list < 0)
+		return;
+
+	/* A single O_APPEND write, so concurrent programs don't interleave. */
+	if (real.write(list, line, (size_t)len) < 0) {
+		/* Nothing else can be done. */
+	}
+
+	real.close(list);
+}
+
+/** Tag a tracked file that's being closed (or record it as dirty). */
+static void finish(int fd, struct tracked *t)
+{
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	char hex[EVP_MAX_MD_SIZE * 2 + 1];
+	char name[64];
+	char ts[32];
+	unsigned int len;
+	unsigned int i;
+	struct stat st;
+
+	if (!t->written)
+		return;
+
+	/* Writes that weren't seen (e.g. through stdio or another fd) change
+	 * the size.
+	 */
+	if (t->dirty || fstat(fd, &st) != 0 || (uint64_t)st.st_size != t->hashed) {
+		record_dirty(fd);
+		return;
+	}
+
+	if (EVP_DigestFinal_ex(t->ctx, hash, &len) == 0)
+		return;
+
+	for (i = 0; i < len; i++)
+		snprintf(hex + i * 2, 3, "%02x", hash[i]);
+
+	snprintf(name, sizeof(name), XATTR_NAMESPACE ".%s", alg_name);
+	snprintf(ts, sizeof(ts), "%lu.%09lu", (unsigned long)st.st_mtim.tv_sec,
+		(unsigned long)st.st_mtim.tv_nsec);
+
+	/* The same order as xa_write(): the checksum, then the timestamp. */
+	if (fsetxattr(fd, name, hex, len * 2, 0) != 0 ||
+		fsetxattr(fd, XATTR_NAMESPACE ".ts", ts, strlen(ts), 0) != 0)
+		record_dirty(fd);
+}
+
+/** Get the mode argument of open() (only passed with O_CREAT or O_TMPFILE). */
+#define OPEN_MODE(flags, mode) \
+	do { \
+		if ((flags) & (O_CREAT | O_TMPFILE)) { \
+			va_list ap; \
+			va_start(ap, flags); \
+			mode = va_arg(ap, mode_t); \
+			va_end(ap); \
+		} \
+	} while (0)
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	int fd;
+
+	INIT();
+	OPEN_MODE(flags, mode);
+
+	fd = real.open(path, flags, mode);
+	track(fd, flags);
+
+	return fd;
+}
+
+int open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	int fd;
+
+	INIT();
+	OPEN_MODE(flags, mode);
+
+	fd = real.open64(path, flags, mode);
+	track(fd, flags);
+
+	return fd;
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	int fd;
+
+	INIT();
+	OPEN_MODE(flags, mode);
+
+	fd = real.openat(dirfd, path, flags, mode);
+	track(fd, flags);
+
+	return fd;
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	int fd;
+
+	INIT();
+	OPEN_MODE(flags, mode);
+
+	fd = real.openat64(dirfd, path, flags, mode);
+	track(fd, flags);
+
+	return fd;
+}
+
+int creat(const char *path, mode_t mode)
+{
+	int fd;
+
+	INIT();
+
+	fd = real.creat(path, mode);
+	track(fd, O_WRONLY | O_CREAT | O_TRUNC);
+
+	return fd;
+}
+
+int creat64(const char *path, mode_t mode)
+{
+	int fd;
+
+	INIT();
+
+	fd = real.creat64(path, mode);
+	track(fd, O_WRONLY | O_CREAT | O_TRUNC);
+
+	return fd;
+}
+
+int close(int fd)
+{
+	struct tracked *t;
+
+	INIT();
+
+	t = take_tracked(fd);
+	if (t != NULL) {
+		int err = errno;
+
+		finish(fd, t);
+		free_tracked(t);
+		errno = err;
+	}
+
+	return real.close(fd);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	struct iovec iov = { (void *)buf, count };
+	struct tracked *t;
+	ssize_t ret;
+
+	INIT();
+
+	t = write_begin(fd);
+	ret = real.write(fd, buf, count);
+	write_end(t, &iov, 1, -1, ret);
+
+	return ret;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct tracked *t;
+	ssize_t ret;
+
+	INIT();
+
+	t = write_begin(fd);
+	ret = real.writev(fd, iov, iovcnt);
+	write_end(t, iov, iovcnt, -1, ret);
+
+	return ret;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	struct iovec iov = { (void *)buf, count };
+	struct tracked *t;
+	ssize_t ret;
+
+	INIT();
+
+	t = write_begin(fd);
+	ret = real.pwrite(fd, buf, count, offset);
+	/* pwrite() ignores O_APPEND's offset only on some systems. */
+	if (t != NULL && t->append)
+		mark_dirty(fd);
+	write_end(t, &iov, 1, offset, ret);
+
+	return ret;
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+	struct iovec iov = { (void *)buf, count };
+	struct tracked *t;
+	ssize_t ret;
+
+	INIT();
+
+	t = write_begin(fd);
+	ret = real.pwrite64(fd, buf, count, offset);
+	if (t != NULL && t->append)
+		mark_dirty(fd);
+	write_end(t, &iov, 1, offset, ret);
+
+	return ret;
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct tracked *t;
+	ssize_t ret;
+
+	INIT();
+
+	t = write_begin(fd);
+	ret = real.pwritev(fd, iov, iovcnt, offset);
+	if (t != NULL && t->append)
+		mark_dirty(fd);
+	write_end(t, iov, iovcnt, offset, ret);
+
+	return ret;
+}
+
+ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)
+{
+	INIT();
+
+	/* The offset semantics depend on the flags, so don't try to hash. */
+	mark_dirty(fd);
+
+	return real.pwritev2(fd, iov, iovcnt, offset, flags);
+}
+
+/** Track a seek (only seeks to the hashed length keep the file clean). */
+static void seeked(int fd, off64_t pos)
+{
+	struct tracked *t = get_tracked(fd);
+
+	if (t == NULL || pos < 0)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	t->pos = (uint64_t)pos;
+	pthread_mutex_unlock(&t->lock);
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+	off_t ret;
+
+	INIT();
+
+	ret = real.lseek(fd, offset, whence);
+	seeked(fd, ret);
+
+	return ret;
+}
+
+off64_t lseek64(int fd, off64_t offset, int whence)
+{
+	off64_t ret;
+
+	INIT();
+
+	ret = real.lseek64(fd, offset, whence);
+	seeked(fd, ret);
+
+	return ret;
+}
+
+int ftruncate(int fd, off_t length)
+{
+	struct tracked *t;
+
+	INIT();
+
+	/* Truncating to the hashed length (e.g. preallocation undone) is fine. */
+	t = get_tracked(fd);
+	if (t != NULL && (uint64_t)length != t->hashed)
+		mark_dirty(fd);
+
+	return real.ftruncate(fd, length);
+}
+
+int ftruncate64(int fd, off64_t length)
+{
+	struct tracked *t;
+
+	INIT();
+
+	t = get_tracked(fd);
+	if (t != NULL && (uint64_t)length != t->hashed)
+		mark_dirty(fd);
+
+	return real.ftruncate64(fd, length);
+}
+
+int fallocate(int fd, int mode, off_t offset, off_t len)
+{
+	INIT();
+
+	/* Only plain preallocation leaves the data alone. */
+	if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE)
+		mark_dirty(fd);
+
+	return real.fallocate(fd, mode, offset, len);
+}
+
+ssize_t copy_file_range(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out, size_t len,
+	unsigned int flags)
+{
+	INIT();
+
+	mark_dirty(fd_out);
+
+	return real.copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	INIT();
+
+	mark_dirty(out_fd);
+
+	return real.sendfile(out_fd, in_fd, offset, count);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	INIT();
+
+	if ((prot & PROT_WRITE) && (flags & MAP_SHARED))
+		mark_dirty(fd);
+
+	return real.mmap(addr, length, prot, flags, fd, offset);
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+	INIT();
+
+	if ((prot & PROT_WRITE) && (flags & MAP_SHARED))
+		mark_dirty(fd);
+
+	return real.mmap64(addr, length, prot, flags, fd, offset);
+}
+
+int dup(int fd)
+{
+	INIT();
+
+	/* Writes through the new fd wouldn't be seen. */
+	mark_dirty(fd);
+
+	return real.dup(fd);
+}
+
+int dup2(int fd, int fd2)
+{
+	int ret;
+
+	INIT();
+
+	if (fd != fd2)
+		mark_dirty(fd);
+
+	ret = real.dup2(fd, fd2);
+	if (ret >= 0 && fd != fd2)
+		free_tracked(take_tracked(fd2));
+
+	return ret;
+}
+
+int dup3(int fd, int fd2, int flags)
+{
+	int ret;
+
+	INIT();
+
+	mark_dirty(fd);
+
+	ret = real.dup3(fd, fd2, flags);
+	if (ret >= 0)
+		free_tracked(take_tracked(fd2));
+
+	return ret;
+}
+
+FILE *fdopen(int fd, const char *mode)
+{
+	INIT();
+
+	/* stdio writes (and fclose()) don't go through the interposed calls. */
+	mark_dirty(fd);
+
+	return real.fdopen(fd, mode);
+}
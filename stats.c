@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Live statistics in shared memory.
+ */
+
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "utilities.h"
+
+/** The mapped segment (NULL if statistics are disabled). */
+static struct stats_segment *seg;
+
+/** The segment's name (for shm_unlink()). */
+static char seg_name[256];
+
+/** Store a counter (only its single writer may call this). */
+#define STATS_SET(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+/** Increase a counter that only one thread writes. */
+#define STATS_ADD(field, value) STATS_SET(field, (field) + (value))
+
+/** Returns the current time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+int stats_open(const char *name, const char *alg)
+{
+	int fd;
+
+	if (name == NULL)
+		snprintf(seg_name, sizeof(seg_name), "/" STATS_PREFIX "%ld", (long)getpid());
+	else if (name[0] == '\0' || strchr(name, '/') != NULL ||
+		snprintf(seg_name, sizeof(seg_name), "/%s", name) >= (int)sizeof(seg_name)) {
+		pr_err("Error: invalid statistics segment name \"%s\"\n", name);
+		return 1;
+	}
+
+	fd = shm_open(seg_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		pr_err("Error: could not create the statistics segment \"%s\": %m\n", seg_name);
+		return 1;
+	}
+
+	if (ftruncate(fd, sizeof(*seg)) != 0) {
+		pr_err("Error: could not size the statistics segment \"%s\": %m\n", seg_name);
+		goto fail;
+	}
+
+	seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		seg = NULL;
+		pr_err("Error: could not map the statistics segment \"%s\": %m\n", seg_name);
+		goto fail;
+	}
+
+	close(fd);
+
+	/* The segment starts out zeroed. */
+	seg->version = STATS_VERSION;
+	seg->size = sizeof(*seg);
+	seg->pid = (uint64_t)getpid();
+	snprintf(seg->alg, sizeof(seg->alg), "%s", alg);
+	seg->start = seg->update = now_ns();
+	seg->status = -1;
+
+	/* Publish the magic number last, so readers never see a partial header. */
+	__atomic_store_n(&seg->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+
+fail:
+	close(fd);
+	shm_unlink(seg_name);
+	return 1;
+}
+
+void stats_close(int status)
+{
+	if (seg == NULL)
+		return;
+
+	STATS_SET(seg->update, now_ns());
+	__atomic_store_n(&seg->status, (int64_t)status, __ATOMIC_RELEASE);
+
+	munmap(seg, sizeof(*seg));
+	seg = NULL;
+
+	shm_unlink(seg_name);
+}
+
+/**
+ * Find (or claim) a device's counters.
+ *
+ * @returns Returns the device's slot or NULL if they're all taken.
+ */
+static struct stats_device *find_device(dev_t dev)
+{
+	uint32_t i;
+
+	for (i = 0; i < seg->ndevices; i++)
+		if (seg->devices[i].dev == (uint64_t)dev + 1)
+			return &seg->devices[i];
+
+	if (i >= STATS_MAX_DEVICES)
+		return NULL;
+
+	/* Only the main thread claims slots, so the slot is published by
+	 * bumping the count after filling it in.
+	 */
+	STATS_SET(seg->devices[i].dev, (uint64_t)dev + 1);
+	__atomic_store_n(&seg->ndevices, i + 1, __ATOMIC_RELEASE);
+
+	return &seg->devices[i];
+}
+
+void stats_state(unsigned int state, const char *name, dev_t dev, off_t size)
+{
+	stats_states(state, name, dev, 1, (uint64_t)size);
+}
+
+void stats_states(unsigned int state, const char *name, dev_t dev, uint64_t files,
+	uint64_t bytes)
+{
+	struct stats_device *d;
+
+	if (seg == NULL)
+		return;
+
+	if (state < STATS_MAX_STATES) {
+		if (seg->state_names[state][0] == '\0')
+			snprintf(seg->state_names[state], sizeof(seg->state_names[state]), "%s", name);
+		if (state >= seg->nstates)
+			__atomic_store_n(&seg->nstates, state + 1, __ATOMIC_RELEASE);
+
+		STATS_ADD(seg->state_files[state], files);
+		STATS_ADD(seg->state_bytes[state], bytes);
+	}
+
+	d = find_device(dev);
+	if (d != NULL) {
+		STATS_ADD(d->files, files);
+		STATS_ADD(d->bytes, bytes);
+	}
+
+	STATS_ADD(seg->files, files);
+	STATS_ADD(seg->bytes, bytes);
+	STATS_SET(seg->update, now_ns());
+}
+
+void stats_dir(void)
+{
+	if (seg != NULL)
+		STATS_ADD(seg->dirs, 1);
+}
+
+void stats_error(void)
+{
+	stats_errors(1);
+}
+
+void stats_errors(uint64_t count)
+{
+	if (seg == NULL)
+		return;
+
+	STATS_ADD(seg->errors, count);
+	STATS_SET(seg->update, now_ns());
+}
+
+void stats_hashed(size_t len)
+{
+	/* The background verification thread hashes too. */
+	if (seg != NULL)
+		__atomic_fetch_add(&seg->hashed, (uint64_t)len, __ATOMIC_RELAXED);
+}
+
+void stats_queue(enum stats_queue queue, size_t depth)
+{
+	if (seg == NULL)
+		return;
+
+	switch (queue) {
+	case STATS_QUEUE_VERIFY:
+		STATS_SET(seg->verify_queue, (uint64_t)depth);
+		break;
+	case STATS_QUEUE_DEFERRED:
+		STATS_SET(seg->deferred, (uint64_t)depth);
+		break;
+	}
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Live statistics declarations.
+ *
+ * With --stats, b2tag publishes its counters in a POSIX shared-memory segment
+ * (/dev/shm/b2tag.PID by default) that any number of observers (e.g.
+ * b2tag-top) can map read-only and poll. Every counter is a 64-bit value that
+ * only its writer changes, with relaxed atomic stores, so updating them costs
+ * no locks or system calls and observers never slow the scan down.
+ *
+ * The segment starts with a magic number, a layout version, and its size.
+ * New fields are only ever appended (bumping the version), so readers can
+ * check the version and ignore fields past the size they know about.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/** The segment's magic number ("b2tagSTS"). */
+#define STATS_MAGIC 0x5354536761743262ULL
+
+/** The current layout version. */
+#define STATS_VERSION 1
+
+/** The prefix of the default segment names. */
+#define STATS_PREFIX "b2tag."
+
+/** The most file states with their own counters. */
+#define STATS_MAX_STATES 16
+
+/** The most devices with their own counters. */
+#define STATS_MAX_DEVICES 16
+
+/** A device's counters. */
+struct stats_device {
+	uint64_t dev;   /**< The device number plus one (0 if the slot is free). */
+	uint64_t files; /**< The files checked. */
+	uint64_t bytes; /**< The size of the files checked. */
+};
+
+/** The shared-memory segment's layout. */
+struct stats_segment {
+	uint64_t magic;      /**< STATS_MAGIC. */
+	uint32_t version;    /**< STATS_VERSION. */
+	uint32_t size;       /**< sizeof(struct stats_segment). */
+	uint64_t pid;        /**< The b2tag process. */
+	char alg[16];        /**< The hash algorithm's name. */
+	uint64_t start;      /**< When the run started (CLOCK_REALTIME, in ns). */
+	uint64_t update;     /**< When a counter last changed (CLOCK_REALTIME, in ns). */
+	int64_t status;      /**< -1 while running, then the exit status. */
+
+	uint64_t files;      /**< The files checked. */
+	uint64_t bytes;      /**< The size of the files checked. */
+	uint64_t hashed;     /**< The bytes read and hashed (for throughput). */
+	uint64_t dirs;       /**< The directories walked. */
+	uint64_t errors;     /**< The files and directories that couldn't be checked. */
+
+	uint64_t verify_queue; /**< Files waiting for background verification. */
+	uint64_t deferred;     /**< Files deferred until their device is free. */
+
+	uint32_t nstates;    /**< The number of states below that are in use. */
+	uint32_t ndevices;   /**< The number of device slots that are in use. */
+	char state_names[STATS_MAX_STATES][16]; /**< The states' names. */
+	uint64_t state_files[STATS_MAX_STATES]; /**< The files in each state. */
+	uint64_t state_bytes[STATS_MAX_STATES]; /**< The size of the files in each state. */
+
+	struct stats_device devices[STATS_MAX_DEVICES]; /**< Per-device counters. */
+};
+
+/** The queues whose depths are published. */
+enum stats_queue {
+	STATS_QUEUE_VERIFY,   /**< The --two-phase verification queue. */
+	STATS_QUEUE_DEFERRED, /**< The files deferred by --device-slots. */
+};
+
+/**
+ * Create and map the statistics segment.
+ *
+ * @param name  The segment's name (NULL for STATS_PREFIX followed by the PID).
+ * @param alg   The hash algorithm's name.
+ *
+ * @retval 0  The segment was created.
+ * @retval !0 An error occurred (statistics are disabled).
+ */
+int stats_open(const char *name, const char *alg);
+
+/**
+ * Publish the exit status and remove the segment.
+ *
+ * Observers that already mapped the segment keep seeing the final counters.
+ *
+ * @param status  The program's exit status.
+ */
+void stats_close(int status);
+
+/**
+ * Account a checked file.
+ *
+ * @param state  The file's state (an index below STATS_MAX_STATES).
+ * @param name   The state's name.
+ * @param dev    The file's device.
+ * @param size   The file's size.
+ */
+void stats_state(unsigned int state, const char *name, dev_t dev, off_t size);
+
+/**
+ * Account several checked files in the same state at once.
+ *
+ * @param state  The files' state (an index below STATS_MAX_STATES).
+ * @param name   The state's name.
+ * @param dev    The files' device.
+ * @param files  The number of files.
+ * @param bytes  The files' total size.
+ */
+void stats_states(unsigned int state, const char *name, dev_t dev, uint64_t files,
+	uint64_t bytes);
+
+/**
+ * Account a walked directory.
+ */
+void stats_dir(void);
+
+/**
+ * Account a file or directory that couldn't be checked.
+ */
+void stats_error(void);
+
+/**
+ * Account several files or directories that couldn't be checked.
+ *
+ * @param count  The number of files and directories.
+ */
+void stats_errors(uint64_t count);
+
+/**
+ * Account hashed data (safe to call from any thread).
+ *
+ * @param len  The number of bytes hashed.
+ */
+void stats_hashed(size_t len);
+
+/**
+ * Publish a queue's depth (safe to call from any thread).
+ *
+ * @param queue  The queue.
+ * @param depth  The number of items in the queue.
+ */
+void stats_queue(enum stats_queue queue, size_t depth);
+
+#endif /* STATS_H */
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Persistent stat/tag cache.
+ *
+ * The cache file is a memory-mapped, native-endian, linear-probing hash table:
+ * a struct tc_header followed by tc_header::capacity struct tc_entry slots.
+ * The file is locked with flock() while in use so concurrent b2tag processes
+ * don't corrupt it (the second one runs without the cache).
+ */
+
+#include "tagcache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "budget.h"
+#include "utilities.h"
+
+/** The magic string (and version) at the start of the cache file. */
+#define TAGCACHE_MAGIC "B2TTAGC1"
+
+/** The initial number of slots in a new cache file. */
+#define TAGCACHE_MIN_CAPACITY 4096
+
+/** Each entry is cross-checked against the xattrs once per this many runs. */
+#define TAGCACHE_CROSSCHECK 16
+
+/** Entries not seen in this many runs are dropped when the table grows. */
+#define TAGCACHE_MAX_AGE 64
+
+/** The tag cache file header. */
+struct tc_header {
+	char     magic[8];   /**< #TAGCACHE_MAGIC */
+	uint32_t entry_size; /**< sizeof(struct tc_entry) */
+	uint32_t run;        /**< Incremented on every run. */
+	uint64_t capacity;   /**< The number of slots (a power of 2). */
+	uint64_t count;      /**< The number of used slots. */
+	uint8_t  pad[32];    /**< Reserved (zero). */
+};
+
+/** A single cached file. */
+struct tc_entry {
+	uint64_t dev;          /**< The file's device ID. */
+	uint64_t ino;          /**< The file's inode number. */
+	int64_t  mtime_sec;    /**< The file's mtime (seconds). */
+	int64_t  ctime_sec;    /**< The file's ctime (seconds). */
+	int64_t  size;         /**< The file's size. */
+	uint32_t mtime_nsec;   /**< The file's mtime (nanoseconds). */
+	uint32_t ctime_nsec;   /**< The file's ctime (nanoseconds). */
+	uint32_t seen;         /**< The run the entry was last used in. */
+	uint8_t  used;         /**< Whether the slot is in use. */
+	uint8_t  alg;          /**< The tag's hash algorithm (::hash_alg_t). */
+	uint8_t  hash_len;     /**< The length of the tag. */
+	uint8_t  fuzzy;        /**< Whether the stored timestamp was truncated. */
+	uint8_t  hash[MAX_HASH_SIZE]; /**< The tag (raw). */
+};
+
+/** The tag cache. */
+static struct {
+	char *path;               /**< The cache file. */
+	int fd;                   /**< The open (and locked) cache file. */
+	struct tc_header *header; /**< The mapped cache file. */
+	struct tc_entry *table;   /**< The hash table (follows the header). */
+	size_t map_size;          /**< The size of the mapping. */
+	unsigned long hits;       /**< Lookups that skipped the xattrs. */
+	unsigned long misses;     /**< Lookups that didn't. */
+	unsigned long stale;      /**< Entries found to disagree with the xattrs. */
+} tc = { .fd = -1 };
+
+bool tagcache_enabled(void)
+{
+	return tc.header != NULL;
+}
+
+/** Returns the size of a cache file with @p capacity slots. */
+static size_t tc_file_size(uint64_t capacity)
+{
+	return sizeof(struct tc_header) + capacity * sizeof(struct tc_entry);
+}
+
+/** Returns the first slot to probe for a file. */
+static uint64_t tc_slot(uint64_t dev, uint64_t ino, uint64_t capacity)
+{
+	uint64_t h = (ino * 0x9e3779b97f4a7c15ULL) ^ (dev * 0xc2b2ae3d27d4eb4fULL);
+
+	return (h ^ (h >> 31)) & (capacity - 1);
+}
+
+/**
+ * Find a file's slot in @p table.
+ *
+ * @returns Returns the file's slot, or the empty slot where it belongs.
+ */
+static struct tc_entry *tc_find(struct tc_entry *table, uint64_t capacity, uint64_t dev, uint64_t ino)
+{
+	uint64_t i = tc_slot(dev, ino, capacity);
+
+	while (table[i].used) {
+		if (table[i].ino == ino && table[i].dev == dev)
+			break;
+		i = (i + 1) & (capacity - 1);
+	}
+
+	return &table[i];
+}
+
+/**
+ * Map a cache file (charging the mapping to the memory budget).
+ *
+ * @param fd        The cache file.
+ * @param capacity  The number of slots to map.
+ *
+ * @returns Returns the mapping or NULL on failure.
+ */
+static struct tc_header *tc_map(int fd, uint64_t capacity)
+{
+	void *map;
+
+	if (budget_reserve(tc_file_size(capacity), false) != 0)
+		return NULL;
+
+	map = mmap(NULL, tc_file_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		budget_release(tc_file_size(capacity));
+		return NULL;
+	}
+
+	return map;
+}
+
+/** Unmap a mapping created by tc_map(). */
+static void tc_unmap(struct tc_header *hdr, size_t size)
+{
+	munmap(hdr, size);
+	budget_release(size);
+}
+
+/**
+ * Create a new (empty) cache file next to the cache and lock it.
+ *
+ * @param capacity  The number of slots.
+ * @param[out] tmp  The name of the new file (must be freed).
+ * @param[out] hdr  The mapping of the new file.
+ *
+ * @returns Returns the new file's fd or -1 on failure.
+ */
+static int tc_create(uint64_t capacity, char **tmp, struct tc_header **hdr)
+{
+	int fd;
+
+	if (asprintf(tmp, "%s.%d", tc.path, (int)getpid()) < 0)
+		return -1;
+
+	fd = open(*tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto fail;
+
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, (off_t)tc_file_size(capacity)) != 0)
+		goto fail;
+
+	*hdr = tc_map(fd, capacity);
+	if (*hdr == NULL)
+		goto fail;
+
+	memcpy((*hdr)->magic, TAGCACHE_MAGIC, sizeof((*hdr)->magic));
+	(*hdr)->entry_size = sizeof(struct tc_entry);
+	(*hdr)->capacity = capacity;
+
+	return fd;
+
+fail:
+	pr_err("Error: could not create tag cache \"%s\": %m\n", *tmp);
+	if (fd >= 0) {
+		close(fd);
+		unlink(*tmp);
+	}
+	free(*tmp);
+	*tmp = NULL;
+	return -1;
+}
+
+/**
+ * Replace the cache with a new, empty one of @p capacity slots and move the
+ * recently used entries of the old cache (if any) into it.
+ *
+ * @returns Returns 0 on success and -1 on failure (the old cache is kept).
+ */
+static int tc_rebuild(uint64_t capacity)
+{
+	struct tc_header *hdr;
+	struct tc_entry *table;
+	char *tmp;
+	uint64_t i;
+	int fd;
+
+	fd = tc_create(capacity, &tmp, &hdr);
+	if (fd < 0)
+		return -1;
+
+	table = (struct tc_entry *)(hdr + 1);
+
+	if (tc.header != NULL) {
+		hdr->run = tc.header->run;
+
+		for (i = 0; i < tc.header->capacity; i++) {
+			struct tc_entry *e = &tc.table[i];
+
+			if (!e->used || tc.header->run - e->seen > TAGCACHE_MAX_AGE)
+				continue;
+
+			*tc_find(table, capacity, e->dev, e->ino) = *e;
+			hdr->count++;
+		}
+	}
+
+	if (rename(tmp, tc.path) != 0) {
+		pr_err("Error: could not replace tag cache \"%s\": %m\n", tc.path);
+		tc_unmap(hdr, tc_file_size(capacity));
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	free(tmp);
+
+	if (tc.header != NULL)
+		tc_unmap(tc.header, tc.map_size);
+	if (tc.fd >= 0)
+		close(tc.fd);
+
+	tc.fd = fd;
+	tc.header = hdr;
+	tc.table = table;
+	tc.map_size = tc_file_size(capacity);
+
+	return 0;
+}
+
+int tagcache_open(const char *path)
+{
+	struct tc_header hdr;
+	struct stat st;
+
+	assert(path != NULL);
+	assert(tc.path == NULL);
+
+	tc.path = strdup(path);
+	if (tc.path == NULL)
+		return -1;
+
+	tc.fd = open(path, O_RDWR | O_CLOEXEC);
+	if (tc.fd < 0) {
+		if (errno != ENOENT) {
+			pr_err("Error: could not open tag cache \"%s\": %m\n", path);
+			goto fail;
+		}
+	}
+	else if (flock(tc.fd, LOCK_EX | LOCK_NB) != 0) {
+		pr_warn("Warning: tag cache \"%s\" is in use, not using it\n", path);
+		goto fail;
+	}
+	else if (fstat(tc.fd, &st) != 0 || pread(tc.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		memcmp(hdr.magic, TAGCACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.entry_size != sizeof(struct tc_entry) ||
+		hdr.capacity == 0 || (hdr.capacity & (hdr.capacity - 1)) != 0 ||
+		(size_t)st.st_size != tc_file_size(hdr.capacity)) {
+		pr_warn("Warning: ignoring unrecognized tag cache \"%s\"\n", path);
+		close(tc.fd);
+		tc.fd = -1;
+	}
+	else {
+		tc.header = tc_map(tc.fd, hdr.capacity);
+		if (tc.header == NULL) {
+			pr_err("Error: could not map tag cache \"%s\": %m\n", path);
+			goto fail;
+		}
+
+		tc.table = (struct tc_entry *)(tc.header + 1);
+		tc.map_size = tc_file_size(hdr.capacity);
+	}
+
+	if (tc.header == NULL && tc_rebuild(TAGCACHE_MIN_CAPACITY) != 0)
+		goto fail;
+
+	tc.header->run++;
+
+	return 0;
+
+fail:
+	if (tc.fd >= 0)
+		close(tc.fd);
+	free(tc.path);
+	tc.path = NULL;
+	tc.fd = -1;
+	return -1;
+}
+
+void tagcache_close(void)
+{
+	if (tc.path == NULL)
+		return;
+
+	if (tc.header != NULL) {
+		pr_debug("Tag cache: %lu hits, %lu misses, %lu stale, %llu entries\n",
+			tc.hits, tc.misses, tc.stale, (unsigned long long)tc.header->count);
+		tc_unmap(tc.header, tc.map_size);
+	}
+
+	if (tc.stale > 0)
+		pr_warn("Warning: %lu tag cache entries disagreed with the stored attributes\n", tc.stale);
+
+	close(tc.fd);
+	free(tc.path);
+	memset(&tc, 0, sizeof(tc));
+	tc.fd = -1;
+}
+
+/** Returns whether a cache entry matches a file's metadata. */
+static bool tc_matches(const struct tc_entry *e, const struct stat *st)
+{
+	return e->used &&
+		e->mtime_sec  == st->st_mtim.tv_sec &&
+		e->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec &&
+		e->ctime_sec  == st->st_ctim.tv_sec &&
+		e->ctime_nsec == (uint32_t)st->st_ctim.tv_nsec &&
+		e->size       == st->st_size;
+}
+
+bool tagcache_lookup(const struct stat *st, xa_t *xa)
+{
+	struct tc_entry *e;
+
+	assert(st != NULL);
+	assert(xa != NULL);
+
+	if (tc.header == NULL)
+		return false;
+
+	e = tc_find(tc.table, tc.header->capacity, st->st_dev, st->st_ino);
+
+	/* Cross-check a different slice of the entries on every run. */
+	if (!tc_matches(e, st) || e->alg != xa->alg ||
+		(e->ino + tc.header->run) % TAGCACHE_CROSSCHECK == 0) {
+		tc.misses++;
+		return false;
+	}
+
+	xa_clear(xa);
+	if (bin2hex(xa->hash, sizeof(xa->hash), e->hash, e->hash_len) != 0) {
+		tc.misses++;
+		return false;
+	}
+
+	xa->mtime = st->st_mtim;
+	xa->fuzzy = e->fuzzy;
+	xa->valid = true;
+	e->seen = tc.header->run;
+	tc.hits++;
+
+	return true;
+}
+
+void tagcache_update(const char *filename, const struct stat *st, const xa_t *xa)
+{
+	struct tc_entry *e;
+	unsigned char raw[MAX_HASH_SIZE];
+	int len;
+
+	assert(st != NULL);
+	assert(xa != NULL);
+
+	if (tc.header == NULL || !xa->valid)
+		return;
+
+	len = hex2bin(raw, sizeof(raw), xa->hash);
+	if (len <= 0)
+		return;
+
+	/* Keep the load factor under 3/4. */
+	if ((tc.header->count + 1) * 4 >= tc.header->capacity * 3 &&
+		tc_rebuild(tc.header->capacity * 2) != 0)
+		return;
+
+	e = tc_find(tc.table, tc.header->capacity, st->st_dev, st->st_ino);
+
+	if (tc_matches(e, st) && e->alg == xa->alg &&
+		(e->hash_len != len || memcmp(e->hash, raw, (size_t)len) != 0)) {
+		pr_warn("Warning: tag cache entry for \"%s\" was stale\n", filename);
+		tc.stale++;
+	}
+
+	if (!e->used)
+		tc.header->count++;
+
+	*e = (struct tc_entry){
+		.dev        = st->st_dev,
+		.ino        = st->st_ino,
+		.mtime_sec  = st->st_mtim.tv_sec,
+		.mtime_nsec = (uint32_t)st->st_mtim.tv_nsec,
+		.ctime_sec  = st->st_ctim.tv_sec,
+		.ctime_nsec = (uint32_t)st->st_ctim.tv_nsec,
+		.size       = st->st_size,
+		.seen       = tc.header->run,
+		.used       = 1,
+		.alg        = (uint8_t)xa->alg,
+		.hash_len   = (uint8_t)len,
+		.fuzzy      = xa->fuzzy,
+	};
+	memcpy(e->hash, raw, (size_t)len);
+}
+
+void tagcache_remove(const struct stat *st)
+{
+	struct tc_entry *e;
+	uint64_t capacity;
+	uint64_t hole;
+	uint64_t i;
+
+	if (tc.header == NULL)
+		return;
+
+	capacity = tc.header->capacity;
+	e = tc_find(tc.table, capacity, st->st_dev, st->st_ino);
+	if (!e->used)
+		return;
+
+	memset(e, 0, sizeof(*e));
+	tc.header->count--;
+
+	/* Backward-shift the rest of the probe sequence into the hole. */
+	hole = (uint64_t)(e - tc.table);
+	for (i = (hole + 1) & (capacity - 1); tc.table[i].used; i = (i + 1) & (capacity - 1)) {
+		uint64_t home = tc_slot(tc.table[i].dev, tc.table[i].ino, capacity);
+
+		/* Move the entry if its home slot isn't cyclically in (hole, i]. */
+		if (((i - home) & (capacity - 1)) >= ((i - hole) & (capacity - 1))) {
+			tc.table[hole] = tc.table[i];
+			memset(&tc.table[i], 0, sizeof(tc.table[i]));
+			hole = i;
+		}
+	}
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Persistent stat/tag cache declarations.
+ *
+ * The tag cache remembers the (mtime, ctime, size, tag) of every file seen by
+ * previous runs, keyed by device and inode number. A quick check of a file
+ * whose stat() still matches its cache entry can then skip opening the file
+ * and reading its extended attributes.
+ *
+ * The extended attributes remain the source of truth: the cache is only ever
+ * filled from them, and a rotating subset of the entries is cross-checked
+ * against them on every run.
+ */
+
+#ifndef TAGCACHE_H
+#define TAGCACHE_H
+
+#include <stdbool.h>
+
+#include <sys/stat.h>
+
+#include "xa.h"
+
+/**
+ * Map the tag cache file @p path (creating it if necessary).
+ *
+ * @param path  The cache file.
+ *
+ * @retval 0  The cache was opened successfully.
+ * @retval !0 An error occurred (the cache is disabled).
+ */
+int tagcache_open(const char *path);
+
+/**
+ * Unmap the tag cache (printing its statistics in verbose mode).
+ */
+void tagcache_close(void);
+
+/**
+ * Returns whether the tag cache is in use.
+ */
+bool tagcache_enabled(void);
+
+/**
+ * Look up a file in the tag cache.
+ *
+ * On a hit, @p xa is filled in with the cached tag (as if it was read with
+ * xa_read()). Entries that are due to be cross-checked against the extended
+ * attributes are reported as misses.
+ *
+ * @param st  The file's stat() structure.
+ * @param xa  The xa structure to fill in (xa_t::alg must already be set).
+ *
+ * @retval true  The file's metadata matches its cache entry.
+ * @retval false The file isn't cached, has changed, or should be cross-checked.
+ */
+bool tagcache_lookup(const struct stat *st, xa_t *xa);
+
+/**
+ * Record a file's current metadata and tag in the tag cache.
+ *
+ * If the file already has an entry with the same metadata but a different
+ * tag, the cache was stale and a warning is printed.
+ *
+ * @param filename  The file's name (for messages).
+ * @param st        The file's stat() structure (after any xattr updates).
+ * @param xa        The file's stored tag.
+ */
+void tagcache_update(const char *filename, const struct stat *st, const xa_t *xa);
+
+/**
+ * Remove a file from the tag cache.
+ *
+ * @param st  The file's stat() structure.
+ */
+void tagcache_remove(const struct stat *st);
+
+#endif /* TAGCACHE_H */
@@ -37,6 +37,12 @@ RET=0
 TEST_FILE=${TEST_FILE:-test.txt}
 TEST_MESSAGE=${TEST_MESSAGE:-The quick brown fox jumped over the lazy dog.}
 
+# The directory tree used by the tests of the recursive modes.
+TEST_DIR=${TEST_DIR:-test.d}
+
+# A directory on a different device than TEST_DIR (for --device-slots).
+TEST_DIR2=${TEST_DIR2:-/dev/shm/b2tag-test.d}
+
 DEFAULT_ALG=blake2b
 
 function fail() {
@@ -58,12 +64,15 @@ function from_hex() {
 	xxd -p -r
 }
 
-# Rudimentary *sum function for blake2s. The coreutils b2sum utility only
-# works with blake2b hashes, so we have to use openssl to verify blake2s.
-function b2ssum() (
+# Rudimentary *sum function for the digests coreutils doesn't have (blake2s
+# and sha3), using openssl. $1 is the openssl digest name.
+function osslsum() (
 	set -e
+	digest="$1"
+	shift
+
 	if [[ ! $1 = -c ]]; then
-		openssl dgst -r -blake2s256 "$@" | sed -r 's/ \*/  /'
+		openssl dgst -r "-$digest" "$@" | sed -r 's/ \*/  /'
 		return 0
 	fi
 
@@ -79,7 +88,7 @@ function b2ssum() (
 		file=$(sed -r "s/^\S+ [ *](.+)$/\1/" <<<"$line")
 		expect=$(sed -r "s/^(\S+) [ *].+/\1/" <<<"$line")
 
-		hash=$(b2ssum "$file" | sed -r "s/^(\S+) [ *].+/\1/")
+		hash=$(osslsum "$digest" "$file" | sed -r "s/^(\S+) [ *].+/\1/")
 
 		if [[ ! $expect = $hash ]]; then
 			fail "$file: FAILED"
@@ -90,6 +99,11 @@ function b2ssum() (
 	return 0
 )
 
+# The coreutils b2sum utility only works with blake2b hashes.
+function b2ssum() {
+	osslsum blake2s256 "$@"
+}
+
 function hash() {
 	local alg="${1:-$DEFAULT_ALG}"
 	local prog
@@ -107,6 +121,10 @@ function hash() {
 			# Stub function since we can't use b2sum
 			prog=b2ssum
 			;;
+		sha3-256|sha3-512)
+			prog=osslsum
+			set -- "$alg" "$@"
+			;;
 		*)
 			fail "Unknown hash algorithm: $alg"
 			return 1
@@ -143,6 +161,29 @@ function attr_name() {
 	echo "user.shatag.$attr"
 }
 
+function has_attr() {
+	getfattr --name="$1" "$2" &>/dev/null
+}
+
+# Create the test tree (and remove the files of earlier tests)
+function make_tree() {
+	rm -rf "$TEST_DIR" "$TEST_DIR".* &&
+	mkdir -p "$TEST_DIR/a/b" "$TEST_DIR/scratch" &&
+	echo one > "$TEST_DIR/a/one" &&
+	echo two > "$TEST_DIR/a/b/two" &&
+	echo three > "$TEST_DIR/scratch/three"
+}
+
+# Change a (one-line) file's data in place without changing its size or mtime
+function corrupt() {
+	local data mtime
+
+	mtime=$(stat --format='%y' "$1") &&
+	data=$(tr 'a-z' 'b-za' < "$1") &&
+	printf '%s\n' "$data" 1<> "$1" &&
+	touch --date="$mtime" "$1"
+}
+
 function get_attr_hex() {
 	local attr=$(attr_name "$1")
 	local file="$2"
@@ -323,7 +364,7 @@ check_hash "$TEST_FILE" "" $ALG || let RET++
 
 # Test setup: create the test file, hash the test message, and grab the
 # test file's modified time
-for ALG in '' blake2b blake2s md5 sha1 sha256 sha512; do
+for ALG in '' blake2b blake2s md5 sha1 sha256 sha512 sha3-256 sha3-512; do
 	HASH=$(echo "$TEST_MESSAGE" | hash $ALG) \
 		|| fail "Could not generate $ALG reference hash: $?" \
 		|| let RET++
@@ -369,10 +410,243 @@ for ALG in '' blake2b blake2s md5 sha1 sha256 sha512; do
 	clear_attr "$ALG" "$TEST_FILE"
 done
 
+# Known-answer test for k12 (no reference tool is commonly available)
+info "Test k12"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+: > "$TEST_DIR/empty"
+./b2tag $args --k12 "$TEST_DIR/empty" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+check_hash "$TEST_DIR/empty" 1ac2d450fc3b4205d19da7bfca1b37513c0803577ac7167f06fe2ce1f0ef39e5 k12 \
+	|| let RET++
+
+info "Test check detects corruption"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+./b2tag -r $args "$TEST_DIR/a" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+corrupt "$TEST_DIR/a/one" \
+	|| fail "Could not corrupt test file: $?" \
+	|| let RET++
+
+! ./b2tag -r -c $args "$TEST_DIR/a" &>/dev/null \
+	|| fail "b2tag -c didn't detect corruption" \
+	|| let RET++
+
+info "Test --dir-cache"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+# Listings of recently modified directories aren't cached.
+touch --date='1 hour ago' "$TEST_DIR" "$TEST_DIR/a" "$TEST_DIR/a/b" "$TEST_DIR/scratch"
+
+./b2tag -r $args --dir-cache="$TEST_DIR.dircache" "$TEST_DIR" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+[[ -s $TEST_DIR.dircache ]] \
+	|| fail "Directory cache was not written" \
+	|| let RET++
+
+# Untag a file without changing its directory, so the cached listing is used.
+clear_attr ts "$TEST_DIR/a/b/two"
+clear_attr "" "$TEST_DIR/a/b/two"
+echo four > "$TEST_DIR/a/four"
+
+./b2tag -r $args --dir-cache="$TEST_DIR.dircache" "$TEST_DIR" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+check_hash "$TEST_DIR/a/b/two" "$(echo two | hash)" || let RET++
+check_hash "$TEST_DIR/a/four" "$(echo four | hash)" || let RET++
+
+info "Test --tag-cache"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+./b2tag -r $args --tag-cache="$TEST_DIR.tagcache" "$TEST_DIR" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+echo changed > "$TEST_DIR/a/one"
+touch --date='tomorrow' "$TEST_DIR/a/one"
+
+./b2tag -r $args --tag-cache="$TEST_DIR.tagcache" "$TEST_DIR" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+check_hash "$TEST_DIR/a/one" "$(echo changed | hash)" || let RET++
+check_hash "$TEST_DIR/a/b/two" "$(echo two | hash)" || let RET++
+
+corrupt "$TEST_DIR/a/b/two" \
+	|| fail "Could not corrupt test file: $?" \
+	|| let RET++
+
+! ./b2tag -r -c $args --tag-cache="$TEST_DIR.tagcache" "$TEST_DIR" &>/dev/null \
+	|| fail "b2tag -c --tag-cache didn't detect corruption" \
+	|| let RET++
+
+info "Test --device-slots with two processes and two devices"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+rm -rf "$TEST_DIR2"
+if ! mkdir -p "$TEST_DIR2" ||
+	[[ $(stat --format='%d' "$TEST_DIR") = $(stat --format='%d' "$TEST_DIR2") ]]; then
+	info "Skipped: $TEST_DIR2 isn't on a different device"
+else
+	# Each process reads a large file on one device (holding its slot) and
+	# then finds the other device busy, so both wait for the other's device.
+	head -c 64M /dev/zero > "$TEST_DIR/big"
+	head -c 64M /dev/zero > "$TEST_DIR2/big"
+	echo one > "$TEST_DIR2/one"
+
+	timeout 60 ./b2tag -n $args --device-slots=1 "$TEST_DIR/big" "$TEST_DIR2/one" &
+	PID1=$!
+	timeout 60 ./b2tag -n $args --device-slots=1 "$TEST_DIR2/big" "$TEST_DIR/a/one" &
+	PID2=$!
+
+	wait $PID1 \
+		|| fail "First b2tag --device-slots returned failure: $?" \
+		|| let RET++
+	wait $PID2 \
+		|| fail "Second b2tag --device-slots returned failure: $?" \
+		|| let RET++
+fi
+
+info "Test --manifest"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+./b2tag -r $args --manifest="$TEST_DIR.manifest" "$TEST_DIR" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+./b2tag-manifest -q verify "$TEST_DIR.manifest" \
+	|| fail "b2tag-manifest verify failed: $?" \
+	|| let RET++
+
+./b2tag-manifest to-text "$TEST_DIR.manifest" | hash "" -c - >/dev/null \
+	|| fail "manifest verification failed: ${PIPESTATUS[*]}" \
+	|| let RET++
+
+info "Test --migrate"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+MTIME=$(get_mtime "$TEST_DIR/a/one")
+
+./b2tag -r $args "$TEST_DIR" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+./b2tag -r $args --migrate=shatag --layout=record "$TEST_DIR" >/dev/null \
+	|| fail "b2tag --migrate returned failure: $?" \
+	|| let RET++
+
+has_attr user.b2tag.blake2b512 "$TEST_DIR/a/one" \
+	|| fail "Tag was not migrated to the record layout" \
+	|| let RET++
+
+check_ts   "$TEST_DIR/a/one" "" || let RET++
+check_hash "$TEST_DIR/a/one" "" || let RET++
+
+./b2tag -r -c $args --layout=record "$TEST_DIR" \
+	|| fail "Migrated tags don't verify: $?" \
+	|| let RET++
+
+./b2tag -r $args --migrate=record --layout=shatag "$TEST_DIR" >/dev/null \
+	|| fail "b2tag --migrate returned failure: $?" \
+	|| let RET++
+
+check_ts   "$TEST_DIR/a/one" "$MTIME" || let RET++
+check_hash "$TEST_DIR/a/one" "$(echo one | hash)" || let RET++
+
+info "Test --remove-tags"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+for ALG in blake2b blake2s sha256; do
+	./b2tag -r $args --$ALG "$TEST_DIR" \
+		|| fail "b2tag returned failure: $?" \
+		|| let RET++
+done
+
+./b2tag -r $args --remove-tags=blake2s,sha256 "$TEST_DIR" >/dev/null \
+	|| fail "b2tag --remove-tags returned failure: $?" \
+	|| let RET++
+
+check_hash "$TEST_DIR/a/one" "" blake2s || let RET++
+check_hash "$TEST_DIR/a/one" "" sha256 || let RET++
+check_hash "$TEST_DIR/a/one" "$(echo one | hash)" || let RET++
+
+./b2tag -r $args --remove-tags "$TEST_DIR" >/dev/null \
+	|| fail "b2tag --remove-tags returned failure: $?" \
+	|| let RET++
+
+check_ts   "$TEST_DIR/a/one" "" || let RET++
+check_hash "$TEST_DIR/a/one" "" || let RET++
+
+info "Test --policy"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+printf '%s\n' 'scratch exclude' 'two alg=sha256' > "$TEST_DIR.policy"
+
+./b2tag -r $args --policy="$TEST_DIR.policy" "$TEST_DIR" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+check_hash "$TEST_DIR/scratch/three" "" || let RET++
+check_hash "$TEST_DIR/a/b/two" "$(echo two | hash sha256)" sha256 || let RET++
+check_hash "$TEST_DIR/a/one" "$(echo one | hash)" || let RET++
+
+info "Test --record-verified and --coverage"
+make_tree \
+	|| fail "Could not create test tree: $?" \
+	|| let RET++
+
+./b2tag -r $args --record-verified "$TEST_DIR/a" \
+	|| fail "b2tag returned failure: $?" \
+	|| let RET++
+
+has_attr user.b2tag.verified "$TEST_DIR/a/one" \
+	|| fail "Verification time was not recorded" \
+	|| let RET++
+
+COVERAGE=$(./b2tag -r --coverage "$TEST_DIR") \
+	|| fail "b2tag --coverage returned failure: $?" \
+	|| let RET++
+
+# 2 of the 3 files were verified (so 100% of a/ and none of scratch/).
+grep -qE "^ +2( +100\.0){6} +$TEST_DIR/a\$" <<<"$COVERAGE" \
+	|| fail "Unexpected coverage report:"$'\n'"$COVERAGE" \
+	|| let RET++
+
+grep -qE "^ +1( +0\.0){6} +$TEST_DIR/scratch\$" <<<"$COVERAGE" \
+	|| fail "Unexpected coverage report:"$'\n'"$COVERAGE" \
+	|| let RET++
+
 # If the test was successful, remove the test file
 if [[ $RET -eq 0 ]]; then
 	echo "All tests successful"
 	rm -f "$TEST_FILE"
+	rm -rf "$TEST_DIR" "$TEST_DIR".* "$TEST_DIR2"
 else
 	fail "$RET test failures"
 fi
@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Live statistics viewer (b2tag-top).
+ *
+ * Maps the statistics segments of running b2tag processes (see stats.h)
+ * read-only and prints their counters every few seconds.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "b2tag.h"
+#include "stats.h"
+#include "utilities.h"
+
+/** The options set by command-line arguments. */
+struct args_s args;
+
+/** The most segments that are shown at once. */
+#define MAX_SEGMENTS 64
+
+/** A watched segment. */
+struct segment {
+	char name[256];                    /**< The segment's name (without the '/'). */
+	const struct stats_segment *stats; /**< The mapped segment. */
+	uint64_t last_hashed;              /**< The hashed bytes at the last refresh. */
+	uint64_t last_time;                /**< When the last refresh was (in ns). */
+};
+
+/** Set by SIGINT and SIGTERM. */
+static volatile sig_atomic_t stop;
+
+/**
+ * Prints a usage message for b2tag-top.
+ *
+ * @param program  The name of the program being run.
+ */
+static void usage(const char *program)
+{
+	printf(
+		"Usage: %s [OPTION]... [NAME]...\n"
+		"\n"
+		"Show the live counters of b2tag processes started with --stats. Without\n"
+		"NAMEs, every " STATS_PREFIX "* segment in /dev/shm is shown.\n"
+		"\n"
+		"Optional arguments:\n"
+		"  -1, --once                print the counters once and exit\n"
+		"  -h, --help                show this help message and exit\n"
+		"  -i, --interval=SECONDS    refresh every SECONDS (default: 2)\n",
+		program);
+}
+
+/** Signal handler to stop refreshing. */
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/** Returns the current time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/** Converts bytes to MiB. */
+static double mib(uint64_t bytes)
+{
+	return (double)bytes / (1024.0 * 1024.0);
+}
+
+/**
+ * Map a segment read-only.
+ *
+ * @retval 0  The segment was mapped.
+ * @retval !0 The segment doesn't exist or isn't a (compatible) b2tag segment.
+ */
+static int map_segment(struct segment *seg)
+{
+	char path[260];
+	struct stat st;
+	void *p;
+	int fd;
+
+	snprintf(path, sizeof(path), "/%s", seg->name);
+
+	fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return 1;
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*seg->stats)) {
+		close(fd);
+		return 1;
+	}
+
+	p = mmap(NULL, sizeof(*seg->stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 1;
+
+	seg->stats = p;
+
+	/* Newer versions only append fields, so they can still be shown. */
+	if (__atomic_load_n(&seg->stats->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+		seg->stats->version < STATS_VERSION || seg->stats->size < sizeof(*seg->stats)) {
+		munmap(p, sizeof(*seg->stats));
+		seg->stats = NULL;
+		return 1;
+	}
+
+	/* The first refresh shows the average since the start. */
+	seg->last_hashed = 0;
+	seg->last_time = seg->stats->start;
+
+	return 0;
+}
+
+/**
+ * Find every b2tag segment in /dev/shm, keeping the segments that are
+ * already mapped (so their throughput can be worked out).
+ *
+ * @param segs   The mapped segments (replaced with the current ones).
+ * @param count  The number of mapped segments.
+ *
+ * @returns Returns the number of segments found.
+ */
+static size_t find_segments(struct segment *segs, size_t count)
+{
+	static struct segment found[MAX_SEGMENTS];
+	struct dirent *entry;
+	size_t nfound = 0;
+	size_t i;
+	DIR *dir;
+
+	dir = opendir("/dev/shm");
+
+	while (dir != NULL && nfound < MAX_SEGMENTS && (entry = readdir(dir)) != NULL) {
+		struct segment *seg = &found[nfound];
+
+		if (strncmp(entry->d_name, STATS_PREFIX, strlen(STATS_PREFIX)) != 0)
+			continue;
+
+		for (i = 0; i < count; i++) {
+			if (segs[i].stats != NULL && strcmp(segs[i].name, entry->d_name) == 0)
+				break;
+		}
+
+		if (i < count) {
+			*seg = segs[i];
+			segs[i].stats = NULL;
+			nfound++;
+			continue;
+		}
+
+		memset(seg, 0, sizeof(*seg));
+		snprintf(seg->name, sizeof(seg->name), "%s", entry->d_name);
+		if (map_segment(seg) == 0)
+			nfound++;
+	}
+
+	if (dir != NULL)
+		closedir(dir);
+
+	/* Segments that were removed. */
+	for (i = 0; i < count; i++)
+		if (segs[i].stats != NULL)
+			munmap((void *)segs[i].stats, sizeof(*segs[i].stats));
+
+	memcpy(segs, found, nfound * sizeof(found[0]));
+
+	return nfound;
+}
+
+/** Print the elapsed time as H:MM:SS. */
+static void print_elapsed(uint64_t ns)
+{
+	unsigned long long s = (unsigned long long)(ns / 1000000000);
+
+	printf("%llu:%02llu:%02llu", s / 3600, s / 60 % 60, s % 60);
+}
+
+/**
+ * Print a segment's counters.
+ *
+ * @param seg  The segment.
+ * @param now  The current time (in ns).
+ */
+static void print_segment(struct segment *seg, uint64_t now)
+{
+	struct stats_segment s;
+	uint64_t elapsed;
+	double rate = 0;
+	uint32_t i;
+
+	/* Take a snapshot (the counters are independent, so tearing between
+	 * them doesn't matter).
+	 */
+	memcpy(&s, seg->stats, sizeof(s));
+	if (s.nstates > STATS_MAX_STATES)
+		s.nstates = STATS_MAX_STATES;
+	if (s.ndevices > STATS_MAX_DEVICES)
+		s.ndevices = STATS_MAX_DEVICES;
+
+	elapsed = (s.status < 0 ? now : s.update) - s.start;
+
+	if (s.status < 0 && now > seg->last_time)
+		rate = mib(s.hashed - seg->last_hashed) / ((double)(now - seg->last_time) / 1e9);
+
+	seg->last_hashed = s.hashed;
+	seg->last_time = now;
+
+	printf("%s  pid %llu  %s  ", seg->name, (unsigned long long)s.pid, s.alg);
+	if (s.status >= 0)
+		printf("exited (%lld)", (long long)s.status);
+	else if (kill((pid_t)s.pid, 0) != 0 && errno == ESRCH)
+		printf("dead");
+	else
+		printf("running");
+	printf("  elapsed ");
+	print_elapsed(elapsed);
+	printf("\n");
+
+	printf("  files %llu (%.1f MiB)  dirs %llu  errors %llu\n",
+		(unsigned long long)s.files, mib(s.bytes), (unsigned long long)s.dirs,
+		(unsigned long long)s.errors);
+	printf("  hashed %.1f MiB  now %.1f MiB/s  average %.1f MiB/s\n", mib(s.hashed), rate,
+		elapsed > 0 ? mib(s.hashed) / ((double)elapsed / 1e9) : 0.0);
+	printf("  queued: verify %llu  deferred %llu\n",
+		(unsigned long long)s.verify_queue, (unsigned long long)s.deferred);
+
+	for (i = 0; i < s.nstates; i++) {
+		s.state_names[i][sizeof(s.state_names[i]) - 1] = '\0';
+		if (s.state_names[i][0] == '\0' || s.state_files[i] == 0)
+			continue;
+
+		printf("  %-10s %12llu files %12.1f MiB\n", s.state_names[i],
+			(unsigned long long)s.state_files[i], mib(s.state_bytes[i]));
+	}
+
+	for (i = 0; i < s.ndevices; i++) {
+		dev_t dev = (dev_t)(s.devices[i].dev - 1);
+
+		if (s.devices[i].dev == 0)
+			continue;
+
+		printf("  dev %3u:%-6u %12llu files %12.1f MiB\n", major(dev), minor(dev),
+			(unsigned long long)s.devices[i].files, mib(s.devices[i].bytes));
+	}
+
+	printf("\n");
+}
+
+/**
+ * The entry point to the b2tag-top utility.
+ *
+ * @param argc  The number of command-line arguments.
+ * @param argv  The command-line arguments.
+ *
+ * @returns Returns the program's exit status.
+ */
+int main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{ "once",     no_argument,       0, '1' },
+		{ "help",     no_argument,       0, 'h' },
+		{ "interval", required_argument, 0, 'i' },
+		{ NULL, 0, 0, 0 }
+	};
+	static struct segment segs[MAX_SEGMENTS];
+	const char *program = argv[0];
+	bool once = false;
+	bool tty = isatty(STDOUT_FILENO);
+	double interval = 2;
+	size_t count = 0;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "1hi:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case '1':
+			once = true;
+			break;
+		case 'h':
+			usage(program);
+			return EXIT_SUCCESS;
+		case 'i': {
+			char *end;
+
+			interval = strtod(optarg, &end);
+			if (end == optarg || *end != '\0' || !(interval >= 0.1 && interval <= 3600)) {
+				fprintf(stderr, "Invalid interval \"%s\"\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		default:
+			usage(program);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = (size_t)optind; i < (size_t)argc && count < MAX_SEGMENTS; i++) {
+		snprintf(segs[count].name, sizeof(segs[count].name), "%s",
+			argv[i][0] == '/' ? argv[i] + 1 : argv[i]);
+		if (map_segment(&segs[count]) != 0) {
+			pr_err("Error: \"%s\" isn't a b2tag statistics segment\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+		count++;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while (!stop) {
+		struct timespec delay;
+		uint64_t now;
+
+		/* Pick up b2tag processes started since the last refresh. */
+		if (optind >= argc)
+			count = find_segments(segs, count);
+
+		if (tty && !once)
+			printf("\033[H\033[2J");
+
+		if (count == 0)
+			printf("No b2tag processes with --stats found\n");
+
+		now = now_ns();
+		for (i = 0; i < count; i++)
+			print_segment(&segs[i], now);
+
+		fflush(stdout);
+
+		if (once)
+			break;
+
+		delay.tv_sec = (time_t)interval;
+		delay.tv_nsec = (long)((interval - (double)delay.tv_sec) * 1e9);
+		nanosleep(&delay, NULL);
+	}
+
+	return EXIT_SUCCESS;
+}
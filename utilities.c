@@ -33,6 +33,8 @@
 
 #include "utilities.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 
@@ -63,6 +65,73 @@ int ts_compare(struct timespec ts1, struct timespec ts2, bool fuzzy)
 	return 0;
 }
 
+int parse_size(const char *s, unsigned long long *size)
+{
+	unsigned long long val;
+	int shift = 0;
+	char *end;
+
+	if (!isdigit(*s))
+		return -1;
+
+	errno = 0;
+	val = strtoull(s, &end, 10);
+	if (errno != 0)
+		return -1;
+
+	switch (toupper(*end)) {
+	case 'T':
+		shift += 10;
+		/* Fall through. */
+	case 'G':
+		shift += 10;
+		/* Fall through. */
+	case 'M':
+		shift += 10;
+		/* Fall through. */
+	case 'K':
+		shift += 10;
+		end++;
+		break;
+	default:
+		break;
+	}
+
+	if (*end != '\0' || (shift > 0 && val > (~0ULL >> shift)))
+		return -1;
+
+	*size = val << shift;
+	return 0;
+}
+
+int parse_duration(const char *s, time_t *duration)
+{
+	unsigned long long n;
+	unsigned long mult;
+	char *end;
+
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (errno != 0 || end == s || *s == '-')
+		return -1;
+
+	switch (*end) {
+	case 's': mult = 1; break;
+	case 'm': mult = 60; break;
+	case 'h': mult = 60 * 60; break;
+	case '\0':
+	case 'd': mult = 24 * 60 * 60; break;
+	case 'w': mult = 7 * 24 * 60 * 60; break;
+	default: return -1;
+	}
+
+	if (*end != '\0' && end[1] != '\0')
+		return -1;
+
+	*duration = (time_t)(n * mult);
+	return 0;
+}
+
 void die(const char *fmt, ...)
 {
 	va_list ap;
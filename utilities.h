@@ -52,6 +52,27 @@
  */
 int ts_compare(struct timespec ts1, struct timespec ts2, bool fuzzy);
 
+/**
+ * Parse a size with an optional K, M, G, or T (binary) suffix.
+ *
+ * @param s     The string to parse.
+ * @param size  Where to store the size.
+ *
+ * @returns Returns 0 on success and a negative number if @p s is malformed.
+ */
+int parse_size(const char *s, unsigned long long *size);
+
+/**
+ * Parse a duration (a number of seconds with an s, m, h, d, or w suffix;
+ * days if there's no suffix).
+ *
+ * @param s         The string to parse.
+ * @param duration  Where to store the duration (in seconds).
+ *
+ * @returns Returns 0 on success and -1 if @p s is malformed.
+ */
+int parse_duration(const char *s, time_t *duration);
+
 /**
  * Prints an error message to stderr and exits the program.
  *
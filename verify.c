@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Background verification queue.
+ */
+
+#include "verify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/ioprio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "budget.h"
+#include "devslot.h"
+#include "io.h"
+#include "stats.h"
+#include "utilities.h"
+
+/** Call the kernel's fadvise() on files larger than this. */
+#define FADVISE_THRESHOLD 65536
+
+/** How often to retry a busy device slot (in nanoseconds). */
+#define SLOT_POLL_NSEC 100000000
+
+/** A singly-linked FIFO of items. */
+struct verify_list {
+	struct verify_item *head; /**< The first item. */
+	struct verify_item *tail; /**< The last item. */
+};
+
+/** The verification queue. */
+static struct {
+	bool running;              /**< Whether the worker thread was started. */
+	bool stop;                 /**< Whether the worker should exit when idle. */
+	size_t busy;               /**< The number of items queued or being verified. */
+	size_t waiting;            /**< The number of items waiting to be verified. */
+	struct verify_list todo;   /**< The files to verify. */
+	struct verify_list done;   /**< The verified files. */
+	pthread_t thread;          /**< The worker thread. */
+	pthread_mutex_t lock;      /**< Protects everything above. */
+	pthread_cond_t queued;     /**< Signalled when a file is queued. */
+	pthread_cond_t verified;   /**< Signalled when a file is verified. */
+} verify = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.verified = PTHREAD_COND_INITIALIZER,
+};
+
+/** Append an item to a list. */
+static void list_push(struct verify_list *list, struct verify_item *item)
+{
+	item->next = NULL;
+	if (list->tail != NULL)
+		list->tail->next = item;
+	else
+		list->head = item;
+	list->tail = item;
+}
+
+/** Remove the first item from a list (or return NULL if it's empty). */
+static struct verify_item *list_pop(struct verify_list *list)
+{
+	struct verify_item *item = list->head;
+
+	if (item != NULL) {
+		list->head = item->next;
+		if (list->head == NULL)
+			list->tail = NULL;
+	}
+
+	return item;
+}
+
+/**
+ * Read a file's stored attributes and hash it.
+ *
+ * @retval 0  The file was verified (or its error recorded in @p item).
+ * @retval >0 The file's device is busy: try again later.
+ */
+static int verify_file(struct verify_item *item)
+{
+	const char *path;
+	int slot;
+	int fd;
+
+	/* Take a turn on the device like the walk does, but never wait for one
+	 * (the other queued files may be on other devices).
+	 */
+	slot = devslot_borrow(item->st.st_dev);
+	if (slot > 0)
+		return 1;
+
+	path = pathtree_path(item->node);
+	if (path == NULL) {
+		item->err = -1;
+		item->error = errno;
+		goto out;
+	}
+
+	fd = io->open(path, O_RDONLY);
+	if (fd < 0) {
+		item->err = -1;
+		item->error = errno;
+		goto out;
+	}
+
+	/* The file may have changed since it was queued. */
+	if (io->fstat(fd, &item->st) != 0) {
+		item->err = -1;
+		item->error = errno;
+		io->close(fd);
+		goto out;
+	}
+
+	if (item->st.st_size > FADVISE_THRESHOLD)
+		io->fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	item->actual.mtime = item->st.st_mtim;
+	item->err = xa_read(fd, &item->stored);
+	if (item->err < 0)
+		item->error = errno;
+	else
+		xa_compute(fd, &item->actual);
+
+	io->close(fd);
+
+out:
+	if (slot == 0)
+		devslot_return(item->st.st_dev);
+
+	return 0;
+}
+
+/** Move the items of @p from to the front of @p to. */
+static void list_prepend(struct verify_list *to, struct verify_list *from)
+{
+	if (from->head == NULL)
+		return;
+
+	from->tail->next = to->head;
+	if (to->tail == NULL)
+		to->tail = from->tail;
+	to->head = from->head;
+	from->head = from->tail = NULL;
+}
+
+/** The verification thread. */
+static void *verify_thread(void *arg)
+{
+	/* The files whose device was busy, and the last busy device. */
+	struct verify_list retry = { NULL, NULL };
+	dev_t busy_dev = 0;
+	bool busy = false;
+	struct verify_item *item;
+
+	(void)arg;
+
+	/* Only use the CPU and disk when nothing else wants them. */
+	if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19) != 0)
+		pr_warn("Warning: could not lower the verification thread's priority: %m\n");
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) != 0)
+		pr_warn("Warning: could not set the verification thread's I/O priority: %m\n");
+
+	pthread_mutex_lock(&verify.lock);
+
+	for (;;) {
+		while (verify.todo.head == NULL && retry.head == NULL && !verify.stop)
+			pthread_cond_wait(&verify.queued, &verify.lock);
+
+		if (verify.stop)
+			break;
+
+		/* Every file left is on a busy device: give its readers a moment
+		 * before trying them again.
+		 */
+		if (verify.todo.head == NULL) {
+			pthread_mutex_unlock(&verify.lock);
+			nanosleep(&(struct timespec){ .tv_nsec = SLOT_POLL_NSEC }, NULL);
+			pthread_mutex_lock(&verify.lock);
+
+			list_prepend(&verify.todo, &retry);
+			busy = false;
+			continue;
+		}
+
+		item = list_pop(&verify.todo);
+
+		/* Skip the rest of a busy device's files until the next round. */
+		if (busy && item->st.st_dev == busy_dev) {
+			list_push(&retry, item);
+			continue;
+		}
+
+		pthread_mutex_unlock(&verify.lock);
+		busy = verify_file(item) > 0;
+		pthread_mutex_lock(&verify.lock);
+
+		if (busy) {
+			busy_dev = item->st.st_dev;
+			list_push(&retry, item);
+			continue;
+		}
+
+		verify.waiting--;
+		list_push(&verify.done, item);
+		pthread_cond_signal(&verify.verified);
+	}
+
+	pthread_mutex_unlock(&verify.lock);
+
+	/* verify_stop() dropped the other files that weren't verified. */
+	while ((item = list_pop(&retry)) != NULL)
+		verify_free(item);
+
+	pathtree_free_buffer();
+
+	return NULL;
+}
+
+int verify_start(void)
+{
+	int err;
+
+	err = pthread_create(&verify.thread, NULL, verify_thread, NULL);
+	if (err != 0) {
+		errno = err;
+		pr_err("Error: could not start the verification thread: %m\n");
+		return -1;
+	}
+
+	verify.running = true;
+
+	return 0;
+}
+
+bool verify_enabled(void)
+{
+	return verify.running;
+}
+
+int verify_queue(pathtree_id node, const struct stat *st, hash_alg_t alg)
+{
+	struct verify_item *item;
+	bool full;
+
+	/* Never wait for the worker: the walk would stall behind it. Only the
+	 * walk queues files, so the queue can't fill up again in the meantime.
+	 */
+	pthread_mutex_lock(&verify.lock);
+	full = verify.waiting >= VERIFY_QUEUE_MAX;
+	pthread_mutex_unlock(&verify.lock);
+
+	if (full)
+		return 2;
+
+	item = budget_malloc(sizeof(*item));
+	if (item == NULL)
+		return 1;
+
+	memset(item, 0, sizeof(*item));
+	item->node = node;
+	item->st = *st;
+	item->stored.alg = alg;
+	item->actual.alg = alg;
+
+	pthread_mutex_lock(&verify.lock);
+	list_push(&verify.todo, item);
+	verify.waiting++;
+	verify.busy++;
+	stats_queue(STATS_QUEUE_VERIFY, verify.busy);
+	pthread_cond_signal(&verify.queued);
+	pthread_mutex_unlock(&verify.lock);
+
+	return 0;
+}
+
+struct verify_item *verify_next(bool wait)
+{
+	struct verify_item *item;
+
+	pthread_mutex_lock(&verify.lock);
+
+	while (wait && verify.done.head == NULL && verify.busy > 0)
+		pthread_cond_wait(&verify.verified, &verify.lock);
+
+	item = list_pop(&verify.done);
+	if (item != NULL) {
+		verify.busy--;
+		stats_queue(STATS_QUEUE_VERIFY, verify.busy);
+	}
+
+	pthread_mutex_unlock(&verify.lock);
+
+	return item;
+}
+
+void verify_free(struct verify_item *item)
+{
+	if (item != NULL)
+		budget_free(item, sizeof(*item));
+}
+
+void verify_stop(void)
+{
+	struct verify_item *item;
+
+	if (!verify.running)
+		return;
+
+	pthread_mutex_lock(&verify.lock);
+	verify.stop = true;
+	while ((item = list_pop(&verify.todo)) != NULL)
+		verify_free(item);
+	verify.waiting = 0;
+	pthread_cond_signal(&verify.queued);
+	pthread_mutex_unlock(&verify.lock);
+
+	pthread_join(verify.thread, NULL);
+	verify.running = false;
+
+	while ((item = list_pop(&verify.done)) != NULL)
+		verify_free(item);
+}
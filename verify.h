@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2018 Tim Schlueter
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the author of this program
+ * gives permission to link the code portions of this program with the
+ * OpenSSL library under certain conditions as described in each file,
+ * and distribute linked combinations including the two.
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL.  If you modify this file(s)
+ * with this exception, you may extend this exception to your version
+ * of the file(s), but you are not obligated to do so.  If you do not
+ * wish to do so, delete this exception statement from your version.
+ * If you delete this exception statement from all source files in the
+ * program, then also delete it here.
+ */
+
+/** @file
+ * Background verification queue declarations.
+ *
+ * With --two-phase, the walk itself only hashes files whose timestamps show
+ * they need (re)tagging, so new data is tagged with little delay. Files whose
+ * quick check passed are queued here instead, and a worker thread running at
+ * idle CPU and I/O priority re-hashes them (the deep verification of --check)
+ * while the walk continues. The results are passed back to the walking
+ * thread, which reports them and updates the attributes.
+ *
+ * Files are queued by their path tree node, and at most #VERIFY_QUEUE_MAX
+ * files wait at once, so the queue stays small however far the verification
+ * falls behind. The walk never waits for the worker: it defers the files it
+ * can't queue until it's done, like the files on busy devices. The worker
+ * never waits for a device either: it sets aside the files on busy devices
+ * and retries them once it has verified everything else.
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/stat.h>
+
+#include "pathtree.h"
+#include "xa.h"
+
+/** The most files waiting to be verified. */
+#define VERIFY_QUEUE_MAX 4096
+
+/** A file to verify (and, once verified, its result). */
+struct verify_item {
+	struct verify_item *next; /**< The next item in the queue. */
+	pathtree_id node;   /**< The file's path tree node. */
+	struct stat st;     /**< The file's stat() structure when it was queued. */
+	int err;            /**< The xa_read() result, or -1 if the file couldn't be read. */
+	int error;          /**< The errno value if err is -1. */
+	xa_t stored;        /**< The file's stored attributes. */
+	xa_t actual;        /**< The file's current hash and mtime. */
+};
+
+/**
+ * Start the verification thread.
+ *
+ * @retval 0  The thread was started.
+ * @retval !0 The thread couldn't be started.
+ */
+int verify_start(void);
+
+/**
+ * Returns whether the verification thread is running.
+ */
+bool verify_enabled(void);
+
+/**
+ * Queue a file for verification (without waiting).
+ *
+ * @param node  The file's path tree node.
+ * @param st    The file's stat() structure.
+ * @param alg   The hash algorithm to verify with.
+ *
+ * @retval 0  The file was queued.
+ * @retval 1  The memory budget is exhausted (verify the file directly).
+ * @retval 2  The queue is full (verify the file later).
+ */
+int verify_queue(pathtree_id node, const struct stat *st, hash_alg_t alg);
+
+/**
+ * Take the next verified file.
+ *
+ * @param wait  Whether to wait for a file that is still being verified.
+ *
+ * @returns Returns the verified file (to free with verify_free()), or NULL if
+ *          none is ready (or, if @p wait is true, no files are left).
+ */
+struct verify_item *verify_next(bool wait);
+
+/**
+ * Free a verified file.
+ *
+ * @param item  The item from verify_next().
+ */
+void verify_free(struct verify_item *item);
+
+/**
+ * Stop the verification thread, dropping any files that weren't verified.
+ */
+void verify_stop(void);
+
+#endif /* VERIFY_H */
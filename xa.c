@@ -37,10 +37,12 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <sys/xattr.h>
 
+#include "io.h"
 #include "utilities.h"
 
 #ifndef ENOATTR
@@ -49,11 +51,22 @@
 
 #define XATTR_NAMESPACE "user.shatag"
 #define TIMESTAMP_XATTR XATTR_NAMESPACE ".ts"
+#define RECORD_NAMESPACE "user.b2tag"
+#define VERIFIED_XATTR RECORD_NAMESPACE ".verified"
+
+/** The names of the ::xa_layout enum values. */
+static const char * const xa_layout_names[] = {
+	"shatag",
+	"record",
+};
+
+/** The layout used by xa_read() and xa_write(). */
+static xa_layout_t xa_layout = XA_LAYOUT_SHATAG;
 
 
 static err_t xa_read_xattr(int fd, const char* attr_name, char* buffer, size_t size) {
 	ssize_t len;
-	len = fgetxattr(fd, attr_name, buffer, size - 1);
+	len = io->fgetxattr(fd, attr_name, buffer, size - 1);
 	if (len < 0) {
 		switch (errno) {
 			case ENOATTR: return E_NOT_FOUND;
@@ -69,7 +82,7 @@ static err_t xa_read_xattr(int fd, const char* attr_name, char* buffer, size_t s
 
 static err_t xa_write_xattr(int fd, const char* attr_name, const char* value) {
 	int err;
-	err = fsetxattr(fd, attr_name, value, strlen(value), 0);
+	err = io->fsetxattr(fd, attr_name, value, strlen(value), 0);
 	if (err != 0) {
 		switch (errno) {
 			case ENOTSUP: return E_UNSUPPORTED;
@@ -81,7 +94,7 @@ static err_t xa_write_xattr(int fd, const char* attr_name, const char* value) {
 
 static err_t xa_remove_xattr(int fd, const char* attr_name) {
 	int err;
-	err = fremovexattr(fd, attr_name);
+	err = io->fremovexattr(fd, attr_name);
 	if (err != 0) {
 		switch (errno) {
 			case ENOATTR: return E_NOT_FOUND;
@@ -92,27 +105,33 @@ static err_t xa_remove_xattr(int fd, const char* attr_name) {
 	return E_OK;
 }
 
-err_t xa_read_timestamp(int fd, struct timespec* mtime, bool* truncated) {
+/**
+ * Parse a stored timestamp (seconds, a '.', and up to 9 fractional digits).
+ *
+ * @param buf        The timestamp.
+ * @param mtime      Where to store the result.
+ * @param truncated  Set if the fraction has fewer than 9 digits.
+ * @param rest       Where to store the end of the timestamp (may be NULL).
+ */
+static err_t xa_parse_timestamp(const char* buf, struct timespec* mtime, bool* truncated,
+	const char** rest) {
 	int err;
-	int end;
-	int start;
-	/* Example: 1335974989.123456789 => len=20 */
-	char buf[32];
-	err_t result;
-
-	assert(fd >= 0);
-	assert(mtime);
-	assert(truncated);
-
-	result = xa_read_xattr(fd, TIMESTAMP_XATTR, buf, sizeof(buf));
-	if (result != E_OK) {
-		return result;
-	}
+	int secs = 0;
+	int start = 0;
+	int end = 0;
 
-	err = sscanf(buf, "%ld.%n%10ld%n", &mtime->tv_sec, &start, &mtime->tv_nsec, &end);
+	mtime->tv_nsec = 0;
+	err = sscanf(buf, "%ld%n.%n%10ld%n", &mtime->tv_sec, &secs, &start, &mtime->tv_nsec, &end);
 	if (err < 1)
 		return E_INVALID;
 
+	/* Without a fraction (or without its digits). */
+	if (end == 0)
+		end = start = start ? start : secs;
+
+	if (rest != NULL)
+		*rest = buf + end;
+
 	end -= start;
 	if (end < 9) {
 		*truncated = true;
@@ -126,6 +145,23 @@ err_t xa_read_timestamp(int fd, struct timespec* mtime, bool* truncated) {
 	return E_OK;
 }
 
+err_t xa_read_timestamp(int fd, struct timespec* mtime, bool* truncated) {
+	/* Example: 1335974989.123456789 => len=20 */
+	char buf[32];
+	err_t result;
+
+	assert(fd >= 0);
+	assert(mtime);
+	assert(truncated);
+
+	result = xa_read_xattr(fd, TIMESTAMP_XATTR, buf, sizeof(buf));
+	if (result != E_OK) {
+		return result;
+	}
+
+	return xa_parse_timestamp(buf, mtime, truncated, NULL);
+}
+
 err_t xa_write_timestamp(int fd, const struct timespec mtime) {
 	char buf[32];
 
@@ -139,19 +175,44 @@ err_t xa_remove_timestamp(int fd) {
 	return xa_remove_xattr(fd, TIMESTAMP_XATTR);
 }
 
-err_t xa_read_checksum(int fd, hash_alg_t alg, char* checksum) {
+err_t xa_read_verified(int fd, struct timespec* verified) {
 	char buf[32];
+	const char* rest;
+	bool truncated;
 	err_t result;
-	char* c = checksum;
 
 	assert(fd >= 0);
-	assert(checksum);
+	assert(verified);
 
-	snprintf(buf, sizeof(buf), XATTR_NAMESPACE ".%s", get_alg_name(alg));
-	result = xa_read_xattr(fd, buf, checksum, MAX_HASH_STRING_LENGTH + 1);
+	result = xa_read_xattr(fd, VERIFIED_XATTR, buf, sizeof(buf));
 	if (result != E_OK)
 		return result;
 
+	result = xa_parse_timestamp(buf, verified, &truncated, &rest);
+	if (result == E_OK && *rest != '\0')
+		return E_INVALID;
+
+	return result;
+}
+
+err_t xa_write_verified(int fd, const struct timespec verified) {
+	char buf[32];
+
+	assert(fd >= 0);
+
+	snprintf(buf, sizeof(buf), "%lu.%09lu", verified.tv_sec, verified.tv_nsec);
+	return xa_write_xattr(fd, VERIFIED_XATTR, buf);
+}
+
+/**
+ * Validate a stored checksum (converting it to lowercase).
+ *
+ * @param alg       The algorithm that produced the checksum.
+ * @param checksum  The checksum.
+ */
+static err_t xa_check_checksum(hash_alg_t alg, char* checksum) {
+	char* c = checksum;
+
 	if (strlen(checksum) != get_alg_size(alg) * 2)
 		return E_INVALID;
 
@@ -169,6 +230,21 @@ err_t xa_read_checksum(int fd, hash_alg_t alg, char* checksum) {
 	return E_OK;
 }
 
+err_t xa_read_checksum(int fd, hash_alg_t alg, char* checksum) {
+	char buf[32];
+	err_t result;
+
+	assert(fd >= 0);
+	assert(checksum);
+
+	snprintf(buf, sizeof(buf), XATTR_NAMESPACE ".%s", get_alg_name(alg));
+	result = xa_read_xattr(fd, buf, checksum, MAX_HASH_STRING_LENGTH + 1);
+	if (result != E_OK)
+		return result;
+
+	return xa_check_checksum(alg, checksum);
+}
+
 err_t xa_write_checksum(int fd, hash_alg_t alg, const char* checksum) {
 	char buf[32];
 
@@ -226,7 +302,8 @@ int xa_compute(int fd, xa_t *xa)
 	return err;
 }
 
-int xa_read(int fd, xa_t *xa)
+/** Read a tag stored in the shatag layout (see xa_read()). */
+static int xa_read_shatag(int fd, xa_t *xa)
 {
 	err_t result;
 
@@ -279,7 +356,8 @@ int xa_read(int fd, xa_t *xa)
 	return 0;
 }
 
-int xa_write(int fd, xa_t *xa)
+/** Write a tag in the shatag layout (see xa_write()). */
+static int xa_write_shatag(int fd, xa_t *xa)
 {
 	err_t result;
 
@@ -304,6 +382,309 @@ int xa_write(int fd, xa_t *xa)
 	return 0;
 }
 
+/**
+ * Returns the name of the record layout's attribute for @p alg.
+ *
+ * @note This uses a static buffer per thread.
+ */
+static const char *xa_record_name(hash_alg_t alg)
+{
+	static __thread char name[32];
+
+	snprintf(name, sizeof(name), RECORD_NAMESPACE ".%s", get_alg_name(alg));
+
+	return name;
+}
+
+/** Read a tag stored in the record layout (see xa_read()). */
+static int xa_read_record(int fd, xa_t *xa)
+{
+	char buf[MAX_HASH_STRING_LENGTH + 48];
+	const char *rest;
+	err_t result;
+
+	xa_clear(xa);
+	assert(fd >= 0);
+
+	result = xa_read_xattr(fd, xa_record_name(xa->alg), buf, sizeof(buf));
+	if (result == E_OK)
+		result = xa_parse_timestamp(buf, &xa->mtime, &xa->fuzzy, &rest);
+	if (result == E_OK) {
+		if (*rest != ' ' || strlen(rest + 1) > MAX_HASH_STRING_LENGTH)
+			result = E_INVALID;
+		else {
+			strcpy(xa->hash, rest + 1);
+			result = xa_check_checksum(xa->alg, xa->hash);
+		}
+	}
+
+	if (result != E_OK) {
+		xa_clear(xa);
+		switch (result) {
+			case E_NOT_FOUND:
+				return 1;
+			case E_UNSUPPORTED:
+				pr_err("Filesystem does not support extended attributes\n");
+				return -1;
+			case E_IO_ERROR:
+				pr_err("Failed to retrieve `%s': %m\n", xa_record_name(xa->alg));
+				return -1;
+			default:
+				pr_err("Malformed tag `%s'\n", xa_record_name(xa->alg));
+				return 2;
+		}
+	}
+
+	xa->valid = true;
+	return 0;
+}
+
+/** Write a tag in the record layout (see xa_write()). */
+static int xa_write_record(int fd, xa_t *xa)
+{
+	char buf[MAX_HASH_STRING_LENGTH + 48];
+
+	assert(fd >= 0);
+	assert(xa != NULL);
+
+	if (!xa->valid)
+		return -EINVAL;
+
+	snprintf(buf, sizeof(buf), "%lu.%09lu %s", xa->mtime.tv_sec, xa->mtime.tv_nsec, xa->hash);
+
+	if (xa_write_xattr(fd, xa_record_name(xa->alg), buf) != E_OK) {
+		pr_err("Failed to set `%s' xattr: %m\n", xa_record_name(xa->alg));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns whether @p fd has a shatag checksum attribute other than @p alg's.
+ *
+ * Errors (including too many attributes to list) count as having one, so
+ * the shared timestamp is kept.
+ */
+static bool xa_has_other_checksum(int fd, hash_alg_t alg)
+{
+	char other[32];
+	char list[4096];
+	ssize_t len;
+	ssize_t i;
+
+	snprintf(other, sizeof(other), XATTR_NAMESPACE ".%s", get_alg_name(alg));
+
+	len = io->flistxattr(fd, list, sizeof(list));
+	if (len < 0)
+		return true;
+
+	for (i = 0; i < len; i += (ssize_t)strlen(list + i) + 1) {
+		const char *name = list + i;
+
+		if (strncmp(name, XATTR_NAMESPACE ".", sizeof(XATTR_NAMESPACE)) != 0)
+			continue;
+		if (strcmp(name, TIMESTAMP_XATTR) != 0 && strcmp(name, other) != 0)
+			return true;
+	}
+
+	return false;
+}
+
+int xa_read_layout(int fd, xa_t *xa, xa_layout_t layout)
+{
+	if (layout == XA_LAYOUT_RECORD)
+		return xa_read_record(fd, xa);
+
+	return xa_read_shatag(fd, xa);
+}
+
+int xa_write_layout(int fd, xa_t *xa, xa_layout_t layout)
+{
+	if (layout == XA_LAYOUT_RECORD)
+		return xa_write_record(fd, xa);
+
+	return xa_write_shatag(fd, xa);
+}
+
+int xa_remove_layout(int fd, hash_alg_t alg, xa_layout_t layout)
+{
+	err_t result;
+
+	if (layout == XA_LAYOUT_RECORD) {
+		result = xa_remove_xattr(fd, xa_record_name(alg));
+		return result == E_OK || result == E_NOT_FOUND ? 0 : -1;
+	}
+
+	result = xa_remove_checksum(fd, alg);
+	if (result != E_OK && result != E_NOT_FOUND)
+		return -1;
+
+	/* The timestamp is shared by every algorithm's checksum. */
+	if (xa_has_other_checksum(fd, alg))
+		return 0;
+
+	result = xa_remove_timestamp(fd);
+	return result == E_OK || result == E_NOT_FOUND ? 0 : -1;
+}
+
+/**
+ * Returns the algorithm of a checksum attribute in @p namespace (e.g.
+ * "user.shatag.sha256"), or -1 if @p name isn't one.
+ */
+static int xa_checksum_alg(const char *name, const char *namespace)
+{
+	size_t len = strlen(namespace);
+	hash_alg_t alg;
+
+	if (strncmp(name, namespace, len) != 0 || name[len] != '.' ||
+		get_alg_by_name(name + len + 1, &alg) != 0)
+		return -1;
+
+	return (int)alg;
+}
+
+/**
+ * Remove one attribute (for xa_remove_tags()).
+ *
+ * @returns Returns 1 if it was removed, 0 if it was already gone, and -1 on
+ *          failure.
+ */
+static int xa_remove_one(int fd, const char *name, bool dry_run)
+{
+	err_t result;
+
+	if (dry_run)
+		return 1;
+
+	result = xa_remove_xattr(fd, name);
+	if (result == E_NOT_FOUND)
+		return 0;
+
+	return result == E_OK ? 1 : -1;
+}
+
+int xa_remove_tags(int fd, unsigned int algs, bool dry_run)
+{
+	char buf[4096];
+	char *list = buf;
+	bool timestamp = false;
+	bool verified = false;
+	bool other = false;
+	int removed = 0;
+	int err = 0;
+	ssize_t len;
+	ssize_t i;
+
+	len = io->flistxattr(fd, list, sizeof(buf));
+
+	/* More attributes than fit on the stack. */
+	if (len < 0 && errno == ERANGE) {
+		len = io->flistxattr(fd, NULL, 0);
+		list = len > 0 ? malloc((size_t)len) : NULL;
+		len = list != NULL ? io->flistxattr(fd, list, (size_t)len) : -1;
+	}
+
+	if (len < 0) {
+		if (list != buf)
+			free(list);
+		return errno == ENOTSUP ? 0 : -1;
+	}
+
+	for (i = 0; i < len; i += (ssize_t)strlen(list + i) + 1) {
+		const char *name = list + i;
+		bool shatag;
+		int alg;
+		int ret;
+
+		if (strcmp(name, TIMESTAMP_XATTR) == 0) {
+			timestamp = true;
+			continue;
+		}
+
+		if (strcmp(name, VERIFIED_XATTR) == 0) {
+			verified = true;
+			continue;
+		}
+
+		shatag = strncmp(name, XATTR_NAMESPACE ".", sizeof(XATTR_NAMESPACE)) == 0;
+		alg = xa_checksum_alg(name, shatag ? XATTR_NAMESPACE : RECORD_NAMESPACE);
+
+		if (alg < 0 || !(algs & (1U << alg))) {
+			/* A checksum that stays (even an unknown one) keeps the timestamp. */
+			if (shatag)
+				other = true;
+			continue;
+		}
+
+		ret = xa_remove_one(fd, name, dry_run);
+		if (ret < 0)
+			err = -1;
+		else
+			removed += ret;
+	}
+
+	/* The timestamp is shared by every algorithm's checksum. */
+	if (timestamp && !other && err == 0) {
+		int ret = xa_remove_one(fd, TIMESTAMP_XATTR, dry_run);
+
+		if (ret < 0)
+			err = -1;
+		else
+			removed += ret;
+	}
+
+	if (verified && algs == XA_ALL_ALGS && err == 0) {
+		int ret = xa_remove_one(fd, VERIFIED_XATTR, dry_run);
+
+		if (ret < 0)
+			err = -1;
+		else
+			removed += ret;
+	}
+
+	if (list != buf)
+		free(list);
+
+	return err < 0 ? -1 : removed;
+}
+
+int xa_layout_by_name(const char *name, xa_layout_t *layout)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(xa_layout_names); i++) {
+		if (strcmp(name, xa_layout_names[i]) == 0) {
+			*layout = (xa_layout_t)i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *xa_layout_name(xa_layout_t layout)
+{
+	assert(layout < ARRAY_SIZE(xa_layout_names));
+
+	return xa_layout_names[layout];
+}
+
+void xa_set_layout(xa_layout_t layout)
+{
+	xa_layout = layout;
+}
+
+int xa_read(int fd, xa_t *xa)
+{
+	return xa_read_layout(fd, xa, xa_layout);
+}
+
+int xa_write(int fd, xa_t *xa)
+{
+	return xa_write_layout(fd, xa, xa_layout);
+}
+
 const char *xa_format(xa_t *xa)
 {
 	int len;
@@ -52,6 +52,16 @@ typedef enum err {
 	E_UNSUPPORTED = 4,
 } err_t;
 
+/**
+ * The ways a tag can be stored in extended attributes.
+ */
+typedef enum xa_layout {
+	/** user.shatag.ts and user.shatag.ALG (compatible with shatag). */
+	XA_LAYOUT_SHATAG,
+	/** A single user.b2tag.ALG attribute holding "MTIME HASH". */
+	XA_LAYOUT_RECORD,
+} xa_layout_t;
+
 /*
  * Low-level attribute operations.
  */
@@ -137,6 +147,33 @@ err_t xa_write_checksum(int fd, hash_alg_t alg, const char* checksum);
  */
 err_t xa_remove_checksum(int fd, hash_alg_t alg);
 
+/**
+ * Read the time @p fd's data was last hashed and found to match its tag
+ * (user.b2tag.verified, whatever the layout).
+ *
+ * @param fd        The file which extended attributes to operate on.
+ * @param verified  Where to store the result.
+ *
+ * @retval E_OK           The time was read and parsed successfully.
+ * @retval E_IO_ERROR     An error occurred while reading the attribute.
+ * @retval E_NOT_FOUND    The corresponding attribute is not present.
+ * @retval E_INVALID      The corresponding attribute contains invalid data.
+ * @retval E_UNSUPPORTED  Extended attributes are not supported.
+ */
+err_t xa_read_verified(int fd, struct timespec* verified);
+
+/**
+ * Write the time @p fd's data was last hashed and found to match its tag.
+ *
+ * @param fd        The file which extended attributes to operate on.
+ * @param verified  The time to write.
+ *
+ * @retval E_OK           The time was written successfully.
+ * @retval E_IO_ERROR     An error occurred while writing the attribute.
+ * @retval E_UNSUPPORTED  Extended attributes are not supported.
+ */
+err_t xa_write_verified(int fd, const struct timespec verified);
+
 /**
  * Metadata structure for b2tag.
  */
@@ -193,6 +230,82 @@ int xa_compute(int fd, xa_t *xa);
  */
 int xa_read(int fd, xa_t *xa);
 
+/**
+ * Read a tag stored in a specific layout (see xa_read()).
+ *
+ * @param fd      The file to retrieve the extended attributes from.
+ * @param xa      The extended attribute structure to store the values in.
+ * @param layout  The layout to read.
+ */
+int xa_read_layout(int fd, xa_t *xa, xa_layout_t layout);
+
+/**
+ * Write a tag in a specific layout (see xa_write()).
+ *
+ * @param fd      The file to update the extended attributes of.
+ * @param xa      The extended attribute structure to store to disk.
+ * @param layout  The layout to write.
+ */
+int xa_write_layout(int fd, xa_t *xa, xa_layout_t layout);
+
+/**
+ * Remove the tag for @p alg stored in @p layout.
+ *
+ * With the shatag layout, the shared timestamp is only removed along with
+ * the last checksum.
+ *
+ * @param fd      The file to remove the tag from.
+ * @param alg     The tag's hash algorithm.
+ * @param layout  The layout to remove.
+ *
+ * @retval 0  The tag was removed (or wasn't there).
+ * @retval -1 An error occurred removing the tag.
+ */
+int xa_remove_layout(int fd, hash_alg_t alg, xa_layout_t layout);
+
+/** The xa_remove_tags() mask of every algorithm. */
+#define XA_ALL_ALGS ((1U << HASH_ALG_COUNT) - 1)
+
+/**
+ * Remove the tags of the algorithms in @p algs, in every layout, listing the
+ * file's attributes only once.
+ *
+ * The shatag timestamp is removed along with the last shatag checksum, and
+ * the verification time (user.b2tag.verified) only if @p algs is
+ * #XA_ALL_ALGS.
+ *
+ * @param fd       The file to remove the tags from.
+ * @param algs     The algorithms whose tags to remove (bit 1 << ::hash_alg_t).
+ * @param dry_run  Only count the attributes that would be removed.
+ *
+ * @returns Returns the number of attributes removed (0 if there were none),
+ *          or -1 if the attributes couldn't be listed or removed.
+ */
+int xa_remove_tags(int fd, unsigned int algs, bool dry_run);
+
+/**
+ * Look up a layout by name ("shatag" or "record").
+ *
+ * @param name    The layout's name.
+ * @param layout  Where to store the layout.
+ *
+ * @retval 0  The layout was found.
+ * @retval -1 There is no such layout.
+ */
+int xa_layout_by_name(const char *name, xa_layout_t *layout);
+
+/**
+ * Returns the name of @p layout.
+ */
+const char *xa_layout_name(xa_layout_t layout);
+
+/**
+ * Set the layout used by xa_read() and xa_write() (shatag by default).
+ *
+ * @param layout  The layout.
+ */
+void xa_set_layout(xa_layout_t layout);
+
 /**
  * Update the stored extended attributes for @p fd from @p xa.
  *